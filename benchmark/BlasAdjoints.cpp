@@ -0,0 +1,70 @@
+//--------------------------------------------------------------------*- C++ -*-
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Run-time benchmark of the gradients of the dot product, axpy and
+// matrix-vector loops, reversed by the generated loops or, with
+// -fblas-adjoints, by the adjoint kernels. Built and run by Runtime.py.
+//------------------------------------------------------------------------------
+
+#include "clad/Differentiator/Differentiator.h"
+
+#include <chrono>
+#include <vector>
+
+constexpr int N = 512;
+
+double dot(double* p, int n) {
+  double s = 0;
+  for (int i = 0; i < n; i++)
+    s += p[i] * p[i];
+  return s;
+}
+
+double axpy(double* p, int n) {
+  double a = p[0];
+  double y[N] = {};
+  for (int i = 0; i < n; i++)
+    y[i] += a * p[i];
+  double s = 0;
+  for (int i = 0; i < n; i++)
+    s += y[i];
+  return s;
+}
+
+// p is an n x n matrix, its first row is multiplied by it.
+double gemv(double* p, int n) {
+  double y[N] = {};
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+      y[i] += p[i * n + j] * p[j];
+  double s = 0;
+  for (int i = 0; i < n; i++)
+    s += y[i];
+  return s;
+}
+
+/// Prints the average time of a call to the gradient, in microseconds.
+template <typename G>
+void measure(const char* name, G& grad, std::vector<double>& p, int reps) {
+  std::vector<double> result(p.size());
+  grad.execute(p.data(), N, result.data());
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < reps; ++r)
+    grad.execute(p.data(), N, result.data());
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("%s: %.2f us\n", name, elapsed.count() / reps);
+}
+
+int main() {
+  std::vector<double> p(N * N);
+  for (int i = 0; i < N * N; ++i)
+    p[i] = 1.0 / (1 + i % 97);
+
+  auto dot_grad = clad::gradient(dot, "p");
+  measure("dot", dot_grad, p, 20000);
+  auto axpy_grad = clad::gradient(axpy, "p");
+  measure("axpy", axpy_grad, p, 20000);
+  auto gemv_grad = clad::gradient(gemv, "p");
+  measure("gemv", gemv_grad, p, 100);
+}
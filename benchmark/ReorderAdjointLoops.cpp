@@ -0,0 +1,46 @@
+//--------------------------------------------------------------------*- C++ -*-
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Run-time benchmark of the gradient of a loop nest reading a matrix by
+// columns, reversed with tapes, by the loops without tapes or, with
+// -freorder-adjoint-loops, by loops updating its adjoint by rows. Built and
+// run by Runtime.py.
+//------------------------------------------------------------------------------
+
+#include "clad/Differentiator/Differentiator.h"
+
+#include <chrono>
+#include <vector>
+
+constexpr int N = 512;
+
+// p is an n x n matrix, the sum of its columns is weighted by its diagonal.
+double colsum(double* p, int n) {
+  double s = 0;
+  for (int i = 0; i < n; i++)
+    for (int j = 0; j < n; j++)
+      s += p[j * n + i] * p[j * n + j];
+  return s;
+}
+
+/// Prints the average time of a call to the gradient, in microseconds.
+template <typename G>
+void measure(const char* name, G& grad, std::vector<double>& p, int reps) {
+  std::vector<double> result(p.size());
+  grad.execute(p.data(), N, result.data());
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < reps; ++r)
+    grad.execute(p.data(), N, result.data());
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("%s: %.2f us\n", name, elapsed.count() / reps);
+}
+
+int main() {
+  std::vector<double> p(N * N);
+  for (int i = 0; i < N * N; ++i)
+    p[i] = 1.0 / (1 + i % 97);
+
+  auto colsum_grad = clad::gradient(colsum, "p");
+  measure("colsum", colsum_grad, p, 100);
+}
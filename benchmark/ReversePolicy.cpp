@@ -0,0 +1,61 @@
+//--------------------------------------------------------------------*- C++ -*-
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Run-time benchmark of the reverse mode policies, -freverse-policy: the
+// gradients of a loop with independent iterations and of a recurrence, whose
+// values are stored on tapes (store-all), recomputed in the independent loop
+// (mixed), or also recomputed by running the recurrence again up to each
+// reversed iteration (recompute-all). The latter trades the traffic of the
+// tapes for a number of iterations quadratic in the length of the loop. Built
+// and run by Runtime.py.
+//------------------------------------------------------------------------------
+
+#include "clad/Differentiator/Differentiator.h"
+
+#include <chrono>
+#include <vector>
+
+double norm(double* p, int n) {
+  double s = 0;
+  for (int i = 0; i < n; i++)
+    s += p[i] * p[i];
+  return s;
+}
+
+// An exponential moving average of the squares of p, each iteration reads
+// the value of the previous one.
+double ema(double* p, int n) {
+  double s = 0;
+  for (int i = 0; i < n; i++)
+    s = 0.9 * s + 0.1 * p[i] * p[i];
+  return s;
+}
+
+/// Prints the average time of a call to the gradient on the n first elements
+/// of p, in microseconds.
+template <typename G>
+void measure(const char* name, G& grad, std::vector<double>& p, int n,
+             int reps) {
+  std::vector<double> result(n);
+  grad.execute(p.data(), n, result.data());
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < reps; ++r)
+    grad.execute(p.data(), n, result.data());
+  std::chrono::duration<double, std::micro> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("%s-%d: %.3f us\n", name, n, elapsed.count() / reps);
+}
+
+int main() {
+  std::vector<double> p(1 << 16);
+  for (unsigned i = 0; i < p.size(); ++i)
+    p[i] = 1.0 / (1 + i % 97);
+
+  auto norm_grad = clad::gradient(norm, "p");
+  auto ema_grad = clad::gradient(ema, "p");
+  for (int n : {8, 64, 512}) {
+    measure("norm", norm_grad, p, n, 100000);
+    measure("ema", ema_grad, p, n, 2000000 / n);
+  }
+  measure("norm", norm_grad, p, 1 << 16, 100);
+}
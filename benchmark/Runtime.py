@@ -0,0 +1,102 @@
+#!/usr/bin/env python
+#-------------------------------------------------------------------------------
+# clad - the C++ Clang-based Automatic Differentiator
+#
+# Run-time benchmark of the derivatives produced by clad.
+#
+# Builds a benchmark source once per variant, i.e. per set of plugin options,
+# runs each executable and compares the timings they report. The sources print
+# one line per measurement, "<name>: <time> us", and the first variant is the
+# baseline of the reported speedups.
+#
+# Usage:
+#   Runtime.py --clang=<clang> --plugin=<clad.so> --include=<clad/include>
+#              [--output-dir=<dir>] [--variant=<name>[:<option>,...]]...
+#              [--csv=<file>] <source.cpp>
+#-------------------------------------------------------------------------------
+
+from __future__ import print_function
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+
+TIMING_RE = re.compile(r'^(\S+): ([0-9.]+) us$')
+
+
+def build(args, source, name, options):
+  exe = os.path.join(args.output_dir,
+                     '%s-%s' % (os.path.splitext(os.path.basename(source))[0],
+                                name))
+  cmd = [args.clang, '-x', 'c++', '-std=c++11', '-O2', '-I' + args.include,
+         '-Xclang', '-add-plugin', '-Xclang', 'clad',
+         '-Xclang', '-load', '-Xclang', args.plugin]
+  for option in options:
+    cmd += ['-Xclang', '-plugin-arg-clad', '-Xclang', option]
+  cmd += [source, '-o', exe, '-lstdc++', '-lm']
+  if subprocess.call(cmd):
+    raise RuntimeError('clang failed on %s (%s)' % (source, name))
+  return exe
+
+
+def run(exe):
+  out = subprocess.check_output([exe], universal_newlines=True)
+  timings = []
+  for line in out.splitlines():
+    m = TIMING_RE.match(line.strip())
+    if m:
+      timings.append((m.group(1), float(m.group(2))))
+  return timings
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description='Run-time benchmark of the derivatives produced by clad.')
+  parser.add_argument('--clang', default='clang')
+  parser.add_argument('--plugin', required=True,
+                      help='path to the clad plugin library')
+  parser.add_argument('--include', required=True,
+                      help='path to the clad include directory')
+  parser.add_argument('--output-dir', default='runtime')
+  parser.add_argument('--variant', action='append', default=[],
+                      help='<name>[:<option>,...], the plugin options of a '
+                           'build, e.g. kernels:-fblas-adjoints')
+  parser.add_argument('--csv', help='write the results in csv format')
+  parser.add_argument('source')
+  args = parser.parse_args()
+
+  if not os.path.isdir(args.output_dir):
+    os.makedirs(args.output_dir)
+  variants = []
+  for variant in args.variant or ['default']:
+    name, _, options = variant.partition(':')
+    variants.append((name, [o for o in options.split(',') if o]))
+
+  results = []
+  for name, options in variants:
+    exe = build(args, args.source, name, options)
+    results.append((name, run(exe)))
+
+  base = dict(results[0][1])
+  rows = []
+  for name, timings in results:
+    for bench, time in timings:
+      speedup = base[bench] / time if bench in base and time > 0 else 0
+      rows.append((bench, name, time, speedup))
+  for bench, name, time, speedup in sorted(rows, key=lambda r: r[0]):
+    print('%-12s %-12s %12.2f us  speedup %6.2fx' %
+          (bench, name, time, speedup))
+  sys.stdout.flush()
+
+  if args.csv and rows:
+    with open(args.csv, 'w') as f:
+      f.write('benchmark,variant,time_us,speedup\n')
+      for row in rows:
+        f.write('%s,%s,%.2f,%.4f\n' % row)
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main())
@@ -0,0 +1,193 @@
+#!/usr/bin/env python
+#-------------------------------------------------------------------------------
+# clad - the C++ Clang-based Automatic Differentiator
+#
+# Compile-time scalability benchmark for the clad plugin.
+#
+# Generates synthetic sources of increasing size, runs clang with the clad
+# plugin on each of them and collects the statistics reported by
+# -fprint-stats (wall time of Derive, peak RSS and the number of AST nodes of
+# the produced derivative). The growth factor between consecutive sizes is
+# reported too, so that super-linear behaviour of the cloning, the unique
+# identifier creation or the visitors is easy to spot.
+#
+# Usage:
+#   Scalability.py --clang=<clang> --plugin=<clad.so> --include=<clad/include>
+#                  [--output-dir=<dir>] [--kinds=stmts,expr,loops,hessian]
+#                  [--sizes=...] [--csv=<file>] [--generate-only]
+#-------------------------------------------------------------------------------
+
+from __future__ import print_function
+
+import argparse
+import math
+import os
+import re
+import subprocess
+import sys
+
+HEADER = '#include "clad/Differentiator/Differentiator.h"\n\n'
+
+
+def gen_stmts(n):
+  """A long straight-line function: n statements on two variables."""
+  body = []
+  for i in range(n):
+    if i % 3 == 0:
+      body.append('  x = x * y + %d;' % (i % 7 + 1))
+    elif i % 3 == 1:
+      body.append('  y = y - x * %d.5;' % (i % 5))
+    else:
+      body.append('  double t%d = x * y;\n  x = t%d + x;' % (i, i))
+  return (HEADER +
+          'double f(double x, double y) {\n' + '\n'.join(body) +
+          '\n  return x + y;\n}\n\n'
+          'int main() {\n'
+          '  auto df = clad::differentiate(f, 0);\n'
+          '  auto gf = clad::gradient(f);\n'
+          '  return 0;\n}\n')
+
+
+def gen_expr(n):
+  """A single return statement holding an expression tree of depth n."""
+  expr = 'x'
+  for i in range(n):
+    op = '*' if i % 2 else '+'
+    expr = '(%s %s %s)' % (expr, op, 'y' if i % 3 else 'x')
+  return (HEADER +
+          'double f(double x, double y) {\n  return ' + expr + ';\n}\n\n'
+          'int main() {\n'
+          '  auto df = clad::differentiate(f, 0);\n'
+          '  auto gf = clad::gradient(f);\n'
+          '  return 0;\n}\n')
+
+
+def gen_loops(n):
+  """n sequential loop nests of depth 3, each with a few statements."""
+  body = []
+  for i in range(n):
+    body.append('  for (int i%d = 0; i%d < 2; i%d++)\n'
+                '    for (int j%d = 0; j%d < 2; j%d++)\n'
+                '      for (int k%d = 0; k%d < 2; k%d++) {\n'
+                '        x = x * y + %d;\n'
+                '        y = y + x;\n'
+                '      }' % ((i,) * 9 + (i % 5,)))
+  return (HEADER +
+          'double f(double x, double y) {\n' + '\n'.join(body) +
+          '\n  return x * y;\n}\n\n'
+          'int main() {\n'
+          '  auto gf = clad::gradient(f);\n'
+          '  return 0;\n}\n')
+
+
+def gen_hessian(n):
+  """A function of n parameters whose full Hessian is requested."""
+  params = ', '.join('double x%d' % i for i in range(n))
+  terms = ' + '.join('x%d * x%d' % (i, (i + 1) % n) for i in range(n))
+  return (HEADER +
+          'double f(' + params + ') {\n  return ' + terms + ';\n}\n\n'
+          'int main() {\n'
+          '  auto hf = clad::hessian(f);\n'
+          '  return 0;\n}\n')
+
+
+GENERATORS = {
+  'stmts': (gen_stmts, [250, 500, 1000, 2000, 4000]),
+  'expr': (gen_expr, [50, 100, 200, 400, 800]),
+  'loops': (gen_loops, [25, 50, 100, 200, 400]),
+  'hessian': (gen_hessian, [8, 16, 32, 64, 128]),
+}
+
+STATS_RE = re.compile(r'^clad stats: (\S+) -> (\S+): wall ([0-9.]+) s, '
+                      r'peak RSS ([0-9]+) KB, AST nodes ([0-9]+), '
+                      r'locals ([0-9]+) B$')
+
+
+def generate(kind, size, output_dir):
+  gen = GENERATORS[kind][0]
+  path = os.path.join(output_dir, '%s_%d.cpp' % (kind, size))
+  with open(path, 'w') as f:
+    f.write(gen(size))
+  return path
+
+
+def run(args, source):
+  cmd = [args.clang, '-x', 'c++', '-std=c++11', '-fsyntax-only',
+         '-I' + args.include,
+         '-Xclang', '-add-plugin', '-Xclang', 'clad',
+         '-Xclang', '-plugin-arg-clad', '-Xclang', '-fprint-stats',
+         '-Xclang', '-load', '-Xclang', args.plugin, source]
+  proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          universal_newlines=True)
+  _, err = proc.communicate()
+  if proc.returncode:
+    sys.stderr.write(err)
+    raise RuntimeError('clang failed on ' + source)
+  # Sum up all derivatives produced for this source, the peak RSS is the
+  # maximum observed.
+  wall, rss, nodes = 0.0, 0, 0
+  for line in err.splitlines():
+    m = STATS_RE.match(line.strip())
+    if m:
+      wall += float(m.group(3))
+      rss = max(rss, int(m.group(4)))
+      nodes += int(m.group(5))
+  return wall, rss, nodes
+
+
+def main():
+  parser = argparse.ArgumentParser(
+      description='Compile-time scalability benchmark for clad.')
+  parser.add_argument('--clang', default='clang')
+  parser.add_argument('--plugin', help='path to the clad plugin library')
+  parser.add_argument('--include', help='path to the clad include directory')
+  parser.add_argument('--output-dir', default='scalability')
+  parser.add_argument('--kinds', default=','.join(sorted(GENERATORS)))
+  parser.add_argument('--sizes', default='',
+                      help='comma separated sizes overriding the defaults')
+  parser.add_argument('--csv', help='write the results in csv format')
+  parser.add_argument('--generate-only', action='store_true')
+  args = parser.parse_args()
+
+  if not os.path.isdir(args.output_dir):
+    os.makedirs(args.output_dir)
+
+  rows = []
+  for kind in args.kinds.split(','):
+    if kind not in GENERATORS:
+      parser.error('unknown kind ' + kind)
+    sizes = GENERATORS[kind][1]
+    if args.sizes:
+      sizes = [int(s) for s in args.sizes.split(',')]
+    prev = None
+    for size in sizes:
+      source = generate(kind, size, args.output_dir)
+      if args.generate_only:
+        print(source)
+        continue
+      if not args.plugin or not args.include:
+        parser.error('--plugin and --include are required')
+      wall, rss, nodes = run(args, source)
+      # Empirical exponent of the time growth with respect to the size. Values
+      # close to 1 mean linear behaviour, close to 2 quadratic.
+      order = ''
+      if prev and prev[1] > 0 and wall > 0:
+        order = '%.2f' % (math.log(wall / prev[1]) /
+                          math.log(float(size) / prev[0]))
+      prev = (size, wall)
+      rows.append((kind, size, wall, rss, nodes, order))
+      print('%-8s %6d  wall %10.6f s  peak RSS %8d KB  AST nodes %9d  %s' %
+            (kind, size, wall, rss, nodes,
+             'order ' + order if order else ''))
+      sys.stdout.flush()
+
+  if args.csv and rows:
+    with open(args.csv, 'w') as f:
+      f.write('kind,size,wall_s,peak_rss_kb,ast_nodes,time_order\n')
+      for row in rows:
+        f.write('%s,%d,%.6f,%d,%d,%s\n' % row)
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main())
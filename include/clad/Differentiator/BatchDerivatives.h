@@ -0,0 +1,148 @@
+//--------------------------------------------------------------------*- C++ -*-
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Batch versions of the builtin derivatives, evaluating them over arrays.
+//------------------------------------------------------------------------------
+
+#ifndef CLAD_BATCH_DERIVATIVES
+#define CLAD_BATCH_DERIVATIVES
+
+#include "BuiltinDerivatives.h"
+#include "Tape.h"
+
+#include <cstddef>
+
+// The kernels are compiled for several instruction sets and the widest one
+// supported by the CPU is selected at run time. Elsewhere only the portable
+// kernel is used.
+#if (defined(__x86_64__) || defined(__i386__)) &&                              \
+    (defined(__GNUC__) || defined(__clang__)) && !defined(__CUDACC__)
+#define CLAD_BATCH_DISPATCH
+#endif
+
+namespace clad {
+  namespace batch {
+    /// The instruction sets the kernels are compiled for.
+    enum class isa { generic, avx2, avx512 };
+
+    /// \returns the widest instruction set supported by the CPU.
+    inline isa detect_isa() {
+#ifdef CLAD_BATCH_DISPATCH
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx512f"))
+        return isa::avx512;
+      if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return isa::avx2;
+#endif
+      return isa::generic;
+    }
+
+    /// \returns the instruction set used by the kernels, detected once.
+    inline isa current_isa() {
+      static const isa selected = detect_isa();
+      return selected;
+    }
+
+    namespace detail {
+      // The element-wise loops, out of place and in place. The out of place
+      // one assumes the arrays do not overlap, so that it is vectorized
+      // without runtime alias checks.
+#define CLAD_BATCH_KERNELS(NAME, TARGET)                                       \
+  template <typename T, typename F>                                            \
+  TARGET inline void NAME(const T* __restrict x, T* __restrict y,              \
+                          std::size_t n, F f) {                                \
+    for (std::size_t i = 0; i < n; ++i)                                        \
+      y[i] = f(x[i]);                                                          \
+  }                                                                            \
+  template <typename T, typename F>                                            \
+  TARGET inline void NAME(T* x, std::size_t n, F f) {                          \
+    for (std::size_t i = 0; i < n; ++i)                                        \
+      x[i] = f(x[i]);                                                          \
+  }
+
+      CLAD_BATCH_KERNELS(map_generic, )
+#ifdef CLAD_BATCH_DISPATCH
+      CLAD_BATCH_KERNELS(map_avx2, __attribute__((target("avx2,fma"))))
+      CLAD_BATCH_KERNELS(map_avx512, __attribute__((target("avx512f"))))
+#endif
+#undef CLAD_BATCH_KERNELS
+    } // end namespace detail
+
+    /// Replaces x[i] by f(x[i]) for every i < n.
+    template <typename T, typename F>
+    void map(T* x, std::size_t n, F f) {
+#ifdef CLAD_BATCH_DISPATCH
+      switch (current_isa()) {
+      case isa::avx512:
+        return detail::map_avx512(x, n, f);
+      case isa::avx2:
+        return detail::map_avx2(x, n, f);
+      default:
+        break;
+      }
+#endif
+      detail::map_generic(x, n, f);
+    }
+
+    /// Stores f(x[i]) into y[i] for every i < n. x and y must either be
+    /// disjoint or the same array.
+    template <typename T, typename F>
+    void map(const T* x, T* y, std::size_t n, F f) {
+      if (x == y)
+        return map(y, n, f);
+#ifdef CLAD_BATCH_DISPATCH
+      switch (current_isa()) {
+      case isa::avx512:
+        return detail::map_avx512(x, y, n, f);
+      case isa::avx2:
+        return detail::map_avx2(x, y, n, f);
+      default:
+        break;
+      }
+#endif
+      detail::map_generic(x, y, n, f);
+    }
+  } // end namespace batch
+} // end namespace clad
+
+namespace custom_derivatives {
+  // For every builtin derivative f_darg0 with a single argument:
+  //   f_darg0_batch(x, d_x, n) stores f_darg0(x[i]) into d_x[i], i < n;
+  //   f_darg0_batch(tape) replaces the values on the tape by the derivatives,
+  //   it is used by the gradients computing the same derivative in a loop.
+#define CLAD_BATCH_DARG0(NAME)                                                 \
+  template <typename T>                                                        \
+  void NAME##_darg0_batch(const T* x, T* d_x, ::std::size_t n) {               \
+    ::clad::batch::map(x, d_x, n, [](T v) { return NAME##_darg0(v); });        \
+  }                                                                            \
+  template <typename T>                                                        \
+  void NAME##_darg0_batch(::clad::tape_impl<T>& x) {                           \
+    ::clad::batch::map(x.begin(), x.size(),                                    \
+                       [](T v) { return NAME##_darg0(v); });                   \
+  }
+
+  CLAD_BATCH_DARG0(abs)
+  CLAD_BATCH_DARG0(exp)
+  CLAD_BATCH_DARG0(sin)
+  CLAD_BATCH_DARG0(cos)
+  CLAD_BATCH_DARG0(sqrt)
+  CLAD_BATCH_DARG0(log)
+  CLAD_BATCH_DARG0(tanh)
+#undef CLAD_BATCH_DARG0
+
+  // The derivatives of pow(x[i], exponent) w.r.t. x[i] and the exponent.
+  template <typename T1, typename T2>
+  void pow_darg0_batch(const T1* x, T2 exponent, T1* d_x, ::std::size_t n) {
+    ::clad::batch::map(x, d_x, n,
+                       [exponent](T1 v) { return pow_darg0(v, exponent); });
+  }
+
+  template <typename T1, typename T2>
+  void pow_darg1_batch(const T1* x, T2 exponent, T1* d_exponent,
+                       ::std::size_t n) {
+    ::clad::batch::map(x, d_exponent, n,
+                       [exponent](T1 v) { return pow_darg1(v, exponent); });
+  }
+} // end namespace custom_derivatives
+
+#endif // CLAD_BATCH_DERIVATIVES
@@ -0,0 +1,89 @@
+//--------------------------------------------------------------------*- C++ -*-
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Adjoint kernels of the dot product, axpy and matrix-vector loops.
+//------------------------------------------------------------------------------
+
+#ifndef CLAD_BLAS_DERIVATIVES
+#define CLAD_BLAS_DERIVATIVES
+
+#include <cstddef>
+
+namespace clad {
+  namespace blas {
+    /// \returns the sum of x[i] * y[i], i < n.
+    template <typename T>
+    T dot(std::size_t n, const T* x, const T* y) {
+      T s = T();
+      for (std::size_t i = 0; i < n; ++i)
+        s += x[i] * y[i];
+      return s;
+    }
+
+    /// Adds a * x[i] to y[i], i < n.
+    template <typename T>
+    void axpy(std::size_t n, T a, const T* x, T* y) {
+      for (std::size_t i = 0; i < n; ++i)
+        y[i] += a * x[i];
+    }
+
+    /// Adds the transposed m x n matrix A, with rows lda elements apart,
+    /// times y to x: x[j] += A[i * lda + j] * y[i]. A is traversed by rows.
+    template <typename T>
+    void gemv_t(std::size_t m, std::size_t n, const T* A, std::size_t lda,
+                const T* y, T* x) {
+      for (std::size_t i = 0; i < m; ++i)
+        axpy(n, y[i], A + i * lda, x);
+    }
+
+    /// Adds the rank-1 update x y^T to the m x n matrix A, with rows lda
+    /// elements apart: A[i * lda + j] += x[i] * y[j].
+    template <typename T>
+    void ger(std::size_t m, std::size_t n, const T* x, const T* y, T* A,
+             std::size_t lda) {
+      for (std::size_t i = 0; i < m; ++i)
+        axpy(n, x[i], y, A + i * lda);
+    }
+  } // end namespace blas
+} // end namespace clad
+
+namespace custom_derivatives {
+  // With -fblas-adjoints, the reverse pass of the loops below is a call to
+  // these kernels. The arrays are offset by the lower bounds of the loops and
+  // n, m are their numbers of iterations. The adjoint of an array is null if
+  // the array is not differentiated. More specialized kernels, e.g. calling
+  // a BLAS library, are registered by declaring overloads in this namespace.
+
+  /// The adjoint of s += x[i] * y[i], i < n.
+  template <typename T>
+  void dot_loop_pullback(const T* x, const T* y, ::std::size_t n, T d_s,
+                         T* d_x, T* d_y) {
+    if (d_x)
+      ::clad::blas::axpy(n, d_s, y, d_x);
+    if (d_y)
+      ::clad::blas::axpy(n, d_s, x, d_y);
+  }
+
+  /// The adjoint of y[i] += a * x[i], i < n.
+  template <typename T>
+  void axpy_loop_pullback(T a, const T* x, const T* d_y, ::std::size_t n,
+                          T* d_a, T* d_x) {
+    if (d_a)
+      *d_a += ::clad::blas::dot(n, d_y, x);
+    if (d_x)
+      ::clad::blas::axpy(n, a, d_y, d_x);
+  }
+
+  /// The adjoint of y[i] += A[i * lda + j] * x[j], i < m, j < n.
+  template <typename T>
+  void gemv_loop_pullback(const T* A, ::std::size_t lda, const T* x,
+                          const T* d_y, ::std::size_t m, ::std::size_t n,
+                          T* d_A, T* d_x) {
+    if (d_A)
+      ::clad::blas::ger(m, n, d_y, x, d_A, lda);
+    if (d_x)
+      ::clad::blas::gemv_t(m, n, A, lda, d_y, d_x);
+  }
+} // end namespace custom_derivatives
+
+#endif // CLAD_BLAS_DERIVATIVES
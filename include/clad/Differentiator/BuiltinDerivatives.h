@@ -108,6 +108,79 @@ namespace custom_derivatives {
     return 1.0/x;
   }
 
+  template <typename T>
+  CUDA_HOST_DEVICE T tanh_darg0(T x) {
+    T t = tanh(x);
+    return ((T)1) - t * t;
+  }
+
+  // The derivatives below take the already computed value of the function
+  // and are used by the gradients instead of calling the function again.
+  template <typename T>
+  CUDA_HOST_DEVICE T exp_darg0_primal(T x, T value) {
+    return value;
+  }
+
+  template <typename T>
+  CUDA_HOST_DEVICE T sqrt_darg0_primal(T x, T value) {
+    return ((T)1)/(((T)2)*value);
+  }
+
+  template <typename T>
+  CUDA_HOST_DEVICE T tanh_darg0_primal(T x, T value) {
+    return ((T)1) - value * value;
+  }
+
+  template <typename T1, typename T2>
+  CUDA_HOST_DEVICE void
+  pow_grad_primal(T1 x, T2 exponent, decltype(pow(T1(), T2())) value,
+                  decltype(pow(T1(), T2())) * result) {
+    result[0] += pow_darg0(x, exponent);
+    result[1] += value * log(x);
+  }
+
+  // The functions below compute the value of the function together with its
+  // derivative, sharing the common subexpressions. Both sin and cos are
+  // computed at once, which the compilers fold into a single sincos call.
+  template <typename T>
+  CUDA_HOST_DEVICE T exp_value_and_darg0(T x, T* d_x) {
+    T value = exp(x);
+    *d_x = value;
+    return value;
+  }
+
+  template <typename T>
+  CUDA_HOST_DEVICE T log_value_and_darg0(T x, T* d_x) {
+    *d_x = ((T)1)/x;
+    return log(x);
+  }
+
+  template <typename T>
+  CUDA_HOST_DEVICE T sqrt_value_and_darg0(T x, T* d_x) {
+    T value = sqrt(x);
+    *d_x = ((T)1)/(((T)2)*value);
+    return value;
+  }
+
+  template <typename T>
+  CUDA_HOST_DEVICE T sin_value_and_darg0(T x, T* d_x) {
+    *d_x = cos(x);
+    return sin(x);
+  }
+
+  template <typename T>
+  CUDA_HOST_DEVICE T cos_value_and_darg0(T x, T* d_x) {
+    *d_x = -sin(x);
+    return cos(x);
+  }
+
+  template <typename T>
+  CUDA_HOST_DEVICE T tanh_value_and_darg0(T x, T* d_x) {
+    T value = tanh(x);
+    *d_x = ((T)1) - value * value;
+    return value;
+  }
+
   // FIXME: These math functions depend on promote_2 just like pow:
   // atan2
   // fmod
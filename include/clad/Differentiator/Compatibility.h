@@ -75,6 +75,24 @@ static inline CompoundStmt* CompoundStmt_Create(
 #endif
 
 
+// Clang 7 add one extra param in UnaryOperator constructor and Clang 11
+// replaced the constructor with UnaryOperator::Create.
+
+static inline UnaryOperator* UnaryOperator_Create(const ASTContext &Ctx,
+        Expr *input, UnaryOperatorKind opc, QualType type, ExprValueKind VK,
+        ExprObjectKind OK, SourceLocation l, bool CanOverflow)
+{
+#if CLANG_VERSION_MAJOR < 7
+   return new (Ctx) UnaryOperator(input, opc, type, VK, OK, l);
+#elif CLANG_VERSION_MAJOR < 11
+   return new (Ctx) UnaryOperator(input, opc, type, VK, OK, l, CanOverflow);
+#elif CLANG_VERSION_MAJOR >= 11
+   return UnaryOperator::Create(Ctx, input, opc, type, VK, OK, l, CanOverflow,
+                                FPOptionsOverride());
+#endif
+}
+
+
 // Clang 8 change E->EvaluateAsInt(APSInt int, context) ===> E->EvaluateAsInt(Expr::EvalResult res, context)
 
 static inline bool Expr_EvaluateAsInt(const Expr *E,
@@ -10,6 +10,7 @@
 #include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/AST/StmtVisitor.h"
 #include "clang/Sema/Sema.h"
+#include "llvm/ADT/DenseMap.h"
 #include "Compatibility.h"
 
 #include <array>
@@ -70,6 +71,7 @@ namespace clad {
       std::vector<std::unordered_map<const clang::VarDecl*, clang::Expr*>>;
 
   static clang::SourceLocation noLoc{};
+  class DerivativeProfile;
   class VisitorBase;
   /// The main builder class which then uses either ForwardModeVisitor or
   /// ReverseModeVisitor based on the required mode.
@@ -86,6 +88,11 @@ namespace clad {
     clang::ASTContext& m_Context;
     std::unique_ptr<utils::StmtClone> m_NodeCloner;
     clang::NamespaceDecl* m_BuiltinDerivativesNSD;
+    /// The structural sparsity patterns of the produced Jacobians and
+    /// Hessians, one line of 0 and 1 per row.
+    llvm::DenseMap<const clang::FunctionDecl*, std::string> m_SparsityPatterns;
+    /// The run-time counts read with -fprofile-derivatives-use, if any.
+    std::unique_ptr<DerivativeProfile> m_Profile;
     DeclWithContext cloneFunction(const clang::FunctionDecl* FD,
                                   clad::VisitorBase VB,
                                   clang::DeclContext* DC,
@@ -123,6 +130,16 @@ namespace clad {
     ///
     DeclWithContext Derive(const clang::FunctionDecl* FD,
                            const DiffRequest & request);
+    /// Returns true if anything named Name is declared in the namespace of the
+    /// builtin derivatives.
+    bool isCustomDerivativeDeclared(llvm::StringRef Name);
+    /// Returns the structural sparsity pattern of a produced Jacobian or
+    /// Hessian, or an empty string if it is unknown.
+    llvm::StringRef getSparsityPattern(const clang::FunctionDecl* FD) const;
+    /// Reads the profile written by derivatives instrumented with
+    /// -fprofile-derivatives-generate, which guides the reverse mode. Returns
+    /// false and sets Error if it cannot be read.
+    bool loadProfile(llvm::StringRef Path, std::string& Error);
   };
 
 } // end namespace clad
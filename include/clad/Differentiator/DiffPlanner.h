@@ -20,7 +20,21 @@ namespace clad {
     forward,
     reverse,
     hessian,
-    jacobian
+    jacobian,
+    sparse_hessian
+  };
+
+  /// How the reverse mode makes the values computed in the loops available to
+  /// their reverse pass.
+  enum class ReversePolicy {
+    /// Store them on tapes.
+    store_all,
+    /// Recompute them in the loops with independent iterations, see
+    /// DiffRequest::TapeFreeLoops, and store the others.
+    mixed,
+    /// Also recompute them in the other innermost loops, by running the loop
+    /// again up to each iteration of its reverse pass.
+    recompute_all
   };
 
   /// A struct containing information about request to differentiate a function.
@@ -46,6 +60,78 @@ namespace clad {
     bool CallUpdateRequired = false;
     /// A flag to enable/disable diag warnings/errors during differentiation.
     bool VerboseDiags = false;
+    /// Run the algebraic simplifier over the produced derivative.
+    bool Simplify = false;
+    /// Replace the small integer powers and the divisions by constants with
+    /// exact reciprocals with multiplications.
+    bool StrengthReduce = false;
+    /// Also replace the repeated divisions by a variable with multiplications
+    /// by its reciprocal, which may change the rounding of the results.
+    bool HoistReciprocals = false;
+    /// Bind the pure subexpressions computed more than once to temporaries.
+    bool EliminateCommonSubexprs = false;
+    /// Remove the stores to the locals of a gradient which are never read.
+    bool EliminateDeadStores = false;
+    /// Let the temporaries of a gradient with disjoint lifetimes share a
+    /// declaration.
+    bool CoalesceTemporaries = false;
+    /// The maximal size (in AST nodes) of the callees inlined into the
+    /// gradient, 0 disables inlining.
+    unsigned InlineThreshold = 0;
+    /// Produce a pullback f_pullback(args..., seed, d_args...) accumulating
+    /// seed * df/darg into *d_arg instead of a gradient.
+    bool Pullback = false;
+    /// Differentiate the callees of a gradient as pullbacks.
+    bool UsePullbacks = false;
+    /// Produce only the forward pass of the pullback, f_forw(args...,
+    /// tapes...), recording the intermediates on the tapes, or only its
+    /// reverse pass, f_reverse(args..., seed, d_args..., tapes...), consuming
+    /// them.
+    bool AugmentedPrimal = false;
+    bool ReverseOnly = false;
+    /// Differentiate the callees of a gradient as pairs of f_forw and
+    /// f_reverse, so that their forward passes are not recomputed.
+    bool SplitPullbacks = false;
+    /// Call the builtin derivatives which take the primal value or compute it
+    /// together with the derivative, when there are any.
+    bool FuseBuiltins = false;
+    /// The derivative is going to be differentiated again, e.g. as a part of
+    /// a hessian, and has to call only differentiable builtins.
+    bool DerivedAgain = false;
+    /// Evaluate the builtin derivatives of the calls in loops over the whole
+    /// tape of their arguments at once, before the reverse pass.
+    bool BatchBuiltins = false;
+    /// Reverse the loops whose iterations are independent without tapes, by
+    /// recomputing their values in a loop running forward.
+    bool TapeFreeLoops = false;
+    /// Buffer the adjoint updates of the loops at indirect indices, e.g.
+    /// _d_x[idx[i]], one slot per iteration, and apply them after the loop.
+    bool BufferIndirectAdjoints = false;
+    /// Reverse the stencil loops, updating the adjoints of x[i + c] for
+    /// several offsets c, with one loop gathering the updates of each
+    /// element. Implies TapeFreeLoops.
+    bool StencilAdjoints = false;
+    /// Reverse the loops computing a dot product, an axpy or a matrix-vector
+    /// product by a call to the adjoint kernel of custom_derivatives.
+    bool BlasAdjoints = false;
+    /// Interchange the reverse loops of the nests without tapes whose adjoint
+    /// updates are contiguous in the outer loop. Implies TapeFreeLoops.
+    bool ReorderAdjointLoops = false;
+    /// Count the entries of the gradient, the calls it makes and the trips of
+    /// its loops at run time, see clad/Differentiator/Profile.h.
+    bool InstrumentProfile = false;
+    /// Allocate the tapes of the gradient from the arena of the thread, see
+    /// clad/Differentiator/TapeArena.h, released when the gradient returns.
+    bool TapeArena = false;
+    /// The structural sparsity pattern of the produced Jacobian or Hessian,
+    /// passed to the updated call if it is known.
+    std::string SparsityPattern = {};
+    /// Seed the forward mode with all the requested parameters at once, i.e.
+    /// produce the derivative along the sum of their directions.
+    bool SeedArgsTogether = false;
+    /// The reverse mode policy, overridden by the clad::store_all, clad::mixed
+    /// and clad::recompute_all annotations of the differentiated function.
+    ReversePolicy Policy = ReversePolicy::store_all;
 
     void updateCall(clang::FunctionDecl* FD, clang::Sema& SemaRef);
   };
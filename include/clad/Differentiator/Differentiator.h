@@ -7,9 +7,16 @@
 #ifndef CLAD_DIFFERENTIATOR
 #define CLAD_DIFFERENTIATOR
 
+#include "BatchDerivatives.h"
+#include "BlasDerivatives.h"
 #include "BuiltinDerivatives.h"
+#include "FixedPoint.h"
 #include "FunctionTraits.h"
+#include "Parallel.h"
+#include "Profile.h"
+#include "ScatterBuffer.h"
 #include "Tape.h"
+#include "TapeArena.h"
 
 #include <assert.h>
 #include <stddef.h>
@@ -49,26 +56,33 @@ namespace clad {
   using tape = tape_impl<T>;
 
   /// Add value to the end of the tape, return the same value.
-  template <typename T>
-  CUDA_HOST_DEVICE T push(tape<T>& to, T val) {
+  template <typename T, typename A>
+  CUDA_HOST_DEVICE T push(tape_impl<T, A>& to, T val) {
     to.emplace_back(val);
     return val;
   }
 
   /// Remove the last value from the tape, return it.
-  template <typename T>
-  CUDA_HOST_DEVICE T pop(tape<T>& to) {
+  template <typename T, typename A>
+  CUDA_HOST_DEVICE T pop(tape_impl<T, A>& to) {
     T val = to.back();
     to.pop_back();
     return val;
   }
 
   /// Access return the last value in the tape.
-  template <typename T>
-  CUDA_HOST_DEVICE T& back(tape<T>& of) {
+  template <typename T, typename A>
+  CUDA_HOST_DEVICE T& back(tape_impl<T, A>& of) {
     return of.back();
   }
 
+  /// Makes room for n values on the tape, e.g. the number of iterations of a
+  /// loop known from a profile.
+  template <typename T, typename A>
+  CUDA_HOST_DEVICE void reserve(tape_impl<T, A>& of, std::size_t n) {
+    of.reserve(n);
+  }
+
   // Using std::function and std::mem_fn introduces a lot of overhead, which we
   // do not need. Another disadvantage is that it is difficult to distinguish a
   // 'normal' use of std::{function,mem_fn} from the ones we must differentiate.
@@ -86,12 +100,16 @@ namespace clad {
     CladFunctionType m_Function;
     char* m_Code;
     FunctorType *m_Functor = nullptr;
+    /// The structural sparsity pattern of a Jacobian or a Hessian, one line of
+    /// 0 and 1 per row, or "" if it is unknown.
+    const char* m_Pattern = "";
 
   public:
     CUDA_HOST_DEVICE CladFunction(CladFunctionType f,
                                   const char* code,
-                                  FunctorType* functor = nullptr)
-        : m_Functor(functor) {
+                                  FunctorType* functor = nullptr,
+                                  const char* pattern = "")
+        : m_Functor(functor), m_Pattern(pattern) {
       assert(f && "Must pass a non-0 argument.");
       if (size_t length = GetLength(code)) {
         m_Function = f;
@@ -157,6 +175,49 @@ namespace clad {
       printf("The code is: %s\n", getCode());
     }
 
+    /// Return the structural sparsity pattern of the generated Jacobian or
+    /// Hessian, one line of 0 and 1 per row, or "" if it is unknown.
+    const char* getSparsityPattern() const { return m_Pattern; }
+
+    /// Return false if the entry (i, j) of the generated Jacobian or Hessian
+    /// is known to be always zero.
+    bool isStructurallyNonZero(unsigned i, unsigned j) const {
+      const char* p = m_Pattern;
+      for (; *p && i; ++p)
+        if (*p == '\n')
+          --i;
+      for (; *p && *p != '\n' && j; ++p)
+        --j;
+      return !*p || *p != '0';
+    }
+
+    /// Return the number of structural nonzeros of the generated Jacobian or
+    /// Hessian, i.e. the number of values of a sparse hessian.
+    unsigned getNumNonZeros() const {
+      unsigned n = 0;
+      for (const char* p = m_Pattern; *p; ++p)
+        n += *p == '1';
+      return n;
+    }
+
+    /// Fill the row offsets (one per row and one past the last) and the
+    /// column indices of the structural nonzeros in compressed sparse row
+    /// format, the order of the values of a sparse hessian.
+    void getSparseIndices(unsigned* rowOffsets, unsigned* columns) const {
+      unsigned k = 0, j = 0;
+      *rowOffsets++ = 0;
+      for (const char* p = m_Pattern; *p; ++p) {
+        if (*p == '\n') {
+          *rowOffsets++ = k;
+          j = 0;
+          continue;
+        }
+        if (*p == '1')
+          columns[k++] = j;
+        ++j;
+      }
+    }
+
     /// Set object pointed by the functor as the default object for
     /// executing derived member function.
     void setObject(FunctorType* functor) {
@@ -312,10 +373,32 @@ namespace clad {
   hessian(F f,
           ArgSpec args = "",
           DerivedFnType derivedFn = static_cast<DerivedFnType>(nullptr),
-          const char* code = "") {
+          const char* code = "",
+          const char* pattern = "") {
     assert(f && "Must pass in a non-0 argument");
     return CladFunction<DerivedFnType>(derivedFn /* will be replaced by hessian*/,
-                                       code);
+                                       code, nullptr, pattern);
+  }
+
+  /// Function for sparse Hessian computation
+  /// Given a function f, clad::sparse_hessian generates f_sparse_hessian,
+  /// which computes only the structurally nonzero entries of the Hessian, one
+  /// compressed Hessian-vector product per color of a star coloring of its
+  /// sparsity pattern. The values are written in compressed sparse row order,
+  /// see CladFunction::getSparseIndices.
+  template <typename ArgSpec = const char*,
+            typename F,
+            typename DerivedFnType = ExtractDerivedFnTraits_t<F>>
+  CladFunction<DerivedFnType> __attribute__((annotate("S")))
+  sparse_hessian(F f,
+                 ArgSpec args = "",
+                 DerivedFnType derivedFn = static_cast<DerivedFnType>(nullptr),
+                 const char* code = "",
+                 const char* pattern = "") {
+    assert(f && "Must pass in a non-0 argument");
+    return CladFunction<DerivedFnType>(
+        derivedFn /* will be replaced by sparse hessian*/, code, nullptr,
+        pattern);
   }
 
   template <typename ArgSpec = const char*,
@@ -325,10 +408,11 @@ namespace clad {
   jacobian(F f,
            ArgSpec args = "",
            DerivedFnType derivedFn = static_cast<DerivedFnType>(nullptr),
-           const char* code = "") {
+           const char* code = "",
+           const char* pattern = "") {
     assert(f && "Must pass in a non-0 argument");
     return CladFunction<DerivedFnType>(
-        derivedFn /* will be replaced by Jacobian*/, code);
+        derivedFn /* will be replaced by Jacobian*/, code, nullptr, pattern);
   }
 }
 #endif // CLAD_DIFFERENTIATOR
@@ -0,0 +1,35 @@
+//--------------------------------------------------------------------*- C++ -*-
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Fixed-point solves, differentiated implicitly in reverse mode.
+//------------------------------------------------------------------------------
+
+#ifndef CLAD_FIXED_POINT_H
+#define CLAD_FIXED_POINT_H
+
+namespace clad {
+  /// Iterates x = g(x, args...) from the initial guess x until two successive
+  /// iterates differ by at most tol, or max_iter iterations were made.
+  /// \returns the last iterate, an approximation of x* = g(x*, args...).
+  ///
+  /// The gradients do not differentiate the iterations. The derivatives are
+  /// computed at the solution by the implicit function theorem, from the
+  /// gradient of g:
+  ///   dx*/dargs = dg/dargs / (1 - dg/dx).
+  /// Hence they do not depend on x, tol and max_iter, and the memory of the
+  /// gradient does not grow with the number of iterations.
+  template <typename T, typename... ParamsT, typename... ArgsT>
+  T fixed_point(T (*g)(T, ParamsT...), T x, T tol, unsigned max_iter,
+                ArgsT... args) {
+    for (unsigned k = 0; k < max_iter; ++k) {
+      T next = g(x, args...);
+      T delta = next - x;
+      x = next;
+      if (delta <= tol && -delta <= tol)
+        break;
+    }
+    return x;
+  }
+} // end namespace clad
+
+#endif // CLAD_FIXED_POINT_H
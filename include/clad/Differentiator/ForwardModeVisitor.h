@@ -25,9 +25,17 @@ namespace clad {
         public VisitorBase {
   private:
     const clang::VarDecl* m_IndependentVar = nullptr;
+    /// The parameters seeded together with m_IndependentVar, if the
+    /// derivative is taken along the sum of their directions.
+    llvm::SmallVector<const clang::VarDecl*, 4> m_SeededVars;
     unsigned m_IndependentVarIndex = ~0;
     unsigned m_DerivativeOrder = ~0;
     unsigned m_ArgIndex = ~0;
+    /// A flag indicating if the derivative is differentiated again, e.g. if
+    /// a higher order derivative is requested.
+    bool m_DerivedAgain = false;
+    /// A flag indicating if the fused builtin derivatives can be called.
+    bool m_FuseBuiltins = false;
 
   public:
     ForwardModeVisitor(DerivativeBuilder& builder);
@@ -29,6 +29,21 @@ namespace clad {
     /// into a single FunctionDecl f_hessian
     DeclWithContext Merge(std::vector<clang::FunctionDecl*> Functions,
                           const DiffRequest& request);
+    /// Derives the function in forward mode along the sum of the directions
+    /// of the parameters named in argNames, separated by commas, and the
+    /// result in reverse mode, i.e. produces a Hessian-vector product.
+    clang::FunctionDecl* DeriveColumn(const DiffRequest& request,
+                                      llvm::StringRef argNames,
+                                      bool seedTogether = false);
+    /// Produces f_sparse_hessian, which computes only the structural
+    /// nonzeros of the hessian, with one compressed Hessian-vector product
+    /// per color of a star coloring of its sparsity pattern.
+    DeclWithContext DeriveSparse(const clang::FunctionDecl* FD,
+                                 const DiffRequest& request,
+                                 const DiffParams& args);
+    /// The nonzeros of a sparse hessian in row-major order, each given by
+    /// the color of the product holding it and its index in the product.
+    std::vector<std::pair<unsigned, unsigned>> m_SparseEntries;
 
   public:
     HessianModeVisitor(DerivativeBuilder& builder);
@@ -0,0 +1,71 @@
+//--------------------------------------------------------------------*- C++ -*-
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// The runtime of the reverse loops of the OpenMP parallel loops.
+//------------------------------------------------------------------------------
+
+#ifndef CLAD_PARALLEL_H
+#define CLAD_PARALLEL_H
+
+#ifdef _OPENMP
+extern "C" {
+  int omp_get_thread_num(void);
+  int omp_get_num_threads(void);
+}
+#endif
+
+namespace clad {
+  /// Runs f once on each thread of a new OpenMP parallel region.
+  template <typename F> void parallel(F&& f) {
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    f();
+  }
+
+  /// Returns the bound of the k-th block when the iterations from lo to hi
+  /// are split in contiguous blocks, one per thread of the parallel region.
+  template <typename T> T thread_bound(T lo, T hi, int k) {
+    if (!(lo < hi))
+      return lo;
+#ifdef _OPENMP
+    T threads = omp_get_num_threads();
+#else
+    T threads = 1;
+#endif
+    T n = hi - lo;
+    T q = n / threads;
+    T r = n % threads;
+    T block = k;
+    return lo + q * block + (block < r ? block : r);
+  }
+
+  /// Returns the first iteration of the block of the calling thread, see
+  /// thread_bound.
+  template <typename T, typename U> T thread_begin(T lo, U hi) {
+#ifdef _OPENMP
+    return thread_bound(lo, static_cast<T>(hi), omp_get_thread_num());
+#else
+    return lo;
+#endif
+  }
+
+  /// Returns the end of the block of the calling thread, see thread_bound.
+  template <typename T, typename U> T thread_end(T lo, U hi) {
+#ifdef _OPENMP
+    return thread_bound(lo, static_cast<T>(hi), omp_get_thread_num() + 1);
+#else
+    return thread_bound(lo, static_cast<T>(hi), 1);
+#endif
+  }
+
+  /// Adds v to x, which other threads may update at the same time.
+  template <typename T, typename U> void atomic_add(T& x, U v) {
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+    x += v;
+  }
+} // end namespace clad
+
+#endif // CLAD_PARALLEL_H
@@ -0,0 +1,78 @@
+//--------------------------------------------------------------------*- C++ -*-
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Run-time counts of the derivatives instrumented with
+// -fprofile-derivatives-generate, read back by -fprofile-derivatives-use.
+//------------------------------------------------------------------------------
+
+#ifndef CLAD_PROFILE_H
+#define CLAD_PROFILE_H
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+
+namespace clad {
+  /// The counts of the sites of the instrumented derivatives, written at exit
+  /// to the file named by the CLAD_PROFILE_FILE environment variable, or to
+  /// clad.profile. Each line is either
+  ///   call <site> <count>
+  /// for the entries of the derivatives of a function, whose site is its
+  /// qualified name with its parameter types, as in f(double, int), and for
+  /// the calls they make, or
+  ///   loop <site> <runs> <trips>
+  /// for their loops. The sites of the calls and of the loops are
+  /// <function>:<line>:<column> in the differentiated source.
+  class profile_data {
+    struct loop_counts {
+      unsigned long long runs = 0;
+      unsigned long long trips = 0;
+    };
+    std::map<std::string, unsigned long long> _calls;
+    std::map<std::string, loop_counts> _loops;
+
+  public:
+    ~profile_data() { write(); }
+
+    void record_call(const char* site) { ++_calls[site]; }
+    void record_loop(const char* site, std::size_t trips) {
+      loop_counts& counts = _loops[site];
+      counts.runs += 1;
+      counts.trips += trips;
+    }
+
+    /// Writes the counts, replacing the previous profile.
+    void write() const {
+      const char* path = std::getenv("CLAD_PROFILE_FILE");
+      FILE* f = std::fopen(path ? path : "clad.profile", "w");
+      if (!f)
+        return;
+      for (const auto& call : _calls)
+        std::fprintf(f, "call %s %llu\n", call.first.c_str(), call.second);
+      for (const auto& loop : _loops)
+        std::fprintf(f, "loop %s %llu %llu\n", loop.first.c_str(),
+                     loop.second.runs, loop.second.trips);
+      std::fclose(f);
+    }
+  };
+
+  /// The counts of the program.
+  inline profile_data& get_profile() {
+    static profile_data profile;
+    return profile;
+  }
+
+  /// Counts an entry into a derivative or a call it makes.
+  inline void profile_call(const char* site) {
+    get_profile().record_call(site);
+  }
+
+  /// Counts a run of a loop of a derivative and its iterations.
+  inline void profile_loop(const char* site, std::size_t trips) {
+    get_profile().record_loop(site, trips);
+  }
+} // end namespace clad
+
+#endif // CLAD_PROFILE_H
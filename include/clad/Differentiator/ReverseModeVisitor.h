@@ -13,11 +13,16 @@
 #include "clang/AST/StmtVisitor.h"
 #include "clang/Sema/Sema.h"
 
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
 #include <array>
 #include <stack>
 #include <unordered_map>
 
 namespace clad {
+  class DerivativeProfile;
+
   /// A visitor for processing the function code in reverse mode.
   /// Used to compute derivatives by clad::gradient.
   class ReverseModeVisitor
@@ -45,6 +50,97 @@ namespace clad {
     unsigned outputArrayCursor = 0;
     unsigned numParams = 0;
     bool isVectorValued = false;
+    /// The maximal size (in AST nodes) of the callees which are inlined into
+    /// the gradient instead of calling their own gradients, 0 disables it.
+    unsigned m_InlineThreshold = 0;
+    /// The callees being inlined, to prevent the recursive ones to be inlined
+    /// infinitely.
+    llvm::SmallPtrSet<const clang::FunctionDecl*, 4> m_InlinedCallees;
+    /// A flag indicating if a pullback is produced instead of a gradient, i.e.
+    /// the adjoint of the returned value is passed as a parameter and the
+    /// adjoints of the parameters are accumulated through pointers.
+    bool isPullback = false;
+    /// The seed parameter of the pullback.
+    clang::ParmVarDecl* m_Seed = nullptr;
+    /// A flag indicating if the callees are differentiated as pullbacks.
+    bool m_UsePullbacks = false;
+    /// Flags indicating if only the forward pass (the augmented primal) or
+    /// only the reverse pass of a pullback is produced. The two communicate
+    /// through the tapes, which are passed by reference.
+    bool isAugmentedPrimal = false;
+    bool isReverseOnly = false;
+    /// A flag indicating if the callees are differentiated as pairs of an
+    /// augmented primal and a reverse pass.
+    bool m_SplitPullbacks = false;
+    /// A flag indicating if the builtin derivatives reusing the value of the
+    /// call are used.
+    bool m_FuseBuiltins = false;
+    /// A flag indicating if the builtin derivatives of the calls in loops are
+    /// evaluated over the tapes of their arguments.
+    bool m_BatchBuiltins = false;
+    /// The calls evaluating the derivatives on the tapes, emitted between the
+    /// forward and the reverse passes.
+    Stmts m_BatchCalls;
+    /// A flag indicating if the loops with independent iterations are
+    /// differentiated without tapes, and if such a loop is being visited.
+    /// Their values are recomputed in a forward running reverse loop.
+    bool m_TapeFreeLoops = false;
+    bool m_InTapeFreeLoop = false;
+    /// A flag indicating if the other innermost loops are reversed without
+    /// tapes too, and if such a loop is being visited. Their reverse pass runs
+    /// the loop again from a checkpoint of the variables it writes up to each
+    /// reversed iteration, which stores its values in plain variables.
+    bool m_ReplayLoops = false;
+    bool m_InReplayedLoop = false;
+    /// The variables storing the values of the replayed loops.
+    llvm::DenseSet<const clang::VarDecl*> m_ReplayStores;
+    /// A flag indicating if the updates of the adjoint arrays at offsets from
+    /// the loop variable, as in stencils, are gathered per element.
+    bool m_StencilAdjoints = false;
+    /// A flag indicating if the reverse loops of the nests without tapes are
+    /// interchanged when their adjoint updates are contiguous in the outer
+    /// loop, e.g. _d_A[j * n + i] updated by the loops over i and j.
+    bool m_ReorderAdjointLoops = false;
+    /// A flag indicating if the loops computing a dot product, an axpy or a
+    /// matrix-vector product are reversed by a call to an adjoint kernel, and
+    /// if such a loop is being visited. Their forward pass has no tapes.
+    bool m_BlasAdjoints = false;
+    bool m_InKernelLoop = false;
+    /// A flag indicating if the independent loops of the OpenMP parallel
+    /// loop directives are reversed by a parallel loop, and if the loop of
+    /// such a directive is being visited.
+    bool m_ParallelLoops = false;
+    bool m_InParallelDirective = false;
+    /// A flag indicating if the adjoint updates at indirect indices in loops,
+    /// e.g. _d_x[idx[i]] += v, are buffered and applied after the loop.
+    bool m_BufferIndirect = false;
+    /// The buffered updates of the innermost loop with a counter.
+    struct LoopBuffers {
+      /// The counter of the loop, which is the number of the remaining
+      /// iterations in the reverse pass.
+      clang::Expr* Counter;
+      /// The variables modified in the loop, whose adjoints must be up to date
+      /// during the reverse pass.
+      llvm::DenseSet<const clang::VarDecl*> Modified;
+      /// The buffers and the adjoint arrays they update.
+      llvm::SmallVector<std::pair<clang::VarDecl*, clang::Expr*>, 2> Buffers;
+    };
+    LoopBuffers* m_LoopBuffers = nullptr;
+    /// The tapes declared in m_Globals.
+    llvm::SmallVector<clang::VarDecl*, 8> m_Tapes;
+    /// A flag indicating if the gradient counts its entries, its calls and
+    /// the trips of its loops at run time, see Profile.h.
+    bool m_InstrumentProfile = false;
+    /// The profile guiding the gradient, null if there is none or if it has
+    /// no entry of the function, and the number of the entries.
+    const DerivativeProfile* m_Profile = nullptr;
+    uint64_t m_ProfileEntries = 0;
+    /// The profiled number of trips of the innermost loop being visited per
+    /// entry, 0 if unknown, and the tapes of the loop nest being visited
+    /// with the number of values they receive, which are reserved before the
+    /// nest runs.
+    uint64_t m_ExpectedTrips = 0;
+    llvm::SmallVector<std::pair<clang::VarDecl*, uint64_t>, 4> m_TapeReserves;
 
     const char* funcPostfix() const {
       if (isVectorValued)
@@ -196,6 +292,9 @@ namespace clad {
       StmtDiff Result;
       bool isConstant;
       bool isInsideLoop;
+      /// The expression is recomputed in the reverse pass instead of being
+      /// stored.
+      bool isRecomputed = false;
       void Finalize(clang::Expr* New);
     };
 
@@ -221,10 +320,112 @@ namespace clad {
       clang::Expr* Last();
     };
 
+    /// Creates a global declaration of a tape of the given type.
+    clang::VarDecl* MakeCladTape(clang::QualType TapeType);
     /// If E is supposed to be stored in a tape, will create a global
     /// declaration of tape of corresponding type and return a result struct
     /// with reference to the tape and constructed calls to push/pop methods.
     CladTapeResult MakeCladTapeFor(clang::Expr* E);
+    /// Turns the tapes of a split pullback into reference parameters appended
+    /// to params.
+    void appendTapeParams(llvm::SmallVectorImpl<clang::ParmVarDecl*>& params);
+
+    /// Differentiates the call CE to a small function FD by splicing RetVal,
+    /// the value returned by FD, into the forward and the reverse passes. The
+    /// parameters are stored in temporaries and their adjoints are propagated
+    /// to the arguments, as for the calls to gradients.
+    StmtDiff InlineCallExpr(const clang::CallExpr* CE,
+                            const clang::FunctionDecl* FD,
+                            const clang::Expr* RetVal);
+    /// Differentiates the call CE to clad::fixed_point(G, x, tol, max_iter,
+    /// args...) implicitly: the gradient of G at the solution replaces the
+    /// reverse pass of the iterations.
+    StmtDiff VisitFixedPointCall(const clang::CallExpr* CE,
+                                 const clang::FunctionDecl* G);
+    /// Produces the augmented primal and the reverse pass of the pullback of
+    /// FD, declares the tapes connecting them and returns the call to the
+    /// reverse pass, appending the tapes to ReverseCallArgs. Returns null if
+    /// either pass cannot be produced.
+    clang::Expr*
+    BuildSplitPullbackCall(const clang::FunctionDecl* FD,
+                           llvm::SmallVectorImpl<clang::Expr*>& ReverseCallArgs,
+                           clang::FunctionDecl*& AugmentedPrimalFD,
+                           llvm::SmallVectorImpl<clang::VarDecl*>& Tapes);
+    /// Builds the call replacing the arguments of FD stored on Tape by the
+    /// derivatives of FD, f_darg0_batch(_tK). Returns null if there is no
+    /// such builtin.
+    clang::Expr* BuildBatchDerivativeCall(const clang::FunctionDecl* FD,
+                                          clang::VarDecl* Tape);
+    /// Builds a call to the function of clad namespace with the given name,
+    /// e.g. clad::scatter(Args).
+    clang::Expr* BuildCladCall(llvm::StringRef Name,
+                               llvm::MutableArrayRef<clang::Expr*> Args);
+    /// Builds the string literal naming the site of S in the profile, or of
+    /// the function if S is null.
+    clang::Expr* BuildProfileSite(const clang::Stmt* S);
+    /// Returns true if the update of the adjoint of an element of Base at
+    /// the given indices is buffered in the current loop.
+    bool isBufferedUpdate(const clang::Expr* Base,
+                          llvm::ArrayRef<const clang::Expr*> Indices) const;
+    /// Declares a buffer of the updates of the adjoint array Target and
+    /// returns the slot of the current iteration updating Target[Index],
+    /// clad::scatter(_bN, Counter - 1, Index).
+    clang::Expr* BuildBufferedUpdate(clang::Expr* Target, clang::Expr* Index);
+    /// The updates A[i + c] += v of the reverse body of a stencil loop at
+    /// the offset c, with the declarations they use.
+    struct StencilTerm {
+      int64_t Offset = 0;
+      clang::CompoundStmt* Body = nullptr;
+      /// The positions of the updates in Body.
+      llvm::SmallVector<unsigned, 2> Updates;
+    };
+    /// Splits the reverse body of a loop without tapes into the terms of its
+    /// updates A[i + c] += v, one per offset c, and the rest of the body, which
+    /// runs after them. Returns false if the body has no updates at nonzero
+    /// offsets or cannot be split.
+    bool splitStencilUpdates(clang::CompoundStmt* Body,
+                             const clang::VarDecl* LoopVar,
+                             llvm::SmallVectorImpl<StencilTerm>& Terms,
+                             clang::CompoundStmt*& Rest);
+    /// Appends to Loops the statements running the terms of the stencil loop
+    /// for (T i = lo; i < hi; i++) in the gather form: a loop over the
+    /// elements j of the updated arrays, A[j] += v(j - c) for each offset c,
+    /// whose first and last iterations, where only some of the terms apply,
+    /// are peeled. The loops of fewer trips than the width of the stencil
+    /// run the terms in place. Returns false if the loop is not of this form.
+    /// The loop runs in parallel if Parallel, see BuildParallelLoop.
+    bool BuildStencilGather(clang::DeclStmt* Init, clang::Expr* Cond,
+                            clang::Expr* Inc,
+                            llvm::ArrayRef<StencilTerm> Terms, bool Parallel,
+                            const clang::Expr* OrigCond,
+                            llvm::SmallVectorImpl<clang::Stmt*>& Loops);
+    /// Returns the call to the adjoint kernel of custom_derivatives replacing
+    /// the reverse pass of FS, if FS computes a dot product, an axpy or a
+    /// matrix-vector product, e.g. dot_loop_pullback(x, y, n, _d_s, _d_x,
+    /// _d_y) for s += x[i] * y[i]. Returns null otherwise.
+    clang::Expr* BuildKernelAdjointCall(const clang::ForStmt* FS);
+    /// Returns the reverse loop of a nest without tapes, with its two
+    /// outermost loops interchanged if more of the array elements assigned by
+    /// its body are contiguous in the outer loop than in the inner one.
+    clang::Stmt* reorderForLocality(clang::ForStmt* Loop);
+    /// Returns the reverse loop of a loop without tapes for (T i = lo; i < hi;
+    /// ++i) run by the threads of an OpenMP parallel region, each on its own
+    /// block of iterations, clad::parallel([&] { ... }). The updates which
+    /// other iterations may make at the same time are atomic, the ones of
+    /// the scalar adjoints are accumulated per thread. Returns Loop, without
+    /// its pairs of updates which cancel out, if it cannot run in parallel.
+    /// E is the original loop condition, which locates the lambda.
+    clang::Stmt* BuildParallelLoop(clang::ForStmt* Loop, const clang::Expr* E);
+    /// Returns the reverse body of a replayed loop, given its forward pass
+    /// Forward and the reverse body of its iterations: it restores the
+    /// variables written by the loop, runs the iterations preceding the
+    /// reversed one again, then the reversed one, which stores its values,
+    /// and ReverseBody. Adds the checkpoint of the variables to the forward
+    /// pass, before the loop.
+    clang::Stmt* BuildReplayedIterations(clang::ForStmt* Forward,
+                                         clang::Expr* CounterIncrement,
+                                         clang::Expr* Counter,
+                                         clang::Stmt* ReverseBody);
 
   public:
     ReverseModeVisitor(DerivativeBuilder& builder);
@@ -268,6 +469,7 @@ namespace clad {
     StmtDiff VisitInitListExpr(const clang::InitListExpr* ILE);
     StmtDiff VisitIntegerLiteral(const clang::IntegerLiteral* IL);
     StmtDiff VisitMemberExpr(const clang::MemberExpr* ME);
+    StmtDiff VisitOMPLoopDirective(const clang::OMPLoopDirective* D);
     StmtDiff VisitParenExpr(const clang::ParenExpr* PE);
     StmtDiff VisitReturnStmt(const clang::ReturnStmt* RS);
     StmtDiff VisitStmt(const clang::Stmt* S);
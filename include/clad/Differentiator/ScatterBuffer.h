@@ -0,0 +1,118 @@
+//--------------------------------------------------------------------*- C++ -*-
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Buffers for the indirect adjoint updates of the loops in reverse mode.
+//------------------------------------------------------------------------------
+
+#ifndef CLAD_SCATTER_BUFFER_H
+#define CLAD_SCATTER_BUFFER_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <new>
+
+namespace clad {
+  /// Collects the updates of an adjoint array at indirect indices, e.g.
+  /// _d_x[idx[i]] += v, one slot per iteration of a reverse loop. Since every
+  /// iteration writes its own slot, the loop has no dependencies through the
+  /// adjoint array. The updates are applied once the loop is over, in the
+  /// order of the indices, so that each element is written once.
+  template <typename T>
+  class scatter_buffer {
+    std::size_t* _indices = nullptr;
+    T* _values = nullptr;
+    std::size_t* _order = nullptr;
+    std::size_t _size = 0;
+    std::size_t _capacity = 0;
+  public:
+    /// Marks the slots which were not written.
+    static constexpr std::size_t unused = static_cast<std::size_t>(-1);
+
+    scatter_buffer() = default;
+    scatter_buffer(const scatter_buffer&) = delete;
+    scatter_buffer& operator=(const scatter_buffer&) = delete;
+    ~scatter_buffer() { release(); }
+
+    /// Allocates n empty slots.
+    void reset(std::size_t n) {
+      if (n > _capacity) {
+        release();
+        _indices = new (std::nothrow) std::size_t[n];
+        _values = new (std::nothrow) T[n];
+        _order = new (std::nothrow) std::size_t[n];
+        assert(_indices && _values && _order);
+        _capacity = n;
+      }
+      _size = n;
+      std::fill(_indices, _indices + n, unused);
+      std::fill(_values, _values + n, T());
+    }
+
+    /// \returns the value of the given slot, which updates the given index.
+    T& at(std::size_t slot, std::size_t index) {
+      _indices[slot] = index;
+      return _values[slot];
+    }
+
+    /// Adds the values of the slots to the elements of target.
+    template <typename U>
+    void flush(U* target) {
+      std::size_t n = 0;
+      for (std::size_t i = 0; i < _size; ++i)
+        if (_indices[i] != unused)
+          _order[n++] = i;
+      // The reverse loops usually fill the slots by decreasing indices.
+      std::reverse(_order, _order + n);
+      const std::size_t* indices = _indices;
+      auto byIndex = [indices](std::size_t a, std::size_t b) {
+        return indices[a] < indices[b];
+      };
+      if (!std::is_sorted(_order, _order + n, byIndex))
+        std::stable_sort(_order, _order + n, byIndex);
+      // Sum the segments of equal indices.
+      for (std::size_t i = 0; i < n;) {
+        std::size_t index = _indices[_order[i]];
+        T sum = _values[_order[i]];
+        for (++i; i < n && _indices[_order[i]] == index; ++i)
+          sum += _values[_order[i]];
+        target[index] += sum;
+      }
+      _size = 0;
+    }
+
+  private:
+    void release() {
+      delete[] _indices;
+      delete[] _values;
+      delete[] _order;
+      _indices = nullptr;
+      _values = nullptr;
+      _order = nullptr;
+      _capacity = 0;
+    }
+  };
+
+  template <typename T>
+  constexpr std::size_t scatter_buffer<T>::unused;
+
+  /// Prepares the buffer for a reverse loop of n iterations.
+  template <typename T>
+  void reserve(scatter_buffer<T>& buffer, std::size_t n) {
+    buffer.reset(n);
+  }
+
+  /// \returns the slot of the buffer updating the given index.
+  template <typename T>
+  T& scatter(scatter_buffer<T>& buffer, std::size_t slot, std::size_t index) {
+    return buffer.at(slot, index);
+  }
+
+  /// Applies the updates of the buffer to target.
+  template <typename T, typename U>
+  void gather(scatter_buffer<T>& buffer, U* target) {
+    buffer.flush(target);
+  }
+} // end namespace clad
+
+#endif // CLAD_SCATTER_BUFFER_H
@@ -2,7 +2,9 @@
 #define CLAD_TAPE_H
 
 #include <cassert>
+#include <cstddef>
 #include <memory>
+#include <new>
 #include <type_traits>
 #include <utility>
 
@@ -13,10 +15,66 @@
 #endif
 
 namespace clad {
+  /// An allocator of the raw storage of the tapes, installed at run time by
+  /// set_tape_allocator. The context is passed back to both functions.
+  struct tape_allocator {
+    void* (*allocate)(void* ctx, std::size_t bytes);
+    void (*deallocate)(void* ctx, void* ptr, std::size_t bytes);
+    void* ctx;
+  };
+
+#ifndef __CUDACC__
+  /// The allocator of the tapes constructed on this thread, null for
+  /// ::operator new.
+  inline const tape_allocator*& current_tape_allocator() {
+    static thread_local const tape_allocator* allocator = nullptr;
+    return allocator;
+  }
+
+  /// Installs the allocator of the tapes constructed afterwards on this
+  /// thread, null restores ::operator new. Returns the previous one.
+  inline const tape_allocator*
+  set_tape_allocator(const tape_allocator* allocator) {
+    const tape_allocator* previous = current_tape_allocator();
+    current_tape_allocator() = allocator;
+    return previous;
+  }
+#endif
+
+  /// The allocator policy of the tapes by default: the allocator installed
+  /// on the thread when the tape is constructed, or ::operator new. The
+  /// tapes keep it for their lifetime.
+  class default_tape_allocator {
+#ifndef __CUDACC__
+    const tape_allocator* _hook = current_tape_allocator();
+#endif
+  public:
+    CUDA_HOST_DEVICE void* allocate(std::size_t bytes) {
+      #ifdef __CUDACC__
+        return ::operator new(bytes);
+      #else
+        if (_hook)
+          return _hook->allocate(_hook->ctx, bytes);
+        return ::operator new(bytes, std::nothrow);
+      #endif
+    }
+    CUDA_HOST_DEVICE void deallocate(void* ptr, std::size_t bytes) {
+      #ifndef __CUDACC__
+        if (_hook) {
+          _hook->deallocate(_hook->ctx, ptr, bytes);
+          return;
+        }
+      #endif
+      ::operator delete(ptr);
+    }
+  };
+
   /// Dynamically-sized array (std::vector-like), primarily used for storing
-  /// values in reverse-mode AD inside loops.
-  template <typename T>
-  class tape_impl {
+  /// values in reverse-mode AD inside loops. Its storage comes from the
+  /// Allocator policy, whose allocate(bytes) and deallocate(ptr, bytes)
+  /// members get and return raw memory.
+  template <typename T, typename Allocator = default_tape_allocator>
+  class tape_impl : private Allocator {
     T* _data = nullptr;
     std::size_t _size = 0;
     std::size_t _capacity = 0;
@@ -32,16 +90,19 @@ namespace clad {
     using iterator = pointer;
     using const_iterator = const_pointer;
 
-    /// Move values from old to new storage
+    tape_impl() = default;
+    tape_impl(const tape_impl&) = delete;
+    tape_impl& operator=(const tape_impl&) = delete;
+    CUDA_HOST_DEVICE ~tape_impl() {
+      destroy(begin(), end());
+      if (_data)
+        Allocator::deallocate(_data, _capacity * sizeof(T));
+    }
+
+    /// Allocate raw storage (without calling constructors of T) of the given
+    /// capacity.
     CUDA_HOST_DEVICE T* AllocateRawStorage(std::size_t _capacity) {
-      #ifdef __CUDACC__
-        // Allocate raw storage (without calling constructors of T) of new capacity.
-        T* new_data = static_cast<T*>(::operator new(_capacity * sizeof(T)));
-      #else
-        T *new_data =
-          static_cast<T *>(::operator new(_capacity * sizeof(T), std::nothrow));
-      #endif
-      return new_data;
+      return static_cast<T*>(Allocator::allocate(_capacity * sizeof(T)));
     }
 
     /// Add new value of type T constructed from args to the end of the tape.
@@ -53,7 +114,13 @@ namespace clad {
       _size += 1;
     }
 
-    CUDA_HOST_DEVICE std::size_t size() const { return size; }
+    /// Makes room for at least n values, without reallocating until then.
+    CUDA_HOST_DEVICE void reserve(std::size_t n) {
+      if (n > _capacity)
+        reallocate(n);
+    }
+
+    CUDA_HOST_DEVICE std::size_t size() const { return _size; }
     CUDA_HOST_DEVICE iterator begin() {
       return reinterpret_cast<iterator>(_data);
     }
@@ -90,32 +157,40 @@ namespace clad {
     CUDA_HOST_DEVICE void grow() {
       // If empty, use initial capacity.
       if (!_capacity)
-        _capacity = _init_capacity;
+        reallocate(_init_capacity);
       else
         // Double the capacity on each reallocation.
-        _capacity *= 2;
-      T* new_data = AllocateRawStorage(_capacity);
+        reallocate(_capacity * 2);
+    }
+    CUDA_HOST_DEVICE void reallocate(std::size_t new_capacity) {
+      T* new_data = AllocateRawStorage(new_capacity);
       assert(new_data);
       // Move values from old storage to the new storage. Should call move
       // constructors on non-trivial types, otherwise is expected to use
       // memcpy/memmove.
-      for (auto i = begin(), e = end(); i != e; ++i, ++new_data)
-        new(new_data) T(std::move(*i));
-      // Destroy all values in the old storage.
+      T* to = new_data;
+      for (auto i = begin(), e = end(); i != e; ++i, ++to)
+        new (to) T(std::move(*i));
+      // Destroy all values in the old storage and release it.
       destroy(begin(), end());
+      if (_data)
+        Allocator::deallocate(_data, _capacity * sizeof(T));
       _data = new_data;
+      _capacity = new_capacity;
     }
     
     template <typename It>
-    using value_type_of = decltype(*std::declval<It>());
+    using value_type_of =
+        typename std::remove_reference<decltype(*std::declval<It>())>::type;
 
     // Call destructor for every value in the given range.
     template <typename It>
     static typename std::enable_if<
         !std::is_trivially_destructible<value_type_of<It>>::value>::type
     destroy(It B, It E) {
-      for (It I = E - 1; I >= B; --I)
-        I->~value_type_of<It>();
+      using V = value_type_of<It>;
+      for (It I = E; I != B;)
+        (--I)->~V();
     }
     // If type is trivially destructible, its destructor is no-op, so we can avoid
     // for loop here.
@@ -0,0 +1,152 @@
+//--------------------------------------------------------------------*- C++ -*-
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// A bump arena for the storage of the tapes, released in bulk when the
+// gradients built with -ftape-arena return.
+//------------------------------------------------------------------------------
+
+#ifndef CLAD_TAPE_ARENA_H
+#define CLAD_TAPE_ARENA_H
+
+#include "Tape.h"
+
+#include <cstddef>
+#include <new>
+
+namespace clad {
+#ifndef __CUDACC__
+  /// Allocates by bumping a pointer through a list of chunks of growing
+  /// sizes. Nothing is freed individually: the storage allocated since a
+  /// mark is released in bulk by rewinding to it, and the chunks are kept
+  /// for the next allocations until the arena is destroyed.
+  class tape_arena {
+    struct chunk {
+      chunk* next;
+      std::size_t size;
+    };
+    chunk* _first = nullptr;
+    chunk* _cur = nullptr;
+    /// The bytes used in the current chunk.
+    std::size_t _used = 0;
+    constexpr static std::size_t _align = alignof(std::max_align_t);
+    constexpr static std::size_t _min_chunk_size = 64 * 1024;
+
+    static std::size_t round_up(std::size_t bytes) {
+      return (bytes + _align - 1) / _align * _align;
+    }
+    static char* storage(chunk* c) {
+      return reinterpret_cast<char*>(c) + round_up(sizeof(chunk));
+    }
+
+    static void* allocate_in(void* ctx, std::size_t bytes) {
+      return static_cast<tape_arena*>(ctx)->allocate(bytes);
+    }
+    static void deallocate_in(void* ctx, void* ptr, std::size_t bytes) {
+      static_cast<tape_arena*>(ctx)->deallocate(ptr, bytes);
+    }
+
+  public:
+    /// A position in the arena, see rewind.
+    struct mark {
+      chunk* cur;
+      std::size_t used;
+    };
+
+    tape_arena() = default;
+    tape_arena(const tape_arena&) = delete;
+    tape_arena& operator=(const tape_arena&) = delete;
+    ~tape_arena() { release(); }
+
+    /// Returns storage of at least the given size, aligned for any scalar
+    /// type, or null if the system is out of memory.
+    void* allocate(std::size_t bytes) {
+      bytes = round_up(bytes);
+      if (!_cur) {
+        _cur = _first;
+        _used = 0;
+      }
+      // Take the first chunk kept from before with enough room.
+      while (_cur && _used + bytes > _cur->size && _cur->next) {
+        _cur = _cur->next;
+        _used = 0;
+      }
+      if (!_cur || _used + bytes > _cur->size) {
+        std::size_t size = _cur ? 2 * _cur->size : _min_chunk_size;
+        if (size < bytes)
+          size = bytes;
+        void* raw =
+            ::operator new(round_up(sizeof(chunk)) + size, std::nothrow);
+        if (!raw)
+          return nullptr;
+        chunk* c = static_cast<chunk*>(raw);
+        c->next = nullptr;
+        c->size = size;
+        if (_cur)
+          _cur->next = c;
+        else
+          _first = c;
+        _cur = c;
+        _used = 0;
+      }
+      void* ptr = storage(_cur) + _used;
+      _used += bytes;
+      return ptr;
+    }
+    /// The storage is released by rewind.
+    void deallocate(void*, std::size_t) {}
+
+    mark get_mark() const { return {_cur, _used}; }
+    /// Releases the storage allocated since the mark.
+    void rewind(mark m) {
+      _cur = m.cur;
+      _used = m.used;
+    }
+    /// Frees all the chunks.
+    void release() {
+      while (_first) {
+        chunk* next = _first->next;
+        ::operator delete(_first);
+        _first = next;
+      }
+      _cur = nullptr;
+      _used = 0;
+    }
+
+    /// The allocator of the tapes which allocates from this arena.
+    tape_allocator get_allocator() {
+      return {&allocate_in, &deallocate_in, this};
+    }
+  };
+
+  /// The arena of the tapes of the gradients running on this thread.
+  inline tape_arena& get_tape_arena() {
+    static thread_local tape_arena arena;
+    return arena;
+  }
+
+  /// Makes the tapes constructed during its lifetime allocate from the arena
+  /// of the thread, and releases their storage in bulk when it ends. The
+  /// gradients built with -ftape-arena declare one before their tapes, so
+  /// that it ends after them.
+  class tape_arena_scope {
+    tape_arena& _arena;
+    tape_arena::mark _mark;
+    tape_allocator _allocator;
+    const tape_allocator* _previous;
+
+  public:
+    tape_arena_scope()
+        : _arena(get_tape_arena()), _mark(_arena.get_mark()),
+          _allocator(_arena.get_allocator()),
+          _previous(set_tape_allocator(&_allocator)) {}
+    tape_arena_scope(const tape_arena_scope&) = delete;
+    tape_arena_scope& operator=(const tape_arena_scope&) = delete;
+    ~tape_arena_scope() {
+      set_tape_allocator(_previous);
+      _arena.rewind(_mark);
+    }
+  };
+#endif
+} // end namespace clad
+
+#endif // CLAD_TAPE_ARENA_H
@@ -13,6 +13,8 @@
 #include "clang/AST/StmtVisitor.h"
 #include "clang/Sema/Sema.h"
 
+#include "llvm/ADT/DenseSet.h"
+
 #include <array>
 #include <stack>
 #include <unordered_map>
@@ -102,13 +104,13 @@ namespace clad {
     std::vector<Stmts> m_Blocks;
     /// Stores output variables for vector-valued functions
     VectorOutputs m_VectorOutput;
-    /// A function used to wrap result of visiting E in a lambda. Returns a call
-    /// to the built lambda. Func is a functor that will be invoked inside
-    /// lambda scope and block. Statements inside lambda are expected to be
-    /// added by addToCurrentBlock from func invocation.
+    /// Builds a lambda capturing by reference, with no parameters, located at
+    /// E. Func is a functor that will be invoked inside lambda scope and block.
+    /// Statements inside lambda are expected to be added by addToCurrentBlock
+    /// from func invocation.
     template <typename F>
-    static clang::Expr* wrapInLambda(VisitorBase& V, clang::Sema& S,
-                                     const clang::Expr* E, F&& func) {
+    static clang::Expr* buildLambda(VisitorBase& V, clang::Sema& S,
+                                    const clang::Expr* E, F&& func) {
       // FIXME: Here we use some of the things that are used from Parser, it
       // seems to be the easiest way to create lambda.
       clang::LambdaIntroducer Intro;
@@ -132,6 +134,14 @@ namespace clad {
       clang::Expr* lambda =
           S.ActOnLambdaExpr(noLoc, body, V.getCurrentScope()).get();
       V.endScope();
+      return lambda;
+    }
+    /// A function used to wrap result of visiting E in a lambda. Returns a call
+    /// to the built lambda, see buildLambda.
+    template <typename F>
+    static clang::Expr* wrapInLambda(VisitorBase& V, clang::Sema& S,
+                                     const clang::Expr* E, F&& func) {
+      clang::Expr* lambda = buildLambda(V, S, E, std::forward<F>(func));
       return S.ActOnCallExpr(V.getCurrentScope(), lambda, noLoc, {}, noLoc)
           .get();
     }
@@ -248,6 +258,13 @@ namespace clad {
     /// guaranteed not to collide with anything in the current scope.
     clang::IdentifierInfo* CreateUniqueIdentifier(llvm::StringRef nameBase);
     std::unordered_map<std::string, std::size_t> m_idCtr;
+    /// The names declared or referenced in the function being differentiated,
+    /// collected once per derivative.
+    llvm::DenseSet<const clang::IdentifierInfo*> m_SourceNames;
+    const clang::FunctionDecl* m_SourceNamesOf = nullptr;
+    /// Returns true if a declaration named II may be visible in the current
+    /// scope. Only the names which may be shadowed are looked up in Sema.
+    bool isNameTaken(clang::IdentifierInfo* II);
 
     /// Updates references in newly cloned statements.
     void updateReferencesOf(clang::Stmt* InSubtree);
@@ -300,6 +317,15 @@ namespace clad {
     clang::LookupResult& GetCladTapeBack();
     /// Instantiate clad::tape<T> type.
     clang::QualType GetCladTapeOfType(clang::QualType T);
+    /// Find the clad::tape_arena_scope type.
+    clang::QualType GetCladTapeArenaScopeType();
+    /// Find declaration of clad::scatter_buffer templated type.
+    clang::TemplateDecl* GetCladScatterBufferDecl();
+    /// Instantiate clad::scatter_buffer<T> type.
+    clang::QualType GetCladScatterBufferOfType(clang::QualType T);
+    /// Instantiate the given class template of clad namespace for T.
+    clang::QualType InstantiateCladTemplate(clang::TemplateDecl* TD,
+                                            clang::QualType T);
 
     /// Assigns the Init expression to VD after performing the necessary
     /// implicit conversion. This is required as clang doesn't add implicit
@@ -0,0 +1,374 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Common subexpression elimination for the produced derivatives, working on
+// AST level
+//
+//----------------------------------------------------------------------------//
+
+#include "CommonSubexprEliminator.h"
+
+#include "ConstantFolder.h"
+#include "WriteCollector.h"
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Sema/Sema.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/FoldingSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringSwitch.h"
+
+#include <algorithm>
+#include <functional>
+
+#include "clad/Differentiator/Compatibility.h"
+
+namespace clad {
+  using namespace clang;
+
+  namespace {
+    /// Collects the variables read by a pure expression.
+    class VarCollector : public RecursiveASTVisitor<VarCollector> {
+    public:
+      llvm::SmallPtrSet<const VarDecl*, 4> Vars;
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+          Vars.insert(VD);
+        return true;
+      }
+    };
+
+    class NodeCounter : public RecursiveASTVisitor<NodeCounter> {
+    public:
+      unsigned Count = 0;
+      bool VisitStmt(Stmt*) { ++Count; return true; }
+    };
+
+    struct Occurrence {
+      /// The slot in the parent holding the expression (or the outermost
+      /// parentheses around it).
+      Stmt** Slot;
+      Expr* E;
+      /// Index of the statement of the block containing the occurrence.
+      unsigned StmtIdx;
+      /// The enclosing candidate expressions.
+      llvm::SmallVector<Expr*, 4> Ancestors;
+    };
+
+    struct Group {
+      llvm::FoldingSetNodeID ID;
+      llvm::SmallPtrSet<const VarDecl*, 4> Vars;
+      llvm::SmallVector<unsigned, 4> Occurrences;
+      llvm::SmallVector<unsigned, 4> Selected;
+      unsigned Size = 0;
+      bool Open = true;
+    };
+  } // end anonymous namespace
+
+  CommonSubexprEliminator::CommonSubexprEliminator(Sema& S)
+    : m_Sema(S), m_Context(S.getASTContext()) {}
+
+  bool CommonSubexprEliminator::isPureCall(const Expr* E) {
+    auto CE = dyn_cast<CallExpr>(E);
+    if (!CE || isa<CXXMemberCallExpr>(CE) || isa<CXXOperatorCallExpr>(CE))
+      return false;
+    const FunctionDecl* FD = CE->getDirectCallee();
+    if (!FD || FD->getReturnType()->isVoidType())
+      return false;
+    if (FD->hasAttr<ConstAttr>())
+      return true;
+    const DeclContext* DC = FD->getDeclContext()->getRedeclContext();
+    // The derivatives of the builtin functions only depend on their
+    // arguments.
+    if (auto ND = dyn_cast<NamespaceDecl>(DC))
+      if (ND->getName() == "custom_derivatives")
+        return true;
+    if (!DC->isTranslationUnit() && !DC->isStdNamespace())
+      return false;
+    if (!FD->getIdentifier())
+      return false;
+    return llvm::StringSwitch<bool>(FD->getName())
+      .Cases("sin", "cos", "tan", "asin", "acos", "atan", "atan2", true)
+      .Cases("sinh", "cosh", "tanh", "asinh", "acosh", "atanh", true)
+      .Cases("exp", "exp2", "expm1", "log", "log2", "log10", "log1p", true)
+      .Cases("sqrt", "cbrt", "pow", "hypot", "erf", "erfc", true)
+      .Cases("abs", "fabs", "floor", "ceil", "fmin", "fmax", true)
+      .Default(false);
+  }
+
+  bool CommonSubexprEliminator::isPure(const Expr* E) const {
+    E = E->IgnoreParens();
+    if (isa<IntegerLiteral>(E) || isa<FloatingLiteral>(E) ||
+        isa<CharacterLiteral>(E) || isa<CXXBoolLiteralExpr>(E))
+      return true;
+    if (auto DRE = dyn_cast<DeclRefExpr>(E)) {
+      if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+        return m_Tracked.count(VD);
+      return isa<EnumConstantDecl>(DRE->getDecl());
+    }
+    if (auto CE = dyn_cast<CastExpr>(E)) {
+      CastKind CK = CE->getCastKind();
+      if (CK == CK_UserDefinedConversion || CK == CK_ConstructorConversion ||
+          CK == CK_ArrayToPointerDecay || CK == CK_ToVoid)
+        return false;
+      return isPure(CE->getSubExpr());
+    }
+    if (auto BO = dyn_cast<BinaryOperator>(E)) {
+      if (BO->isAssignmentOp() || BO->getOpcode() == BO_Comma ||
+          BO->isPtrMemOp())
+        return false;
+      return isPure(BO->getLHS()) && isPure(BO->getRHS());
+    }
+    if (auto UO = dyn_cast<UnaryOperator>(E)) {
+      UnaryOperatorKind Opc = UO->getOpcode();
+      if (Opc != UO_Minus && Opc != UO_Plus && Opc != UO_Not &&
+          Opc != UO_LNot)
+        return false;
+      return isPure(UO->getSubExpr());
+    }
+    if (auto CO = dyn_cast<ConditionalOperator>(E))
+      return isPure(CO->getCond()) && isPure(CO->getTrueExpr()) &&
+             isPure(CO->getFalseExpr());
+    if (auto CE = dyn_cast<CallExpr>(E)) {
+      if (!isPureCall(CE))
+        return false;
+      for (const Expr* Arg : CE->arguments())
+        if (!isPure(Arg))
+          return false;
+      return true;
+    }
+    return false;
+  }
+
+  std::string CommonSubexprEliminator::createTempName() {
+    for (;;) {
+      std::string Name = "_cse" + std::to_string(m_TempCtr++);
+      if (!m_Names.count(Name)) {
+        m_Names.insert(Name);
+        return Name;
+      }
+    }
+  }
+
+  void CommonSubexprEliminator::processStmt(Stmt* S) {
+    for (Stmt*& Child : S->children()) {
+      // Blocks nested in expressions (lambdas, statement expressions) are
+      // left untouched.
+      if (!Child || isa<Expr>(Child))
+        continue;
+      if (auto CS = dyn_cast<CompoundStmt>(Child))
+        Child = processBlock(CS);
+      else
+        processStmt(Child);
+    }
+  }
+
+  CompoundStmt* CommonSubexprEliminator::processBlock(CompoundStmt* CS) {
+    for (Stmt*& S : CS->body()) {
+      if (auto Nested = dyn_cast<CompoundStmt>(S))
+        S = processBlock(Nested);
+      else
+        processStmt(S);
+    }
+
+    llvm::SmallVector<Occurrence, 32> Occurrences;
+    llvm::SmallVector<Group, 16> Groups;
+    llvm::DenseMap<unsigned, llvm::SmallVector<unsigned, 1>> OpenGroups;
+
+    auto isCandidate = [this](const Expr* E) {
+      if (!isa<BinaryOperator>(E) && !isa<CallExpr>(E) &&
+          !isa<ConditionalOperator>(E))
+        return false;
+      return E->isRValue() && ConstantFolder::isFoldableType(E->getType()) &&
+             !E->isEvaluatable(m_Context) && isPure(E);
+    };
+
+    auto addOccurrence = [&](Occurrence Occ) {
+      llvm::FoldingSetNodeID ID;
+      Occ.E->Profile(ID, m_Context, /*Canonical*/true);
+      unsigned OccIdx = Occurrences.size();
+      Occurrences.push_back(Occ);
+      llvm::SmallVector<unsigned, 1>& Candidates = OpenGroups[ID.ComputeHash()];
+      for (unsigned GroupIdx : Candidates) {
+        Group& G = Groups[GroupIdx];
+        if (G.Open && G.ID == ID) {
+          G.Occurrences.push_back(OccIdx);
+          return;
+        }
+      }
+      Group G;
+      G.ID = ID;
+      VarCollector VC;
+      VC.TraverseStmt(Occ.E);
+      G.Vars = VC.Vars;
+      NodeCounter NC;
+      NC.TraverseStmt(Occ.E);
+      G.Size = NC.Count;
+      G.Occurrences.push_back(OccIdx);
+      Candidates.push_back(Groups.size());
+      Groups.push_back(G);
+    };
+
+    // Walks an expression recording the candidate subexpressions. Only the
+    // subexpressions which are evaluated unconditionally are considered, so
+    // that hoisting them into a temporary does not introduce evaluations.
+    std::function<void(Stmt**, unsigned, llvm::SmallVectorImpl<Expr*>&)>
+      collect = [&](Stmt** Slot, unsigned StmtIdx,
+                    llvm::SmallVectorImpl<Expr*>& Ancestors) {
+      Expr* E = cast<Expr>(*Slot)->IgnoreParens();
+      if (isa<LambdaExpr>(E) || isa<StmtExpr>(E) ||
+          isa<BinaryConditionalOperator>(E))
+        return;
+      bool IsCandidate = isCandidate(E);
+      if (IsCandidate) {
+        Occurrence Occ{Slot, E, StmtIdx, {}};
+        Occ.Ancestors.append(Ancestors.begin(), Ancestors.end());
+        addOccurrence(Occ);
+        Ancestors.push_back(E);
+      }
+      bool OnlyFirstChild = isa<ConditionalOperator>(E);
+      if (auto BO = dyn_cast<BinaryOperator>(E))
+        OnlyFirstChild = BO->isLogicalOp();
+      for (Stmt*& Child : E->children()) {
+        if (Child && isa<Expr>(Child))
+          collect(&Child, StmtIdx, Ancestors);
+        if (OnlyFirstChild)
+          break;
+      }
+      if (IsCandidate)
+        Ancestors.pop_back();
+    };
+
+    auto kill = [&](const llvm::DenseSet<const VarDecl*>& Written) {
+      if (Written.empty())
+        return;
+      for (Group& G : Groups)
+        if (G.Open)
+          for (const VarDecl* VD : G.Vars)
+            if (Written.count(VD)) {
+              G.Open = false;
+              break;
+            }
+    };
+
+    unsigned NumStmts = CS->size();
+    for (unsigned i = 0; i < NumStmts; ++i) {
+      Stmt*& S = CS->body_begin()[i];
+      if (isa<LabelStmt>(S)) {
+        // A join point, nothing computed before is known to be available.
+        for (Group& G : Groups)
+          G.Open = false;
+        continue;
+      }
+      WriteCollector WC;
+      WC.TraverseStmt(S);
+      llvm::SmallVector<Expr*, 4> Ancestors;
+      auto DS = dyn_cast<DeclStmt>(S);
+      // Only single declarations, the initializers of a declaration group
+      // may refer to the variables declared before them.
+      if (isa<Expr>(S) || isa<ReturnStmt>(S) || (DS && DS->isSingleDecl())) {
+        if (WC.Written.empty()) {
+          if (isa<Expr>(S))
+            collect(&S, i, Ancestors);
+          else
+            for (Stmt*& Child : S->children())
+              if (Child)
+                collect(&Child, i, Ancestors);
+        }
+        else if (WC.NumWrites == 1 && isa<Expr>(S)) {
+          // x = smth or x op= smth: the right hand side is computed before
+          // x is modified.
+          auto BO = dyn_cast<BinaryOperator>(cast<Expr>(S)->IgnoreParens());
+          if (BO && BO->isAssignmentOp() &&
+              isa<DeclRefExpr>(BO->getLHS()->IgnoreParens())) {
+            auto RHS = BO->child_begin();
+            ++RHS;
+            collect(&*RHS, i, Ancestors);
+          }
+        }
+      }
+      kill(WC.Written);
+    }
+
+    // Eliminate the largest expressions first, the occurrences nested in the
+    // replaced ones disappear with them.
+    llvm::SmallVector<unsigned, 16> Order;
+    for (unsigned i = 0, e = Groups.size(); i < e; ++i)
+      if (Groups[i].Occurrences.size() > 1)
+        Order.push_back(i);
+    if (Order.empty())
+      return CS;
+    std::stable_sort(Order.begin(), Order.end(), [&](unsigned A, unsigned B) {
+      return Groups[A].Size > Groups[B].Size;
+    });
+
+    llvm::SmallPtrSet<Expr*, 16> Removed;
+    std::vector<llvm::SmallVector<unsigned, 2>> Temps(NumStmts);
+    for (unsigned GroupIdx : Order) {
+      Group& G = Groups[GroupIdx];
+      for (unsigned OccIdx : G.Occurrences) {
+        const Occurrence& Occ = Occurrences[OccIdx];
+        if (std::none_of(Occ.Ancestors.begin(), Occ.Ancestors.end(),
+                         [&](Expr* A) { return Removed.count(A); }))
+          G.Selected.push_back(OccIdx);
+      }
+      if (G.Selected.size() < 2)
+        continue;
+      for (unsigned i = 1, e = G.Selected.size(); i < e; ++i)
+        Removed.insert(Occurrences[G.Selected[i]].E);
+      // The temporaries of nested expressions have to be declared first.
+      auto& Pre = Temps[Occurrences[G.Selected.front()].StmtIdx];
+      Pre.insert(Pre.begin(), GroupIdx);
+    }
+
+    SourceLocation noLoc;
+    llvm::SmallVector<Stmt*, 32> Stmts;
+    for (unsigned i = 0; i < NumStmts; ++i) {
+      for (unsigned GroupIdx : Temps[i]) {
+        Group& G = Groups[GroupIdx];
+        Expr* Init = Occurrences[G.Selected.front()].E;
+        QualType T = Init->getType().getUnqualifiedType();
+        auto VD = VarDecl::Create(m_Context, m_Function, noLoc, noLoc,
+                                  &m_Context.Idents.get(createTempName()), T,
+                                  m_Context.getTrivialTypeSourceInfo(T),
+                                  SC_None);
+        VD->setInit(Init);
+        Stmts.push_back(new (m_Context) DeclStmt(DeclGroupRef(VD), noLoc,
+                                                 noLoc));
+        for (unsigned OccIdx : G.Selected) {
+          Expr* Ref = clad_compat::GetResult<Expr*>(
+            m_Sema.BuildDeclRefExpr(VD, T, VK_LValue, noLoc));
+          *Occurrences[OccIdx].Slot =
+            m_Sema.DefaultLvalueConversion(Ref).get();
+        }
+      }
+      Stmts.push_back(CS->body_begin()[i]);
+    }
+    return clad_compat::CompoundStmt_Create(m_Context, Stmts,
+                                            CS->getLBracLoc(),
+                                            CS->getRBracLoc());
+  }
+
+  void CommonSubexprEliminator::Eliminate(FunctionDecl* FD) {
+    auto Body = dyn_cast_or_null<CompoundStmt>(FD->getBody());
+    if (!Body)
+      return;
+    m_Function = FD;
+    WriteCollector WC;
+    WC.TraverseStmt(Body);
+    for (const VarDecl* VD : WC.Referenced)
+      if (VD->hasLocalStorage() && !VD->getType()->isReferenceType() &&
+          !VD->getType().isVolatileQualified() && !WC.Escaped.count(VD))
+        m_Tracked.insert(VD);
+    for (const ParmVarDecl* PVD : FD->parameters())
+      if (PVD->getIdentifier())
+        m_Names.insert(PVD->getName());
+    for (const VarDecl* VD : WC.Referenced)
+      if (VD->getIdentifier())
+        m_Names.insert(VD->getName());
+    FD->setBody(processBlock(Body));
+  }
+} // end namespace clad
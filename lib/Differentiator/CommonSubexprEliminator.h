@@ -0,0 +1,57 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Common subexpression elimination for the produced derivatives, working on
+// AST level
+//
+//----------------------------------------------------------------------------//
+
+#ifndef CLAD_COMMON_SUBEXPR_ELIMINATOR_H
+#define CLAD_COMMON_SUBEXPR_ELIMINATOR_H
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringSet.h"
+
+#include <string>
+
+namespace clang {
+  class ASTContext;
+  class CompoundStmt;
+  class Expr;
+  class FunctionDecl;
+  class Sema;
+  class Stmt;
+  class VarDecl;
+}
+
+namespace clad {
+  /// Finds pure subexpressions, including calls to known pure math functions
+  /// and to the builtin derivatives, which are computed more than once in a
+  /// block without their operands being modified in between. Each of them is
+  /// bound to a temporary (_cseN) declared before its first use, and all the
+  /// occurrences are replaced by a reference to it.
+  class CommonSubexprEliminator {
+  private:
+    clang::Sema& m_Sema;
+    clang::ASTContext& m_Context;
+    clang::FunctionDecl* m_Function = nullptr;
+    /// Variables whose every write is visible, i.e. locals and parameters
+    /// which are never referenced other than by reads and assignments.
+    llvm::DenseSet<const clang::VarDecl*> m_Tracked;
+    /// Names already taken in the function.
+    llvm::StringSet<> m_Names;
+    unsigned m_TempCtr = 0;
+  public:
+    CommonSubexprEliminator(clang::Sema& S);
+    void Eliminate(clang::FunctionDecl* FD);
+    ///\returns true if the callee of the call is known not to have side
+    /// effects, e.g. std::sin or the builtin derivatives.
+    static bool isPureCall(const clang::Expr* E);
+  private:
+    bool isPure(const clang::Expr* E) const;
+    void processStmt(clang::Stmt* S);
+    clang::CompoundStmt* processBlock(clang::CompoundStmt* CS);
+    std::string createTempName();
+  };
+} // end namespace clad
+#endif // CLAD_COMMON_SUBEXPR_ELIMINATOR_H
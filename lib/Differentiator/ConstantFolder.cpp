@@ -10,19 +10,29 @@
 
 #include "clang/AST/ASTContext.h"
 
+#include <cstdlib>
+
+#include "clad/Differentiator/Compatibility.h"
+
 namespace clad {
   using namespace clang;
 
-  static bool evalsToN(Expr* E, ASTContext& C, uint64_t N = 0) {
+  static bool evalsToN(const Expr* E, ASTContext& C, int64_t N = 0) {
+    if (E->isValueDependent() || E->isTypeDependent())
+      return false;
     Expr::EvalResult result;
-    if (E->EvaluateAsRValue(result, C)) {
+    if (E->EvaluateAsRValue(result, C) && !result.HasSideEffects) {
       if (result.Val.isFloat()) {
         using namespace llvm;
         APFloat F = result.Val.getFloat();
-        return APFloat(F.getSemantics(), N).compare(F) == APFloat::cmpEqual;
+        APFloat NF(F.getSemantics());
+        NF.convertFromAPInt(APInt(64, N, /*isSigned*/true), /*isSigned*/true,
+                            APFloat::rmNearestTiesToEven);
+        return NF.compare(F) == APFloat::cmpEqual;
       }
       else if (result.Val.isInt()) {
-        return result.Val.getInt().getZExtValue() == N;
+        return llvm::APSInt::isSameValue(result.Val.getInt(),
+                                         llvm::APSInt::get(N));
       }
     }
 
@@ -37,6 +47,18 @@ namespace clad {
     return evalsToN(E, C, /*N=*/1);
   }
 
+  static bool evalsToMinusOne(Expr* E, ASTContext& C) {
+    return evalsToN(E, C, /*N=*/-1);
+  }
+
+  /// Returns the operand of a unary minus, looking through parentheses.
+  static Expr* getNegatedExpr(Expr* E) {
+    if (auto UO = dyn_cast<UnaryOperator>(E->IgnoreParens()))
+      if (UO->getOpcode() == UO_Minus)
+        return UO->getSubExpr();
+    return nullptr;
+  }
+
   static Expr* synthesizeLiteral(QualType QT, ASTContext& C, llvm::APInt val) {
     assert(QT->isIntegralType(C) && "Not an integer type.");
     SourceLocation noLoc;
@@ -49,15 +71,65 @@ namespace clad {
     return FloatingLiteral::Create(C, val, /*isexact*/true, QT, noLoc);
   }
 
+  bool ConstantFolder::isFoldableType(QualType QT) {
+    // Only builtin arithmetic types have literals we can synthesize. Bools and
+    // characters are left alone to keep the produced code readable.
+    const BuiltinType* BT = QT.getCanonicalType()->getAs<BuiltinType>();
+    if (!BT)
+      return false;
+    if (BT->isFloatingPoint())
+      return BT->getKind() != BuiltinType::Half;
+    return BT->isInteger() && !BT->isBooleanType() && !BT->isCharType();
+  }
+
+  bool ConstantFolder::evalsTo(const Expr* E, ASTContext& C, int64_t N) {
+    return evalsToN(E, C, N);
+  }
+
+  bool ConstantFolder::canReplace(const Expr* E, const Expr* With) const {
+    return m_Context.hasSameUnqualifiedType(E->getType(), With->getType());
+  }
+
+  Expr* ConstantFolder::buildParensIfNeeded(Expr* E) {
+    Expr* Inner = E->IgnoreImpCasts();
+    if (isa<BinaryOperator>(Inner) || isa<ConditionalOperator>(Inner))
+      return new (m_Context) ParenExpr(SourceLocation(), SourceLocation(), E);
+    return E;
+  }
+
+  Expr* ConstantFolder::buildNeg(Expr* E) {
+    // -(-smth) == smth
+    if (Expr* Negated = getNegatedExpr(E))
+      if (canReplace(E, Negated))
+        return buildParensIfNeeded(Negated);
+    return clad_compat::UnaryOperator_Create(m_Context, buildParensIfNeeded(E),
+                                             UO_Minus, E->getType(),
+                                             VK_RValue, OK_Ordinary,
+                                             SourceLocation(),
+                                             /*CanOverflow*/false);
+  }
+
   Expr* ConstantFolder::trivialFold(Expr* E) {
+    // Only prvalues of types for which we can synthesize literals are folded,
+    // and only if the evaluation does not drop side effects.
+    if (!E->isRValue() || !isFoldableType(E->getType()) ||
+        isa<IntegerLiteral>(E) || isa<FloatingLiteral>(E))
+      return E;
     Expr::EvalResult Result;
-    if (E->EvaluateAsRValue(Result, m_Context)) {
+    if (E->EvaluateAsRValue(Result, m_Context) && !Result.HasSideEffects) {
       if (Result.Val.isFloat()) {
         llvm::APFloat F = Result.Val.getFloat();
+        // Keep the negative values as unary minus of a literal.
+        if (F.isNegative())
+          return E;
+        if (&m_Context.getFloatTypeSemantics(E->getType()) != &F.getSemantics())
+          return E;
         E = clad::synthesizeLiteral(E->getType(), m_Context, F);
       }
       else if (Result.Val.isInt()) {
         llvm::APSInt I = Result.Val.getInt();
+        if (I.isNegative())
+          return E;
         E = clad::synthesizeLiteral(E->getType(), m_Context, I);
       }
     }
@@ -65,6 +137,17 @@ namespace clad {
   }
 
   Expr* ConstantFolder::VisitExpr(Expr* E) {
+    // Lambdas and the opaque forms of the conditional operator share their
+    // subexpressions, leave them untouched.
+    if (isa<LambdaExpr>(E) || isa<BinaryConditionalOperator>(E) ||
+        isa<OpaqueValueExpr>(E) || isa<StmtExpr>(E))
+      return E;
+    for (Stmt*& Child : E->children())
+      if (auto ChildE = dyn_cast_or_null<Expr>(Child)) {
+        Expr* Folded = Visit(ChildE);
+        if (canReplace(ChildE, Folded))
+          Child = Folded;
+      }
     return E;
   }
 
@@ -73,44 +156,136 @@ namespace clad {
     Expr* RHS = cast<Expr>(Visit(BinOp->getRHS()));
     BinaryOperatorKind opCode = BinOp->getOpcode();
 
-    if (opCode == BO_Mul) {
+    // Pointer arithmetic, overloaded or dependent operations are not folded.
+    bool isArithmetic = isFoldableType(BinOp->getType()) &&
+                        canReplace(BinOp, LHS) && canReplace(BinOp, RHS);
+    auto Zero = [&](Expr* Operand, Expr* Other) -> Expr* {
+      // The whole expression is zero, we may drop the other operand only if
+      // its evaluation has no side effects.
+      if (Other->HasSideEffects(m_Context))
+        return nullptr;
+      return Operand;
+    };
+
+    if (!isArithmetic) {
+      // Nothing to simplify.
+    }
+    else if (opCode == BO_Mul) {
       // 0 * smth or smth * 0 == 0
        if (evalsToZero(LHS, m_Context))
-         return LHS;
+         if (Expr* Result = Zero(LHS, RHS))
+           return Result;
        if (evalsToZero(RHS, m_Context))
-         return RHS;
+         if (Expr* Result = Zero(RHS, LHS))
+           return Result;
 
        // 1 * smth or smth * 1 == smth
        if (evalsToOne(LHS, m_Context))
          return RHS;
        if (evalsToOne(RHS, m_Context))
          return LHS;
+
+       // -1 * smth or smth * -1 == -smth
+       if (evalsToMinusOne(LHS, m_Context))
+         return buildNeg(RHS);
+       if (evalsToMinusOne(RHS, m_Context))
+         return buildNeg(LHS);
     }
     else if (opCode == BO_Add || opCode == BO_Sub) {
       // smth +- 0 == smth
       if (evalsToZero(RHS, m_Context))
         return LHS;
 
-      // 0 + smth == smth
-      if (opCode == BO_Add)
-        if (evalsToZero(LHS, m_Context))
-          return RHS;
+      // 0 + smth == smth, 0 - smth == -smth
+      if (evalsToZero(LHS, m_Context))
+        return opCode == BO_Add ? RHS : buildNeg(RHS);
     }
     else if (opCode == BO_Div) {
       // 0 / smth == 0
       if (evalsToZero(LHS, m_Context))
+        if (Expr* Result = Zero(LHS, RHS))
+          return Result;
+
+      // smth / 1 == smth
+      if (evalsToOne(RHS, m_Context))
         return LHS;
     }
 
+    if (isArithmetic) {
+      Expr* NegLHS = getNegatedExpr(LHS);
+      Expr* NegRHS = getNegatedExpr(RHS);
+      if (NegRHS && !canReplace(RHS, NegRHS))
+        NegRHS = nullptr;
+      if (NegLHS && !canReplace(LHS, NegLHS))
+        NegLHS = nullptr;
+      // (-a) * (-b) == a * b, (-a) / (-b) == a / b
+      if ((opCode == BO_Mul || opCode == BO_Div) && NegLHS && NegRHS) {
+        LHS = buildParensIfNeeded(NegLHS);
+        RHS = buildParensIfNeeded(NegRHS);
+      }
+      // a + (-b) == a - b, a - (-b) == a + b
+      else if ((opCode == BO_Add || opCode == BO_Sub) && NegRHS) {
+        BinOp->setOpcode(opCode == BO_Add ? BO_Sub : BO_Add);
+        RHS = buildParensIfNeeded(NegRHS);
+      }
+    }
+
     BinOp->setLHS(trivialFold(LHS));
     BinOp->setRHS(trivialFold(RHS));
     return BinOp;
   }
 
+  Expr* ConstantFolder::VisitUnaryOperator(UnaryOperator* UnOp) {
+    Expr* Sub = Visit(UnOp->getSubExpr());
+    if (canReplace(UnOp->getSubExpr(), Sub))
+      UnOp->setSubExpr(Sub);
+    if (!isFoldableType(UnOp->getType()) || !canReplace(UnOp, Sub))
+      return UnOp;
+    UnaryOperatorKind opCode = UnOp->getOpcode();
+    // +smth == smth
+    if (opCode == UO_Plus)
+      return Sub;
+    if (opCode == UO_Minus) {
+      // -0 == 0
+      if (evalsToZero(Sub, m_Context))
+        return Sub;
+      // -(-smth) == smth
+      if (Expr* Negated = getNegatedExpr(Sub))
+        if (canReplace(UnOp, Negated))
+          return buildParensIfNeeded(Negated);
+    }
+    return UnOp;
+  }
+
+  Expr* ConstantFolder::VisitImplicitCastExpr(ImplicitCastExpr* ICE) {
+    // Propagate the values of the variables known to be constant.
+    if (ICE->getCastKind() == CK_LValueToRValue)
+      if (auto DRE = dyn_cast<DeclRefExpr>(ICE->getSubExpr()->IgnoreParens()))
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl())) {
+          auto it = m_KnownValues.find(VD);
+          if (it != m_KnownValues.end() && isFoldableType(ICE->getType())) {
+            Expr* Lit = synthesizeLiteral(ICE->getType(), m_Context,
+                                          std::abs(it->second));
+            return it->second < 0 ? buildNeg(Lit) : Lit;
+          }
+        }
+    Expr* Sub = Visit(ICE->getSubExpr());
+    if (canReplace(ICE->getSubExpr(), Sub))
+      ICE->setSubExpr(Sub);
+    return ICE;
+  }
+
   Expr* ConstantFolder::VisitParenExpr(clang::ParenExpr* PE) {
     Expr* result = cast<Expr>(Visit(PE->getSubExpr()));
-    if (!isa<BinaryOperator>(result))
-      return result;
+    // Parentheses are only needed around operators of lower precedence.
+    Expr* Inner = result->IgnoreImpCasts();
+    if (isa<DeclRefExpr>(Inner) || isa<IntegerLiteral>(Inner) ||
+        isa<FloatingLiteral>(Inner) || isa<CallExpr>(Inner) ||
+        isa<ArraySubscriptExpr>(Inner) || isa<MemberExpr>(Inner) ||
+        isa<ParenExpr>(Inner))
+      if (canReplace(PE, result) && PE->getValueKind() ==
+                                    result->getValueKind())
+        return result;
     PE->setSubExpr(result);
     return PE;
   }
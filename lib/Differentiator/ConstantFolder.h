@@ -11,11 +11,16 @@
 
 #include "clang/AST/StmtVisitor.h"
 
+#include "llvm/ADT/DenseMap.h"
+
 namespace clang {
   class ASTContext;
   class BinaryOperator;
   class Expr;
+  class ImplicitCastExpr;
   class QualType;
+  class UnaryOperator;
+  class VarDecl;
 }
 
 namespace clad {
@@ -24,16 +29,33 @@ namespace clad {
   private:
     clang::ASTContext& m_Context;
     bool m_Enabled;
+    /// Variables which are known to hold a constant value throughout the
+    /// function, e.g. zero or one tangents. Reads of them are replaced by
+    /// literals.
+    llvm::DenseMap<const clang::VarDecl*, int64_t> m_KnownValues;
   public:
-    ConstantFolder(clang::ASTContext& C) : m_Context(C), m_Enabled(false) {}
+    ConstantFolder(clang::ASTContext& C, bool Enabled = false)
+      : m_Context(C), m_Enabled(Enabled) {}
     clang::Expr* fold(clang::Expr* E);
+    void setKnownValue(const clang::VarDecl* VD, int64_t val) {
+      m_KnownValues[VD] = val;
+    }
     clang::Expr* VisitExpr(clang::Expr* E);
     clang::Expr* VisitBinaryOperator(clang::BinaryOperator* BinOp);
+    clang::Expr* VisitUnaryOperator(clang::UnaryOperator* UnOp);
+    clang::Expr* VisitImplicitCastExpr(clang::ImplicitCastExpr* ICE);
     clang::Expr* VisitParenExpr(clang::ParenExpr* PE);
     static clang::Expr* synthesizeLiteral(clang::QualType, clang::ASTContext &C,
                                           uint64_t val);
+    ///\returns true if E is free of side effects and evaluates to N.
+    static bool evalsTo(const clang::Expr* E, clang::ASTContext& C, int64_t N);
+    ///\returns true if the folder can produce literals of type QT.
+    static bool isFoldableType(clang::QualType QT);
   private:
     clang::Expr* trivialFold(clang::Expr* E);
+    clang::Expr* buildNeg(clang::Expr* E);
+    clang::Expr* buildParensIfNeeded(clang::Expr* E);
+    bool canReplace(const clang::Expr* E, const clang::Expr* With) const;
   };
 } // end namespace clad
 #endif // CLAD_CONSTANT_FOLDER_H
@@ -0,0 +1,213 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Dead-store elimination for the produced gradients, working on AST level
+//
+//----------------------------------------------------------------------------//
+
+#include "DeadStoreEliminator.h"
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+
+#include "llvm/ADT/SmallVector.h"
+
+#include "clad/Differentiator/Compatibility.h"
+
+namespace clad {
+  using namespace clang;
+
+  namespace {
+    /// Counts the references to each variable and collects the local ones.
+    class UseCounter : public RecursiveASTVisitor<UseCounter> {
+    public:
+      llvm::DenseMap<const VarDecl*, unsigned>& Uses;
+      llvm::SmallVector<const VarDecl*, 16> Locals;
+
+      UseCounter(llvm::DenseMap<const VarDecl*, unsigned>& U) : Uses(U) {}
+      bool VisitVarDecl(VarDecl* VD) {
+        Locals.push_back(VD);
+        return true;
+      }
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+          Uses[VD]++;
+        return true;
+      }
+    };
+  } // end anonymous namespace
+
+  ///\returns true if Child is in statement position in Parent, i.e. it can be
+  /// replaced by a null statement.
+  static bool isSubStatement(const Stmt* Parent, const Stmt* Child) {
+    if (isa<CompoundStmt>(Parent))
+      return true;
+    if (auto If = dyn_cast<IfStmt>(Parent))
+      return Child == If->getThen() || Child == If->getElse();
+    if (auto For = dyn_cast<ForStmt>(Parent))
+      return Child == For->getBody();
+    if (auto While = dyn_cast<WhileStmt>(Parent))
+      return Child == While->getBody();
+    if (auto Do = dyn_cast<DoStmt>(Parent))
+      return Child == Do->getBody();
+    if (auto Range = dyn_cast<CXXForRangeStmt>(Parent))
+      return Child == Range->getBody();
+    if (auto Switch = dyn_cast<SwitchStmt>(Parent))
+      return Child == Switch->getBody();
+    if (auto Case = dyn_cast<SwitchCase>(Parent))
+      return Child == Case->getSubStmt();
+    if (auto Label = dyn_cast<LabelStmt>(Parent))
+      return Child == Label->getSubStmt();
+    return false;
+  }
+
+  bool DeadStoreEliminator::isCandidate(const VarDecl* VD) const {
+    // Locals of lambdas have the lambda as their context.
+    if (isa<ParmVarDecl>(VD) || VD->getDeclContext() != m_Function ||
+        !VD->hasLocalStorage())
+      return false;
+    QualType QT = VD->getType();
+    return QT->isScalarType() && !QT.isVolatileQualified();
+  }
+
+  const VarDecl* DeadStoreEliminator::getStoredVar(const Stmt* S) const {
+    auto E = dyn_cast<Expr>(S);
+    if (!E)
+      return nullptr;
+    E = E->IgnoreParens();
+    const Expr* Target = nullptr;
+    if (auto BO = dyn_cast<BinaryOperator>(E)) {
+      // Both x = ... and x op= ... are stores, x is only read to be written.
+      if (BO->isAssignmentOp())
+        Target = BO->getLHS();
+    } else if (auto UO = dyn_cast<UnaryOperator>(E)) {
+      if (UO->isIncrementDecrementOp())
+        Target = UO->getSubExpr();
+    }
+    if (!Target)
+      return nullptr;
+    auto DRE = dyn_cast<DeclRefExpr>(Target->IgnoreParens());
+    if (!DRE)
+      return nullptr;
+    auto VD = dyn_cast<VarDecl>(DRE->getDecl());
+    return VD && isCandidate(VD) ? VD : nullptr;
+  }
+
+  void DeadStoreEliminator::collectStores(Stmt* S) {
+    for (Stmt* Child : S->children()) {
+      if (!Child)
+        continue;
+      // Only the stores which rewriteStmt will see can be removed.
+      if (isSubStatement(S, Child))
+        if (const VarDecl* VD = getStoredVar(Child))
+          m_Stores[VD]++;
+      // Statements nested in expressions (lambdas, statement expressions) are
+      // left untouched.
+      if (!isa<Expr>(Child))
+        collectStores(Child);
+    }
+  }
+
+  Stmt* DeadStoreEliminator::rewriteStmt(Stmt* S) {
+    if (auto DS = dyn_cast<DeclStmt>(S)) {
+      for (Decl* D : DS->decls()) {
+        auto VD = dyn_cast<VarDecl>(D);
+        if (!VD || !m_Dead.count(VD))
+          return S;
+      }
+      Expr* Init = nullptr;
+      if (DS->isSingleDecl())
+        Init = cast<VarDecl>(DS->getSingleDecl())->getInit();
+      else
+        for (Decl* D : DS->decls())
+          // The side effects of several initializers cannot be kept without
+          // the declaration.
+          if (cast<VarDecl>(D)->getInit() &&
+              cast<VarDecl>(D)->getInit()->HasSideEffects(m_Context))
+            return S;
+      m_Removed = true;
+      if (Init && Init->HasSideEffects(m_Context))
+        return Init;
+      return nullptr;
+    }
+    const VarDecl* VD = getStoredVar(S);
+    if (!VD || !m_Dead.count(VD))
+      return S;
+    m_Removed = true;
+    // Keep the side effects of the stored value, e.g. the tape pops.
+    if (auto BO = dyn_cast<BinaryOperator>(cast<Expr>(S)->IgnoreParens()))
+      if (BO->getRHS()->HasSideEffects(m_Context))
+        return BO->getRHS();
+    return nullptr;
+  }
+
+  CompoundStmt* DeadStoreEliminator::pruneCompoundStmt(CompoundStmt* CS) {
+    llvm::SmallVector<Stmt*, 16> Stmts;
+    bool Changed = false;
+    for (Stmt* S : CS->body()) {
+      Stmt* NewS = rewriteStmt(S);
+      if (auto NestedCS = dyn_cast_or_null<CompoundStmt>(NewS)) {
+        NewS = pruneCompoundStmt(NestedCS);
+        // The blocks emptied by the removal are dropped.
+        if (NestedCS->size() && cast<CompoundStmt>(NewS)->body_empty())
+          NewS = nullptr;
+      } else if (NewS && !isa<Expr>(NewS))
+        removeDeadStores(NewS);
+      Changed |= NewS != S;
+      if (NewS)
+        Stmts.push_back(NewS);
+    }
+    if (!Changed)
+      return CS;
+    return clad_compat::CompoundStmt_Create(m_Context, Stmts,
+                                            CS->getLBracLoc(),
+                                            CS->getRBracLoc());
+  }
+
+  void DeadStoreEliminator::removeDeadStores(Stmt* S) {
+    for (Stmt*& Child : S->children()) {
+      if (!Child)
+        continue;
+      if (auto CS = dyn_cast<CompoundStmt>(Child)) {
+        Child = pruneCompoundStmt(CS);
+        continue;
+      }
+      if (isSubStatement(S, Child)) {
+        Stmt* NewChild = rewriteStmt(Child);
+        if (!NewChild)
+          NewChild = new (m_Context) NullStmt(Child->getBeginLoc());
+        Child = NewChild;
+      }
+      if (!isa<Expr>(Child))
+        removeDeadStores(Child);
+    }
+  }
+
+  bool DeadStoreEliminator::Eliminate(FunctionDecl* FD) {
+    auto Body = dyn_cast_or_null<CompoundStmt>(FD->getBody());
+    if (!Body)
+      return false;
+    m_Function = FD;
+    bool Changed = false;
+    do {
+      m_Uses.clear();
+      m_Stores.clear();
+      m_Dead.clear();
+      m_Removed = false;
+      UseCounter Counter(m_Uses);
+      Counter.TraverseStmt(Body);
+      collectStores(Body);
+      // A variable is dead if it is never read: all its references are
+      // removable stores. This includes the ones which are only declared.
+      for (const VarDecl* VD : Counter.Locals)
+        if (isCandidate(VD) && m_Uses.lookup(VD) == m_Stores.lookup(VD))
+          m_Dead.insert(VD);
+      if (m_Dead.empty())
+        break;
+      Body = pruneCompoundStmt(Body);
+      Changed |= m_Removed;
+    } while (m_Removed);
+    FD->setBody(Body);
+    return Changed;
+  }
+} // end namespace clad
@@ -0,0 +1,58 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Dead-store elimination for the produced gradients, working on AST level
+//
+//----------------------------------------------------------------------------//
+
+#ifndef CLAD_DEAD_STORE_ELIMINATOR_H
+#define CLAD_DEAD_STORE_ELIMINATOR_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+
+namespace clang {
+  class ASTContext;
+  class CompoundStmt;
+  class Expr;
+  class FunctionDecl;
+  class Stmt;
+  class VarDecl;
+}
+
+namespace clad {
+  /// Removes the stores to the local variables of a produced derivative whose
+  /// value is never read, e.g. the adjoints of locals which do not feed the
+  /// result or the _r temporaries of non-active call arguments, together with
+  /// their declarations. The right-hand sides having side effects (tape pops,
+  /// calls) are kept. Removing a store may make other variables dead, so the
+  /// process is repeated until nothing changes.
+  class DeadStoreEliminator {
+  private:
+    clang::ASTContext& m_Context;
+    clang::FunctionDecl* m_Function = nullptr;
+    /// The number of references to each variable.
+    llvm::DenseMap<const clang::VarDecl*, unsigned> m_Uses;
+    /// The number of references which are the target of a store in statement
+    /// position, i.e. the ones which can be removed.
+    llvm::DenseMap<const clang::VarDecl*, unsigned> m_Stores;
+    /// Variables which are never read.
+    llvm::DenseSet<const clang::VarDecl*> m_Dead;
+    /// Whether the current iteration removed anything.
+    bool m_Removed = false;
+  public:
+    DeadStoreEliminator(clang::ASTContext& C) : m_Context(C) {}
+    /// Rewrites the body of FD, \returns true if anything was removed.
+    bool Eliminate(clang::FunctionDecl* FD);
+  private:
+    void collectStores(clang::Stmt* S);
+    const clang::VarDecl* getStoredVar(const clang::Stmt* S) const;
+    bool isCandidate(const clang::VarDecl* VD) const;
+    /// \returns what is left of the statement S in statement position after
+    /// removing the dead stores: S itself, a side effect or nullptr.
+    clang::Stmt* rewriteStmt(clang::Stmt* S);
+    void removeDeadStores(clang::Stmt* S);
+    clang::CompoundStmt* pruneCompoundStmt(clang::CompoundStmt* CS);
+  };
+} // end namespace clad
+#endif // CLAD_DEAD_STORE_ELIMINATOR_H
@@ -6,6 +6,11 @@
 
 #include "clad/Differentiator/DerivativeBuilder.h"
 
+#include "CommonSubexprEliminator.h"
+#include "DerivativeProfile.h"
+#include "Simplifier.h"
+#include "StrengthReducer.h"
+
 #include "clad/Differentiator/ForwardModeVisitor.h"
 #include "clad/Differentiator/HessianModeVisitor.h"
 #include "clad/Differentiator/JacobianModeVisitor.h"
@@ -127,7 +132,8 @@ namespace clad {
     else if (request.Mode == DiffMode::reverse) {
       ReverseModeVisitor V(*this);
       result = V.Derive(FD, request);
-    } else if (request.Mode == DiffMode::hessian) {
+    } else if (request.Mode == DiffMode::hessian ||
+               request.Mode == DiffMode::sparse_hessian) {
       HessianModeVisitor H(*this);
       result = H.Derive(FD, request);
     } if (request.Mode == DiffMode::jacobian) {
@@ -135,8 +141,40 @@ namespace clad {
       result = J.Derive(FD, request);
     }
 
+    // Reduce first, the simplifier folds the produced constants and CSE shares
+    // the produced products.
+    if (result.first && request.StrengthReduce) {
+      StrengthReducer SR(m_Sema, request.HoistReciprocals);
+      SR.Reduce(result.first);
+    }
+    if (result.first && request.Simplify) {
+      Simplifier S(m_Context);
+      S.Simplify(result.first);
+    }
+    if (result.first && request.EliminateCommonSubexprs) {
+      CommonSubexprEliminator CSE(m_Sema);
+      CSE.Eliminate(result.first);
+    }
+
     if (result.first)
       registerDerivative(result.first, m_Sema);
     return result;
   }
+
+  llvm::StringRef
+  DerivativeBuilder::getSparsityPattern(const FunctionDecl* FD) const {
+    auto it = m_SparsityPatterns.find(FD);
+    if (it == m_SparsityPatterns.end())
+      return {};
+    return it->second;
+  }
+
+  bool DerivativeBuilder::loadProfile(llvm::StringRef Path,
+                                      std::string& Error) {
+    std::unique_ptr<DerivativeProfile> Profile(new DerivativeProfile());
+    if (!Profile->read(Path, Error))
+      return false;
+    m_Profile = std::move(Profile);
+    return true;
+  }
 }// end namespace clad
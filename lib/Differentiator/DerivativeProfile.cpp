@@ -0,0 +1,103 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// The run-time counts of the derivatives, read from a profile written by the
+// derivatives instrumented with -fprofile-derivatives-generate
+//
+//----------------------------------------------------------------------------//
+
+#include "DerivativeProfile.h"
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/Stmt.h"
+#include "clang/Basic/SourceManager.h"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <tuple>
+
+#include "clad/Differentiator/Compatibility.h"
+
+namespace clad {
+  using namespace clang;
+
+  bool DerivativeProfile::read(llvm::StringRef Path, std::string& Error) {
+    auto Buffer = llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer) {
+      Error = "cannot read profile '" + Path.str() +
+              "': " + Buffer.getError().message();
+      return false;
+    }
+    llvm::SmallVector<llvm::StringRef, 16> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', /*MaxSplit=*/-1,
+                                 /*KeepEmpty=*/false);
+    for (unsigned i = 0, e = Lines.size(); i < e; ++i) {
+      llvm::StringRef Line = Lines[i].trim();
+      if (Line.empty())
+        continue;
+      // The counts are taken from the end of the line, the site is what is
+      // left after the kind.
+      llvm::StringRef Kind, Rest;
+      std::tie(Kind, Rest) = Line.split(' ');
+      uint64_t Count = 0, Runs = 0;
+      llvm::StringRef Site, Number;
+      std::tie(Rest, Number) = Rest.rsplit(' ');
+      bool Malformed = Number.getAsInteger(10, Count);
+      if (Kind == "loop") {
+        std::tie(Site, Number) = Rest.rsplit(' ');
+        Malformed |= Number.getAsInteger(10, Runs);
+      } else {
+        Site = Rest;
+        Malformed |= Kind != "call";
+      }
+      if (Malformed || Site.empty()) {
+        Error = "malformed profile '" + Path.str() + "' at line " +
+                std::to_string(i + 1);
+        return false;
+      }
+      if (Kind == "call") {
+        m_Calls[Site] += Count;
+      } else {
+        LoopCounts& Counts = m_Loops[Site];
+        Counts.Runs += Runs;
+        Counts.Trips += Count;
+      }
+    }
+    return true;
+  }
+
+  std::string DerivativeProfile::getSite(const FunctionDecl* FD,
+                                         const Stmt* S /*=nullptr*/) {
+    // The parameter types tell the overloads apart.
+    const ASTContext& C = FD->getASTContext();
+    std::string Site = FD->getQualifiedNameAsString() + "(";
+    for (unsigned i = 0, e = FD->getNumParams(); i < e; ++i) {
+      if (i)
+        Site += ", ";
+      QualType T = FD->getParamDecl(i)->getType().getCanonicalType();
+      Site += T.getAsString(C.getPrintingPolicy());
+    }
+    Site += ")";
+    if (!S)
+      return Site;
+    const SourceManager& SM = C.getSourceManager();
+    SourceLocation Loc = SM.getExpansionLoc(S->getBeginLoc());
+    Site += ":" + std::to_string(SM.getExpansionLineNumber(Loc)) + ":" +
+            std::to_string(SM.getExpansionColumnNumber(Loc));
+    return Site;
+  }
+
+  const uint64_t*
+  DerivativeProfile::getCallCount(llvm::StringRef Site) const {
+    auto it = m_Calls.find(Site);
+    return it == m_Calls.end() ? nullptr : &it->second;
+  }
+
+  const DerivativeProfile::LoopCounts*
+  DerivativeProfile::getLoopCounts(llvm::StringRef Site) const {
+    auto it = m_Loops.find(Site);
+    return it == m_Loops.end() ? nullptr : &it->second;
+  }
+} // end namespace clad
@@ -0,0 +1,53 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// The run-time counts of the derivatives, read from a profile written by the
+// derivatives instrumented with -fprofile-derivatives-generate
+//
+//----------------------------------------------------------------------------//
+
+#ifndef CLAD_DERIVATIVE_PROFILE_H
+#define CLAD_DERIVATIVE_PROFILE_H
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <string>
+
+namespace clang {
+  class FunctionDecl;
+  class Stmt;
+}
+
+namespace clad {
+  /// The counts written by clad::profile_data, see Profile.h: the entries of
+  /// the derivatives of each function, the calls they make and the runs and
+  /// iterations of their loops, keyed by site.
+  class DerivativeProfile {
+  public:
+    struct LoopCounts {
+      uint64_t Runs = 0;
+      uint64_t Trips = 0;
+    };
+
+  private:
+    llvm::StringMap<uint64_t> m_Calls;
+    llvm::StringMap<LoopCounts> m_Loops;
+
+  public:
+    /// Reads the profile at Path, adding to the counts already read. Returns
+    /// false and sets Error if the file cannot be read or is malformed.
+    bool read(llvm::StringRef Path, std::string& Error);
+    /// The site of the derivatives of FD, or of the statement S in its body:
+    /// the qualified name of FD with its parameter types, as in f(double, int),
+    /// followed by the expansion line and column of S.
+    static std::string getSite(const clang::FunctionDecl* FD,
+                               const clang::Stmt* S = nullptr);
+    /// The number of executions of a site, or null if it was not profiled.
+    const uint64_t* getCallCount(llvm::StringRef Site) const;
+    /// The counts of the loop at a site, or null if it was not profiled.
+    const LoopCounts* getLoopCounts(llvm::StringRef Site) const;
+  };
+} // end namespace clad
+#endif // CLAD_DERIVATIVE_PROFILE_H
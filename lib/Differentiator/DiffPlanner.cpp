@@ -171,13 +171,51 @@ namespace clad {
     return finder.m_FnDRE;
   }
 
+  /// Creates the string literal S converted to the type of the default
+  /// argument it replaces.
+  static Expr* BuildStringArg(Sema& SemaRef, llvm::StringRef S,
+                              CXXDefaultArgExpr* Arg) {
+    ASTContext& C = SemaRef.getASTContext();
+    // Copied and adapted from clang::Sema::ActOnStringLiteral.
+    QualType CharTyConst = C.CharTy;
+    CharTyConst.addConst();
+    // Get an array type for the string, according to C99 6.4.5. This includes
+    // the nul terminator character as well as the string length for pascal
+    // strings.
+    QualType StrTy =
+      clad_compat::getConstantArrayType(C, CharTyConst,
+                             llvm::APInt(32, S.size() + 1),
+                             nullptr,
+                             ArrayType::Normal,
+                             /*IndexTypeQuals*/0);
+
+    StringLiteral* SL =
+      StringLiteral::Create(C,
+                            S,
+                            StringLiteral::Ascii,
+                            /*Pascal*/false,
+                            StrTy,
+                            noLoc);
+    return SemaRef.ImpCastExprToType(SL,
+                                     Arg->getType(),
+                                     CK_ArrayToPointerDecay).get();
+  }
+
   void DiffRequest::updateCall(FunctionDecl* FD, Sema& SemaRef) {
     CallExpr* call = this->CallContext;
-    // Index of "code" parameter:
+    assert(call && "Must be set");
+    // Index of "code" parameter, followed by the "pattern" parameter of
+    // clad::hessian and clad::jacobian.
     auto codeArgIdx = static_cast<int>(call->getNumArgs()) - 1;
+    int patternArgIdx = -1;
+    if (const FunctionDecl* Callee = call->getDirectCallee())
+      for (unsigned i = 0, e = Callee->getNumParams(); i < e; ++i)
+        if (Callee->getParamDecl(i)->getName() == "code")
+          codeArgIdx = i;
+        else if (Callee->getParamDecl(i)->getName() == "pattern")
+          patternArgIdx = i;
     auto derivedFnArgIdx = codeArgIdx - 1;
 
-    assert(call && "Must be set");
     assert(FD && "Trying to update with null FunctionDecl");
 
     DeclRefExpr* oldDRE = getArgFunction(call, SemaRef);
@@ -208,32 +246,17 @@ namespace clad {
       FD->print(Out, Policy);
       Out.flush();
 
-      // Copied and adapted from clang::Sema::ActOnStringLiteral.
-      QualType CharTyConst = C.CharTy;
-      CharTyConst.addConst();
-      // Get an array type for the string, according to C99 6.4.5. This includes
-      // the nul terminator character as well as the string length for pascal
-      // strings.
-      QualType StrTy =
-        clad_compat::getConstantArrayType(C, CharTyConst,
-                               llvm::APInt(32, Out.str().size() + 1),
-                               nullptr,
-                               ArrayType::Normal,
-                               /*IndexTypeQuals*/0);
-
-      StringLiteral* SL =
-        StringLiteral::Create(C,
-                              Out.str(),
-                              StringLiteral::Ascii,
-                              /*Pascal*/false,
-                              StrTy,
-                              noLoc);
-      Expr* newArg =
-        SemaRef.ImpCastExprToType(SL,
-                                  Arg->getType(),
-                                  CK_ArrayToPointerDecay).get();
-      call->setArg(codeArgIdx, newArg);
+      call->setArg(codeArgIdx, BuildStringArg(SemaRef, Out.str(), Arg));
     }
+
+    // Update the sparsity pattern parameter.
+    if (patternArgIdx < 0 || SparsityPattern.empty() ||
+        patternArgIdx >= static_cast<int>(call->getNumArgs()))
+      return;
+    if (CXXDefaultArgExpr* Arg
+        = dyn_cast<CXXDefaultArgExpr>(call->getArg(patternArgIdx)))
+      call->setArg(patternArgIdx,
+                   BuildStringArg(SemaRef, SparsityPattern, Arg));
   }
 
   DiffCollector::DiffCollector(DeclGroupRef DGR, DiffInterval& Interval,
@@ -283,7 +306,8 @@ namespace clad {
     // TODO: why not check for its name? clad::differentiate/gradient?
     const AnnotateAttr* A = FD->getAttr<AnnotateAttr>();
     if (A && (A->getAnnotation().equals("D") || A->getAnnotation().equals("G") 
-        || A->getAnnotation().equals("H") || A->getAnnotation().equals("J"))) {
+        || A->getAnnotation().equals("H") || A->getAnnotation().equals("J")
+        || A->getAnnotation().equals("S"))) {
       // A call to clad::differentiate or clad::gradient was found.
       DeclRefExpr* DRE = getArgFunction(E, m_Sema);
       if (!DRE)
@@ -302,6 +326,8 @@ namespace clad {
         request.Mode = DiffMode::hessian;
       } else if (A->getAnnotation().equals("J")) {
         request.Mode = DiffMode::jacobian;
+      } else if (A->getAnnotation().equals("S")) {
+        request.Mode = DiffMode::sparse_hessian;
       } else {
         request.Mode = DiffMode::reverse;
       }
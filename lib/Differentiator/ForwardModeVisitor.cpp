@@ -21,6 +21,7 @@
 #include "clang/Sema/SemaInternal.h"
 #include "clang/Sema/Template.h"
 
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/Support/SaveAndRestore.h"
 
 #include <algorithm>
@@ -55,6 +56,15 @@ namespace clad {
     }
     if (args.empty())
       return {};
+    // The real parameters may be seeded together, e.g. for the compressed
+    // Hessian-vector products of the sparse hessians.
+    if (request.SeedArgsTogether && args.size() > 1 &&
+        std::all_of(args.begin(), args.end(), [](const VarDecl* VD) {
+          return VD->getType()->isRealType();
+        })) {
+      m_SeededVars.assign(args.begin(), std::prev(args.end()));
+      args.erase(args.begin(), std::prev(args.end()));
+    }
     // Check that only one arg is requested and if the arg requested is of array
     // or pointer type, only one of the indices have been requested
     if (args.size() > 1 || (isArrayOrPointerType(args[0]->getType()) &&
@@ -95,6 +105,11 @@ namespace clad {
       return {};
     }
     m_DerivativeOrder = request.CurrentDerivativeOrder;
+    m_DerivedAgain =
+        request.DerivedAgain ||
+        request.CurrentDerivativeOrder < request.RequestedDerivativeOrder;
+    // The fused builtins are not differentiable themselves.
+    m_FuseBuiltins = request.FuseBuiltins && !m_DerivedAgain;
     std::string s = std::to_string(m_DerivativeOrder);
     std::string derivativeBaseName;
     if (m_DerivativeOrder == 1)
@@ -107,8 +122,21 @@ namespace clad {
     m_ArgIndex = std::distance(
         FD->param_begin(),
         std::find(FD->param_begin(), FD->param_end(), m_IndependentVar));
+    // The derivative along several parameters is named after all of them,
+    // e.g. f_dir0_2, which cannot be the name of a mixed derivative such as
+    // f_darg0_darg2.
+    std::string derivativePrefix = "_d" + s + "arg";
+    if (!m_SeededVars.empty()) {
+      derivativePrefix = "_dir" + s;
+      for (const VarDecl* VD : m_SeededVars)
+        derivativePrefix +=
+            std::to_string(std::distance(
+                FD->param_begin(),
+                std::find(FD->param_begin(), FD->param_end(), VD))) +
+            "_";
+    }
     IdentifierInfo* II =
-        &m_Context.Idents.get(derivativeBaseName + "_d" + s + "arg" +
+        &m_Context.Idents.get(derivativeBaseName + derivativePrefix +
                               std::to_string(m_ArgIndex) + derivativeSuffix);
     DeclarationNameInfo name(II, noLoc);
     llvm::SaveAndRestore<DeclContext*> SaveContext(m_Sema.CurContext);
@@ -151,6 +179,9 @@ namespace clad {
       // derivedFD.
       if (PVD == m_IndependentVar)
         m_IndependentVar = newPVD;
+      std::replace(m_SeededVars.begin(), m_SeededVars.end(),
+                   static_cast<const VarDecl*>(PVD),
+                   static_cast<const VarDecl*>(newPVD));
 
       params.push_back(newPVD);
       // Add the args in the scope and id chain so that they could be found.
@@ -174,7 +205,8 @@ namespace clad {
       if (!param->getType()->isRealType())
         continue;
       // If param is independent variable, its derivative is 1, otherwise 0.
-      int dValue = (param == m_IndependentVar);
+      int dValue = (param == m_IndependentVar) ||
+                   llvm::is_contained(m_SeededVars, param);
       auto dParam =
           ConstantFolder::synthesizeLiteral(m_Context.IntTy, m_Context, dValue);
       // For each function arg, create a variable _d_arg to store derivatives
@@ -690,6 +722,13 @@ namespace clad {
     return OverloadedFn;
   }
 
+  bool DerivativeBuilder::isCustomDerivativeDeclared(llvm::StringRef Name) {
+    if (!m_BuiltinDerivativesNSD)
+      m_BuiltinDerivativesNSD = LookupBuiltinDerivativesNSD(m_Context, m_Sema);
+    DeclarationName DN(&m_Context.Idents.get(Name));
+    return !m_BuiltinDerivativesNSD->lookup(DN).empty();
+  }
+
   StmtDiff ForwardModeVisitor::VisitCallExpr(const CallExpr* CE) {
     const FunctionDecl* FD = CE->getDirectCallee();
     if (!FD) {
@@ -723,6 +762,29 @@ namespace clad {
       CallArgs.push_back(argDiff.getExpr());
     }
 
+    // The fused builtins compute the value of the call together with its
+    // derivative, e.g. _t1 = exp_value_and_darg0(x, &_t0).
+    if (m_FuseBuiltins && m_DerivativeOrder == 1 && CallArgs.size() == 1 &&
+        CE->getType()->isRealFloatingType()) {
+      std::string FusedName = FD->getNameAsString() + "_value_and_darg0";
+      if (m_Builder.isCustomDerivativeDeclared(FusedName)) {
+        VarDecl* DerivativeDecl = BuildVarDecl(CE->getType(), "_t");
+        llvm::SmallVector<Expr*, 2> FusedArgs{
+            CallArgs[0], BuildOp(UO_AddrOf, BuildDeclRef(DerivativeDecl))};
+        DeclarationNameInfo FusedDNInfo(
+            DeclarationName(&m_Context.Idents.get(FusedName)), DeclLoc);
+        if (Expr* Fused =
+                m_Builder.findOverloadedDefinition(FusedDNInfo, FusedArgs)) {
+          addToCurrentBlock(BuildDeclStmt(DerivativeDecl));
+          Expr* Value = StoreAndRef(Fused, "_t", /*forceDeclCreation*/ true);
+          Expr* FusedDiff = BuildDeclRef(DerivativeDecl);
+          if (Multiplier)
+            FusedDiff = BuildOp(BO_Mul, FusedDiff, BuildParens(Multiplier));
+          return StmtDiff(Value, FusedDiff);
+        }
+      }
+    }
+
     Expr* call = m_Sema
                      .ActOnCallExpr(getCurrentScope(),
                                     Clone(CE->getCallee()),
@@ -765,6 +827,7 @@ namespace clad {
       request.Function = FD;
       request.BaseFunctionName = FD->getNameAsString();
       request.Mode = DiffMode::forward;
+      request.DerivedAgain = m_DerivedAgain;
       // Silence diag outputs in nested derivation process.
       request.VerboseDiags = false;
 
@@ -6,6 +6,8 @@
 
 #include "clad/Differentiator/HessianModeVisitor.h"
 
+#include "SparsityAnalyzer.h"
+
 #include "clad/Differentiator/DiffPlanner.h"
 #include "clad/Differentiator/StmtClone.h"
 
@@ -26,11 +28,110 @@
 using namespace clang;
 
 namespace clad {
+  namespace {
+    /// Returns true if the column j is the only one of its color with a
+    /// nonzero in the row i, i.e. the product of its color holds the entry
+    /// (i, j) at the index i.
+    bool isIsolated(const SparsityPattern& P, const std::vector<int>& Colors,
+                    unsigned i, unsigned j) {
+      for (int k = P[i].find_first(); k != -1; k = P[i].find_next(k))
+        if (k != (int)j && Colors[k] == Colors[j])
+          return false;
+      return true;
+    }
+
+    /// Returns true if the vertex v of the adjacency graph of P can take the
+    /// color c: no neighbour has it and no path on four vertices through v
+    /// would be colored with two colors only.
+    bool canStarColor(const SparsityPattern& P, const std::vector<int>& Colors,
+                      unsigned v, int c) {
+      for (int a = P[v].find_first(); a != -1; a = P[v].find_next(a)) {
+        if (a == (int)v || Colors[a] < 0)
+          continue;
+        if (Colors[a] == c)
+          return false;
+        // v - a - b - d, colored c A c A.
+        for (int b = P[a].find_first(); b != -1; b = P[a].find_next(b)) {
+          if (b == a || b == (int)v || Colors[b] != c)
+            continue;
+          for (int d = P[b].find_first(); d != -1; d = P[b].find_next(d))
+            if (d != b && d != a && d != (int)v && Colors[d] == Colors[a])
+              return false;
+        }
+        // a - v - b - d, colored A c A c.
+        for (int b = P[v].find_first(); b != -1; b = P[v].find_next(b)) {
+          if (b == (int)v || b == a || Colors[b] != Colors[a])
+            continue;
+          for (int d = P[b].find_first(); d != -1; d = P[b].find_next(d))
+            if (d != b && d != (int)v && Colors[d] == c)
+              return false;
+        }
+      }
+      return true;
+    }
+
+    /// Greedily star colors the columns of a symmetric pattern, so that
+    /// every nonzero can be read from the Hessian-vector product of the sum
+    /// of the columns of one color, see isIsolated. The zero columns get no
+    /// color, -1.
+    std::vector<int> colorStar(const SparsityPattern& P) {
+      std::vector<int> Colors(P.size(), -1);
+      for (unsigned v = 0, e = P.size(); v < e; ++v) {
+        if (P[v].none())
+          continue;
+        int c = 0;
+        while (!canStarColor(P, Colors, v, c))
+          ++c;
+        Colors[v] = c;
+      }
+      return Colors;
+    }
+  } // end anonymous namespace
+
   HessianModeVisitor::HessianModeVisitor(DerivativeBuilder& builder)
       : VisitorBase(builder) {}
 
   HessianModeVisitor::~HessianModeVisitor() {}
 
+  FunctionDecl* HessianModeVisitor::DeriveColumn(const DiffRequest& request,
+                                                 llvm::StringRef argNames,
+                                                 bool seedTogether) {
+    DiffRequest independentArgRequest = request;
+    // Converts the independent arguments to a StringLiteral Expr
+    QualType CharTyConst = m_Context.CharTy.withConst();
+    QualType StrTy = clad_compat::getConstantArrayType(
+        m_Context,
+        CharTyConst,
+        llvm::APInt(32, argNames.size() + 1),
+        nullptr,
+        ArrayType::Normal,
+        /*IndexTypeQuals*/ 0);
+    StringLiteral* independentArgString =
+        StringLiteral::Create(m_Context,
+                              argNames,
+                              StringLiteral::Ascii,
+                              false,
+                              StrTy,
+                              noLoc);
+
+    // Derives function once in forward mode w.r.t to independentArg
+    independentArgRequest.Args = independentArgString;
+    independentArgRequest.Mode = DiffMode::forward;
+    independentArgRequest.CallUpdateRequired = false;
+    independentArgRequest.DerivedAgain = true;
+    independentArgRequest.SeedArgsTogether = seedTogether;
+    FunctionDecl* firstDerivative =
+        plugin::ProcessDiffRequest(m_CladPlugin, independentArgRequest);
+
+    // Further derives function w.r.t to all args in reverse mode
+    independentArgRequest.Mode = DiffMode::reverse;
+    independentArgRequest.Function = firstDerivative;
+    independentArgRequest.Args = nullptr;
+    independentArgRequest.DerivedAgain = request.DerivedAgain;
+    independentArgRequest.SeedArgsTogether = false;
+    return plugin::ProcessDiffRequest(m_CladPlugin, independentArgRequest);
+  }
+
   DeclWithContext HessianModeVisitor::Derive(const clang::FunctionDecl* FD,
                                              const DiffRequest& request) {
     DiffParams args{};
@@ -39,6 +140,17 @@ namespace clad {
       std::tie(args, indexIntervalTable) = parseDiffArgs(request.Args, FD);
     else
       std::copy(FD->param_begin(), FD->param_end(), std::back_inserter(args));
+    if (request.Mode == DiffMode::sparse_hessian)
+      return DeriveSparse(FD, request, args);
+
+    // The rows of the Hessian which are structurally zero need not be
+    // generated, their second derivative functions are skipped.
+    llvm::SmallVector<const VarDecl*, 16> params(FD->param_begin(),
+                                                 FD->param_end());
+    SparsityPattern pattern;
+    bool sparsityKnown =
+        SparsityAnalyzer(FD, params).computeHessian(pattern);
+    SparsityPattern rows;
 
     std::vector<FunctionDecl*> secondDerivativeColumns;
 
@@ -48,41 +160,90 @@ namespace clad {
     // (corresponds to columns of Hessian matrix) in a vector for private method
     // merge.
     for (auto independentArg : args) {
-      DiffRequest independentArgRequest = request;
-      // Converts an independent argument from VarDecl to a StringLiteral Expr
-      QualType CharTyConst = m_Context.CharTy.withConst();
-      QualType StrTy = clad_compat::getConstantArrayType(
-          m_Context,
-          CharTyConst,
-          llvm::APInt(32, independentArg->getNameAsString().size() + 1),
-          nullptr,
-          ArrayType::Normal,
-          /*IndexTypeQuals*/ 0);
-      StringLiteral* independentArgString =
-          StringLiteral::Create(m_Context,
-                                independentArg->getName(),
-                                StringLiteral::Ascii,
-                                false,
-                                StrTy,
-                                noLoc);
-
-      // Derives function once in forward mode w.r.t to independentArg
-      independentArgRequest.Args = independentArgString;
-      independentArgRequest.Mode = DiffMode::forward;
-      independentArgRequest.CallUpdateRequired = false;
-      FunctionDecl* firstDerivative =
-          plugin::ProcessDiffRequest(m_CladPlugin, independentArgRequest);
-
-      // Further derives function w.r.t to all args in reverse mode
-      independentArgRequest.Mode = DiffMode::reverse;
-      independentArgRequest.Function = firstDerivative;
-      independentArgRequest.Args = nullptr;
-      FunctionDecl* secondDerivative =
-          plugin::ProcessDiffRequest(m_CladPlugin, independentArgRequest);
-
-      secondDerivativeColumns.push_back(secondDerivative);
+      auto it = std::find(params.begin(), params.end(), independentArg);
+      if (sparsityKnown && it != params.end()) {
+        const llvm::BitVector& row = pattern[it - params.begin()];
+        rows.push_back(row);
+        if (row.none() && independentArg->getType()->isRealType()) {
+          secondDerivativeColumns.push_back(nullptr);
+          continue;
+        }
+      } else
+        sparsityKnown = false;
+      secondDerivativeColumns.push_back(
+          DeriveColumn(request, independentArg->getName()));
     }
-    return Merge(secondDerivativeColumns, request);
+    DeclWithContext result = Merge(secondDerivativeColumns, request);
+    if (result.first && sparsityKnown)
+      m_Builder.m_SparsityPatterns[result.first] =
+          SparsityAnalyzer::print(rows);
+    return result;
+  }
+
+  DeclWithContext HessianModeVisitor::DeriveSparse(const FunctionDecl* FD,
+                                                   const DiffRequest& request,
+                                                   const DiffParams& args) {
+    // The independent variables keep the positions of the parameters.
+    unsigned numParams = FD->getNumParams();
+    llvm::SmallVector<const VarDecl*, 16> inputs(numParams, nullptr);
+    for (const VarDecl* arg : args) {
+      if (!arg->getType()->isRealType()) {
+        diag(DiagnosticsEngine::Error,
+             arg->getEndLoc(),
+             "sparse hessians support only parameters of a real type, "
+             "'%0' is not",
+             {arg->getNameAsString()});
+        return {};
+      }
+      auto it = std::find(FD->param_begin(), FD->param_end(), arg);
+      inputs[it - FD->param_begin()] = arg;
+    }
+
+    // If the function is not analyzable, all the entries of the independent
+    // variables are nonzeros and get a color each.
+    SparsityPattern pattern;
+    if (!SparsityAnalyzer(FD, inputs).computeHessian(pattern)) {
+      pattern.assign(numParams, llvm::BitVector(numParams));
+      for (unsigned i = 0; i < numParams; ++i)
+        for (unsigned j = 0; j < numParams; ++j)
+          if (inputs[i] && inputs[j])
+            pattern[i].set(j);
+    }
+    std::vector<int> colors = colorStar(pattern);
+
+    // One compressed Hessian-vector product per color, seeding the forward
+    // mode with all the parameters of the color at once.
+    std::vector<FunctionDecl*> products;
+    for (int c = 0; std::count(colors.begin(), colors.end(), c); ++c) {
+      std::string argNames;
+      unsigned numSeeds = 0;
+      for (unsigned i = 0; i < numParams; ++i)
+        if (colors[i] == c)
+          argNames += (numSeeds++ ? "," : "") + inputs[i]->getNameAsString();
+      products.push_back(DeriveColumn(request, argNames, numSeeds > 1));
+      if (!products.back())
+        return {};
+    }
+
+    // Each nonzero is read from the product of the color of its column, or
+    // from the one of its row by symmetry, in the row-major order.
+    m_SparseEntries.clear();
+    for (unsigned i = 0; i < numParams; ++i)
+      for (int j = pattern[i].find_first(); j != -1;
+           j = pattern[i].find_next(j)) {
+        if (isIsolated(pattern, colors, i, j))
+          m_SparseEntries.emplace_back(colors[j], i);
+        else {
+          assert(isIsolated(pattern, colors, j, i) && "Not a star coloring");
+          m_SparseEntries.emplace_back(colors[i], j);
+        }
+      }
+
+    DeclWithContext result = Merge(products, request);
+    if (result.first)
+      m_Builder.m_SparsityPatterns[result.first] =
+          SparsityAnalyzer::print(pattern);
+    return result;
   }
 
   // Combines all generated second derivative functions into a
@@ -98,7 +259,10 @@ namespace clad {
               m_Function->param_end(),
               std::back_inserter(args));
 
-    std::string hessianFuncName = request.BaseFunctionName + "_hessian";
+    bool isSparse = request.Mode == DiffMode::sparse_hessian;
+    std::string hessianFuncName =
+        request.BaseFunctionName +
+        (isSparse ? "_sparse_hessian" : "_hessian");
     IdentifierInfo* II = &m_Context.Idents.get(hessianFuncName);
     DeclarationNameInfo name(II, noLoc);
 
@@ -172,7 +336,7 @@ namespace clad {
         hessianFD,
         noLoc,
         noLoc,
-        &m_Context.Idents.get("hessianMatrix"),
+        &m_Context.Idents.get(isSparse ? "hessianValues" : "hessianMatrix"),
         paramTypes.back(),
         m_Context.getTrivialTypeSourceInfo(paramTypes.back(), noLoc),
         params.front()->getStorageClass(),
@@ -192,26 +356,51 @@ namespace clad {
     beginScope(Scope::FnScope | Scope::DeclScope);
     m_DerivativeFnScope = getCurrentScope();
 
+    auto size_type = m_Context.getSizeType();
+    auto size_type_bits = m_Context.getIntWidth(size_type);
+    // The compressed Hessian-vector products of a sparse hessian.
+    llvm::SmallVector<VarDecl*, 8> products;
+
     // Creates callExprs to the second derivative functions genereated
-    // and creates maps array elements to input array.
+    // and creates maps array elements to input array. The structurally zero
+    // rows have no second derivative function and are left untouched.
     for (size_t i = 0, e = secDerivFuncs.size(); i < e; ++i) {
+      if (!secDerivFuncs[i])
+        continue;
       const int numIndependentArgs = secDerivFuncs[i]->getNumParams();
 
-      auto size_type = m_Context.getSizeType();
-      auto size_type_bits = m_Context.getIntWidth(size_type);
-      // Create the idx literal.
-      auto idx = IntegerLiteral::Create(
-          m_Context,
-          llvm::APInt(size_type_bits, (i * (numIndependentArgs - 1))),
-          size_type,
-          noLoc);
-      // Create the hessianMatrix[idx] expression.
-      auto arrayExpr =
-          m_Sema.CreateBuiltinArraySubscriptExpr(m_Result, noLoc, idx, noLoc)
-              .get();
-      // Creates the &hessianMatrix[idx] expression.
-      auto addressArrayExpr =
-          m_Sema.BuildUnaryOp(nullptr, noLoc, UO_AddrOf, arrayExpr).get();
+      Expr* addressArrayExpr = nullptr;
+      if (isSparse) {
+        // Declare: double _hvpN[n] = {};
+        QualType productType = clad_compat::getConstantArrayType(
+            m_Context,
+            m_Function->getReturnType(),
+            llvm::APInt(size_type_bits, numIndependentArgs - 1),
+            nullptr,
+            ArrayType::Normal,
+            /*IndexTypeQuals*/ 0);
+        VarDecl* product =
+            BuildVarDecl(productType,
+                         "_hvp",
+                         m_Sema.ActOnInitList(noLoc, {}, noLoc).get());
+        CompStmtSave.push_back(BuildDeclStmt(product));
+        products.push_back(product);
+        addressArrayExpr = BuildDeclRef(product);
+      } else {
+        // Create the idx literal.
+        auto idx = IntegerLiteral::Create(
+            m_Context,
+            llvm::APInt(size_type_bits, (i * (numIndependentArgs - 1))),
+            size_type,
+            noLoc);
+        // Create the hessianMatrix[idx] expression.
+        auto arrayExpr =
+            m_Sema.CreateBuiltinArraySubscriptExpr(m_Result, noLoc, idx, noLoc)
+                .get();
+        // Creates the &hessianMatrix[idx] expression.
+        addressArrayExpr =
+            m_Sema.BuildUnaryOp(nullptr, noLoc, UO_AddrOf, arrayExpr).get();
+      }
 
       // Transforms ParmVarDecls into Expr paramters for insertion into function
       std::vector<Expr*> DeclRefToParams;
@@ -229,6 +418,32 @@ namespace clad {
       CompStmtSave.push_back(call);
     }
 
+    // Reads the nonzeros of a sparse hessian from the products:
+    // hessianValues[k] = _hvpC[i];
+    if (isSparse)
+      for (size_t k = 0, e = m_SparseEntries.size(); k < e; ++k) {
+        auto valueIdx = IntegerLiteral::Create(
+            m_Context, llvm::APInt(size_type_bits, k), size_type, noLoc);
+        auto productIdx = IntegerLiteral::Create(
+            m_Context,
+            llvm::APInt(size_type_bits, m_SparseEntries[k].second),
+            size_type,
+            noLoc);
+        Expr* value = m_Sema
+                          .CreateBuiltinArraySubscriptExpr(
+                              m_Result, noLoc, valueIdx, noLoc)
+                          .get();
+        Expr* entry =
+            m_Sema
+                .CreateBuiltinArraySubscriptExpr(
+                    BuildDeclRef(products[m_SparseEntries[k].first]),
+                    noLoc,
+                    productIdx,
+                    noLoc)
+                .get();
+        CompStmtSave.push_back(BuildOp(BO_Assign, value, entry));
+      }
+
     auto StmtsRef =
         llvm::makeArrayRef(CompStmtSave.data(), CompStmtSave.size());
     CompoundStmt* CS =
@@ -6,6 +6,8 @@
 
 #include "clad/Differentiator/JacobianModeVisitor.h"
 
+#include "SparsityAnalyzer.h"
+
 #include "clad/Differentiator/DiffPlanner.h"
 #include "clad/Differentiator/ReverseModeVisitor.h"
 #include "clad/Differentiator/StmtClone.h"
@@ -38,7 +40,24 @@ namespace clad {
 
     ReverseModeVisitor V(this->builder);
     result = V.Derive(FD, request);
-
+    if (!result.first)
+      return result;
+
+    // The reverse pass only accumulates the entries the outputs depend on,
+    // the pattern of the others is reported along with the derivative.
+    DiffParams args{};
+    if (request.Args)
+      std::tie(args, std::ignore) = parseDiffArgs(request.Args, FD);
+    else
+      std::copy(FD->param_begin(), FD->param_end(), std::back_inserter(args));
+    if (args.empty())
+      return result;
+    args.pop_back();
+    const VarDecl* output = FD->getParamDecl(FD->getNumParams() - 1);
+    SparsityPattern pattern;
+    if (SparsityAnalyzer(FD, args).computeJacobian(output, pattern))
+      builder.m_SparsityPatterns[result.first] =
+          SparsityAnalyzer::print(pattern);
     return result;
   }
 } // end namespace clad
\ No newline at end of file
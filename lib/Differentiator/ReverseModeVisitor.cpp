@@ -7,12 +7,16 @@
 #include "clad/Differentiator/ReverseModeVisitor.h"
 
 #include "ConstantFolder.h"
+#include "DeadStoreEliminator.h"
+#include "DerivativeProfile.h"
+#include "TemporaryCoalescer.h"
 
 #include "clad/Differentiator/DiffPlanner.h"
 #include "clad/Differentiator/StmtClone.h"
 
 #include "clang/AST/ASTContext.h"
 #include "clang/AST/Expr.h"
+#include "clang/AST/StmtOpenMP.h"
 #include "clang/AST/TemplateBase.h"
 #include "clang/Sema/Lookup.h"
 #include "clang/Sema/Overload.h"
@@ -21,9 +25,17 @@
 #include "clang/Sema/SemaInternal.h"
 #include "clang/Sema/Template.h"
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Support/SaveAndRestore.h"
 
 #include <algorithm>
+#include <functional>
+#include <map>
 #include <numeric>
 
 #include "clad/Differentiator/Compatibility.h"
@@ -46,6 +58,65 @@ namespace clad {
     return Call;
   }
 
+  VarDecl* ReverseModeVisitor::MakeCladTape(QualType TapeType) {
+    VarDecl* VD = GlobalStoreImpl(TapeType, "_t");
+    // Add fake location, since Clang AST does assert(Loc.isValid()) somewhere.
+    VD->setLocation(m_Function->getLocation());
+    m_Sema.AddInitializerToDecl(VD, getZeroInit(TapeType), false);
+    m_Tapes.push_back(VD);
+    if (m_ExpectedTrips)
+      m_TapeReserves.push_back({VD, m_ExpectedTrips});
+    return VD;
+  }
+
+  namespace {
+    /// Redirects the references to the given variables.
+    class DeclRefRetargeter : public RecursiveASTVisitor<DeclRefRetargeter> {
+      const llvm::DenseMap<const VarDecl*, VarDecl*>& m_Replacements;
+    public:
+      DeclRefRetargeter(
+          const llvm::DenseMap<const VarDecl*, VarDecl*>& Replacements)
+          : m_Replacements(Replacements) {}
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+          if (VarDecl* Replacement = m_Replacements.lookup(VD))
+            DRE->setDecl(Replacement);
+        return true;
+      }
+    };
+  } // end anonymous namespace
+
+  void ReverseModeVisitor::appendTapeParams(
+      llvm::SmallVectorImpl<ParmVarDecl*>& params) {
+    llvm::DenseMap<const VarDecl*, VarDecl*> Replacements;
+    for (VarDecl* Tape : m_Tapes) {
+      QualType TapeRefType = m_Context.getLValueReferenceType(Tape->getType());
+      ParmVarDecl* PVD = ParmVarDecl::Create(
+          m_Context,
+          m_Derivative,
+          noLoc,
+          noLoc,
+          Tape->getIdentifier(),
+          TapeRefType,
+          m_Context.getTrivialTypeSourceInfo(TapeRefType, noLoc),
+          SC_None,
+          /* No default value */ nullptr);
+      params.push_back(PVD);
+      Replacements[Tape] = PVD;
+    }
+    DeclRefRetargeter Retargeter(Replacements);
+    Retargeter.TraverseStmt(m_Derivative->getBody());
+
+    llvm::SmallVector<QualType, 16> paramTypes;
+    for (ParmVarDecl* PVD : params)
+      paramTypes.push_back(PVD->getType());
+    auto FnType = cast<FunctionProtoType>(m_Derivative->getType());
+    m_Derivative->setType(m_Context.getFunctionType(FnType->getReturnType(),
+                                                    paramTypes,
+                                                    FnType->getExtProtoInfo()));
+    m_Derivative->setParams(params);
+  }
+
   ReverseModeVisitor::CladTapeResult
   ReverseModeVisitor::MakeCladTapeFor(Expr* E) {
     assert(E && "must be provided");
@@ -53,11 +124,7 @@ namespace clad {
         GetCladTapeOfType(getNonConstType(E->getType(), m_Context, m_Sema));
     LookupResult& Push = GetCladTapePush();
     LookupResult& Pop = GetCladTapePop();
-    Expr* TapeRef = BuildDeclRef(GlobalStoreImpl(TapeType, "_t"));
-    auto VD = cast<VarDecl>(cast<DeclRefExpr>(TapeRef)->getDecl());
-    // Add fake location, since Clang AST does assert(Loc.isValid()) somewhere.
-    VD->setLocation(m_Function->getLocation());
-    m_Sema.AddInitializerToDecl(VD, getZeroInit(TapeType), false);
+    Expr* TapeRef = BuildDeclRef(MakeCladTape(TapeType));
     CXXScopeSpec CSS;
     CSS.Extend(m_Context, GetCladNamespace(), noLoc, noLoc);
     auto PopDRE =
@@ -74,6 +141,64 @@ namespace clad {
     return CladTapeResult{*this, PushExpr, PopExpr, TapeRef};
   }
 
+  namespace {
+    /// Counts the returns of a function and finds its recursive calls.
+    class ReturnCounter : public RecursiveASTVisitor<ReturnCounter> {
+      const FunctionDecl* m_FD;
+    public:
+      unsigned Returns = 0;
+      bool IsRecursive = false;
+      ReturnCounter(const FunctionDecl* FD) : m_FD(FD) {}
+      bool VisitReturnStmt(ReturnStmt*) {
+        ++Returns;
+        return true;
+      }
+      bool VisitCallExpr(CallExpr* CE) {
+        const FunctionDecl* Callee = CE->getDirectCallee();
+        if (Callee && Callee->getCanonicalDecl() == m_FD->getCanonicalDecl())
+          IsRecursive = true;
+        return true;
+      }
+      // The returns of lambdas do not leave the function.
+      bool TraverseLambdaExpr(LambdaExpr*) { return true; }
+    };
+  } // end anonymous namespace
+
+  /// Returns true if the only return of Def is its last statement, so that
+  /// the reverse pass always starts from its end. Unless AllowRecursion is
+  /// set, Def must not call itself either.
+  static bool hasSingleTrailingReturn(const FunctionDecl* Def,
+                                      bool AllowRecursion) {
+    auto Body = dyn_cast_or_null<CompoundStmt>(Def->getBody());
+    if (!Body || Body->body_empty() || !isa<ReturnStmt>(Body->body_back()))
+      return false;
+    ReturnCounter Counter(Def);
+    Counter.TraverseStmt(Body);
+    return Counter.Returns == 1 && (AllowRecursion || !Counter.IsRecursive);
+  }
+
+  /// Returns the reverse mode policy of FD, given by its clad::store_all,
+  /// clad::mixed or clad::recompute_all annotation, or else by the request.
+  /// The flags reversing the independent loops without tapes imply the mixed
+  /// policy.
+  static ReversePolicy getReversePolicy(const FunctionDecl* FD,
+                                        const DiffRequest& request) {
+    for (const AnnotateAttr* A : FD->specific_attrs<AnnotateAttr>()) {
+      llvm::StringRef Annotation = A->getAnnotation();
+      if (Annotation == "clad::store_all")
+        return ReversePolicy::store_all;
+      if (Annotation == "clad::mixed")
+        return ReversePolicy::mixed;
+      if (Annotation == "clad::recompute_all")
+        return ReversePolicy::recompute_all;
+    }
+    if (request.Policy == ReversePolicy::store_all &&
+        (request.TapeFreeLoops || request.StencilAdjoints ||
+         request.ReorderAdjointLoops))
+      return ReversePolicy::mixed;
+    return request.Policy;
+  }
+
   ReverseModeVisitor::ReverseModeVisitor(DerivativeBuilder& builder)
       : VisitorBase(builder), m_Result(nullptr) {}
 
@@ -82,11 +207,53 @@ namespace clad {
   DeclWithContext ReverseModeVisitor::Derive(const FunctionDecl* FD,
                                              const DiffRequest& request) {
     silenceDiags = !request.VerboseDiags;
+    m_InlineThreshold = request.InlineThreshold;
+    m_UsePullbacks = request.UsePullbacks;
+    isPullback = request.Pullback;
+    isAugmentedPrimal = request.AugmentedPrimal;
+    isReverseOnly = request.ReverseOnly;
+    m_SplitPullbacks = request.SplitPullbacks;
+    m_FuseBuiltins = request.FuseBuiltins && !request.DerivedAgain;
+    // The batches are evaluated once the forward pass is over, which is known
+    // when the reverse pass starts from the end of the function.
+    m_BatchBuiltins = request.BatchBuiltins && !request.DerivedAgain &&
+                      !isAugmentedPrimal && !isReverseOnly &&
+                      hasSingleTrailingReturn(FD, /*AllowRecursion*/ true);
+    // The split passes communicate through the tapes. The stencils are split,
+    // and the nests reordered, in the loops without tapes, which recompute
+    // their values.
+    m_StencilAdjoints = request.StencilAdjoints;
+    ReversePolicy Policy = getReversePolicy(FD, request);
+    m_TapeFreeLoops = Policy != ReversePolicy::store_all &&
+                      !isAugmentedPrimal && !isReverseOnly;
+    m_ReplayLoops = Policy == ReversePolicy::recompute_all && m_TapeFreeLoops;
+    m_ReorderAdjointLoops = request.ReorderAdjointLoops;
+    m_BufferIndirect = request.BufferIndirectAdjoints;
+    m_BlasAdjoints =
+        request.BlasAdjoints && !isAugmentedPrimal && !isReverseOnly;
+    // The reverse loops run in parallel regions, which -fopenmp-simd lacks.
+    m_ParallelLoops = m_Context.getLangOpts().OpenMP && !isAugmentedPrimal &&
+                      !isReverseOnly;
     m_Function = FD;
     assert(m_Function && "Must not be null.");
+    // The split passes run in separate calls, the augmented primal counts
+    // the entries and the trips.
+    m_InstrumentProfile = request.InstrumentProfile && !isReverseOnly;
+    // A profile without an entry of the function tells nothing about it.
+    m_Profile = m_Builder.m_Profile.get();
+    m_ProfileEntries = 0;
+    if (m_Profile)
+      if (const uint64_t* Entries =
+              m_Profile->getCallCount(DerivativeProfile::getSite(FD)))
+        m_ProfileEntries = *Entries;
+    if (!m_ProfileEntries)
+      m_Profile = nullptr;
+    m_ExpectedTrips = 0;
+    m_TapeReserves.clear();
 
     DiffParams args{};
-    if (request.Args)
+    // Pullbacks are always taken w.r.t. all the parameters.
+    if (request.Args && !isPullback && !isAugmentedPrimal)
       std::tie(args, std::ignore) = parseDiffArgs(request.Args, FD);
     else
       std::copy(FD->param_begin(), FD->param_end(), std::back_inserter(args));
@@ -99,7 +266,15 @@ namespace clad {
     }
 
     auto derivativeBaseName = m_Function->getNameAsString();
-    std::string gradientName = derivativeBaseName + funcPostfix();
+    std::string gradientName = derivativeBaseName;
+    if (isAugmentedPrimal)
+      gradientName += "_forw";
+    else if (isReverseOnly)
+      gradientName += "_reverse";
+    else if (isPullback)
+      gradientName += "_pullback";
+    else
+      gradientName += funcPostfix();
     // To be consistent with older tests, nothing is appended to 'f_grad' if
     // we differentiate w.r.t. all the parameters at once.
     if (request.Mode == DiffMode::jacobian &&
@@ -132,6 +307,18 @@ namespace clad {
     if (request.Mode == DiffMode::jacobian) {
       unsigned lastArgN = m_Function->getNumParams() - 1;
       paramTypes.back() = m_Function->getParamDecl(lastArgN)->getType();
+    } else if (isAugmentedPrimal) {
+      // The augmented primal has the parameters of f, the tapes are appended
+      // once they are known.
+      paramTypes.pop_back();
+    } else if (isPullback) {
+      // For a function f of type R(A1, A2, ..., An), the type of the pullback
+      // is void(A1, A2, ..., An, R, A1*, A2*, ..., An*).
+      paramTypes.back() =
+          getNonConstType(m_Function->getReturnType(), m_Context, m_Sema);
+      for (const ParmVarDecl* PVD : m_Function->parameters())
+        paramTypes.push_back(m_Context.getPointerType(
+            getNonConstType(PVD->getType(), m_Context, m_Sema)));
     } else {
       // The last parameter is the output parameter of the R* type.
       paramTypes.back() = m_Context.getPointerType(m_Function->getReturnType());
@@ -139,8 +326,10 @@ namespace clad {
     auto originalFnType = dyn_cast<FunctionProtoType>(m_Function->getType());
     // For a function f of type R(A1, A2, ..., An),
     // the type of the gradient function is void(A1, A2, ..., An, R*).
+    QualType gradientReturnType =
+        isAugmentedPrimal ? m_Function->getReturnType() : m_Context.VoidTy;
     QualType gradientFunctionType = m_Context.getFunctionType(
-        m_Context.VoidTy,
+        gradientReturnType,
         llvm::ArrayRef<QualType>(paramTypes.data(), paramTypes.size()),
         // Cast to function pointer.
         originalFnType->getExtProtoInfo());
@@ -195,29 +384,59 @@ namespace clad {
                        *it = VD;
                      return VD;
                    });
-    // The output paremeter "_result".
-    params.back() = ParmVarDecl::Create(
-        m_Context,
-        gradientFD,
-        noLoc,
-        noLoc,
-        &m_Context.Idents.get(resultArg()),
-        paramTypes.back(),
-        m_Context.getTrivialTypeSourceInfo(paramTypes.back(), noLoc),
-        params.front()->getStorageClass(),
-        /* No default value */ nullptr);
-    if (params.back()->getIdentifier())
-      m_Sema.PushOnScopeChains(params.back(),
-                               getCurrentScope(),
-                               /*AddToContext*/ false);
+    if (isAugmentedPrimal) {
+      // No parameters besides the ones of f.
+    } else if (isPullback) {
+      // The seed "_d_y" and the adjoints of the parameters "_d_<param>".
+      unsigned NParams = m_Function->getNumParams();
+      for (unsigned i = NParams, e = params.size(); i < e; ++i) {
+        std::string Name = "_d_y";
+        if (i > NParams)
+          Name = "_d_" + m_Function->getParamDecl(i - NParams - 1)
+                             ->getNameAsString();
+        params[i] = ParmVarDecl::Create(
+            m_Context,
+            gradientFD,
+            noLoc,
+            noLoc,
+            CreateUniqueIdentifier(Name),
+            paramTypes[i],
+            m_Context.getTrivialTypeSourceInfo(paramTypes[i], noLoc),
+            params.front()->getStorageClass(),
+            /* No default value */ nullptr);
+        m_Sema.PushOnScopeChains(params[i],
+                                 getCurrentScope(),
+                                 /*AddToContext*/ false);
+      }
+      m_Seed = params[NParams];
+    } else {
+      // The output paremeter "_result".
+      params.back() = ParmVarDecl::Create(
+          m_Context,
+          gradientFD,
+          noLoc,
+          noLoc,
+          &m_Context.Idents.get(resultArg()),
+          paramTypes.back(),
+          m_Context.getTrivialTypeSourceInfo(paramTypes.back(), noLoc),
+          params.front()->getStorageClass(),
+          /* No default value */ nullptr);
+      if (params.back()->getIdentifier())
+        m_Sema.PushOnScopeChains(params.back(),
+                                 getCurrentScope(),
+                                 /*AddToContext*/ false);
+    }
 
     llvm::ArrayRef<ParmVarDecl*> paramsRef =
         llvm::makeArrayRef(params.data(), params.size());
-    gradientFD->setParams(paramsRef);
+    // The parameters of a split pullback are set once its tapes are known.
+    if (!isAugmentedPrimal && !isReverseOnly)
+      gradientFD->setParams(paramsRef);
     gradientFD->setBody(nullptr);
 
     // Reference to the output parameter.
-    m_Result = BuildDeclRef(params.back());
+    if (!isPullback && !isAugmentedPrimal)
+      m_Result = BuildDeclRef(params.back());
 
     // Turns output array dimension input into APSInt
     auto PVDTotalArgs =
@@ -235,6 +454,9 @@ namespace clad {
                                        ? Clone(PVDTotalArgs->getDefaultArg())
                                        : nullptr));
     auto DRETotalArgs = (Expr*)BuildDeclRef(VD);
+    // The augmented primal does not compute any adjoints.
+    if (isAugmentedPrimal)
+      args.clear();
     numParams = args.size();
 
     // Creates the ArraySubscriptExprs for the independent variables
@@ -248,6 +470,14 @@ namespace clad {
         idx += 1;
         continue;
       }
+      if (isPullback) {
+        // The adjoint of the parameter is *_d_<param>.
+        ParmVarDecl* dArg = params[m_Function->getNumParams() + 1 + idx];
+        m_Variables[arg] = BuildOp(UO_Deref, BuildDeclRef(dArg));
+        idx += 1;
+        m_IndependentVars.push_back(arg);
+        continue;
+      }
       auto size_type = m_Context.getSizeType();
       auto size_type_bits = m_Context.getIntWidth(size_type);
       // Create the idx literal.
@@ -266,29 +496,70 @@ namespace clad {
     beginScope(Scope::FnScope | Scope::DeclScope);
     m_DerivativeFnScope = getCurrentScope();
     beginBlock();
+    // The passes of a split pullback run in separate calls, everything the
+    // reverse pass needs is stored on the tapes as it is done in loops.
+    bool isSplit = isAugmentedPrimal || isReverseOnly;
+    isInsideLoop = isSplit;
     // Start the visitation process which outputs the statements in the current
     // block.
     StmtDiff BodyDiff = Visit(FD->getBody());
     Stmt* Forward = BodyDiff.getStmt();
     Stmt* Reverse = BodyDiff.getStmt_dx();
+    // The tapes allocate from the arena of the thread, rewound when the
+    // scope declared before them ends. The tapes of a split pullback belong
+    // to its caller.
+    if (request.TapeArena && !isSplit && !m_Tapes.empty()) {
+      QualType ScopeType = GetCladTapeArenaScopeType();
+      VarDecl* Arena =
+          BuildVarDecl(ScopeType, "_arena", getZeroInit(ScopeType));
+      addToCurrentBlock(BuildDeclStmt(Arena), forward);
+    }
     // Create the body of the function.
-    // Firstly, all "global" Stmts are put into fn's body.
-    for (Stmt* S : m_Globals)
+    // Firstly, all "global" Stmts are put into fn's body. The tapes of a split
+    // pullback are its parameters instead.
+    for (Stmt* S : m_Globals) {
+      auto DS = dyn_cast<DeclStmt>(S);
+      if (isSplit && DS && DS->isSingleDecl() &&
+          llvm::is_contained(m_Tapes, DS->getSingleDecl()))
+        continue;
       addToCurrentBlock(S, forward);
+    }
     // Forward pass.
-    if (auto CS = dyn_cast<CompoundStmt>(Forward))
-      for (Stmt* S : CS->body())
-        addToCurrentBlock(S, forward);
-    else
-      addToCurrentBlock(Forward, forward);
+    if (!isReverseOnly) {
+      if (m_InstrumentProfile) {
+        Expr* Site = BuildProfileSite(nullptr);
+        addToCurrentBlock(BuildCladCall("profile_call", Site), forward);
+      }
+      if (auto CS = dyn_cast<CompoundStmt>(Forward))
+        for (Stmt* S : CS->body())
+          addToCurrentBlock(S, forward);
+      else
+        addToCurrentBlock(Forward, forward);
+    }
     // Reverse pass.
-    if (auto RCS = dyn_cast<CompoundStmt>(Reverse))
-      for (Stmt* S : RCS->body())
-        addToCurrentBlock(S, forward);
-    else
-      addToCurrentBlock(Reverse, forward);
+    if (!isAugmentedPrimal) {
+      if (auto RCS = dyn_cast<CompoundStmt>(Reverse))
+        for (Stmt* S : RCS->body())
+          addToCurrentBlock(S, forward);
+      else
+        addToCurrentBlock(Reverse, forward);
+    }
     Stmt* gradientBody = endBlock();
     m_Derivative->setBody(gradientBody);
+    if (isSplit)
+      appendTapeParams(params);
+    // The reverse pass accumulates into adjoints and temporaries which may
+    // never be read, e.g. the adjoints of the locals not feeding the result.
+    if (request.EliminateDeadStores) {
+      DeadStoreEliminator DSE(m_Context);
+      DSE.Eliminate(m_Derivative);
+    }
+    // Every temporary stored by GlobalStoreImpl is declared at the top of the
+    // gradient, let the ones with disjoint lifetimes share a declaration.
+    if (request.CoalesceTemporaries) {
+      TemporaryCoalescer TC(m_Context);
+      TC.Coalesce(m_Derivative);
+    }
 
     endScope(); // Function body scope
     m_Sema.PopFunctionScopeInfo();
@@ -566,16 +837,1789 @@ namespace clad {
     return StmtDiff(condExpr);
   }
 
+  namespace {
+    /// Returns the variable an lvalue refers to or points into, e.g. x for x,
+    /// x[i], *x or x.m.
+    const VarDecl* getBaseVar(const Expr* E) {
+      E = E->IgnoreParenImpCasts();
+      if (auto DRE = dyn_cast<DeclRefExpr>(E))
+        return dyn_cast<VarDecl>(DRE->getDecl());
+      if (auto ASE = dyn_cast<ArraySubscriptExpr>(E))
+        return getBaseVar(ASE->getBase());
+      if (auto ME = dyn_cast<MemberExpr>(E))
+        return getBaseVar(ME->getBase());
+      if (auto UO = dyn_cast<UnaryOperator>(E))
+        if (UO->getOpcode() == UO_Deref)
+          return getBaseVar(UO->getSubExpr());
+      return nullptr;
+    }
+
+    bool passesByAddress(QualType T) {
+      return T->isPointerType() || T->isReferenceType() || T->isArrayType();
+    }
+
+    bool isPureCallee(const FunctionDecl* FD,
+                      llvm::SmallPtrSetImpl<const FunctionDecl*>& Visited);
+
+    /// Checks that a function body references no mutable global variable,
+    /// static locals included, and calls only pure functions.
+    class PureBodyChecker : public RecursiveASTVisitor<PureBodyChecker> {
+      llvm::SmallPtrSetImpl<const FunctionDecl*>& m_Visited;
+    public:
+      bool Pure = true;
+      PureBodyChecker(llvm::SmallPtrSetImpl<const FunctionDecl*>& Visited)
+          : m_Visited(Visited) {}
+      bool reject() { return Pure = false; }
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        auto VD = dyn_cast<VarDecl>(DRE->getDecl());
+        if (VD && VD->hasGlobalStorage() && !VD->getType().isConstQualified())
+          return reject();
+        return true;
+      }
+      bool VisitCallExpr(CallExpr* CE) {
+        const FunctionDecl* FD = CE->getDirectCallee();
+        if (!FD || !isPureCallee(FD, m_Visited))
+          return reject();
+        return true;
+      }
+      bool VisitCXXConstructExpr(CXXConstructExpr* CE) {
+        if (!CE->getConstructor()->isTrivial())
+          return reject();
+        return true;
+      }
+      bool VisitAsmStmt(AsmStmt*) { return reject(); }
+    };
+
+    /// Returns true if a call to FD depends on nothing but its arguments and
+    /// has no side effects, so that the reverse pass may evaluate it again.
+    /// FD is a free, non-variadic function taking its parameters by value,
+    /// which is declared const, or is a builtin without side effects, e.g.
+    /// the math functions of the C library, or else has a body checked by
+    /// PureBodyChecker. The functions without an available body are not.
+    bool isPureCallee(const FunctionDecl* FD,
+                      llvm::SmallPtrSetImpl<const FunctionDecl*>& Visited) {
+      if (isa<CXXMethodDecl>(FD) || FD->isVariadic())
+        return false;
+      for (const ParmVarDecl* PVD : FD->parameters())
+        if (passesByAddress(PVD->getType()))
+          return false;
+      if (FD->hasAttr<ConstAttr>())
+        return true;
+      if (unsigned ID = FD->getBuiltinID()) {
+        const Builtin::Context& Builtins = FD->getASTContext().BuiltinInfo;
+        return Builtins.isConst(ID) || Builtins.isConstWithoutErrno(ID);
+      }
+      const FunctionDecl* Def = nullptr;
+      if (!FD->hasBody(Def))
+        if (const FunctionDecl* Pattern = FD->getTemplateInstantiationPattern())
+          Pattern->hasBody(Def);
+      if (!Def)
+        return false;
+      // A recursive call is pure if the rest of the body is.
+      if (!Visited.insert(Def).second)
+        return true;
+      PureBodyChecker Checker(Visited);
+      Checker.TraverseStmt(Def->getBody());
+      return Checker.Pure;
+    }
+
+    bool isPureCallee(const FunctionDecl* FD) {
+      llvm::SmallPtrSet<const FunctionDecl*, 8> Visited;
+      return isPureCallee(FD, Visited);
+    }
+
+    /// Collects the variables referenced by an expression.
+    class VarRefCollector : public RecursiveASTVisitor<VarRefCollector> {
+    public:
+      llvm::DenseSet<const VarDecl*> Vars;
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+          Vars.insert(VD);
+        return true;
+      }
+    };
+
+    /// Collects the variables which may be modified by a function: the ones
+    /// assigned or incremented, directly or through a subscript, and the ones
+    /// whose address escapes, i.e. is taken, passed by pointer or by
+    /// reference, or copied into another pointer or reference. The distinct
+    /// parameters are assumed not to alias.
+    class ModifiedVarsCollector
+        : public RecursiveASTVisitor<ModifiedVarsCollector> {
+    public:
+      llvm::DenseSet<const VarDecl*> Modified;
+      void markModified(const Expr* E) {
+        if (const VarDecl* VD = getBaseVar(E))
+          Modified.insert(VD);
+      }
+      void markEscaped(Expr* E) {
+        VarRefCollector Refs;
+        Refs.TraverseStmt(E);
+        Modified.insert(Refs.Vars.begin(), Refs.Vars.end());
+      }
+      bool VisitBinaryOperator(BinaryOperator* BO) {
+        if (!BO->isAssignmentOp())
+          return true;
+        markModified(BO->getLHS());
+        if (passesByAddress(BO->getLHS()->getType()))
+          markEscaped(BO->getRHS());
+        return true;
+      }
+      bool VisitUnaryOperator(UnaryOperator* UO) {
+        if (UO->isIncrementDecrementOp())
+          markModified(UO->getSubExpr());
+        else if (UO->getOpcode() == UO_AddrOf)
+          markEscaped(UO->getSubExpr());
+        return true;
+      }
+      bool VisitVarDecl(VarDecl* VD) {
+        // The elements of an array are copied from its initializer.
+        QualType T = VD->getType();
+        if (VD->getInit() && (T->isPointerType() || T->isReferenceType())) {
+          Modified.insert(VD);
+          markEscaped(VD->getInit());
+        }
+        return true;
+      }
+      bool VisitCallExpr(CallExpr* CE) {
+        const FunctionDecl* FD = CE->getDirectCallee();
+        for (unsigned i = 0, e = CE->getNumArgs(); i < e; ++i)
+          if (!FD || i >= FD->getNumParams() ||
+              passesByAddress(FD->getParamDecl(i)->getType()))
+            markEscaped(CE->getArg(i));
+        if (auto MCE = dyn_cast<CXXMemberCallExpr>(CE))
+          markEscaped(MCE->getImplicitObjectArgument());
+        return true;
+      }
+    };
+
+    /// Returns the row stride lda if E is i * lda + j or a permutation of it.
+    const Expr* matchRowMajorIndex(const Expr* E, const VarDecl* Row,
+                                   const VarDecl* Col) {
+      auto isVar = [](const Expr* E, const VarDecl* VD) {
+        auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+        return DRE && DRE->getDecl() == VD;
+      };
+      auto Add = dyn_cast<BinaryOperator>(E->IgnoreParenImpCasts());
+      if (!Add || Add->getOpcode() != BO_Add)
+        return nullptr;
+      const Expr* RowOffset = Add->getLHS();
+      if (isVar(RowOffset, Col))
+        RowOffset = Add->getRHS();
+      else if (!isVar(Add->getRHS(), Col))
+        return nullptr;
+      auto Mul = dyn_cast<BinaryOperator>(RowOffset->IgnoreParenImpCasts());
+      if (!Mul || Mul->getOpcode() != BO_Mul)
+        return nullptr;
+      if (isVar(Mul->getLHS(), Row))
+        return Mul->getRHS();
+      if (isVar(Mul->getRHS(), Row))
+        return Mul->getLHS();
+      return nullptr;
+    }
+
+    /// Checks that the expressions of a loop have no side effects and
+    /// collects the variables they read.
+    class PureExprChecker : public RecursiveASTVisitor<PureExprChecker> {
+    public:
+      bool Pure = true;
+      llvm::DenseSet<const VarDecl*> Reads;
+      bool reject() { return Pure = false; }
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+          Reads.insert(VD);
+        return true;
+      }
+      bool VisitBinaryOperator(BinaryOperator* BO) {
+        if (BO->isAssignmentOp() || BO->getOpcode() == BO_Comma)
+          return reject();
+        return true;
+      }
+      bool VisitUnaryOperator(UnaryOperator* UO) {
+        if (UO->isIncrementDecrementOp() || UO->getOpcode() == UO_AddrOf)
+          return reject();
+        return true;
+      }
+      // The reverse pass of a conditional operator stores the condition.
+      bool VisitConditionalOperator(ConditionalOperator*) { return reject(); }
+      // The calls are evaluated again in the reverse pass.
+      bool VisitCallExpr(CallExpr* CE) {
+        const FunctionDecl* FD = CE->getDirectCallee();
+        if (!FD || !isPureCallee(FD))
+          return reject();
+        return true;
+      }
+      bool TraverseLambdaExpr(LambdaExpr*) { return reject(); }
+      bool TraverseStmtExpr(StmtExpr*) { return reject(); }
+    };
+  } // end anonymous namespace
+
+  /// Returns true if the variables are available unchanged in the reverse pass
+  /// of FD: FD never modifies them, and they are parameters, globals or
+  /// locals declared at the top level of FD.
+  static bool areUnmodifiedReads(const FunctionDecl* FD,
+                                 const llvm::DenseSet<const VarDecl*>& Reads) {
+    ModifiedVarsCollector Collector;
+    Collector.TraverseStmt(FD->getBody());
+    llvm::DenseSet<const Decl*> TopLevel;
+    if (auto CS = dyn_cast_or_null<CompoundStmt>(FD->getBody()))
+      for (const Stmt* S : CS->body())
+        if (auto DS = dyn_cast<DeclStmt>(S))
+          TopLevel.insert(DS->decl_begin(), DS->decl_end());
+    for (const VarDecl* VD : Reads) {
+      if (Collector.Modified.count(VD))
+        return false;
+      if (!isa<ParmVarDecl>(VD) && !VD->hasGlobalStorage() &&
+          !TopLevel.count(VD))
+        return false;
+    }
+    return true;
+  }
+
+  /// Returns true if the variable of FS, a loop over LoopVar, stays within
+  /// [0, Stride): it starts at a nonnegative constant, only increases, and
+  /// the loop runs while it is less than Stride or than a constant no
+  /// greater than Stride.
+  static bool isWithinStride(const ForStmt* FS, const VarDecl* LoopVar,
+                             const Expr* Stride, const ASTContext& C) {
+    auto isLoopVar = [LoopVar](const Expr* E) {
+      auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+      return DRE && DRE->getDecl() == LoopVar;
+    };
+    llvm::APSInt Value;
+    if (!clad_compat::Expr_EvaluateAsInt(LoopVar->getInit(), Value, C) ||
+        Value.isNegative())
+      return false;
+    const Expr* Inc = FS->getInc()->IgnoreParens();
+    if (auto UO = dyn_cast<UnaryOperator>(Inc)) {
+      if (!UO->isIncrementOp())
+        return false;
+    } else {
+      auto CAO = cast<CompoundAssignOperator>(Inc);
+      if (CAO->getOpcode() != BO_AddAssign ||
+          !clad_compat::Expr_EvaluateAsInt(CAO->getRHS(), Value, C) ||
+          !Value.isStrictlyPositive())
+        return false;
+    }
+    auto Cond = dyn_cast<BinaryOperator>(FS->getCond()->IgnoreParens());
+    if (!Cond || Cond->getOpcode() != BO_LT || !isLoopVar(Cond->getLHS()))
+      return false;
+    const Expr* Bound = Cond->getRHS()->IgnoreParenImpCasts();
+    Stride = Stride->IgnoreParenImpCasts();
+    auto BoundDRE = dyn_cast<DeclRefExpr>(Bound);
+    auto StrideDRE = dyn_cast<DeclRefExpr>(Stride);
+    if (BoundDRE || StrideDRE)
+      return BoundDRE && StrideDRE &&
+             BoundDRE->getDecl() == StrideDRE->getDecl();
+    llvm::APSInt StrideValue;
+    return clad_compat::Expr_EvaluateAsInt(Bound, Value, C) &&
+           clad_compat::Expr_EvaluateAsInt(Stride, StrideValue, C) &&
+           Value.getExtValue() <= StrideValue.getExtValue();
+  }
+
+  /// Collects the loops, their variables, the reads and the writes of FS and
+  /// of the loops nested in it, as described by isIndependentLoop.
+  static bool
+  collectIndependentNest(const ForStmt* FS,
+                         llvm::SmallVectorImpl<const ForStmt*>& Loops,
+                         llvm::SmallVectorImpl<const VarDecl*>& LoopVars,
+                         PureExprChecker& Checker,
+                         llvm::DenseSet<const VarDecl*>& Written,
+                         const ASTContext& C) {
+    auto Init = dyn_cast_or_null<DeclStmt>(FS->getInit());
+    if (!Init || !Init->isSingleDecl() || FS->getConditionVariable() ||
+        !FS->getCond() || !FS->getInc())
+      return false;
+    auto LoopVar = dyn_cast<VarDecl>(Init->getSingleDecl());
+    if (!LoopVar || !LoopVar->getType()->isIntegerType() ||
+        !LoopVar->getInit())
+      return false;
+    Loops.push_back(FS);
+    LoopVars.push_back(LoopVar);
+    auto refersToLoopVar = [LoopVar](const Expr* E) {
+      auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+      return DRE && DRE->getDecl() == LoopVar;
+    };
+
+    Checker.TraverseStmt(const_cast<Expr*>(LoopVar->getInit()));
+    Checker.TraverseStmt(const_cast<Expr*>(FS->getCond()));
+    // The increment only steps the loop variable.
+    const Expr* Inc = FS->getInc()->IgnoreParens();
+    if (auto UO = dyn_cast<UnaryOperator>(Inc)) {
+      if (!UO->isIncrementDecrementOp() || !refersToLoopVar(UO->getSubExpr()))
+        return false;
+    } else if (auto CAO = dyn_cast<CompoundAssignOperator>(Inc)) {
+      if ((CAO->getOpcode() != BO_AddAssign &&
+           CAO->getOpcode() != BO_SubAssign) ||
+          !refersToLoopVar(CAO->getLHS()))
+        return false;
+      Checker.TraverseStmt(CAO->getRHS());
+    } else
+      return false;
+
+    llvm::SmallVector<const Stmt*, 8> Body;
+    if (auto CS = dyn_cast<CompoundStmt>(FS->getBody()))
+      Body.append(CS->body_begin(), CS->body_end());
+    else
+      Body.push_back(FS->getBody());
+    if (Body.size() == 1)
+      if (auto Inner = dyn_cast<ForStmt>(Body.front()))
+        return collectIndependentNest(Inner, Loops, LoopVars, Checker,
+                                      Written, C);
+
+    auto isLoopVar = [&LoopVars](const Expr* E) {
+      auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+      return DRE && llvm::is_contained(LoopVars, DRE->getDecl());
+    };
+    // Returns true if E is i or i * n + j, for the loop variables i and j.
+    // An injective i * n + j needs j to stay within [0, n).
+    auto isElementIndex = [&](const Expr* E, bool Injective) {
+      unsigned Depth = LoopVars.size();
+      if (isLoopVar(E))
+        return !Injective || Depth == 1;
+      if (Depth != 2 && Injective)
+        return false;
+      for (unsigned Row = 0; Row < Depth; ++Row)
+        for (unsigned Col = 0; Col < Depth; ++Col) {
+          if (Row == Col)
+            continue;
+          const Expr* Stride =
+              matchRowMajorIndex(E, LoopVars[Row], LoopVars[Col]);
+          if (!Stride)
+            continue;
+          if (!Injective ||
+              isWithinStride(Loops[Col], LoopVars[Col], Stride, C))
+            return true;
+        }
+      return false;
+    };
+    for (const Stmt* S : Body) {
+      auto E = dyn_cast<Expr>(S);
+      auto BO = E ? dyn_cast<BinaryOperator>(E->IgnoreParens()) : nullptr;
+      if (!BO)
+        return false;
+      BinaryOperatorKind Op = BO->getOpcode();
+      const Expr* LHS = BO->getLHS()->IgnoreParenImpCasts();
+      if (auto DRE = dyn_cast<DeclRefExpr>(LHS)) {
+        auto VD = dyn_cast<VarDecl>(DRE->getDecl());
+        if ((Op != BO_AddAssign && Op != BO_SubAssign) || !VD ||
+            llvm::is_contained(LoopVars, VD))
+          return false;
+        Written.insert(VD);
+      } else if (auto ASE = dyn_cast<ArraySubscriptExpr>(LHS)) {
+        auto Base =
+            dyn_cast<DeclRefExpr>(ASE->getBase()->IgnoreParenImpCasts());
+        if ((Op != BO_Assign && Op != BO_AddAssign && Op != BO_SubAssign) ||
+            !Base || !isa<VarDecl>(Base->getDecl()) ||
+            !isElementIndex(ASE->getIdx(), Op == BO_Assign))
+          return false;
+        Written.insert(cast<VarDecl>(Base->getDecl()));
+        // The strides must not change either.
+        Checker.TraverseStmt(ASE->getIdx());
+      } else
+        return false;
+      Checker.TraverseStmt(BO->getRHS());
+    }
+    return true;
+  }
+
+  /// Returns true if the iterations of FS, a loop of FD, are independent and
+  /// the values they read are still available once the forward pass is over,
+  /// so that the reverse pass can recompute them in a loop running forward.
+  /// FS may be a perfect nest of such loops. The innermost body must consist
+  /// of reductions into scalars (s += e, s -= e) and of updates of array
+  /// elements (y[i] += e, y[i] -= e), indexed by a loop variable or by a
+  /// row-major index i * n + j of two of them, with no side effects in the
+  /// right hand sides, whose calls are pure, see isPureCallee. An element may also be assigned (y[i] = e) if each
+  /// iteration assigns a distinct one: its index is the loop variable of a
+  /// single loop, or i * n + j in a nest of two loops where j runs within
+  /// [0, n), as in for (int j = 0; j < n; j++). The variables read by
+  /// the loops are never modified by FD, and are parameters, globals or
+  /// locals declared at the top level of FD.
+  static bool isIndependentLoop(const FunctionDecl* FD, const ForStmt* FS) {
+    llvm::SmallVector<const ForStmt*, 2> Loops;
+    llvm::SmallVector<const VarDecl*, 2> LoopVars;
+    PureExprChecker Checker;
+    // The accumulators and the outputs.
+    llvm::DenseSet<const VarDecl*> Written;
+    if (!collectIndependentNest(FS, Loops, LoopVars, Checker, Written,
+                                FD->getASTContext()) ||
+        !Checker.Pure)
+      return false;
+    for (const VarDecl* LoopVar : LoopVars)
+      Checker.Reads.erase(LoopVar);
+    for (const VarDecl* VD : Written)
+      if (Checker.Reads.count(VD))
+        return false;
+    return areUnmodifiedReads(FD, Checker.Reads);
+  }
+
+  namespace {
+    /// Checks that a loop body can run again in the reverse pass: it has no
+    /// nested loops nor jumps, calls only pure functions, see isPureCallee,
+    /// and writes only scalar variables. Collects the variables it reads,
+    /// writes and declares.
+    class ReplayChecker : public RecursiveASTVisitor<ReplayChecker> {
+    public:
+      bool Replayable = true;
+      llvm::DenseSet<const VarDecl*> Reads;
+      llvm::DenseSet<const VarDecl*> Written;
+      llvm::DenseSet<const VarDecl*> Locals;
+      bool reject() { return Replayable = false; }
+      bool markWritten(const Expr* E) {
+        auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+        auto VD = DRE ? dyn_cast<VarDecl>(DRE->getDecl()) : nullptr;
+        if (!VD || !VD->getType()->isArithmeticType())
+          return reject();
+        Written.insert(VD);
+        return true;
+      }
+      bool VisitStmt(Stmt* S) {
+        if (isa<ForStmt>(S) || isa<WhileStmt>(S) || isa<DoStmt>(S) ||
+            isa<SwitchStmt>(S) || isa<ReturnStmt>(S) || isa<BreakStmt>(S) ||
+            isa<ContinueStmt>(S) || isa<GotoStmt>(S) || isa<LabelStmt>(S))
+          return reject();
+        return true;
+      }
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+          Reads.insert(VD);
+        return true;
+      }
+      bool VisitVarDecl(VarDecl* VD) {
+        if (!VD->getType()->isArithmeticType())
+          return reject();
+        Locals.insert(VD);
+        return true;
+      }
+      bool VisitBinaryOperator(BinaryOperator* BO) {
+        if (BO->isAssignmentOp())
+          return markWritten(BO->getLHS());
+        return true;
+      }
+      bool VisitUnaryOperator(UnaryOperator* UO) {
+        if (UO->isIncrementDecrementOp())
+          return markWritten(UO->getSubExpr());
+        if (UO->getOpcode() == UO_AddrOf)
+          return reject();
+        return true;
+      }
+      bool VisitCallExpr(CallExpr* CE) {
+        const FunctionDecl* FD = CE->getDirectCallee();
+        if (!FD || !isPureCallee(FD))
+          return reject();
+        return true;
+      }
+      bool TraverseLambdaExpr(LambdaExpr*) { return reject(); }
+      bool TraverseStmtExpr(StmtExpr*) { return reject(); }
+    };
+  } // end anonymous namespace
+
+  /// Returns true if FS, a loop of FD, can be reversed by running it again
+  /// from a checkpoint up to each reversed iteration. FS must be an innermost
+  /// loop stepping its loop variable, see ReplayChecker. The scalars written by
+  /// its body are declared there, or are parameters or locals declared at the
+  /// top level of FD, so that the reverse pass can restore them. The other
+  /// variables it reads are available unchanged, as in isIndependentLoop.
+  static bool isReplayableLoop(const FunctionDecl* FD, const ForStmt* FS) {
+    auto Init = dyn_cast_or_null<DeclStmt>(FS->getInit());
+    if (!Init || !Init->isSingleDecl() || FS->getConditionVariable() ||
+        !FS->getCond() || !FS->getInc())
+      return false;
+    auto LoopVar = dyn_cast<VarDecl>(Init->getSingleDecl());
+    if (!LoopVar || !LoopVar->getType()->isIntegerType() ||
+        !LoopVar->getInit())
+      return false;
+    const Expr* Inc = FS->getInc()->IgnoreParens();
+    const Expr* Step = nullptr;
+    if (auto UO = dyn_cast<UnaryOperator>(Inc)) {
+      if (!UO->isIncrementDecrementOp())
+        return false;
+      Step = UO->getSubExpr();
+    } else if (auto CAO = dyn_cast<CompoundAssignOperator>(Inc)) {
+      if (CAO->getOpcode() != BO_AddAssign && CAO->getOpcode() != BO_SubAssign)
+        return false;
+      Step = CAO->getLHS();
+    } else
+      return false;
+    auto StepRef = dyn_cast<DeclRefExpr>(Step->IgnoreParenImpCasts());
+    if (!StepRef || StepRef->getDecl() != LoopVar)
+      return false;
+
+    ReplayChecker Checker;
+    Checker.TraverseStmt(const_cast<Stmt*>(FS->getBody()));
+    if (!Checker.Replayable || Checker.Written.count(LoopVar))
+      return false;
+    // The loop expressions only write the loop variable.
+    PureExprChecker Header;
+    Header.TraverseStmt(const_cast<Expr*>(LoopVar->getInit()));
+    Header.TraverseStmt(const_cast<Expr*>(FS->getCond()));
+    if (auto CAO = dyn_cast<CompoundAssignOperator>(Inc))
+      Header.TraverseStmt(CAO->getRHS());
+    if (!Header.Pure)
+      return false;
+
+    llvm::DenseSet<const Decl*> TopLevel;
+    if (auto CS = dyn_cast_or_null<CompoundStmt>(FD->getBody()))
+      for (const Stmt* S : CS->body())
+        if (auto DS = dyn_cast<DeclStmt>(S))
+          TopLevel.insert(DS->decl_begin(), DS->decl_end());
+    llvm::DenseSet<const VarDecl*> Reads = std::move(Header.Reads);
+    Reads.erase(LoopVar);
+    for (const VarDecl* VD : Checker.Reads)
+      if (VD != LoopVar && !Checker.Written.count(VD) &&
+          !Checker.Locals.count(VD))
+        Reads.insert(VD);
+    for (const VarDecl* VD : Checker.Written) {
+      if (Checker.Locals.count(VD))
+        continue;
+      if (!isa<ParmVarDecl>(VD) && !TopLevel.count(VD))
+        return false;
+      // Restored from the checkpoint before the loop runs again.
+      Reads.erase(VD);
+    }
+    return areUnmodifiedReads(FD, Reads);
+  }
+
+  namespace {
+    /// Counts the references to the variables in a statement.
+    class VarRefCounter : public RecursiveASTVisitor<VarRefCounter> {
+    public:
+      llvm::DenseMap<const VarDecl*, unsigned> Refs;
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+          ++Refs[VD];
+        return true;
+      }
+    };
+
+    /// Returns c if E is i, i + c, c + i or i - c, for the loop variable i
+    /// and an integer constant c.
+    llvm::Optional<int64_t> getLoopOffset(const Expr* E,
+                                          const VarDecl* LoopVar,
+                                          const ASTContext& C) {
+      auto isLoopVar = [LoopVar](const Expr* E) {
+        auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+        return DRE && DRE->getDecl() == LoopVar;
+      };
+      E = E->IgnoreParenImpCasts();
+      if (isLoopVar(E))
+        return 0;
+      auto BO = dyn_cast<BinaryOperator>(E);
+      if (!BO || (BO->getOpcode() != BO_Add && BO->getOpcode() != BO_Sub))
+        return llvm::None;
+      llvm::APSInt Offset;
+      if (isLoopVar(BO->getLHS()) &&
+          clad_compat::Expr_EvaluateAsInt(BO->getRHS(), Offset, C))
+        return BO->getOpcode() == BO_Add ? Offset.getExtValue()
+                                         : -Offset.getExtValue();
+      if (BO->getOpcode() == BO_Add && isLoopVar(BO->getRHS()) &&
+          clad_compat::Expr_EvaluateAsInt(BO->getLHS(), Offset, C))
+        return Offset.getExtValue();
+      return llvm::None;
+    }
+
+    /// An assignment to the element of an array at an offset from the loop
+    /// variable, A[i + c] op= v.
+    struct OffsetUpdate {
+      const VarDecl* Target = nullptr;
+      int64_t Offset = 0;
+      BinaryOperatorKind Op = BO_Assign;
+    };
+
+    OffsetUpdate matchOffsetUpdate(const Stmt* S,
+                                   const VarDecl* LoopVar,
+                                   const ASTContext& C) {
+      auto BO = dyn_cast<BinaryOperator>(S);
+      if (!BO || !BO->isAssignmentOp())
+        return {};
+      auto ASE = dyn_cast<ArraySubscriptExpr>(BO->getLHS()->IgnoreParens());
+      if (!ASE)
+        return {};
+      auto Base = dyn_cast<DeclRefExpr>(ASE->getBase()->IgnoreParenImpCasts());
+      auto Offset = getLoopOffset(ASE->getIdx(), LoopVar, C);
+      if (!Base || !isa<VarDecl>(Base->getDecl()) || !Offset)
+        return {};
+      return {cast<VarDecl>(Base->getDecl()), *Offset, BO->getOpcode()};
+    }
+
+    /// Checks that the references to a variable in a statement are reads of
+    /// its element at the loop variable, X[i].
+    class ElementReadChecker : public RecursiveASTVisitor<ElementReadChecker> {
+      const VarDecl* m_Var;
+      const VarDecl* m_LoopVar;
+      const ASTContext& m_Context;
+      unsigned m_Elements = 0;
+      unsigned m_Refs = 0;
+    public:
+      ElementReadChecker(const VarDecl* Var, const VarDecl* LoopVar,
+                         const ASTContext& C)
+          : m_Var(Var), m_LoopVar(LoopVar), m_Context(C) {}
+      bool VisitArraySubscriptExpr(ArraySubscriptExpr* ASE) {
+        auto Base =
+            dyn_cast<DeclRefExpr>(ASE->getBase()->IgnoreParenImpCasts());
+        auto Offset = getLoopOffset(ASE->getIdx(), m_LoopVar, m_Context);
+        if (Base && Base->getDecl() == m_Var && Offset && *Offset == 0)
+          ++m_Elements;
+        return true;
+      }
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (DRE->getDecl() == m_Var)
+          ++m_Refs;
+        return true;
+      }
+      bool onlyReadsElement(Stmt* S) {
+        TraverseStmt(S);
+        return m_Refs == m_Elements;
+      }
+    };
+
+    /// Returns true if A and B are X += r and X -= r, which leave X unchanged.
+    bool isCancellingPair(const Stmt* A, const Stmt* B, const VarDecl* LoopVar,
+                          const ASTContext& C) {
+      auto AddBO = dyn_cast<BinaryOperator>(A);
+      auto SubBO = dyn_cast<BinaryOperator>(B);
+      if (!AddBO || !SubBO || AddBO->getOpcode() != BO_AddAssign ||
+          SubBO->getOpcode() != BO_SubAssign)
+        return false;
+      auto AddR = dyn_cast<DeclRefExpr>(AddBO->getRHS()->IgnoreParenImpCasts());
+      auto SubR = dyn_cast<DeclRefExpr>(SubBO->getRHS()->IgnoreParenImpCasts());
+      if (!AddR || !SubR || AddR->getDecl() != SubR->getDecl())
+        return false;
+      auto AddL = dyn_cast<DeclRefExpr>(AddBO->getLHS()->IgnoreParens());
+      auto SubL = dyn_cast<DeclRefExpr>(SubBO->getLHS()->IgnoreParens());
+      if (AddL || SubL)
+        return AddL && SubL && AddL->getDecl() == SubL->getDecl();
+      OffsetUpdate AddU = matchOffsetUpdate(A, LoopVar, C);
+      OffsetUpdate SubU = matchOffsetUpdate(B, LoopVar, C);
+      return AddU.Target && AddU.Target == SubU.Target &&
+             AddU.Offset == SubU.Offset;
+    }
+  } // end anonymous namespace
+
+  bool ReverseModeVisitor::splitStencilUpdates(
+      CompoundStmt* Body, const VarDecl* LoopVar,
+      llvm::SmallVectorImpl<StencilTerm>& Terms, CompoundStmt*& Rest) {
+    llvm::SmallVector<Stmt*, 16> BodyStmts(Body->body_begin(),
+                                           Body->body_end());
+    unsigned N = BodyStmts.size();
+    // The variables declared by the body, with the position of the
+    // declaration.
+    llvm::DenseMap<const VarDecl*, unsigned> Declared;
+    VarRefCounter AllRefs;
+    llvm::DenseMap<const VarDecl*, unsigned> UpdateRefs;
+    llvm::SmallVector<OffsetUpdate, 16> Updates(N);
+    for (unsigned k = 0; k < N; ++k) {
+      if (auto DS = dyn_cast<DeclStmt>(BodyStmts[k]))
+        for (Decl* D : DS->decls())
+          if (auto VD = dyn_cast<VarDecl>(D))
+            Declared[VD] = k;
+      AllRefs.TraverseStmt(BodyStmts[k]);
+      OffsetUpdate U = matchOffsetUpdate(BodyStmts[k], LoopVar, m_Context);
+      if (U.Target && U.Op == BO_AddAssign) {
+        Updates[k] = U;
+        ++UpdateRefs[U.Target];
+      }
+    }
+
+    // The updates of the arrays which are not otherwise referenced by the
+    // body are moved to the terms of their offsets.
+    std::map<int64_t, llvm::SmallVector<unsigned, 4>> Moved;
+    llvm::SmallVector<bool, 16> IsMoved(N, false);
+    for (unsigned k = 0; k < N; ++k) {
+      const OffsetUpdate& U = Updates[k];
+      if (U.Target && !Declared.count(U.Target) &&
+          AllRefs.Refs[U.Target] == UpdateRefs[U.Target]) {
+        Moved[U.Offset].push_back(k);
+        IsMoved[k] = true;
+      }
+    }
+    if (Moved.empty() || (Moved.size() == 1 && Moved.count(0)))
+      return false;
+
+    // The declarations used by the given statements, transitively.
+    auto getNeededDecls = [&](llvm::ArrayRef<unsigned> Roots) {
+      llvm::SmallVector<bool, 16> Needed(N, false);
+      llvm::SmallVector<unsigned, 16> Worklist(Roots.begin(), Roots.end());
+      while (!Worklist.empty()) {
+        unsigned k = Worklist.pop_back_val();
+        VarRefCounter Counter;
+        Counter.TraverseStmt(BodyStmts[k]);
+        for (auto& Ref : Counter.Refs) {
+          auto It = Declared.find(Ref.first);
+          if (It != Declared.end() && It->second != k && !Needed[It->second]) {
+            Needed[It->second] = true;
+            Worklist.push_back(It->second);
+          }
+        }
+      }
+      return Needed;
+    };
+
+    // The moved updates run before the rest of the body. The values they use
+    // must not depend on it: the rest only modifies the variables they read
+    // through pairs of updates which cancel out, or the elements X[i] read by
+    // the same iteration before they are modified.
+    llvm::SmallVector<unsigned, 16> Others;
+    for (unsigned k = 0; k < N; ++k)
+      if (!IsMoved[k] && !isa<DeclStmt>(BodyStmts[k]))
+        Others.push_back(k);
+    llvm::SmallVector<bool, 16> Cancelled(N, false);
+    for (unsigned a = 0; a < Others.size(); ++a)
+      for (unsigned b = a + 1; b < Others.size() && !Cancelled[Others[a]]; ++b)
+        if (!Cancelled[Others[b]] &&
+            isCancellingPair(BodyStmts[Others[a]], BodyStmts[Others[b]],
+                             LoopVar, m_Context))
+          Cancelled[Others[a]] = Cancelled[Others[b]] = true;
+    // The variables modified by each statement of the rest.
+    llvm::DenseMap<unsigned, llvm::DenseSet<const VarDecl*>> Modified;
+    llvm::DenseSet<const VarDecl*> AllModified;
+    for (unsigned k : Others) {
+      if (Cancelled[k])
+        continue;
+      ModifiedVarsCollector Collector;
+      Collector.TraverseStmt(BodyStmts[k]);
+      AllModified.insert(Collector.Modified.begin(), Collector.Modified.end());
+      Modified[k] = std::move(Collector.Modified);
+    }
+    auto canReorder = [&](unsigned Pos) {
+      Stmt* S = BodyStmts[Pos];
+      if (auto DS = dyn_cast<DeclStmt>(S))
+        for (Decl* D : DS->decls())
+          if (AllModified.count(dyn_cast<VarDecl>(D)))
+            return false;
+      VarRefCounter Reads;
+      Reads.TraverseStmt(S);
+      for (auto& Read : Reads.Refs) {
+        const VarDecl* X = Read.first;
+        if (X == LoopVar || X == Updates[Pos].Target || Declared.count(X) ||
+            !AllModified.count(X))
+          continue;
+        ElementReadChecker Checker(X, LoopVar, m_Context);
+        if (!Checker.onlyReadsElement(S))
+          return false;
+        for (auto& M : Modified) {
+          if (!M.second.count(X))
+            continue;
+          OffsetUpdate U = matchOffsetUpdate(BodyStmts[M.first], LoopVar,
+                                             m_Context);
+          if (U.Target != X || U.Offset || M.first < Pos)
+            return false;
+        }
+      }
+      return true;
+    };
+
+    llvm::SmallVector<bool, 16> NeededByMoved(N, false);
+    for (auto& Group : Moved) {
+      llvm::SmallVector<bool, 16> Needed = getNeededDecls(Group.second);
+      StencilTerm Term;
+      Term.Offset = Group.first;
+      Stmts Split;
+      for (unsigned k = 0; k < N; ++k) {
+        bool IsUpdate = IsMoved[k] && Updates[k].Offset == Group.first;
+        if (!Needed[k] && !IsUpdate)
+          continue;
+        if (!canReorder(k)) {
+          Terms.clear();
+          return false;
+        }
+        if (IsUpdate)
+          Term.Updates.push_back(Split.size());
+        Split.push_back(BodyStmts[k]);
+        NeededByMoved[k] = NeededByMoved[k] || Needed[k];
+      }
+      Term.Body = MakeCompoundStmt(Split);
+      Terms.push_back(Term);
+    }
+    // The rest keeps the declarations it uses, or which are not used by the
+    // moved updates.
+    llvm::SmallVector<bool, 16> NeededByRest = getNeededDecls(Others);
+    Stmts Remaining;
+    for (unsigned k = 0; k < N; ++k)
+      if (!IsMoved[k] && (NeededByRest[k] || !NeededByMoved[k]))
+        Remaining.push_back(BodyStmts[k]);
+    Rest = MakeCompoundStmt(Remaining);
+    return true;
+  }
+
+  namespace {
+    /// Counts the references to a variable and the reads of its value.
+    class VarReadCounter : public RecursiveASTVisitor<VarReadCounter> {
+      const VarDecl* m_Var;
+    public:
+      unsigned Refs = 0;
+      unsigned Reads = 0;
+      VarReadCounter(const VarDecl* Var) : m_Var(Var) {}
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (DRE->getDecl() == m_Var)
+          ++Refs;
+        return true;
+      }
+      bool VisitImplicitCastExpr(ImplicitCastExpr* ICE) {
+        auto DRE = dyn_cast<DeclRefExpr>(ICE->getSubExpr()->IgnoreParens());
+        if (ICE->getCastKind() == CK_LValueToRValue && DRE &&
+            DRE->getDecl() == m_Var)
+          ++Reads;
+        return true;
+      }
+    };
+  } // end anonymous namespace
+
+  bool ReverseModeVisitor::BuildStencilGather(
+      DeclStmt* Init, Expr* Cond, Expr* Inc, llvm::ArrayRef<StencilTerm> Terms,
+      bool Parallel, const Expr* OrigCond,
+      llvm::SmallVectorImpl<Stmt*>& Loops) {
+    auto LoopVar = cast<VarDecl>(Init->getSingleDecl());
+    auto isLoopVar = [LoopVar](const Expr* E) {
+      auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+      return DRE && DRE->getDecl() == LoopVar;
+    };
+    auto CondBO = dyn_cast<BinaryOperator>(Cond->IgnoreParens());
+    auto IncUO = Inc ? dyn_cast<UnaryOperator>(Inc->IgnoreParens()) : nullptr;
+    if (!CondBO || CondBO->getOpcode() != BO_LT ||
+        !isLoopVar(CondBO->getLHS()) || !IncUO || !IncUO->isIncrementOp() ||
+        !isLoopVar(IncUO->getSubExpr()))
+      return false;
+    // The terms are evaluated at other values of the loop variable, which
+    // they may only read.
+    for (const StencilTerm& Term : Terms) {
+      VarReadCounter Counter(LoopVar);
+      Counter.TraverseStmt(Term.Body);
+      if (Counter.Refs != Counter.Reads)
+        return false;
+    }
+    Expr* Lo = LoopVar->getInit();
+    Expr* Hi = CondBO->getRHS();
+    QualType T = LoopVar->getType();
+    int64_t MinOffset = Terms.front().Offset;
+    int64_t MaxOffset = Terms.front().Offset;
+    for (const StencilTerm& Term : Terms) {
+      MinOffset = std::min(MinOffset, Term.Offset);
+      MaxOffset = std::max(MaxOffset, Term.Offset);
+    }
+    int64_t Width = MaxOffset - MinOffset;
+
+    auto BuildLiteral = [&](int64_t Value) {
+      Expr* Literal = ConstantFolder::synthesizeLiteral(T, m_Context,
+                                                        std::abs(Value));
+      return Value < 0 ? BuildOp(UO_Minus, Literal) : Literal;
+    };
+    // Returns E + C, folded if E is a constant.
+    auto BuildShifted = [&](Expr* E, int64_t C) {
+      llvm::APSInt Value;
+      if (clad_compat::Expr_EvaluateAsInt(E, Value, m_Context))
+        return BuildLiteral(Value.getExtValue() + C);
+      if (!C)
+        return Clone(E);
+      return BuildOp(C > 0 ? BO_Add : BO_Sub, Clone(E),
+                     BuildLiteral(std::abs(C)));
+    };
+    // Returns a copy of the term for the element J of the arrays it updates,
+    // which reads the values of the iteration J - c in the gather form, or
+    // of the iteration J otherwise.
+    auto BuildTerm = [&](const StencilTerm& Term, VarDecl* J, bool Gather) {
+      auto Cloned = cast<CompoundStmt>(Clone(Term.Body));
+      llvm::DenseMap<const VarDecl*, VarDecl*> Replacements;
+      for (unsigned i = 0, e = Term.Body->size(); i < e; ++i) {
+        auto DS = dyn_cast<DeclStmt>(Term.Body->body_begin()[i]);
+        if (!DS)
+          continue;
+        auto ClonedDS = cast<DeclStmt>(Cloned->body_begin()[i]);
+        for (auto D = DS->decl_begin(), CD = ClonedDS->decl_begin(),
+                  E = DS->decl_end();
+             D != E; ++D, ++CD)
+          if (auto VD = dyn_cast<VarDecl>(*D))
+            Replacements[VD] = cast<VarDecl>(*CD);
+      }
+      if (!Gather || !Term.Offset) {
+        Replacements[LoopVar] = J;
+        DeclRefRetargeter Retargeter(Replacements);
+        Retargeter.TraverseStmt(Cloned);
+        return Cloned;
+      }
+      DeclRefRetargeter Retargeter(Replacements);
+      Retargeter.TraverseStmt(Cloned);
+      // The updated elements are A[J], the reads of i become reads of J - c.
+      for (unsigned Pos : Term.Updates) {
+        auto BO = cast<BinaryOperator>(Cloned->body_begin()[Pos]);
+        auto ASE = cast<ArraySubscriptExpr>(BO->getLHS()->IgnoreParens());
+        Expr* Index = m_Sema.DefaultLvalueConversion(BuildDeclRef(J)).get();
+        if (ASE->getIdx() == ASE->getRHS())
+          ASE->setRHS(Index);
+        else
+          ASE->setLHS(Index);
+      }
+      std::function<void(Stmt*)> replaceReads = [&](Stmt* S) {
+        for (Stmt*& Child : S->children()) {
+          if (!Child)
+            continue;
+          auto ICE = dyn_cast<ImplicitCastExpr>(Child);
+          if (!ICE || ICE->getCastKind() != CK_LValueToRValue ||
+              !isLoopVar(ICE)) {
+            replaceReads(Child);
+            continue;
+          }
+          Expr* Read = BuildOp(Term.Offset > 0 ? BO_Sub : BO_Add,
+                               BuildDeclRef(J),
+                               BuildLiteral(std::abs(Term.Offset)));
+          if (isa<Expr>(S) && !isa<ArraySubscriptExpr>(S) &&
+              !isa<CallExpr>(S) && !isa<ParenExpr>(S))
+            Read = BuildParens(Read);
+          Child = Read;
+        }
+      };
+      replaceReads(Cloned);
+      return Cloned;
+    };
+    // Builds the declaration of the loop variable with the given initializer.
+    auto BuildIndex = [&](Expr* Value) {
+      auto IndexDS = cast<DeclStmt>(Clone(Init));
+      cast<VarDecl>(IndexDS->getSingleDecl())->setInit(Value);
+      return IndexDS;
+    };
+    // Builds the loop for (T J = From; J < To; J++) running the terms.
+    auto BuildLoop = [&](Expr* From, Expr* To, bool Gather) -> Stmt* {
+      DeclStmt* IndexDS = BuildIndex(From);
+      auto J = cast<VarDecl>(IndexDS->getSingleDecl());
+      Stmts Body;
+      for (const StencilTerm& Term : Terms)
+        Body.push_back(BuildTerm(Term, J, Gather));
+      auto Loop = new (m_Context) ForStmt(m_Context,
+                                          IndexDS,
+                                          BuildOp(BO_LT, BuildDeclRef(J), To),
+                                          nullptr,
+                                          BuildOp(UO_PostInc,
+                                                  BuildDeclRef(J)),
+                                          MakeCompoundStmt(Body),
+                                          noLoc,
+                                          noLoc,
+                                          noLoc);
+      return Parallel ? BuildParallelLoop(Loop, OrigCond) : Loop;
+    };
+    // A peeled iteration J = From, running the terms whose offsets c satisfy
+    // Applies(c).
+    auto BuildPeeled = [&](Expr* From,
+                           llvm::function_ref<bool(int64_t)> Applies) {
+      DeclStmt* IndexDS = BuildIndex(From);
+      auto J = cast<VarDecl>(IndexDS->getSingleDecl());
+      Stmts Body;
+      Body.push_back(IndexDS);
+      for (const StencilTerm& Term : Terms)
+        if (Applies(Term.Offset))
+          Body.push_back(BuildTerm(Term, J, /*Gather*/ true));
+      return MakeCompoundStmt(Body);
+    };
+
+    // The element j receives the terms of the iterations j - c in [lo, hi).
+    // All of them apply in [lo + max c, hi + min c), the first and the last
+    // elements are peeled. This needs at least max c - min c iterations.
+    Stmts GatherStmts;
+    for (int64_t t = 0; t < Width; ++t)
+      GatherStmts.push_back(
+          BuildPeeled(BuildShifted(Lo, MinOffset + t),
+                      [&](int64_t C) { return C <= MinOffset + t; }));
+    GatherStmts.push_back(BuildLoop(BuildShifted(Lo, MaxOffset),
+                                    BuildShifted(Hi, MinOffset),
+                                    /*Gather*/ true));
+    for (int64_t t = 0; t < Width; ++t)
+      GatherStmts.push_back(
+          BuildPeeled(BuildShifted(Hi, MinOffset + t),
+                      [&](int64_t C) { return C > MinOffset + t; }));
+    if (!Width) {
+      Loops.append(GatherStmts.begin(), GatherStmts.end());
+      return true;
+    }
+    llvm::APSInt LoValue, HiValue;
+    if (clad_compat::Expr_EvaluateAsInt(Lo, LoValue, m_Context) &&
+        clad_compat::Expr_EvaluateAsInt(Hi, HiValue, m_Context)) {
+      if (HiValue.getExtValue() - LoValue.getExtValue() >= Width)
+        Loops.append(GatherStmts.begin(), GatherStmts.end());
+      else
+        Loops.push_back(BuildLoop(Clone(Lo), Clone(Hi), /*Gather*/ false));
+      return true;
+    }
+    // The shorter loops compute the terms in place.
+    Expr* IsLong = BuildOp(BO_LE, BuildShifted(Lo, Width), Clone(Hi));
+    Loops.push_back(clad_compat::IfStmt_Create(m_Context,
+                                               noLoc,
+                                               /*IsConstexpr*/ false,
+                                               nullptr,
+                                               nullptr,
+                                               IsLong,
+                                               noLoc,
+                                               noLoc,
+                                               MakeCompoundStmt(GatherStmts),
+                                               noLoc,
+                                               BuildLoop(Clone(Lo),
+                                                         Clone(Hi),
+                                                         /*Gather*/ false)));
+    return true;
+  }
+
+  namespace {
+    /// A loop for (int i = Lo; i < Hi; i++) whose body is a single statement.
+    struct CountedLoop {
+      const VarDecl* Var;
+      const Expr* Lo;
+      const Expr* Hi;
+      const Stmt* Body;
+    };
+
+    llvm::Optional<CountedLoop> matchCountedLoop(const Stmt* S) {
+      auto FS = dyn_cast<ForStmt>(S);
+      auto Init = FS ? dyn_cast_or_null<DeclStmt>(FS->getInit()) : nullptr;
+      if (!Init || !Init->isSingleDecl() || FS->getConditionVariable() ||
+          !FS->getCond() || !FS->getInc())
+        return llvm::None;
+      auto Var = dyn_cast<VarDecl>(Init->getSingleDecl());
+      if (!Var || !Var->getType()->isIntegerType() || !Var->getInit())
+        return llvm::None;
+      auto isVar = [Var](const Expr* E) {
+        auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+        return DRE && DRE->getDecl() == Var;
+      };
+      auto Cond = dyn_cast<BinaryOperator>(FS->getCond()->IgnoreParens());
+      auto Inc = dyn_cast<UnaryOperator>(FS->getInc()->IgnoreParens());
+      if (!Cond || Cond->getOpcode() != BO_LT || !isVar(Cond->getLHS()) ||
+          !Inc || !Inc->isIncrementOp() || !isVar(Inc->getSubExpr()))
+        return llvm::None;
+      const Stmt* Body = FS->getBody();
+      if (auto CS = dyn_cast<CompoundStmt>(Body)) {
+        if (CS->size() != 1)
+          return llvm::None;
+        Body = CS->body_front();
+      }
+      return CountedLoop{Var, Var->getInit(), Cond->getRHS(), Body};
+    }
+
+    /// Returns X if E is X[i], for an array or a pointer X and the loop
+    /// variable i.
+    const DeclRefExpr* matchElement(const Expr* E, const VarDecl* LoopVar) {
+      auto ASE = dyn_cast<ArraySubscriptExpr>(E->IgnoreParenImpCasts());
+      if (!ASE)
+        return nullptr;
+      auto Idx = dyn_cast<DeclRefExpr>(ASE->getIdx()->IgnoreParenImpCasts());
+      auto Base = dyn_cast<DeclRefExpr>(ASE->getBase()->IgnoreParenImpCasts());
+      if (!Idx || Idx->getDecl() != LoopVar || !Base ||
+          !isa<VarDecl>(Base->getDecl()))
+        return nullptr;
+      return Base;
+    }
+  } // end anonymous namespace
+
+  Expr* ReverseModeVisitor::BuildKernelAdjointCall(const ForStmt* FS) {
+    auto Outer = matchCountedLoop(FS);
+    if (!Outer)
+      return nullptr;
+    // The matrix-vector product has a nested loop over the columns.
+    auto Inner = matchCountedLoop(Outer->Body);
+    const Stmt* Body = Inner ? Inner->Body : Outer->Body;
+    auto Update = dyn_cast<CompoundAssignOperator>(Body);
+    if (!Update || Update->getOpcode() != BO_AddAssign ||
+        !Update->getType()->isRealFloatingType())
+      return nullptr;
+    auto Mul =
+        dyn_cast<BinaryOperator>(Update->getRHS()->IgnoreParenImpCasts());
+    if (!Mul || Mul->getOpcode() != BO_Mul)
+      return nullptr;
+    const Expr* Factors[] = {Mul->getLHS(), Mul->getRHS()};
+    const VarDecl* I = Outer->Var;
+
+    // The values read by the kernel, which must be available in the reverse
+    // pass, and the variable written by the loop.
+    PureExprChecker Checker;
+    Checker.TraverseStmt(const_cast<Expr*>(Outer->Lo));
+    Checker.TraverseStmt(const_cast<Expr*>(Outer->Hi));
+    const DeclRefExpr* Out = nullptr;
+    llvm::SmallVector<const DeclRefExpr*, 3> Operands;
+    llvm::StringRef Name;
+    const Expr* Stride = nullptr;
+    if (Inner) {
+      // y[i] += A[i * lda + j] * x[j]
+      const VarDecl* J = Inner->Var;
+      Checker.TraverseStmt(const_cast<Expr*>(Inner->Lo));
+      Checker.TraverseStmt(const_cast<Expr*>(Inner->Hi));
+      Out = matchElement(Update->getLHS(), I);
+      for (unsigned k = 0; k < 2 && !Stride; ++k) {
+        auto ASE =
+            dyn_cast<ArraySubscriptExpr>(Factors[k]->IgnoreParenImpCasts());
+        auto A = ASE ? dyn_cast<DeclRefExpr>(
+                           ASE->getBase()->IgnoreParenImpCasts())
+                     : nullptr;
+        const DeclRefExpr* X = matchElement(Factors[1 - k], J);
+        if (!A || !isa<VarDecl>(A->getDecl()) || !X)
+          continue;
+        Stride = matchRowMajorIndex(ASE->getIdx(), I, J);
+        Operands = {A, X};
+      }
+      if (!Stride)
+        return nullptr;
+      Checker.TraverseStmt(const_cast<Expr*>(Stride));
+      Name = "gemv_loop_pullback";
+    } else if (isa<DeclRefExpr>(Update->getLHS()->IgnoreParens())) {
+      // s += x[i] * y[i]
+      Out = cast<DeclRefExpr>(Update->getLHS()->IgnoreParens());
+      Operands = {matchElement(Factors[0], I), matchElement(Factors[1], I)};
+      Name = "dot_loop_pullback";
+    } else {
+      // y[i] += a * x[i]
+      Out = matchElement(Update->getLHS(), I);
+      unsigned k = matchElement(Factors[0], I) ? 0 : 1;
+      auto A = dyn_cast<DeclRefExpr>(Factors[1 - k]->IgnoreParenImpCasts());
+      Operands = {A, matchElement(Factors[k], I)};
+      if (A && !A->getType()->isRealFloatingType())
+        return nullptr;
+      Name = "axpy_loop_pullback";
+    }
+    if (!Out || !isa<VarDecl>(Out->getDecl()) || !Checker.Pure ||
+        llvm::is_contained(Operands, nullptr))
+      return nullptr;
+    for (const DeclRefExpr* Op : Operands) {
+      if (!isa<VarDecl>(Op->getDecl()))
+        return nullptr;
+      Checker.Reads.insert(cast<VarDecl>(Op->getDecl()));
+    }
+    // The bounds are the same for every iteration.
+    if (Checker.Reads.count(I) ||
+        (Inner && Checker.Reads.count(Inner->Var)) ||
+        Checker.Reads.count(cast<VarDecl>(Out->getDecl())) ||
+        !areUnmodifiedReads(m_Function, Checker.Reads))
+      return nullptr;
+
+    // The arrays are offset by the lower bounds of the loops.
+    auto Paren = [this](const Expr* E) {
+      Expr* Cloned = Clone(E);
+      if (isa<BinaryOperator>(E->IgnoreImpCasts()) ||
+          isa<ConditionalOperator>(E->IgnoreImpCasts()))
+        return BuildParens(Cloned);
+      return Cloned;
+    };
+    auto Offset = [&](Expr* Ptr, const Expr* Lo, const Expr* Stride) {
+      if (!Lo || ConstantFolder::evalsTo(Lo, m_Context, 0))
+        return Ptr;
+      Expr* Off = Paren(Lo);
+      if (Stride)
+        Off = BuildOp(BO_Mul, Off, Paren(Stride));
+      return BuildOp(BO_Add, Ptr, Off);
+    };
+    // The counts are unsigned, an empty range must not wrap around: they are
+    // Hi > Lo ? Hi - Lo : 0.
+    auto Count = [&](const CountedLoop& L) -> Expr* {
+      bool FromZero = ConstantFolder::evalsTo(L.Lo, m_Context, 0);
+      if (FromZero && L.Hi->getType()->isUnsignedIntegerType())
+        return Clone(L.Hi);
+      Expr* Trips = FromZero ? Clone(L.Hi)
+                             : BuildOp(BO_Sub, Paren(L.Hi), Paren(L.Lo));
+      Expr* Lo = FromZero ? ConstantFolder::synthesizeLiteral(m_Context.IntTy,
+                                                              m_Context, 0)
+                          : Paren(L.Lo);
+      Expr* NonEmpty = BuildOp(BO_GT, Paren(L.Hi), Lo);
+      Expr* Zero =
+          ConstantFolder::synthesizeLiteral(m_Context.IntTy, m_Context, 0);
+      return m_Sema.ActOnConditionalOp(noLoc, noLoc, NonEmpty, Trips, Zero)
+          .get();
+    };
+    // The adjoints are null for the variables which are not differentiated.
+    auto Adjoint = [&](const DeclRefExpr* DRE,
+                       llvm::function_ref<Expr*(Expr*)> Shift) -> Expr* {
+      Expr* dX = Visit(DRE).getExpr_dx();
+      QualType T = DRE->getType();
+      bool IsArray = T->isArrayType() || T->isPointerType();
+      if (dX && IsArray &&
+          (dX->getType()->isArrayType() || dX->getType()->isPointerType()))
+        return Shift(dX);
+      if (dX && !IsArray)
+        return BuildOp(UO_AddrOf, dX);
+      QualType ElemType =
+          IsArray ? QualType(T->getPointeeOrArrayElementType(), 0)
+                  : T.getNonReferenceType();
+      Expr* Null =
+          new (m_Context) CXXNullPtrLiteralExpr(m_Context.NullPtrTy, noLoc);
+      return m_Sema
+          .ImpCastExprToType(Null,
+                             m_Context.getPointerType(ElemType),
+                             CK_NullToPointer)
+          .get();
+    };
+    Expr* dOut = Visit(Out).getExpr_dx();
+    if (!dOut)
+      return nullptr;
+
+    llvm::SmallVector<Expr*, 8> Args;
+    auto ShiftRows = [&](Expr* Ptr) {
+      return Offset(Ptr, Outer->Lo, nullptr);
+    };
+    if (Name == "dot_loop_pullback") {
+      // dot_loop_pullback(x, y, n, _d_s, _d_x, _d_y)
+      for (const DeclRefExpr* Op : Operands)
+        Args.push_back(ShiftRows(Visit(Op).getExpr()));
+      Args.push_back(Count(*Outer));
+      Args.push_back(dOut);
+      for (const DeclRefExpr* Op : Operands)
+        Args.push_back(Adjoint(Op, ShiftRows));
+    } else if (Name == "axpy_loop_pullback") {
+      // axpy_loop_pullback(a, x, _d_y, n, &_d_a, _d_x)
+      Args.push_back(Visit(Operands[0]).getExpr());
+      Args.push_back(ShiftRows(Visit(Operands[1]).getExpr()));
+      Args.push_back(ShiftRows(dOut));
+      Args.push_back(Count(*Outer));
+      Args.push_back(Adjoint(Operands[0], ShiftRows));
+      Args.push_back(Adjoint(Operands[1], ShiftRows));
+    } else {
+      // gemv_loop_pullback(A, lda, x, _d_y, m, n, _d_A, _d_x)
+      auto ShiftMatrix = [&](Expr* Ptr) {
+        return Offset(Offset(Ptr, Outer->Lo, Stride), Inner->Lo, nullptr);
+      };
+      auto ShiftCols = [&](Expr* Ptr) {
+        return Offset(Ptr, Inner->Lo, nullptr);
+      };
+      Args.push_back(ShiftMatrix(Visit(Operands[0]).getExpr()));
+      Args.push_back(Clone(Stride));
+      Args.push_back(ShiftCols(Visit(Operands[1]).getExpr()));
+      Args.push_back(ShiftRows(dOut));
+      Args.push_back(Count(*Outer));
+      Args.push_back(Count(*Inner));
+      Args.push_back(Adjoint(Operands[0], ShiftMatrix));
+      Args.push_back(Adjoint(Operands[1], ShiftCols));
+    }
+    IdentifierInfo* II = &m_Context.Idents.get(Name);
+    DeclarationNameInfo DNInfo(DeclarationName(II), noLoc);
+    return m_Builder.findOverloadedDefinition(DNInfo, Args);
+  }
+
+  namespace {
+    /// Counts the assignments to array elements in the body of a loop nest
+    /// which are contiguous in its inner loop, A[i * n + j] or A[i][j], and
+    /// the ones which are contiguous in its outer loop, A[j * n + i] or
+    /// A[j][i], for the outer loop variable i and the inner one j.
+    class AccessOrderCounter : public RecursiveASTVisitor<AccessOrderCounter> {
+      const VarDecl* m_Outer;
+      const VarDecl* m_Inner;
+    public:
+      unsigned InnerContiguous = 0;
+      unsigned OuterContiguous = 0;
+      AccessOrderCounter(const VarDecl* Outer, const VarDecl* Inner)
+          : m_Outer(Outer), m_Inner(Inner) {}
+      bool isVar(const Expr* E, const VarDecl* VD) {
+        auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+        return DRE && DRE->getDecl() == VD;
+      }
+      /// Returns true if E is A[Row * n + Col] or A[Row][Col].
+      bool isElement(const Expr* E, const VarDecl* Row, const VarDecl* Col) {
+        auto ASE = dyn_cast<ArraySubscriptExpr>(E->IgnoreParens());
+        if (!ASE)
+          return false;
+        if (auto RowASE = dyn_cast<ArraySubscriptExpr>(
+                ASE->getBase()->IgnoreParenImpCasts()))
+          return isVar(RowASE->getIdx(), Row) && isVar(ASE->getIdx(), Col);
+        return matchRowMajorIndex(ASE->getIdx(), Row, Col);
+      }
+      bool VisitBinaryOperator(BinaryOperator* BO) {
+        if (!BO->isAssignmentOp())
+          return true;
+        if (isElement(BO->getLHS(), m_Outer, m_Inner))
+          ++InnerContiguous;
+        else if (isElement(BO->getLHS(), m_Inner, m_Outer))
+          ++OuterContiguous;
+        return true;
+      }
+    };
+  } // end anonymous namespace
+
+  Stmt* ReverseModeVisitor::reorderForLocality(ForStmt* Loop) {
+    Stmt* Body = Loop->getBody();
+    while (auto CS = dyn_cast<CompoundStmt>(Body)) {
+      if (CS->size() != 1)
+        return Loop;
+      Body = CS->body_front();
+    }
+    auto Inner = dyn_cast<ForStmt>(Body);
+    if (!Inner)
+      return Loop;
+    auto OuterInit = cast<DeclStmt>(Loop->getInit());
+    auto InnerInit = dyn_cast_or_null<DeclStmt>(Inner->getInit());
+    if (!InnerInit || !InnerInit->isSingleDecl())
+      return Loop;
+    auto OuterVar = cast<VarDecl>(OuterInit->getSingleDecl());
+    auto InnerVar = dyn_cast<VarDecl>(InnerInit->getSingleDecl());
+    // The bounds of the inner loop must not depend on the outer one.
+    VarRefCollector HeaderRefs;
+    HeaderRefs.TraverseStmt(InnerInit);
+    HeaderRefs.TraverseStmt(Inner->getCond());
+    HeaderRefs.TraverseStmt(Inner->getInc());
+    if (!InnerVar || HeaderRefs.Vars.count(OuterVar))
+      return Loop;
+    AccessOrderCounter Counter(OuterVar, InnerVar);
+    Counter.TraverseStmt(Inner->getBody());
+    if (Counter.OuterContiguous <= Counter.InnerContiguous)
+      return Loop;
+    // The iterations of the nest commute, the loops are swapped.
+    Stmt* NewInner = new (m_Context) ForStmt(m_Context,
+                                             OuterInit,
+                                             Loop->getCond(),
+                                             nullptr,
+                                             Loop->getInc(),
+                                             Inner->getBody(),
+                                             noLoc,
+                                             noLoc,
+                                             noLoc);
+    return new (m_Context) ForStmt(m_Context,
+                                   InnerInit,
+                                   Inner->getCond(),
+                                   nullptr,
+                                   Inner->getInc(),
+                                   NewInner,
+                                   noLoc,
+                                   noLoc,
+                                   noLoc);
+  }
+
+  namespace {
+    /// Collects the variables assigned or incremented in a statement, and the
+    /// ones it declares, in order.
+    class AssignedVarsCollector
+        : public RecursiveASTVisitor<AssignedVarsCollector> {
+    public:
+      llvm::SetVector<VarDecl*> Assigned;
+      llvm::SmallVector<VarDecl*, 4> Declared;
+      void markAssigned(Expr* E) {
+        if (auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()))
+          if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+            Assigned.insert(VD);
+      }
+      bool VisitBinaryOperator(BinaryOperator* BO) {
+        if (BO->isAssignmentOp())
+          markAssigned(BO->getLHS());
+        return true;
+      }
+      bool VisitUnaryOperator(UnaryOperator* UO) {
+        if (UO->isIncrementDecrementOp())
+          markAssigned(UO->getSubExpr());
+        return true;
+      }
+      bool VisitVarDecl(VarDecl* VD) {
+        Declared.push_back(VD);
+        return true;
+      }
+    };
+  } // end anonymous namespace
+
+  Stmt* ReverseModeVisitor::BuildReplayedIterations(ForStmt* Forward,
+                                                    Expr* CounterIncrement,
+                                                    Expr* Counter,
+                                                    Stmt* ReverseBody) {
+    auto Init = cast<DeclStmt>(Forward->getInit());
+    auto LoopVar = cast<VarDecl>(Init->getSingleDecl());
+    Stmts Body;
+    for (Stmt* S : cast<CompoundStmt>(Forward->getBody())->body())
+      if (S != CounterIncrement)
+        Body.push_back(S);
+    CompoundStmt* Iteration = MakeCompoundStmt(Body);
+    AssignedVarsCollector Collector;
+    Collector.TraverseStmt(Iteration);
+
+    // The variables of the enclosing scopes written by the loop are saved
+    // before it and restored before each replay:
+    // _t1 = s;
+    // for (...) { _t0++; ... s = ...; }
+    // ...
+    // for (; _t0; _t0--) { s = _t1; ... }
+    Stmts Replay;
+    for (VarDecl* VD : Collector.Assigned) {
+      if (VD == LoopVar || m_ReplayStores.count(VD) ||
+          llvm::is_contained(Collector.Declared, VD))
+        continue;
+      VarDecl* Checkpoint = GlobalStoreImpl(
+          getNonConstType(VD->getType(), m_Context, m_Sema), "_t");
+      addToCurrentBlock(
+          BuildOp(BO_Assign, BuildDeclRef(Checkpoint), BuildDeclRef(VD)),
+          forward);
+      Replay.push_back(
+          BuildOp(BO_Assign, BuildDeclRef(VD), BuildDeclRef(Checkpoint)));
+    }
+
+    // The copies of the iteration declare their own locals and read their own
+    // copy of the loop variable, declared along with the first one.
+    auto ReplayInit = cast<DeclStmt>(m_Builder.m_NodeCloner->Clone(Init));
+    auto ReplayVar = cast<VarDecl>(ReplayInit->getSingleDecl());
+    llvm::DenseMap<const VarDecl*, VarDecl*> Replacements;
+    Replacements[LoopVar] = ReplayVar;
+    auto CloneIteration = [&]() {
+      auto Copy = cast<CompoundStmt>(m_Builder.m_NodeCloner->Clone(Iteration));
+      AssignedVarsCollector CopyCollector;
+      CopyCollector.TraverseStmt(Copy);
+      for (unsigned i = 0, e = Collector.Declared.size(); i < e; ++i)
+        Replacements[Collector.Declared[i]] = CopyCollector.Declared[i];
+      DeclRefRetargeter Retargeter(Replacements);
+      Retargeter.TraverseStmt(Copy);
+      return Copy;
+    };
+    // The iterations preceding the reversed one run again:
+    // int i = 0;
+    // for (unsigned long _t2 = 1; _t2 < _t0; _t2++) { ...; i++; }
+    Replay.push_back(ReplayInit);
+    CompoundStmt* Preceding = CloneIteration();
+    Stmts PrecedingBody(Preceding->body_begin(), Preceding->body_end());
+    Expr* ReplayInc = cast<Expr>(m_Builder.m_NodeCloner->Clone(
+        Forward->getInc()));
+    DeclRefRetargeter Retargeter(Replacements);
+    Retargeter.TraverseStmt(ReplayInc);
+    PrecedingBody.push_back(ReplayInc);
+    QualType SizeTy = m_Context.getSizeType();
+    VarDecl* Step = BuildVarDecl(
+        SizeTy, "_t", ConstantFolder::synthesizeLiteral(SizeTy, m_Context, 1));
+    Expr* StepCond = BuildOp(BO_LT, BuildDeclRef(Step), Clone(Counter));
+    Replay.push_back(new (m_Context)
+                         ForStmt(m_Context,
+                                 BuildDeclStmt(Step),
+                                 StepCond,
+                                 nullptr,
+                                 BuildOp(UO_PostInc, BuildDeclRef(Step)),
+                                 MakeCompoundStmt(PrecedingBody),
+                                 noLoc,
+                                 noLoc,
+                                 noLoc));
+    // The reversed iteration stores its values, then runs backwards.
+    CompoundStmt* Reversed = CloneIteration();
+    Replay.append(Reversed->body_begin(), Reversed->body_end());
+    Retargeter.TraverseStmt(ReverseBody);
+    if (auto CS = dyn_cast<CompoundStmt>(ReverseBody))
+      Replay.append(CS->body_begin(), CS->body_end());
+    else
+      Replay.push_back(ReverseBody);
+    return MakeCompoundStmt(Replay);
+  }
+
+  namespace {
+    /// Removes from Body, and from the bodies of the loops nested in it, the
+    /// pairs of updates X += r and X -= r between which no statement
+    /// references X or modifies r. Returns the body without them.
+    Stmt* dropCancellingPairs(Stmt* Body, const VarDecl* LoopVar,
+                              ASTContext& C) {
+      if (auto FS = dyn_cast<ForStmt>(Body)) {
+        auto Init = dyn_cast_or_null<DeclStmt>(FS->getInit());
+        if (Init && Init->isSingleDecl())
+          if (auto InnerVar = dyn_cast<VarDecl>(Init->getSingleDecl()))
+            FS->setBody(dropCancellingPairs(FS->getBody(), InnerVar, C));
+        return FS;
+      }
+      auto CS = dyn_cast<CompoundStmt>(Body);
+      if (!CS)
+        return Body;
+      llvm::SmallVector<Stmt*, 16> BodyStmts;
+      for (Stmt* S : CS->body())
+        BodyStmts.push_back(dropCancellingPairs(S, LoopVar, C));
+      unsigned N = BodyStmts.size();
+      llvm::SmallVector<bool, 16> Dropped(N, false);
+      for (unsigned a = 0; a < N; ++a) {
+        auto AddBO = dyn_cast<BinaryOperator>(BodyStmts[a]);
+        if (!AddBO || AddBO->getOpcode() != BO_AddAssign)
+          continue;
+        const VarDecl* X = getBaseVar(AddBO->getLHS());
+        auto R = dyn_cast<DeclRefExpr>(AddBO->getRHS()->IgnoreParenImpCasts());
+        if (!X || !R)
+          continue;
+        for (unsigned b = a + 1; b < N; ++b) {
+          if (Dropped[b])
+            continue;
+          if (isCancellingPair(BodyStmts[a], BodyStmts[b], LoopVar, C)) {
+            Dropped[a] = Dropped[b] = true;
+            break;
+          }
+          VarRefCounter Refs;
+          Refs.TraverseStmt(BodyStmts[b]);
+          ModifiedVarsCollector Collector;
+          Collector.TraverseStmt(BodyStmts[b]);
+          if (Refs.Refs.count(X) ||
+              Collector.Modified.count(dyn_cast<VarDecl>(R->getDecl())))
+            break;
+        }
+      }
+      llvm::SmallVector<Stmt*, 16> Kept;
+      for (unsigned k = 0; k < N; ++k)
+        if (!Dropped[k])
+          Kept.push_back(BodyStmts[k]);
+      return clad_compat::CompoundStmt_Create(C, Kept, noLoc, noLoc);
+    }
+
+    /// Checks that the iterations of a reverse loop can run at the same time.
+    /// Besides the variables they declare, they may share variables which
+    /// are only read, only updated by X += v or X -= v, or only accessed as
+    /// their element at the loop variable, X[i], which no other iteration
+    /// accesses.
+    class ParallelLoopChecker
+        : public RecursiveASTVisitor<ParallelLoopChecker> {
+      const VarDecl* m_LoopVar;
+      const llvm::DenseSet<const VarDecl*>& m_Declared;
+      const ASTContext& m_Context;
+      /// The references to the shared variables: all of them, the targets of
+      /// assignments, and the elements at the loop variable.
+      llvm::DenseMap<const VarDecl*, unsigned> m_Refs;
+      llvm::DenseMap<const VarDecl*, unsigned> m_AssignRefs;
+      llvm::DenseMap<const VarDecl*, unsigned> m_ElementRefs;
+      /// The assignments to each shared variable.
+      llvm::MapVector<const VarDecl*, llvm::SmallVector<BinaryOperator*, 4>>
+          m_Assignments;
+      bool isShared(const VarDecl* VD) const {
+        return VD && !m_Declared.count(VD);
+      }
+      /// Rejects the loop if E refers to a shared variable, whose address it
+      /// lets escape.
+      bool rejectIfShared(Expr* E) {
+        VarRefCollector Refs;
+        Refs.TraverseStmt(E);
+        for (const VarDecl* VD : Refs.Vars)
+          if (isShared(VD))
+            return reject();
+        return true;
+      }
+    public:
+      bool Parallel = true;
+      /// The updates which other iterations may make at the same time.
+      llvm::DenseSet<const BinaryOperator*> Atomic;
+      /// The scalars only updated, whose updates are accumulated per thread.
+      llvm::SmallVector<VarDecl*, 4> Reductions;
+
+      ParallelLoopChecker(const VarDecl* LoopVar,
+                          const llvm::DenseSet<const VarDecl*>& Declared,
+                          const ASTContext& C)
+          : m_LoopVar(LoopVar), m_Declared(Declared), m_Context(C) {}
+      bool reject() { return Parallel = false; }
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        auto VD = dyn_cast<VarDecl>(DRE->getDecl());
+        if (isShared(VD))
+          ++m_Refs[VD];
+        return true;
+      }
+      bool VisitArraySubscriptExpr(ArraySubscriptExpr* ASE) {
+        auto Base =
+            dyn_cast<DeclRefExpr>(ASE->getBase()->IgnoreParenImpCasts());
+        auto VD = Base ? dyn_cast<VarDecl>(Base->getDecl()) : nullptr;
+        auto Offset = getLoopOffset(ASE->getIdx(), m_LoopVar, m_Context);
+        if (isShared(VD) && Offset && *Offset == 0)
+          ++m_ElementRefs[VD];
+        return true;
+      }
+      bool VisitBinaryOperator(BinaryOperator* BO) {
+        if (!BO->isAssignmentOp())
+          return true;
+        const VarDecl* VD = getBaseVar(BO->getLHS());
+        if (!VD || (isShared(VD) && passesByAddress(BO->getLHS()->getType())))
+          return reject();
+        if (isShared(VD)) {
+          ++m_AssignRefs[VD];
+          m_Assignments[VD].push_back(BO);
+        }
+        return true;
+      }
+      bool VisitUnaryOperator(UnaryOperator* UO) {
+        if (UO->isIncrementDecrementOp() &&
+            !m_Declared.count(getBaseVar(UO->getSubExpr())))
+          return reject();
+        if (UO->getOpcode() == UO_AddrOf)
+          return rejectIfShared(UO->getSubExpr());
+        return true;
+      }
+      bool VisitVarDecl(VarDecl* VD) {
+        QualType T = VD->getType();
+        if (VD->getInit() && (T->isPointerType() || T->isReferenceType()))
+          return rejectIfShared(VD->getInit());
+        return true;
+      }
+      bool VisitCallExpr(CallExpr* CE) {
+        const FunctionDecl* FD = CE->getDirectCallee();
+        for (unsigned i = 0, e = CE->getNumArgs(); i < e; ++i)
+          if (!FD || i >= FD->getNumParams() ||
+              passesByAddress(FD->getParamDecl(i)->getType()))
+            if (!rejectIfShared(CE->getArg(i)))
+              return false;
+        if (auto MCE = dyn_cast<CXXMemberCallExpr>(CE))
+          return rejectIfShared(MCE->getImplicitObjectArgument());
+        return true;
+      }
+      bool VisitCXXThisExpr(CXXThisExpr*) { return reject(); }
+      bool TraverseLambdaExpr(LambdaExpr*) { return reject(); }
+      bool TraverseStmtExpr(StmtExpr*) { return reject(); }
+
+      /// Classifies the updates of the shared variables once the loop body
+      /// is traversed.
+      void classifyUpdates() {
+        for (auto& A : m_Assignments) {
+          const VarDecl* VD = A.first;
+          if (m_ElementRefs.lookup(VD) == m_Refs.lookup(VD))
+            continue;
+          if (m_AssignRefs.lookup(VD) != m_Refs.lookup(VD)) {
+            reject();
+            return;
+          }
+          bool Scalar =
+              VD->getType().getNonReferenceType()->isArithmeticType();
+          for (BinaryOperator* BO : A.second) {
+            if (BO->getOpcode() != BO_AddAssign &&
+                BO->getOpcode() != BO_SubAssign) {
+              reject();
+              return;
+            }
+            if (!isa<DeclRefExpr>(BO->getLHS()->IgnoreParens()))
+              Scalar = false;
+          }
+          if (Scalar)
+            Reductions.push_back(const_cast<VarDecl*>(VD));
+          else
+            Atomic.insert(A.second.begin(), A.second.end());
+        }
+      }
+    };
+  } // end anonymous namespace
+
+  Stmt* ReverseModeVisitor::BuildParallelLoop(ForStmt* Loop, const Expr* E) {
+    auto LoopVar =
+        cast<VarDecl>(cast<DeclStmt>(Loop->getInit())->getSingleDecl());
+    // The pairs read the shared adjoints in between, as the other iterations
+    // update them.
+    Loop->setBody(dropCancellingPairs(Loop->getBody(), LoopVar, m_Context));
+    auto isLoopVar = [LoopVar](const Expr* E) {
+      auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+      return DRE && DRE->getDecl() == LoopVar;
+    };
+    if (!Loop->getCond() || !Loop->getInc())
+      return Loop;
+    auto Cond = dyn_cast<BinaryOperator>(Loop->getCond()->IgnoreParens());
+    auto Inc = dyn_cast<UnaryOperator>(Loop->getInc()->IgnoreParens());
+    if (!Cond || Cond->getOpcode() != BO_LT || !isLoopVar(Cond->getLHS()) ||
+        !Inc || !Inc->isIncrementOp() || !isLoopVar(Inc->getSubExpr()))
+      return Loop;
+    AssignedVarsCollector Vars;
+    Vars.TraverseStmt(Loop);
+    llvm::DenseSet<const VarDecl*> Declared;
+    Declared.insert(Vars.Declared.begin(), Vars.Declared.end());
+    ParallelLoopChecker Checker(LoopVar, Declared, m_Context);
+    Checker.TraverseStmt(Loop->getBody());
+    if (Checker.Parallel)
+      Checker.classifyUpdates();
+    if (!Checker.Parallel)
+      return Loop;
+
+    // Rebuilds the references to the variables inside the lambda, and the
+    // updates other threads may make at the same time as atomic ones.
+    struct LambdaRebuilder {
+      ReverseModeVisitor& V;
+      const llvm::DenseSet<const BinaryOperator*>& Atomic;
+      void rebuild(Stmt*& S) {
+        if (!S)
+          return;
+        for (Stmt*& Child : S->children())
+          rebuild(Child);
+        if (auto DRE = dyn_cast<DeclRefExpr>(S)) {
+          // Sema::BuildDeclRefExpr adds the captured fields of the variables
+          // declared outside of the lambda.
+          auto VD = dyn_cast<VarDecl>(DRE->getDecl());
+          if (VD && VD->hasLocalStorage())
+            S = V.BuildDeclRef(VD);
+        } else if (auto BO = dyn_cast<BinaryOperator>(S)) {
+          if (!Atomic.count(BO))
+            return;
+          Expr* RHS = BO->getRHS();
+          if (BO->getOpcode() == BO_SubAssign)
+            RHS = V.BuildOp(UO_Minus, V.BuildParens(RHS));
+          Expr* Args[] = {BO->getLHS(), RHS};
+          S = V.BuildCladCall("atomic_add", Args);
+        }
+      }
+    };
+    Expr* Lo = LoopVar->getInit();
+    Expr* Hi = Cond->getRHS();
+    Expr* Lambda = buildLambda(*this, m_Sema, E, [&] {
+      // The variables of the iterations are now declared in the lambda.
+      for (VarDecl* VD : Vars.Declared)
+        VD->setDeclContext(m_Sema.CurContext);
+      llvm::DenseMap<const VarDecl*, VarDecl*> Replacements;
+      for (VarDecl* VD : Checker.Reductions) {
+        QualType T = VD->getType().getNonReferenceType();
+        VarDecl* Private = BuildVarDecl(T, "_r", getZeroInit(T));
+        addToCurrentBlock(BuildDeclStmt(Private));
+        Replacements[VD] = Private;
+      }
+      // Each thread runs its own block of iterations.
+      QualType T = LoopVar->getType();
+      Expr* EndArgs[] = {Clone(Lo), Clone(Hi)};
+      VarDecl* End =
+          BuildVarDecl(T, "_t", BuildCladCall("thread_end", EndArgs));
+      Stmt* EndDecl = BuildDeclStmt(End);
+      Expr* BeginArgs[] = {Clone(Lo), Clone(Hi)};
+      VarDecl* Begin = BuildVarDecl(T, LoopVar->getIdentifier(),
+                                    BuildCladCall("thread_begin", BeginArgs));
+      Replacements[LoopVar] = Begin;
+      DeclRefRetargeter Retargeter(Replacements);
+      Retargeter.TraverseStmt(Loop->getInc());
+      Retargeter.TraverseStmt(Loop->getBody());
+      Loop->setInit(BuildDeclStmt(Begin));
+      Loop->setCond(BuildOp(BO_LT, BuildDeclRef(Begin), BuildDeclRef(End)));
+      LambdaRebuilder Rebuilder{*this, Checker.Atomic};
+      Stmt* Rebuilt = Loop;
+      Rebuilder.rebuild(EndDecl);
+      Rebuilder.rebuild(Rebuilt);
+      addToCurrentBlock(EndDecl);
+      addToCurrentBlock(Rebuilt);
+      for (VarDecl* VD : Checker.Reductions) {
+        Expr* Args[] = {BuildDeclRef(VD), BuildDeclRef(Replacements[VD])};
+        addToCurrentBlock(BuildCladCall("atomic_add", Args));
+      }
+    });
+    Expr* Args[] = {Lambda};
+    return BuildCladCall("parallel", Args);
+  }
+
   StmtDiff ReverseModeVisitor::VisitForStmt(const ForStmt* FS) {
     beginScope(Scope::DeclScope | Scope::ControlScope | Scope::BreakScope |
                Scope::ContinueScope);
+    // The loops computing a BLAS-like kernel are reversed by a call to its
+    // adjoint kernel. Neither they nor their inner loops store any value.
+    Expr* KernelCall = nullptr;
+    if (m_BlasAdjoints && !isVectorValued && !m_InKernelLoop)
+      KernelCall = BuildKernelAdjointCall(FS);
+    // The loop of an OpenMP parallel loop directive, not the loops nested in
+    // it, is reversed by a parallel loop if its iterations are independent.
+    bool InParallelDirective = m_InParallelDirective;
+    llvm::SaveAndRestore<bool> SaveInParallelDirective(m_InParallelDirective,
+                                                       false);
+    // The independent iterations are reversed in their original order, by a
+    // copy of the loop which recomputes the values instead of popping them.
+    // So are the loops nested in such a loop.
+    bool TapeFree = KernelCall || m_InTapeFreeLoop ||
+                    ((m_TapeFreeLoops || InParallelDirective) &&
+                     !isVectorValued && isIndependentLoop(m_Function, FS));
+    bool Parallel = InParallelDirective && TapeFree && !KernelCall &&
+                    !m_InTapeFreeLoop;
+    // The counts of the loop in the profile, if any.
+    const DerivativeProfile::LoopCounts* Profiled =
+        m_Profile ? m_Profile->getLoopCounts(
+                        DerivativeProfile::getSite(m_Function, FS))
+                  : nullptr;
+    // The other innermost loops may run again in the reverse pass, up to each
+    // reversed iteration, instead of storing their values on tapes. With a
+    // profile, the ones running few trips are, whatever the policy which
+    // allows recomputation, since the replays are quadratic in the trips.
+    bool ReplayLoop = m_ReplayLoops;
+    if (Profiled && m_TapeFreeLoops)
+      ReplayLoop = Profiled->Trips <= 16 * Profiled->Runs;
+    bool Replayed = !TapeFree && ReplayLoop && !isInsideLoop &&
+                    !isVectorValued && isReplayableLoop(m_Function, FS);
+    // The recompute-all policy falls back to tapes for the other loops.
+    if (m_ReplayLoops && ReplayLoop && !TapeFree && !Replayed &&
+        !isInsideLoop && !isVectorValued)
+      diag(DiagnosticsEngine::Warning, FS->getBeginLoc(),
+           "the values of the loop are stored on tapes, the recompute-all "
+           "policy only replays the innermost loops which write scalars and "
+           "call pure functions");
     // Counter that is used to count number of executed iterations of the loop,
     // to be able to use the same number of iterations in reverse pass.
     Expr* Counter = nullptr;
     Expr* Pop = nullptr;
     // If current loop is inside another loop, counter also has to be stored
     // in a tape.
-    if (isInsideLoop) {
+    if (isInsideLoop && !TapeFree) {
       auto zero = ConstantFolder::synthesizeLiteral(m_Context.getSizeType(),
                                                     m_Context,
                                                     0);
@@ -583,7 +2627,7 @@ namespace clad {
       addToCurrentBlock(CounterTape.Push, forward);
       Counter = CounterTape.Last();
       Pop = CounterTape.Pop;
-    } else
+    } else if (!TapeFree)
       Counter = GlobalStoreAndRef(getZeroInit(m_Context.IntTy),
                                   m_Context.getSizeType(),
                                   "_t",
@@ -615,9 +2659,35 @@ namespace clad {
 
     // Save the isInsideLoop value (we may be inside another loop).
     llvm::SaveAndRestore<bool> SaveIsInsideLoop(isInsideLoop);
+    bool isOutermost = !isInsideLoop;
     isInsideLoop = true;
+    // The tapes of the body receive a value per trip.
+    uint64_t ExpectedTrips = 0;
+    if (Profiled)
+      ExpectedTrips = (Profiled->Trips + m_ProfileEntries - 1) /
+                      m_ProfileEntries;
+    llvm::SaveAndRestore<uint64_t> SaveExpectedTrips(m_ExpectedTrips,
+                                                     ExpectedTrips);
+    llvm::SaveAndRestore<bool> SaveInTapeFreeLoop(m_InTapeFreeLoop, TapeFree);
+    llvm::SaveAndRestore<bool> SaveInReplayedLoop(m_InReplayedLoop, Replayed);
+    llvm::SaveAndRestore<bool> SaveInKernelLoop(m_InKernelLoop,
+                                                m_InKernelLoop || KernelCall);
+    // The augmented primals of the callees would store their values on tapes.
+    llvm::SaveAndRestore<bool> SaveSplitPullbacks(
+        m_SplitPullbacks, m_SplitPullbacks && !TapeFree && !Replayed);
+    // The loops without a counter have no iteration number to index the
+    // buffers with.
+    LoopBuffers Buffers{Counter, {}, {}};
+    if (m_BufferIndirect && !TapeFree) {
+      ModifiedVarsCollector Collector;
+      Collector.TraverseStmt(const_cast<ForStmt*>(FS));
+      Buffers.Modified = std::move(Collector.Modified);
+    }
+    llvm::SaveAndRestore<LoopBuffers*> SaveLoopBuffers(
+        m_LoopBuffers, m_BufferIndirect && !TapeFree ? &Buffers : nullptr);
 
-    Expr* CounterIncrement = BuildOp(UO_PostInc, Counter);
+    Expr* CounterIncrement =
+        TapeFree ? nullptr : BuildOp(UO_PostInc, Counter);
     // Differentiate the increment expression of the for loop
     // incExprDiff.getExpr() is the reconstructed expression, incDiff.getStmt()
     // a block with all the intermediate statements used to reconstruct it on
@@ -685,18 +2755,6 @@ namespace clad {
                                             noLoc,
                                             noLoc);
 
-    // Create a condition testing counter for being zero, and its decrement.
-    // To match the number of iterations in the forward pass, the reverse loop
-    // will look like: for(; Counter; Counter--) ...
-    Expr* CounterCondition = m_Sema
-                                 .ActOnCondition(m_CurScope,
-                                                 noLoc,
-                                                 Counter,
-                                                 Sema::ConditionKind::Boolean)
-                                 .get()
-                                 .second;
-    Expr* CounterDecrement = BuildOp(UO_PostDec, Counter);
-
     beginBlock(reverse);
     // First, reverse the original loop increment expression, then loop's body.
     addToCurrentBlock(incDiff.getStmt_dx(), reverse);
@@ -706,20 +2764,111 @@ namespace clad {
     Stmt* ReverseResult = unwrapIfSingleStmt(ReverseBody);
     if (!ReverseResult)
       ReverseResult = new (m_Context) NullStmt(noLoc);
-    Stmt* Reverse = new (m_Context) ForStmt(m_Context,
-                                            nullptr,
-                                            CounterCondition,
-                                            condVarClone,
-                                            CounterDecrement,
-                                            ReverseResult,
-                                            noLoc,
-                                            noLoc,
-                                            noLoc);
+    // The reverse loops in the order they run.
+    llvm::SmallVector<Stmt*, 4> ReverseLoops;
+    if (KernelCall)
+      ReverseLoops.push_back(KernelCall);
+    else if (TapeFree) {
+      auto InitDS = cast<DeclStmt>(initResult.getStmt());
+      auto LoopVar = cast<VarDecl>(InitDS->getSingleDecl());
+      // Each reverse loop declares its own copy of the loop variable.
+      auto BuildReverseLoop =
+          [&](Stmt* LoopBody,
+              llvm::DenseMap<const VarDecl*, VarDecl*>& Replacements) {
+            auto RevInit = cast<DeclStmt>(Clone(InitDS));
+            Expr* RevCond = Clone(cond.getExpr());
+            Expr* RevInc = Clone(incResult);
+            Replacements[LoopVar] = cast<VarDecl>(RevInit->getSingleDecl());
+            DeclRefRetargeter Retargeter(Replacements);
+            Retargeter.TraverseStmt(RevCond);
+            Retargeter.TraverseStmt(RevInc);
+            Retargeter.TraverseStmt(LoopBody);
+            return new (m_Context) ForStmt(m_Context,
+                                           RevInit,
+                                           RevCond,
+                                           nullptr,
+                                           RevInc,
+                                           LoopBody,
+                                           noLoc,
+                                           noLoc,
+                                           noLoc);
+          };
+      // The stencil updates run first, in the gather form, followed by the
+      // loop running the rest of the body.
+      llvm::SmallVector<StencilTerm, 4> Terms;
+      CompoundStmt* Rest = nullptr;
+      if (m_StencilAdjoints &&
+          splitStencilUpdates(ReverseBody, LoopVar, Terms, Rest) &&
+          BuildStencilGather(InitDS, cond.getExpr(), incResult, Terms,
+                             Parallel, FS->getCond(), ReverseLoops))
+        ReverseResult = Rest->body_empty() ? nullptr : unwrapIfSingleStmt(Rest);
+      if (ReverseResult) {
+        llvm::DenseMap<const VarDecl*, VarDecl*> Replacements;
+        Stmt* Loop = BuildReverseLoop(ReverseResult, Replacements);
+        if (m_ReorderAdjointLoops)
+          Loop = reorderForLocality(cast<ForStmt>(Loop));
+        if (Parallel)
+          Loop = BuildParallelLoop(cast<ForStmt>(Loop), FS->getCond());
+        ReverseLoops.push_back(Loop);
+      }
+    } else {
+      // Create a condition testing counter for being zero, and its decrement.
+      // To match the number of iterations in the forward pass, the reverse
+      // loop will look like: for(; Counter; Counter--) ...
+      Expr* CounterCondition =
+          m_Sema
+              .ActOnCondition(m_CurScope,
+                              noLoc,
+                              Counter,
+                              Sema::ConditionKind::Boolean)
+              .get()
+              .second;
+      Expr* CounterDecrement = BuildOp(UO_PostDec, Counter);
+      if (Replayed)
+        ReverseResult = BuildReplayedIterations(cast<ForStmt>(Forward),
+                                                CounterIncrement,
+                                                Counter,
+                                                ReverseResult);
+      ReverseLoops.push_back(new (m_Context) ForStmt(m_Context,
+                                                     nullptr,
+                                                     CounterCondition,
+                                                     condVarClone,
+                                                     CounterDecrement,
+                                                     ReverseResult,
+                                                     noLoc,
+                                                     noLoc,
+                                                     noLoc));
+    }
+    // The tapes of the nest are sized once, before it runs.
+    if (isOutermost) {
+      for (auto& TR : m_TapeReserves) {
+        Expr* Args[] = {BuildDeclRef(TR.first),
+                        ConstantFolder::synthesizeLiteral(
+                            m_Context.getSizeType(), m_Context, TR.second)};
+        addToCurrentBlock(BuildCladCall("reserve", Args), forward);
+      }
+      m_TapeReserves.clear();
+    }
     addToCurrentBlock(Forward, forward);
+    if (m_InstrumentProfile && Counter) {
+      Expr* Args[] = {BuildProfileSite(FS), Clone(Counter)};
+      addToCurrentBlock(BuildCladCall("profile_loop", Args), forward);
+    }
     Forward = endBlock(forward);
+    // The statements of the block run in the reverse order: the buffers are
+    // allocated before the reverse loop and applied after it.
     addToCurrentBlock(Pop, reverse);
-    addToCurrentBlock(Reverse, reverse);
-    Reverse = endBlock(reverse);
+    for (auto& B : Buffers.Buffers) {
+      Expr* Args[] = {BuildDeclRef(B.first), B.second};
+      addToCurrentBlock(BuildCladCall("gather", Args), reverse);
+    }
+    for (Stmt* Loop : llvm::reverse(ReverseLoops))
+      addToCurrentBlock(Loop, reverse);
+    for (auto& B : Buffers.Buffers) {
+      Expr* Args[] = {BuildDeclRef(B.first), Clone(Counter)};
+      addToCurrentBlock(BuildCladCall("reserve", Args), reverse);
+    }
+    Stmt* Reverse = endBlock(reverse);
     endScope();
 
     return {unwrapIfSingleStmt(Forward), unwrapIfSingleStmt(Reverse)};
@@ -735,22 +2884,64 @@ namespace clad {
     return Clone(BL);
   }
 
+  StmtDiff ReverseModeVisitor::VisitOMPLoopDirective(
+      const OMPLoopDirective* D) {
+    // The iterations of an OpenMP loop may run in any order, they are
+    // differentiated in the order of a serial loop. The loop is wrapped into
+    // the captured regions of the directive, the collapsed loops are nested
+    // in it. The reverse loop of a parallel loop runs in parallel if its
+    // iterations are independent, see BuildParallelLoop.
+    const Stmt* S = D->getAssociatedStmt();
+    while (auto CS = dyn_cast_or_null<CapturedStmt>(S))
+      S = CS->getCapturedStmt();
+    auto FS = dyn_cast_or_null<ForStmt>(S);
+    // The copies made by firstprivate are initialized once per thread, which
+    // the serial loop cannot reproduce if they are modified.
+    bool HasFirstprivate = llvm::any_of(D->clauses(), [](const OMPClause* C) {
+      return isa<OMPFirstprivateClause>(C);
+    });
+    if (!FS || HasFirstprivate)
+      return VisitStmt(D);
+    OpenMPDirectiveKind Kind = D->getDirectiveKind();
+    llvm::SaveAndRestore<bool> SaveInParallelDirective(
+        m_InParallelDirective, m_ParallelLoops &&
+                                   isOpenMPParallelDirective(Kind) &&
+                                   isOpenMPWorksharingDirective(Kind));
+    return VisitForStmt(FS);
+  }
+
   StmtDiff ReverseModeVisitor::VisitReturnStmt(const ReturnStmt* RS) {
-    // Initially, df/df = 1.
+    // Initially, df/df = 1, or the seed in pullbacks.
     const Expr* value = RS->getRetValue();
     QualType type = value->getType();
-    auto dfdf =
-        ConstantFolder::synthesizeLiteral(m_Context.IntTy, m_Context, 1);
-    ExprResult tmp = dfdf;
-    dfdf = m_Sema
-               .ImpCastExprToType(tmp.get(),
-                                  type,
-                                  m_Sema.PrepareScalarCast(tmp, type))
-               .get();
+    Expr* dfdf = nullptr;
+    if (isPullback)
+      dfdf = BuildDeclRef(m_Seed);
+    else {
+      dfdf = ConstantFolder::synthesizeLiteral(m_Context.IntTy, m_Context, 1);
+      ExprResult tmp = dfdf;
+      dfdf = m_Sema
+                 .ImpCastExprToType(tmp.get(),
+                                    type,
+                                    m_Sema.PrepareScalarCast(tmp, type))
+                 .get();
+    }
     auto ReturnResult = DifferentiateSingleExpr(value, dfdf);
     StmtDiff ReturnDiff = ReturnResult.first;
     StmtDiff ExprDiff = ReturnResult.second;
     Stmt* Reverse = ReturnDiff.getStmt_dx();
+    // The passes of a split pullback are separate functions, the only return
+    // is the last statement and there is nothing to skip.
+    if (isAugmentedPrimal) {
+      for (Stmt* S : cast<CompoundStmt>(ReturnDiff.getStmt())->body())
+        addToCurrentBlock(S, forward);
+      return m_Sema.ActOnReturnStmt(noLoc, ExprDiff.getExpr(), m_CurScope)
+          .get();
+    }
+    if (isReverseOnly) {
+      addToCurrentBlock(Reverse, reverse);
+      return StmtDiff();
+    }
     // If the original function returns at this point, some part of the reverse
     // pass (corresponding to other branches that do not return here) must be
     // skipped. We create a label in the reverse pass and jump to it via goto.
@@ -770,6 +2961,10 @@ namespace clad {
                 forward,
                 m_Function->getNameAsString() + "_return",
                 /*force*/ true);
+    // All the values of the arguments are on the tapes now, the derivatives
+    // replace them at once.
+    for (Stmt* S : m_BatchCalls)
+      addToCurrentBlock(S, forward);
     // Create goto to the label.
     return m_Sema.ActOnGotoStmt(noLoc, noLoc, LD).get();
   }
@@ -823,7 +3018,10 @@ namespace clad {
       result = BuildArraySubscript(target, reverseIndices);
     // Create the (target += dfdx) statement.
     if (dfdx()) {
-      auto add_assign = BuildOp(BO_AddAssign, result, dfdx());
+      Expr* Updated = result;
+      if (result != target && isBufferedUpdate(Base, Indices))
+        Updated = BuildBufferedUpdate(target, reverseIndices[0]);
+      auto add_assign = BuildOp(BO_AddAssign, Updated, dfdx());
       // Add it to the body statements.
       addToCurrentBlock(add_assign, reverse);
     }
@@ -897,6 +3095,416 @@ namespace clad {
     return StmtDiff(Clone(FL));
   }
 
+  namespace {
+    /// Measures the returned expression of a candidate for inlining and checks
+    /// that it can be spliced into the caller.
+    class InlineCandidateChecker
+        : public RecursiveASTVisitor<InlineCandidateChecker> {
+      const FunctionDecl* m_FD;
+    public:
+      unsigned Size = 0;
+      bool Inlinable = true;
+      InlineCandidateChecker(const FunctionDecl* FD) : m_FD(FD) {}
+      bool VisitStmt(Stmt* S) {
+        ++Size;
+        // Lambdas, statement expressions and 'this' would need the callee's
+        // context.
+        if (isa<LambdaExpr>(S) || isa<StmtExpr>(S) || isa<CXXThisExpr>(S))
+          Inlinable = false;
+        return Inlinable;
+      }
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        // References are rebuilt by name in the caller, only the parameters
+        // are guaranteed to refer to the same declarations.
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+          Inlinable = isa<ParmVarDecl>(VD) && VD->getDeclContext() == m_FD;
+        return Inlinable;
+      }
+      bool VisitBinaryOperator(BinaryOperator* BO) {
+        Inlinable = !BO->isAssignmentOp();
+        return Inlinable;
+      }
+      bool VisitUnaryOperator(UnaryOperator* UO) {
+        Inlinable = !UO->isIncrementDecrementOp() &&
+                    UO->getOpcode() != UO_AddrOf;
+        return Inlinable;
+      }
+    };
+  } // end anonymous namespace
+
+  /// Returns the expression returned by the definition of FD if the calls to
+  /// FD are worth inlining into the gradient: the body is a single return
+  /// statement of at most Threshold AST nodes, the parameters and the result
+  /// are floating point values and there is no custom derivative for FD.
+  static const Expr* getInlinableReturnValue(DerivativeBuilder& Builder,
+                                             const FunctionDecl* FD,
+                                             unsigned Threshold) {
+    const FunctionDecl* Def = nullptr;
+    if (!Threshold || !FD->hasBody(Def) || Def->isVariadic() ||
+        isa<CXXMethodDecl>(Def) || !Def->getReturnType()->isRealFloatingType())
+      return nullptr;
+    for (const ParmVarDecl* PVD : Def->parameters())
+      if (!PVD->getType()->isRealFloatingType())
+        return nullptr;
+    auto Body = dyn_cast<CompoundStmt>(Def->getBody());
+    if (!Body || Body->size() != 1)
+      return nullptr;
+    auto RS = dyn_cast<ReturnStmt>(Body->body_front());
+    if (!RS || !RS->getRetValue())
+      return nullptr;
+    std::string Name = FD->getNameAsString();
+    if (Builder.isCustomDerivativeDeclared(Name + "_darg0") ||
+        Builder.isCustomDerivativeDeclared(Name + "_grad"))
+      return nullptr;
+    InlineCandidateChecker Checker(Def);
+    Checker.TraverseStmt(const_cast<Expr*>(RS->getRetValue()));
+    if (!Checker.Inlinable || Checker.Size > Threshold)
+      return nullptr;
+    return RS->getRetValue();
+  }
+
+  /// Returns true if the calls to FD can be differentiated by calling the
+  /// pullback of FD: either a custom one or one produced by clad, if FD has no
+  /// other custom derivative.
+  static bool isPullbackCandidate(DerivativeBuilder& Builder,
+                                  const FunctionDecl* FD) {
+    if (FD->isVariadic() || isa<CXXMethodDecl>(FD) ||
+        !FD->getReturnType()->isRealFloatingType())
+      return false;
+    for (const ParmVarDecl* PVD : FD->parameters())
+      if (!PVD->getType()->isRealFloatingType())
+        return false;
+    std::string Name = FD->getNameAsString();
+    if (Builder.isCustomDerivativeDeclared(Name + "_pullback"))
+      return true;
+    if ((FD->getNumParams() == 1 &&
+         Builder.isCustomDerivativeDeclared(Name + "_darg0")) ||
+        Builder.isCustomDerivativeDeclared(Name + "_grad"))
+      return false;
+    return FD->hasBody();
+  }
+
+  /// Returns true if the pullback of FD can be split into the forward and the
+  /// reverse passes.
+  static bool isSplitCandidate(DerivativeBuilder& Builder,
+                               const FunctionDecl* FD) {
+    const FunctionDecl* Def = nullptr;
+    if (!FD->hasBody(Def) ||
+        Builder.isCustomDerivativeDeclared(FD->getNameAsString() + "_pullback"))
+      return false;
+    return hasSingleTrailingReturn(Def, /*AllowRecursion*/ false);
+  }
+
+  Expr* ReverseModeVisitor::BuildSplitPullbackCall(
+      const FunctionDecl* FD,
+      llvm::SmallVectorImpl<Expr*>& ReverseCallArgs,
+      FunctionDecl*& AugmentedPrimalFD,
+      llvm::SmallVectorImpl<VarDecl*>& Tapes) {
+    DiffRequest request{};
+    request.Function = FD;
+    request.BaseFunctionName = FD->getNameAsString();
+    request.Mode = DiffMode::reverse;
+    // Silence diag outputs in nested derivation process.
+    request.VerboseDiags = false;
+    request.AugmentedPrimal = true;
+    FunctionDecl* ForwardFD = plugin::ProcessDiffRequest(m_CladPlugin, request);
+    if (!ForwardFD)
+      return nullptr;
+    request.AugmentedPrimal = false;
+    request.Pullback = true;
+    request.ReverseOnly = true;
+    FunctionDecl* ReverseFD = plugin::ProcessDiffRequest(m_CladPlugin, request);
+    if (!ReverseFD)
+      return nullptr;
+    // Both passes take the same tapes after their other parameters, they are
+    // declared in the caller and live across the calls.
+    for (unsigned i = FD->getNumParams(), e = ForwardFD->getNumParams(); i < e;
+         ++i) {
+      QualType TapeType =
+          ForwardFD->getParamDecl(i)->getType().getNonReferenceType();
+      Tapes.push_back(MakeCladTape(TapeType));
+      ReverseCallArgs.push_back(BuildDeclRef(Tapes.back()));
+    }
+    assert(ReverseFD->getNumParams() == ReverseCallArgs.size() &&
+           "the passes do not agree on the tapes");
+    AugmentedPrimalFD = ForwardFD;
+    return m_Sema
+        .ActOnCallExpr(getCurrentScope(),
+                       BuildDeclRef(ReverseFD),
+                       noLoc,
+                       llvm::MutableArrayRef<Expr*>(ReverseCallArgs.data(),
+                                                    ReverseCallArgs.size()),
+                       noLoc)
+        .get();
+  }
+
+  Expr* ReverseModeVisitor::BuildBatchDerivativeCall(const FunctionDecl* FD,
+                                                     VarDecl* Tape) {
+    std::string Name = FD->getNameAsString() + "_darg0_batch";
+    if (!m_Builder.isCustomDerivativeDeclared(Name))
+      return nullptr;
+    IdentifierInfo* II = &m_Context.Idents.get(Name);
+    DeclarationNameInfo DNInfo(DeclarationName(II), noLoc);
+    llvm::SmallVector<Expr*, 1> BatchArgs{BuildDeclRef(Tape)};
+    return m_Builder.findOverloadedDefinition(DNInfo, BatchArgs);
+  }
+
+  Expr* ReverseModeVisitor::BuildCladCall(llvm::StringRef Name,
+                                          llvm::MutableArrayRef<Expr*> Args) {
+    LookupResult R = LookupCladTapeMethod(Name);
+    CXXScopeSpec CSS;
+    CSS.Extend(m_Context, GetCladNamespace(), noLoc, noLoc);
+    Expr* DRE = m_Sema.BuildDeclarationNameExpr(CSS, R, /*ADL*/ false).get();
+    return m_Sema.ActOnCallExpr(getCurrentScope(), DRE, noLoc, Args, noLoc)
+        .get();
+  }
+
+  Expr* ReverseModeVisitor::BuildProfileSite(const Stmt* S) {
+    std::string Site = DerivativeProfile::getSite(m_Function, S);
+    QualType CharTyConst = m_Context.CharTy.withConst();
+    QualType StrTy = clad_compat::getConstantArrayType(
+        m_Context,
+        CharTyConst,
+        llvm::APInt(32, Site.size() + 1),
+        nullptr,
+        ArrayType::Normal,
+        /*IndexTypeQuals*/ 0);
+    return StringLiteral::Create(m_Context,
+                                 Site,
+                                 StringLiteral::Ascii,
+                                 false,
+                                 StrTy,
+                                 noLoc);
+  }
+
+  namespace {
+    /// Finds the array subscripts in an expression.
+    class SubscriptFinder : public RecursiveASTVisitor<SubscriptFinder> {
+    public:
+      bool Found = false;
+      bool VisitArraySubscriptExpr(ArraySubscriptExpr*) {
+        Found = true;
+        return false;
+      }
+    };
+  } // end anonymous namespace
+
+  bool ReverseModeVisitor::isBufferedUpdate(
+      const Expr* Base, llvm::ArrayRef<const Expr*> Indices) const {
+    if (!m_LoopBuffers || isVectorValued || Indices.size() != 1)
+      return false;
+    // The adjoints of the arrays modified in the loop are read by the reverse
+    // pass of the assignments, which would miss the buffered updates.
+    const VarDecl* BaseVD = getBaseVar(Base);
+    if (!BaseVD || m_LoopBuffers->Modified.count(BaseVD) ||
+        !Indices[0]->getType()->isIntegerType())
+      return false;
+    // Only the indices read from other arrays are indirect, e.g. x[idx[i]].
+    SubscriptFinder Finder;
+    Finder.TraverseStmt(const_cast<Expr*>(Indices[0]));
+    return Finder.Found;
+  }
+
+  Expr* ReverseModeVisitor::BuildBufferedUpdate(Expr* Target, Expr* Index) {
+    QualType ElemType(Target->getType()->getPointeeOrArrayElementType(), 0);
+    QualType BufferType = GetCladScatterBufferOfType(ElemType);
+    VarDecl* Buffer = GlobalStoreImpl(BufferType, "_b");
+    // Add fake location, since Clang AST does assert(Loc.isValid()) somewhere.
+    Buffer->setLocation(m_Function->getLocation());
+    m_Sema.AddInitializerToDecl(Buffer, getZeroInit(BufferType), false);
+    m_LoopBuffers->Buffers.push_back({Buffer, Clone(Target)});
+    // The counter goes from the number of iterations down to 1 in the reverse
+    // pass, each iteration has its own slot.
+    Expr* One = ConstantFolder::synthesizeLiteral(m_Context.getSizeType(),
+                                                  m_Context,
+                                                  1);
+    Expr* Slot = BuildOp(BO_Sub, Clone(m_LoopBuffers->Counter), One);
+    Expr* Args[] = {BuildDeclRef(Buffer), Slot, Index};
+    return BuildCladCall("scatter", Args);
+  }
+
+  StmtDiff ReverseModeVisitor::InlineCallExpr(const CallExpr* CE,
+                                              const FunctionDecl* FD,
+                                              const Expr* RetVal) {
+    // The adjoints of the parameters are accumulated by the reverse pass of
+    // the callee's body, which has to precede the reverse pass of the
+    // arguments.
+    std::size_t insertionPoint = getCurrentBlock(reverse).size();
+    Stmts InlinedReverse;
+    llvm::SmallVector<const ParmVarDecl*, 4> Params;
+    llvm::SmallVector<VarDecl*, 4> ParamCopies;
+    for (unsigned i = 0, e = CE->getNumArgs(); i < e; ++i) {
+      const ParmVarDecl* PVD = FD->getParamDecl(i);
+      QualType ParamType = getNonConstType(PVD->getType(), m_Context, m_Sema);
+      VarDecl* dParam = BuildVarDecl(ParamType, "_r", getZeroInit(ParamType));
+      addToBlock(BuildDeclStmt(dParam), InlinedReverse);
+      StmtDiff ArgDiff = Visit(CE->getArg(i), BuildDeclRef(dParam));
+      // The parameter is a copy of the argument, which is not modified by the
+      // callee.
+      Expr* Copy = GlobalStoreAndRef(ArgDiff.getExpr(), ParamType, "_t",
+                                     /*force*/ true).getExpr();
+      auto CopyVD = cast<VarDecl>(cast<DeclRefExpr>(Copy)->getDecl());
+      m_DeclReplacements[PVD] = CopyVD;
+      m_Variables[CopyVD] = BuildDeclRef(dParam);
+      Params.push_back(PVD);
+      ParamCopies.push_back(CopyVD);
+    }
+
+    m_InlinedCallees.insert(FD);
+    beginBlock(reverse);
+    StmtDiff RetValDiff = Visit(RetVal, dfdx());
+    // endBlock reverses the statements, restore their order.
+    CompoundStmt* RetValReverse = endBlock(reverse);
+    InlinedReverse.append(RetValReverse->body_rbegin(),
+                          RetValReverse->body_rend());
+    m_InlinedCallees.erase(FD);
+
+    for (unsigned i = 0, e = Params.size(); i < e; ++i) {
+      m_DeclReplacements.erase(Params[i]);
+      m_Variables.erase(ParamCopies[i]);
+    }
+    auto& block = getCurrentBlock(reverse);
+    block.insert(std::next(std::begin(block), insertionPoint),
+                 InlinedReverse.begin(),
+                 InlinedReverse.end());
+    return StmtDiff(RetValDiff.getExpr());
+  }
+
+  namespace {
+    /// \returns g if CE is a call to clad::fixed_point(g, x, tol, max_iter,
+    /// args...) and g is a direct reference to a function with a parameter
+    /// per argument, null otherwise.
+    const FunctionDecl* getFixedPointFunction(const CallExpr* CE) {
+      const FunctionDecl* FD = CE->getDirectCallee();
+      if (!FD || FD->getNameAsString() != "fixed_point" ||
+          CE->getNumArgs() < 4)
+        return nullptr;
+      auto NSD = dyn_cast<NamespaceDecl>(FD->getDeclContext());
+      if (!NSD || NSD->getName() != "clad")
+        return nullptr;
+      const Expr* GE = CE->getArg(0)->IgnoreParenImpCasts();
+      if (auto UO = dyn_cast<UnaryOperator>(GE))
+        if (UO->getOpcode() == UO_AddrOf)
+          GE = UO->getSubExpr()->IgnoreParenImpCasts();
+      auto DRE = dyn_cast<DeclRefExpr>(GE);
+      if (!DRE)
+        return nullptr;
+      auto G = dyn_cast<FunctionDecl>(DRE->getDecl());
+      if (!G || G->getNumParams() != CE->getNumArgs() - 3)
+        return nullptr;
+      return G;
+    }
+  } // end anonymous namespace
+
+  StmtDiff ReverseModeVisitor::VisitFixedPointCall(const CallExpr* CE,
+                                                   const FunctionDecl* G) {
+    // At the solution x* = g(x*, args...), the implicit function theorem gives
+    //   dx*/dargs = dg/dargs / (1 - dg/dx),
+    // thus only the solution is stored and the reverse pass is:
+    //   double _grad0[N] = {};
+    //   g_grad(x*, args..., _grad0);
+    //   double _r_l0 = dfdx / (1 - _grad0[0]);
+    //   _r0 = _r_l0 * _grad0[1];
+    //   ...
+    // The initial guess, the tolerance and the bound on the iterations do not
+    // contribute to the solution.
+    llvm::SmallVector<Expr*, 8> CallArgs{Clone(CE->getArg(0))};
+    for (unsigned i = 1; i < 4; ++i)
+      CallArgs.push_back(Visit(CE->getArg(i)).getExpr());
+
+    std::size_t insertionPoint = getCurrentBlock(reverse).size();
+    QualType CEType = getNonConstType(CE->getType(), m_Context, m_Sema);
+    llvm::SmallVector<VarDecl*, 4> ArgResultDecls{};
+    llvm::SmallVector<Expr*, 8> GradArgs{};
+    for (unsigned i = 4, e = CE->getNumArgs(); i < e; ++i) {
+      Expr* dArg = StoreAndRef(nullptr, CEType, reverse, "_r", /*force*/ true);
+      ArgResultDecls.push_back(
+          cast<VarDecl>(cast<DeclRefExpr>(dArg)->getDecl()));
+      StmtDiff ArgDiff = Visit(CE->getArg(i), dArg);
+      ArgDiff = GlobalStoreAndRef(ArgDiff.getExpr());
+      CallArgs.push_back(ArgDiff.getExpr());
+      GradArgs.push_back(ArgDiff.getExpr_dx());
+    }
+    Expr* Call = m_Sema
+                     .ActOnCallExpr(getCurrentScope(),
+                                    Clone(CE->getCallee()),
+                                    noLoc,
+                                    llvm::MutableArrayRef<Expr*>(CallArgs),
+                                    noLoc)
+                     .get();
+    StmtDiff Solution = GlobalStoreAndRef(Call, CEType, "_t", /*force*/ true);
+    GradArgs.insert(GradArgs.begin(), Solution.getExpr_dx());
+
+    // Declare: Type _gradX[N] = {};
+    auto size_type_bits = m_Context.getIntWidth(m_Context.getSizeType());
+    auto ArrayType = clad_compat::getConstantArrayType(
+        m_Context,
+        CEType,
+        llvm::APInt(size_type_bits, G->getNumParams()),
+        nullptr,
+        ArrayType::ArraySizeModifier::Normal,
+        0); // No IndexTypeQualifiers
+    auto ZeroInitBraces = m_Sema.ActOnInitList(noLoc, {}, noLoc).get();
+    VarDecl* ResultDecl = BuildVarDecl(ArrayType,
+                                       CreateUniqueIdentifier(funcPostfix()),
+                                       ZeroInitBraces);
+    Expr* Result = BuildDeclRef(ResultDecl);
+    GradArgs.push_back(Result);
+
+    IdentifierInfo* II =
+        &m_Context.Idents.get(G->getNameAsString() + funcPostfix());
+    DeclarationNameInfo DNInfo(DeclarationName(II), noLoc);
+    Expr* GradCall = m_Builder.findOverloadedDefinition(DNInfo, GradArgs);
+    if (!GradCall) {
+      DiffRequest request{};
+      request.Function = G;
+      request.BaseFunctionName = G->getNameAsString();
+      request.Mode = DiffMode::reverse;
+      // Silence diag outputs in nested derivation process.
+      request.VerboseDiags = false;
+      FunctionDecl* derivedFD =
+          plugin::ProcessDiffRequest(m_CladPlugin, request);
+      if (!derivedFD) {
+        diag(DiagnosticsEngine::Warning,
+             CE->getBeginLoc(),
+             "function '%0' was not differentiated because clad failed to "
+             "differentiate it and no suitable overload was found in "
+             "namespace 'custom_derivatives'",
+             {G->getNameAsString()});
+        return StmtDiff(Solution.getExpr());
+      }
+      GradCall = m_Sema
+                     .ActOnCallExpr(getCurrentScope(),
+                                    BuildDeclRef(derivedFD),
+                                    noLoc,
+                                    llvm::MutableArrayRef<Expr*>(GradArgs),
+                                    noLoc)
+                     .get();
+    }
+
+    auto ithResult = [&](unsigned i) {
+      Expr* I = ConstantFolder::synthesizeLiteral(m_Context.getSizeType(),
+                                                  m_Context,
+                                                  i);
+      return m_Sema.CreateBuiltinArraySubscriptExpr(Result, noLoc, I, noLoc)
+          .get();
+    };
+    // The adjoint linear system of the scalar solve, (1 - dg/dx) * l = dfdx.
+    Expr* One = ConstantFolder::synthesizeLiteral(CEType, m_Context, 1);
+    Expr* Scale = BuildOp(BO_Sub, One, ithResult(0));
+    Expr* Lambda = BuildOp(BO_Div, dfdx(), BuildParens(Scale));
+    VarDecl* LambdaDecl = BuildVarDecl(CEType, "_r_l", Lambda);
+    auto& block = getCurrentBlock(reverse);
+    block.insert(std::next(std::begin(block), insertionPoint),
+                 {BuildDeclStmt(ResultDecl), GradCall,
+                  BuildDeclStmt(LambdaDecl)});
+    for (unsigned i = 0, e = ArgResultDecls.size(); i < e; ++i)
+      PerformImplicitConversionAndAssign(
+          ArgResultDecls[i],
+          BuildOp(BO_Mul, BuildDeclRef(LambdaDecl), ithResult(i + 1)));
+    return StmtDiff(Solution.getExpr());
+  }
+
   StmtDiff ReverseModeVisitor::VisitCallExpr(const CallExpr* CE) {
     const FunctionDecl* FD = CE->getDirectCallee();
     if (!FD) {
@@ -932,7 +3540,47 @@ namespace clad {
       return call;
     }
 
+    // Fixed-point solves are differentiated at their solution.
+    if (!isVectorValued)
+      if (const FunctionDecl* G = getFixedPointFunction(CE))
+        return VisitFixedPointCall(CE, G);
+
+    if (m_InstrumentProfile && FD->hasBody()) {
+      Expr* Site = BuildProfileSite(CE);
+      addToCurrentBlock(BuildCladCall("profile_call", Site), forward);
+    }
+
+    // Small callees are spliced into the gradient, avoiding the call to their
+    // gradient and the recomputation of their forward pass.
+    if (!isInsideLoop && !isVectorValued && FD != m_Function &&
+        CE->getNumArgs() == NArgs) {
+      // The profiled call sites run by at least half of the entries take
+      // larger callees, the ones never run none. A threshold of 0 keeps the
+      // inlining off.
+      unsigned Threshold = m_InlineThreshold;
+      const uint64_t* Calls = nullptr;
+      if (m_Profile)
+        Calls = m_Profile->getCallCount(
+            DerivativeProfile::getSite(m_Function, CE));
+      if (Calls && !*Calls)
+        Threshold = 0;
+      else if (Calls && 2 * *Calls >= m_ProfileEntries && Threshold)
+        Threshold = std::max(4 * m_InlineThreshold, 32u);
+      const FunctionDecl* Def = nullptr;
+      if (FD->hasBody(Def) && !m_InlinedCallees.count(Def))
+        if (const Expr* RetVal =
+                getInlinableReturnValue(m_Builder, FD, Threshold))
+          return InlineCallExpr(CE, Def, RetVal);
+    }
+
+    // The pullback accumulates dfdx * df/dargi directly into the adjoints of
+    // the arguments, without the _grad array and the scaling of its entries.
+    bool asPullback = m_UsePullbacks && !isVectorValued &&
+                      CE->getNumArgs() == NArgs &&
+                      isPullbackCandidate(m_Builder, FD);
     llvm::SmallVector<VarDecl*, 16> ArgResultDecls{};
+    // The tape storing the last argument, if it is stored on one.
+    VarDecl* ArgTape = nullptr;
     // Save current index in the current block, to potentially put some
     // statements there later.
     std::size_t insertionPoint = getCurrentBlock(reverse).size();
@@ -946,14 +3594,26 @@ namespace clad {
       // done to reduce cloning complexity and only clone once. The type is same
       // as the call expression as it is the type used to declare the _gradX
       // array
-      Expr* dArg = StoreAndRef(nullptr, CEType, reverse, "_r", /*force*/ true);
+      Expr* dArg = nullptr;
+      if (asPullback) {
+        // The adjoints passed to the pullback are zero-initialized and have
+        // the types of the parameters, they are declared before the call.
+        const ParmVarDecl* PVD = FD->getParamDecl(ArgResultDecls.size());
+        QualType dArgType = getNonConstType(PVD->getType(), m_Context, m_Sema);
+        VarDecl* dArgDecl =
+            BuildVarDecl(dArgType, "_r", getZeroInit(dArgType));
+        dArg = BuildDeclRef(dArgDecl);
+      } else
+        dArg = StoreAndRef(nullptr, CEType, reverse, "_r", /*force*/ true);
       ArgResultDecls.push_back(
           cast<VarDecl>(cast<DeclRefExpr>(dArg)->getDecl()));
       // Visit using uninitialized reference.
       StmtDiff ArgDiff = Visit(Arg, dArg);
       // Save cloned arg in a "global" variable, so that it is accesible from
       // the reverse pass.
+      std::size_t NumTapes = m_Tapes.size();
       ArgDiff = GlobalStoreAndRef(ArgDiff.getExpr());
+      ArgTape = m_Tapes.size() > NumTapes ? m_Tapes.back() : nullptr;
       CallArgs.push_back(ArgDiff.getExpr());
       ReverseCallArgs.push_back(ArgDiff.getExpr_dx());
     }
@@ -965,19 +3625,109 @@ namespace clad {
     // this arg (it is unlikely that we need gradient of a one-dimensional'
     // function).
     bool asGrad = true;
-    if (NArgs == 1) {
-      IdentifierInfo* II =
-          &m_Context.Idents.get(FD->getNameAsString() + "_darg0");
+    // With split pullbacks, the original call is replaced by the call to the
+    // augmented primal of FD, which records its intermediates on the tapes.
+    FunctionDecl* AugmentedPrimalFD = nullptr;
+    llvm::SmallVector<VarDecl*, 4> Tapes;
+    // With fused builtins, the value of the call is stored in the forward pass
+    // and the derivative is either computed along with it or takes it instead
+    // of calling the function again.
+    Expr* FusedCall = nullptr;
+    std::string PrimalPostfix;
+    if (m_FuseBuiltins && !asPullback && !isVectorValued &&
+        CEType->isRealFloatingType()) {
+      std::string Name = FD->getNameAsString();
+      if (NArgs == 1 && !isInsideLoop &&
+          m_Builder.isCustomDerivativeDeclared(Name + "_value_and_darg0")) {
+        // _tV = f_value_and_darg0(x, &_tD);
+        // ...
+        // _r0 = dfdx * _tD;
+        VarDecl* DerivativeDecl = GlobalStoreImpl(CEType, "_t");
+        llvm::SmallVector<Expr*, 2> FusedArgs{
+            Clone(CallArgs[0]),
+            BuildOp(UO_AddrOf, BuildDeclRef(DerivativeDecl))};
+        IdentifierInfo* II = &m_Context.Idents.get(Name + "_value_and_darg0");
+        DeclarationName name(II);
+        DeclarationNameInfo DNInfo(name, noLoc);
+        if (Expr* Fused = m_Builder.findOverloadedDefinition(DNInfo,
+                                                             FusedArgs)) {
+          FusedCall = GlobalStoreAndRef(Fused, CEType, "_t", true).getExpr();
+          OverloadedDerivedFn = BuildDeclRef(DerivativeDecl);
+          asGrad = false;
+        }
+      } else if (m_Builder.isCustomDerivativeDeclared(
+                     Name + (NArgs == 1 ? "_darg0" : "_grad") + "_primal")) {
+        llvm::SmallVector<Expr*, 4> PrimalArgs;
+        for (Expr* Arg : CallArgs)
+          PrimalArgs.push_back(Clone(Arg));
+        Expr* Primal =
+            m_Sema
+                .ActOnCallExpr(getCurrentScope(),
+                               Clone(CE->getCallee()),
+                               noLoc,
+                               llvm::MutableArrayRef<Expr*>(PrimalArgs),
+                               noLoc)
+                .get();
+        StmtDiff Value = GlobalStoreAndRef(Primal, CEType, "_t", true);
+        FusedCall = Value.getExpr();
+        ReverseCallArgs.push_back(Value.getExpr_dx());
+        PrimalPostfix = "_primal";
+      }
+    }
+    if (asPullback) {
+      // Call FD_pullback(args..., dfdx, &_r0, ..., &_rN).
+      ReverseCallArgs.push_back(dfdx());
+      for (VarDecl* dArgDecl : ArgResultDecls)
+        ReverseCallArgs.push_back(BuildOp(UO_AddrOf, BuildDeclRef(dArgDecl)));
+      if (m_SplitPullbacks && FD != m_Function &&
+          isSplitCandidate(m_Builder, FD))
+        OverloadedDerivedFn = BuildSplitPullbackCall(FD,
+                                                     ReverseCallArgs,
+                                                     AugmentedPrimalFD,
+                                                     Tapes);
+      if (!OverloadedDerivedFn) {
+        IdentifierInfo* II =
+            &m_Context.Idents.get(FD->getNameAsString() + "_pullback");
+        // Try to find it in builtin derivatives
+        DeclarationName name(II);
+        DeclarationNameInfo DNInfo(name, noLoc);
+        OverloadedDerivedFn =
+            m_Builder.findOverloadedDefinition(DNInfo, ReverseCallArgs);
+      }
+      asGrad = false;
+    } else if (NArgs == 1 && !OverloadedDerivedFn) {
+      IdentifierInfo* II = &m_Context.Idents.get(FD->getNameAsString() +
+                                                 "_darg0" + PrimalPostfix);
       // Try to find it in builtin derivatives
       DeclarationName name(II);
       DeclarationNameInfo DNInfo(name, noLoc);
       OverloadedDerivedFn =
           m_Builder.findOverloadedDefinition(DNInfo, ReverseCallArgs);
-      if (OverloadedDerivedFn)
+      if (!OverloadedDerivedFn && !PrimalPostfix.empty()) {
+        // No overload takes the value of the call, drop it.
+        ReverseCallArgs.pop_back();
+        PrimalPostfix.clear();
+        II = &m_Context.Idents.get(FD->getNameAsString() + "_darg0");
+        DeclarationNameInfo PlainDNInfo(DeclarationName(II), noLoc);
+        OverloadedDerivedFn =
+            m_Builder.findOverloadedDefinition(PlainDNInfo, ReverseCallArgs);
+      }
+      if (OverloadedDerivedFn) {
         asGrad = false;
+        // The derivative has the type of the argument on the tape.
+        if (m_BatchBuiltins && ArgTape && !FusedCall &&
+            m_Context.hasSameUnqualifiedType(CallArgs[0]->getType(), CEType))
+          if (Expr* Batch = BuildBatchDerivativeCall(FD, ArgTape)) {
+            // The popped value is already the derivative:
+            // _r0 = dfdx * clad::pop(_tK);
+            m_BatchCalls.push_back(Batch);
+            OverloadedDerivedFn = ReverseCallArgs[0];
+          }
+      }
     }
     // If it has more args or f_darg0 was not found, we look for its gradient.
-    if (!OverloadedDerivedFn) {
+    // A pullback is derived instead, without the _grad array.
+    if (!OverloadedDerivedFn && !asPullback) {
       IdentifierInfo* II =
           &m_Context.Idents.get(FD->getNameAsString() + funcPostfix());
       // We also need to create an array to store the result of gradient call.
@@ -1003,12 +3753,23 @@ namespace clad {
       // Try to find it in builtin derivatives
       DeclarationName name(II);
       DeclarationNameInfo DNInfo(name, noLoc);
-      OverloadedDerivedFn =
-          m_Builder.findOverloadedDefinition(DNInfo, ReverseCallArgs);
+      if (!PrimalPostfix.empty()) {
+        IdentifierInfo* PrimalII = &m_Context.Idents.get(
+            FD->getNameAsString() + funcPostfix() + PrimalPostfix);
+        DeclarationNameInfo PrimalDNInfo(DeclarationName(PrimalII), noLoc);
+        OverloadedDerivedFn =
+            m_Builder.findOverloadedDefinition(PrimalDNInfo, ReverseCallArgs);
+        // No overload takes the value of the call, drop it.
+        if (!OverloadedDerivedFn)
+          ReverseCallArgs.erase(ReverseCallArgs.begin() + CE->getNumArgs());
+      }
+      if (!OverloadedDerivedFn)
+        OverloadedDerivedFn =
+            m_Builder.findOverloadedDefinition(DNInfo, ReverseCallArgs);
     }
     // Derivative was not found, check if it is a recursive call
     if (!OverloadedDerivedFn) {
-      if (FD == m_Function) {
+      if (FD == m_Function && asPullback == isPullback) {
         // Recursive call.
         auto selfRef =
             m_Sema
@@ -1032,6 +3793,7 @@ namespace clad {
         request.Function = FD;
         request.BaseFunctionName = FD->getNameAsString();
         request.Mode = DiffMode::reverse;
+        request.Pullback = asPullback;
         // Silence diag outputs in nested derivation process.
         request.VerboseDiags = false;
 
@@ -1061,7 +3823,18 @@ namespace clad {
 
     if (OverloadedDerivedFn) {
       // Derivative was found.
-      if (!asGrad) {
+      if (asPullback) {
+        // Declare the adjoints of the arguments and call the pullback before
+        // the reverse pass of the arguments.
+        Stmts PullbackStmts;
+        for (VarDecl* dArgDecl : ArgResultDecls)
+          addToBlock(BuildDeclStmt(dArgDecl), PullbackStmts);
+        PullbackStmts.push_back(OverloadedDerivedFn);
+        auto& block = getCurrentBlock(reverse);
+        block.insert(std::next(std::begin(block), insertionPoint),
+                     PullbackStmts.begin(),
+                     PullbackStmts.end());
+      } else if (!asGrad) {
         // If the derivative is called through _darg0 instead of _grad.
         Expr* d = BuildOp(BO_Mul, dfdx(), OverloadedDerivedFn);
 
@@ -1092,6 +3865,10 @@ namespace clad {
       }
     }
 
+    // The value of the call has already been stored.
+    if (FusedCall)
+      return StmtDiff(FusedCall);
+
     // Re-clone function arguments again, since they are required at 2 places:
     // call to gradient and call to original function.
     // At this point, each arg is either a simple expression or a reference
@@ -1101,9 +3878,15 @@ namespace clad {
                    std::begin(CallArgs),
                    [this](Expr* E) { return Clone(E); });
     // Recreate the original call expression.
+    Expr* Callee = Clone(CE->getCallee());
+    if (AugmentedPrimalFD) {
+      Callee = BuildDeclRef(AugmentedPrimalFD);
+      for (VarDecl* Tape : Tapes)
+        CallArgs.push_back(BuildDeclRef(Tape));
+    }
     Expr* call = m_Sema
                      .ActOnCallExpr(getCurrentScope(),
-                                    Clone(CE->getCallee()),
+                                    Callee,
                                     noLoc,
                                     llvm::MutableArrayRef<Expr*>(CallArgs),
                                     noLoc)
@@ -1640,6 +4423,16 @@ namespace clad {
     if (!force && !UsefulToStoreGlobal(E))
       return {E, E};
 
+    if (isInsideLoop && m_InTapeFreeLoop)
+      return {E, Clone(E)};
+    // The replayed loops store the values of the iteration being reversed:
+    // (_t = E), which the caller places as it would place the push.
+    if (isInsideLoop && m_InReplayedLoop) {
+      VarDecl* Store = GlobalStoreImpl(Type, prefix);
+      m_ReplayStores.insert(Store);
+      Expr* Set = BuildOp(BO_Assign, BuildDeclRef(Store), E);
+      return {BuildParens(Set), BuildDeclRef(Store)};
+    }
     if (isInsideLoop) {
       auto CladTape = MakeCladTapeFor(E);
       Expr* Push = CladTape.Push;
@@ -1664,7 +4457,7 @@ namespace clad {
   }
 
   void ReverseModeVisitor::DelayedStoreResult::Finalize(Expr* New) {
-    if (isConstant)
+    if (isConstant || isRecomputed)
       return;
     if (isInsideLoop) {
       auto Push = cast<CallExpr>(Result.getExpr());
@@ -1687,7 +4480,15 @@ namespace clad {
                                 /*isConstant*/ true,
                                 /*isInsideLoop*/ false};
     }
-    if (isInsideLoop) {
+    // The values read by a loop without tapes are available in the reverse
+    // pass.
+    if (isInsideLoop && m_InTapeFreeLoop)
+      return DelayedStoreResult{*this,
+                                StmtDiff{Clone(E), Clone(E)},
+                                /*isConstant*/ false,
+                                /*isInsideLoop*/ true,
+                                /*isRecomputed*/ true};
+    if (isInsideLoop && !m_InReplayedLoop) {
       Expr* dummy = E;
       auto CladTape = MakeCladTapeFor(dummy);
       Expr* Push = CladTape.Push;
@@ -1697,8 +4498,12 @@ namespace clad {
                                 /*isConstant*/ false,
                                 /*isInsideLoop*/ true};
     } else {
-      Expr* Ref = BuildDeclRef(GlobalStoreImpl(
-          getNonConstType(E->getType(), m_Context, m_Sema), prefix));
+      VarDecl* Store = GlobalStoreImpl(
+          getNonConstType(E->getType(), m_Context, m_Sema), prefix);
+      // The replayed loops store their values as the code outside of loops.
+      if (isInsideLoop)
+        m_ReplayStores.insert(Store);
+      Expr* Ref = BuildDeclRef(Store);
       // Return reference to the declaration instead of original expression.
       return DelayedStoreResult{*this,
                                 StmtDiff{Ref, Ref},
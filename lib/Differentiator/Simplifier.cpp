@@ -0,0 +1,168 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// An algebraic simplifier for the produced derivatives, working on AST level
+//
+//----------------------------------------------------------------------------//
+
+#include "Simplifier.h"
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include "clad/Differentiator/Compatibility.h"
+
+namespace clad {
+  using namespace clang;
+
+  namespace {
+    /// Counts the references to each variable and how many of them are plain
+    /// reads, i.e. lvalue-to-rvalue conversions.
+    class VarUsageCollector : public RecursiveASTVisitor<VarUsageCollector> {
+      unsigned m_LambdaDepth = 0;
+    public:
+      llvm::DenseMap<const VarDecl*, unsigned> Uses;
+      llvm::DenseMap<const VarDecl*, unsigned> Reads;
+      llvm::SmallVector<VarDecl*, 16> Locals;
+
+      bool VisitVarDecl(VarDecl* VD) {
+        if (!isa<ParmVarDecl>(VD))
+          Locals.push_back(VD);
+        return true;
+      }
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+          Uses[VD]++;
+        return true;
+      }
+      bool VisitImplicitCastExpr(ImplicitCastExpr* ICE) {
+        // Reads inside lambdas are not rewritten, count them as generic uses.
+        if (m_LambdaDepth || ICE->getCastKind() != CK_LValueToRValue)
+          return true;
+        if (auto DRE = dyn_cast<DeclRefExpr>(ICE->getSubExpr()->IgnoreParens()))
+          if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+            Reads[VD]++;
+        return true;
+      }
+      bool TraverseLambdaExpr(LambdaExpr* LE) {
+        ++m_LambdaDepth;
+        bool Result = RecursiveASTVisitor<VarUsageCollector>::
+          TraverseLambdaExpr(LE);
+        --m_LambdaDepth;
+        return Result;
+      }
+    };
+  } // end anonymous namespace
+
+  void Simplifier::collectConstants(FunctionDecl* FD) {
+    VarUsageCollector Collector;
+    Collector.TraverseStmt(FD->getBody());
+    for (VarDecl* VD : Collector.Locals) {
+      // Only the tangents and adjoints produced by clad are considered.
+      if (VD->getDeclContext() != FD || !VD->getName().startswith("_d_"))
+        continue;
+      QualType QT = VD->getType();
+      if (QT.isVolatileQualified() || !ConstantFolder::isFoldableType(QT))
+        continue;
+      const Expr* Init = VD->getInit();
+      if (!Init || Init->HasSideEffects(m_Context))
+        continue;
+      // Every use has to be a read, otherwise the variable may be modified.
+      if (Collector.Uses.lookup(VD) != Collector.Reads.lookup(VD))
+        continue;
+      for (int64_t N : {0, 1})
+        if (ConstantFolder::evalsTo(Init, m_Context, N)) {
+          m_Folder.setKnownValue(VD, N);
+          m_Propagated.insert(VD);
+          break;
+        }
+    }
+  }
+
+  void Simplifier::foldStmt(Stmt* S) {
+    for (Stmt*& Child : S->children()) {
+      if (!Child)
+        continue;
+      if (auto E = dyn_cast<Expr>(Child))
+        Child = m_Folder.fold(E);
+      else
+        foldStmt(Child);
+    }
+  }
+
+  bool Simplifier::isDeadStmt(Stmt* S) {
+    if (auto CS = dyn_cast<CompoundStmt>(S))
+      return CS->body_empty();
+    if (auto DS = dyn_cast<DeclStmt>(S)) {
+      // The declarations of propagated constants are not referenced anymore.
+      for (Decl* D : DS->decls()) {
+        auto VD = dyn_cast<VarDecl>(D);
+        if (!VD || !m_Propagated.count(VD))
+          return false;
+      }
+      return true;
+    }
+    auto E = dyn_cast<Expr>(S);
+    if (!E)
+      return false;
+    E = E->IgnoreParens();
+    // x += 0, x -= 0, x *= 1 and x /= 1 do not contribute.
+    if (auto CAO = dyn_cast<CompoundAssignOperator>(E)) {
+      if (CAO->getLHS()->HasSideEffects(m_Context))
+        return false;
+      BinaryOperatorKind Opc = CAO->getOpcode();
+      if (Opc == BO_AddAssign || Opc == BO_SubAssign)
+        return ConstantFolder::evalsTo(CAO->getRHS(), m_Context, 0);
+      if (Opc == BO_MulAssign || Opc == BO_DivAssign)
+        return ConstantFolder::evalsTo(CAO->getRHS(), m_Context, 1);
+      return false;
+    }
+    // Expressions without side effects, e.g. folded derivatives of unused
+    // results.
+    return !E->HasSideEffects(m_Context);
+  }
+
+  CompoundStmt* Simplifier::pruneCompoundStmt(CompoundStmt* CS) {
+    llvm::SmallVector<Stmt*, 16> Stmts;
+    for (Stmt* S : CS->body())
+      if (!isDeadStmt(S))
+        Stmts.push_back(S);
+    if (Stmts.size() == CS->size())
+      return CS;
+    return clad_compat::CompoundStmt_Create(m_Context, Stmts,
+                                            CS->getLBracLoc(),
+                                            CS->getRBracLoc());
+  }
+
+  void Simplifier::removeDeadStmts(Stmt* S) {
+    for (Stmt*& Child : S->children()) {
+      // Statements nested in expressions (lambdas, statement expressions) are
+      // left untouched.
+      if (!Child || isa<Expr>(Child))
+        continue;
+      removeDeadStmts(Child);
+      if (auto CS = dyn_cast<CompoundStmt>(Child))
+        Child = pruneCompoundStmt(CS);
+    }
+  }
+
+  void Simplifier::Simplify(FunctionDecl* FD) {
+    auto Body = dyn_cast_or_null<CompoundStmt>(FD->getBody());
+    if (!Body)
+      return;
+    collectConstants(FD);
+    foldStmt(Body);
+    // Make sure the propagated constants are not referenced anymore before
+    // dropping their declarations.
+    VarUsageCollector Collector;
+    Collector.TraverseStmt(Body);
+    for (auto& Use : Collector.Uses)
+      if (Use.second)
+        m_Propagated.erase(Use.first);
+    removeDeadStmts(Body);
+    FD->setBody(pruneCompoundStmt(Body));
+  }
+} // end namespace clad
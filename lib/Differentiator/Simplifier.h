@@ -0,0 +1,45 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// An algebraic simplifier for the produced derivatives, working on AST level
+//
+//----------------------------------------------------------------------------//
+
+#ifndef CLAD_SIMPLIFIER_H
+#define CLAD_SIMPLIFIER_H
+
+#include "ConstantFolder.h"
+
+#include "llvm/ADT/DenseSet.h"
+
+namespace clang {
+  class ASTContext;
+  class CompoundStmt;
+  class FunctionDecl;
+  class Stmt;
+  class VarDecl;
+}
+
+namespace clad {
+  /// Simplifies the body of a produced derivative. The tangents and adjoints
+  /// which are initialized to zero or one and never written again are
+  /// propagated as constants, the arithmetic is folded with ConstantFolder and
+  /// the statements which no longer contribute to the result are removed.
+  class Simplifier {
+  private:
+    clang::ASTContext& m_Context;
+    ConstantFolder m_Folder;
+    /// Variables whose reads were replaced by constants.
+    llvm::DenseSet<const clang::VarDecl*> m_Propagated;
+  public:
+    Simplifier(clang::ASTContext& C) : m_Context(C), m_Folder(C, true) {}
+    void Simplify(clang::FunctionDecl* FD);
+  private:
+    void collectConstants(clang::FunctionDecl* FD);
+    void foldStmt(clang::Stmt* S);
+    void removeDeadStmts(clang::Stmt* S);
+    clang::CompoundStmt* pruneCompoundStmt(clang::CompoundStmt* CS);
+    bool isDeadStmt(clang::Stmt* S);
+  };
+} // end namespace clad
+#endif // CLAD_SIMPLIFIER_H
@@ -0,0 +1,332 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Static dependence analysis computing the structural sparsity of the
+// Jacobians and the Hessians, working on AST level
+//
+//----------------------------------------------------------------------------//
+
+#include "SparsityAnalyzer.h"
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/Decl.h"
+#include "clang/AST/Expr.h"
+#include "clang/AST/ExprCXX.h"
+#include "clang/AST/Stmt.h"
+
+#include "clad/Differentiator/Compatibility.h"
+
+namespace clad {
+  using namespace clang;
+
+  namespace {
+    /// Joins From into To, returns true if To changed.
+    bool unite(SparsityAnalyzer::Info& To, const SparsityAnalyzer::Info& From) {
+      bool Changed = false;
+      llvm::BitVector Old = To.Deps;
+      To.Deps |= From.Deps;
+      Changed |= To.Deps != Old;
+      for (unsigned i = 0, e = From.Hess.size(); i < e; ++i) {
+        Old = To.Hess[i];
+        To.Hess[i] |= From.Hess[i];
+        Changed |= To.Hess[i] != Old;
+      }
+      return Changed;
+    }
+
+    /// Returns true if a parameter of this type lets the callee modify the
+    /// argument.
+    bool passesWritable(QualType T) {
+      if (T->isReferenceType() || T->isPointerType())
+        return !T->getPointeeType().isConstQualified();
+      return false;
+    }
+  } // end anonymous namespace
+
+  SparsityAnalyzer::SparsityAnalyzer(const FunctionDecl* FD,
+                                     llvm::ArrayRef<const VarDecl*> Inputs)
+      : m_Function(FD), m_NumInputs(Inputs.size()) {
+    for (unsigned i = 0, e = Inputs.size(); i < e; ++i)
+      if (Inputs[i] && Inputs[i]->getType()->isRealType())
+        m_Inputs[Inputs[i]] = i;
+    m_Return = makeInfo();
+  }
+
+  SparsityAnalyzer::Info SparsityAnalyzer::makeInfo() const {
+    return {llvm::BitVector(m_NumInputs),
+            SparsityPattern(m_NumInputs, llvm::BitVector(m_NumInputs))};
+  }
+
+  void SparsityAnalyzer::addProducts(SparsityPattern& H,
+                                     const llvm::BitVector& A,
+                                     const llvm::BitVector& B) {
+    for (int i = A.find_first(); i != -1; i = A.find_next(i))
+      H[i] |= B;
+    for (int j = B.find_first(); j != -1; j = B.find_next(j))
+      H[j] |= A;
+  }
+
+  bool SparsityAnalyzer::analyze() {
+    const Stmt* Body = m_Function->getBody();
+    if (!Body)
+      return false;
+    for (auto& Input : m_Inputs) {
+      Info I = makeInfo();
+      I.Deps.set(Input.second);
+      m_Vars[Input.first] = I;
+    }
+    // The abstractions only grow, until a fixed point is reached.
+    do {
+      m_Changed = false;
+      visit(Body);
+    } while (m_Changed && m_Supported);
+    return m_Supported;
+  }
+
+  bool SparsityAnalyzer::computeJacobian(const VarDecl* Output,
+                                         SparsityPattern& P) {
+    m_Output = Output;
+    if (!analyze())
+      return false;
+    P.clear();
+    if (!m_Rows.empty())
+      P.resize(m_Rows.rbegin()->first + 1, llvm::BitVector(m_NumInputs));
+    for (auto& Row : m_Rows)
+      P[Row.first] = Row.second;
+    return true;
+  }
+
+  bool SparsityAnalyzer::computeHessian(SparsityPattern& P) {
+    if (!analyze())
+      return false;
+    P = m_Return.Hess;
+    return true;
+  }
+
+  std::string SparsityAnalyzer::print(const SparsityPattern& P) {
+    std::string S;
+    for (const llvm::BitVector& Row : P) {
+      for (unsigned j = 0, e = Row.size(); j < e; ++j)
+        S += Row.test(j) ? '1' : '0';
+      S += '\n';
+    }
+    return S;
+  }
+
+  void SparsityAnalyzer::assign(const Expr* LHS, const Info& Value) {
+    LHS = LHS->IgnoreParens();
+    const Expr* Base = LHS;
+    bool Element = false;
+    while (true) {
+      Base = Base->IgnoreParenImpCasts();
+      if (auto ASE = dyn_cast<ArraySubscriptExpr>(Base)) {
+        eval(ASE->getIdx());
+        Base = ASE->getBase();
+      } else if (auto UO = dyn_cast<UnaryOperator>(Base)) {
+        if (UO->getOpcode() != UO_Deref)
+          break;
+        Base = UO->getSubExpr();
+      } else
+        break;
+      Element = true;
+    }
+    auto DRE = dyn_cast<DeclRefExpr>(Base);
+    auto VD = DRE ? dyn_cast<VarDecl>(DRE->getDecl()) : nullptr;
+    if (!VD) {
+      m_Supported = false;
+      return;
+    }
+    if (VD == m_Output) {
+      // The rows are the elements written at constant indices.
+      auto ASE = dyn_cast<ArraySubscriptExpr>(LHS);
+      const ASTContext& C = m_Function->getASTContext();
+      llvm::APSInt Idx;
+      if (!ASE || !clad_compat::Expr_EvaluateAsInt(ASE->getIdx(), Idx, C)) {
+        m_Supported = false;
+        return;
+      }
+      auto Inserted =
+          m_Rows.insert({Idx.getExtValue(), llvm::BitVector(m_NumInputs)});
+      llvm::BitVector& Row = Inserted.first->second;
+      llvm::BitVector Old = Row;
+      Row |= Value.Deps;
+      m_Changed |= Inserted.second || Row != Old;
+      return;
+    }
+    if (!Element && VD->getType()->isReferenceType()) {
+      m_Supported = false;
+      return;
+    }
+    assignVar(VD, Value);
+  }
+
+  void SparsityAnalyzer::assignVar(const VarDecl* VD, const Info& Value) {
+    auto It = m_Vars.find(VD);
+    if (It == m_Vars.end())
+      It = m_Vars.insert({VD, makeInfo()}).first;
+    m_Changed |= unite(It->second, Value);
+  }
+
+  SparsityAnalyzer::Info SparsityAnalyzer::eval(const Expr* E) {
+    E = E->IgnoreParens();
+    if (isa<IntegerLiteral>(E) || isa<FloatingLiteral>(E) ||
+        isa<CXXBoolLiteralExpr>(E) || isa<CharacterLiteral>(E) ||
+        isa<StringLiteral>(E) || isa<CXXNullPtrLiteralExpr>(E) ||
+        isa<UnaryExprOrTypeTraitExpr>(E) || isa<CXXThisExpr>(E) ||
+        isa<ImplicitValueInitExpr>(E))
+      return makeInfo();
+    if (auto CE = dyn_cast<CastExpr>(E))
+      return eval(CE->getSubExpr());
+    if (auto DAE = dyn_cast<CXXDefaultArgExpr>(E))
+      return eval(DAE->getExpr());
+    if (auto DRE = dyn_cast<DeclRefExpr>(E)) {
+      auto VD = dyn_cast<VarDecl>(DRE->getDecl());
+      auto It = VD ? m_Vars.find(VD) : m_Vars.end();
+      return It != m_Vars.end() ? It->second : makeInfo();
+    }
+    if (auto ME = dyn_cast<MemberExpr>(E)) {
+      // The members of the object are constants.
+      if (isa<CXXThisExpr>(ME->getBase()->IgnoreParenImpCasts()))
+        return makeInfo();
+      return eval(ME->getBase());
+    }
+    if (auto ASE = dyn_cast<ArraySubscriptExpr>(E)) {
+      eval(ASE->getIdx());
+      return eval(ASE->getBase());
+    }
+    if (auto UO = dyn_cast<UnaryOperator>(E)) {
+      if (UO->getOpcode() == UO_AddrOf) {
+        m_Supported = false;
+        return makeInfo();
+      }
+      Info Sub = eval(UO->getSubExpr());
+      return UO->getOpcode() == UO_LNot ? makeInfo() : Sub;
+    }
+    if (auto BO = dyn_cast<BinaryOperator>(E)) {
+      BinaryOperatorKind Op = BO->getOpcode();
+      if (Op == BO_Comma) {
+        eval(BO->getLHS());
+        return eval(BO->getRHS());
+      }
+      if (Op == BO_PtrMemD || Op == BO_PtrMemI) {
+        m_Supported = false;
+        return makeInfo();
+      }
+      Info R = eval(BO->getRHS());
+      if (Op == BO_Assign) {
+        assign(BO->getLHS(), R);
+        return R;
+      }
+      Info L = eval(BO->getLHS());
+      if (BO->isCompoundAssignmentOp())
+        Op = BinaryOperator::getOpForCompoundAssignment(Op);
+      // The comparisons are piecewise constant.
+      if (BO->isComparisonOp() || BO->isLogicalOp())
+        return makeInfo();
+      Info Result = L;
+      unite(Result, R);
+      if (Op == BO_Mul) {
+        addProducts(Result.Hess, L.Deps, R.Deps);
+      } else if (Op == BO_Div) {
+        addProducts(Result.Hess, L.Deps, R.Deps);
+        addProducts(Result.Hess, R.Deps, R.Deps);
+      } else if (Op != BO_Add && Op != BO_Sub) {
+        addProducts(Result.Hess, Result.Deps, Result.Deps);
+      }
+      if (BO->isCompoundAssignmentOp())
+        assign(BO->getLHS(), Result);
+      return Result;
+    }
+    if (auto CO = dyn_cast<ConditionalOperator>(E)) {
+      eval(CO->getCond());
+      Info Result = eval(CO->getTrueExpr());
+      unite(Result, eval(CO->getFalseExpr()));
+      return Result;
+    }
+    if (auto ILE = dyn_cast<InitListExpr>(E)) {
+      Info Result = makeInfo();
+      for (const Expr* Init : ILE->inits())
+        unite(Result, eval(Init));
+      return Result;
+    }
+    if (auto CE = dyn_cast<CallExpr>(E)) {
+      // A member function may modify the object, an operator its operands.
+      const FunctionDecl* FD = CE->getDirectCallee();
+      if (!FD || isa<CXXMemberCallExpr>(CE) || isa<CXXOperatorCallExpr>(CE)) {
+        m_Supported = false;
+        return makeInfo();
+      }
+      // Any function of the arguments may be nonlinear in all of them.
+      Info Result = makeInfo();
+      for (unsigned i = 0, e = CE->getNumArgs(); i < e; ++i) {
+        if (i < FD->getNumParams() &&
+            passesWritable(FD->getParamDecl(i)->getType())) {
+          m_Supported = false;
+          return makeInfo();
+        }
+        unite(Result, eval(CE->getArg(i)));
+      }
+      addProducts(Result.Hess, Result.Deps, Result.Deps);
+      return Result;
+    }
+    m_Supported = false;
+    return makeInfo();
+  }
+
+  void SparsityAnalyzer::visit(const Stmt* S) {
+    if (!S || !m_Supported)
+      return;
+    if (auto E = dyn_cast<Expr>(S)) {
+      eval(E);
+    } else if (auto CS = dyn_cast<CompoundStmt>(S)) {
+      for (const Stmt* Child : CS->body())
+        visit(Child);
+    } else if (auto DS = dyn_cast<DeclStmt>(S)) {
+      for (const Decl* D : DS->decls()) {
+        auto VD = dyn_cast<VarDecl>(D);
+        if (!VD)
+          continue;
+        // The pointers and the references may alias other variables.
+        QualType T = VD->getType();
+        if (T->isPointerType() || T->isReferenceType()) {
+          m_Supported = false;
+          return;
+        }
+        if (VD->getInit())
+          assignVar(VD, eval(VD->getInit()));
+      }
+    } else if (auto If = dyn_cast<IfStmt>(S)) {
+      visit(If->getConditionVariableDeclStmt());
+      eval(If->getCond());
+      visit(If->getThen());
+      visit(If->getElse());
+    } else if (auto For = dyn_cast<ForStmt>(S)) {
+      visit(For->getInit());
+      visit(For->getConditionVariableDeclStmt());
+      visit(For->getCond());
+      visit(For->getInc());
+      visit(For->getBody());
+    } else if (auto While = dyn_cast<WhileStmt>(S)) {
+      visit(While->getConditionVariableDeclStmt());
+      eval(While->getCond());
+      visit(While->getBody());
+    } else if (auto Do = dyn_cast<DoStmt>(S)) {
+      visit(Do->getBody());
+      eval(Do->getCond());
+    } else if (auto Switch = dyn_cast<SwitchStmt>(S)) {
+      visit(Switch->getConditionVariableDeclStmt());
+      eval(Switch->getCond());
+      visit(Switch->getBody());
+    } else if (auto SC = dyn_cast<SwitchCase>(S)) {
+      visit(SC->getSubStmt());
+    } else if (auto LS = dyn_cast<LabelStmt>(S)) {
+      visit(LS->getSubStmt());
+    } else if (auto RS = dyn_cast<ReturnStmt>(S)) {
+      if (RS->getRetValue())
+        m_Changed |= unite(m_Return, eval(RS->getRetValue()));
+    } else if (!isa<BreakStmt>(S) && !isa<ContinueStmt>(S) &&
+               !isa<NullStmt>(S) && !isa<GotoStmt>(S)) {
+      m_Supported = false;
+    }
+  }
+} // end namespace clad
@@ -0,0 +1,96 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Static dependence analysis computing the structural sparsity of the
+// Jacobians and the Hessians, working on AST level
+//
+//----------------------------------------------------------------------------//
+
+#ifndef CLAD_SPARSITY_ANALYZER_H
+#define CLAD_SPARSITY_ANALYZER_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace clang {
+  class Expr;
+  class FunctionDecl;
+  class Stmt;
+  class VarDecl;
+}
+
+namespace clad {
+  /// The rows of a structural sparsity pattern, a set bit is an entry which
+  /// may be nonzero.
+  using SparsityPattern = std::vector<llvm::BitVector>;
+
+  /// Finds which inputs of a function its outputs depend on, and which pairs
+  /// of inputs interact nonlinearly, without evaluating it. Each value is
+  /// abstracted by the inputs it depends on and by the pairs of inputs its
+  /// second derivatives may be nonzero for. The analysis is flow-insensitive:
+  /// the abstraction of a variable joins all the values assigned to it, and
+  /// the body is visited until they no longer change, which covers the
+  /// branches and the loops. Arrays are abstracted as a whole. The inputs are
+  /// the scalar parameters given to the constructor, the other parameters,
+  /// the globals and the members are constants.
+  ///
+  /// The functions whose values may escape the analysis, through pointers or
+  /// references, member assignments or calls which may write to their
+  /// arguments, are not supported and make the patterns dense.
+  class SparsityAnalyzer {
+  public:
+    /// The abstraction of a value.
+    struct Info {
+      llvm::BitVector Deps;
+      SparsityPattern Hess;
+    };
+
+  private:
+    const clang::FunctionDecl* m_Function;
+    /// The position of each input.
+    llvm::DenseMap<const clang::VarDecl*, unsigned> m_Inputs;
+    unsigned m_NumInputs;
+    /// The output array of a vector-valued function, as in clad::jacobian.
+    const clang::VarDecl* m_Output = nullptr;
+    llvm::DenseMap<const clang::VarDecl*, Info> m_Vars;
+    /// The dependencies of the elements of the output array, by index.
+    std::map<unsigned, llvm::BitVector> m_Rows;
+    Info m_Return;
+    bool m_Changed = false;
+    bool m_Supported = true;
+
+  public:
+    /// Inputs are the independent variables, the columns of the patterns in
+    /// their order. Null entries and non-scalar parameters are skipped but
+    /// keep their column.
+    SparsityAnalyzer(const clang::FunctionDecl* FD,
+                     llvm::ArrayRef<const clang::VarDecl*> Inputs);
+    /// Computes the pattern of the Jacobian of a function writing its outputs
+    /// to the elements of the array Output at constant indices, one row per
+    /// element up to the last one written. Returns false if the function is
+    /// not supported.
+    bool computeJacobian(const clang::VarDecl* Output, SparsityPattern& P);
+    /// Computes the symmetric pattern of the Hessian of the returned value.
+    /// Returns false if the function is not supported.
+    bool computeHessian(SparsityPattern& P);
+    /// Prints a pattern, one line of 0 and 1 per row.
+    static std::string print(const SparsityPattern& P);
+
+  private:
+    bool analyze();
+    Info makeInfo() const;
+    /// Adds the pairs of A x B and B x A to H.
+    void addProducts(SparsityPattern& H, const llvm::BitVector& A,
+                     const llvm::BitVector& B);
+    void assign(const clang::Expr* LHS, const Info& Value);
+    void assignVar(const clang::VarDecl* VD, const Info& Value);
+    Info eval(const clang::Expr* E);
+    void visit(const clang::Stmt* S);
+  };
+} // end namespace clad
+#endif // CLAD_SPARSITY_ANALYZER_H
@@ -0,0 +1,458 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Strength reduction of the math calls in the produced derivatives, working on
+// AST level
+//
+//----------------------------------------------------------------------------//
+
+#include "StrengthReducer.h"
+
+#include "ConstantFolder.h"
+#include "WriteCollector.h"
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Sema/Sema.h"
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringSwitch.h"
+
+#include <functional>
+#include <vector>
+
+#include "clad/Differentiator/Compatibility.h"
+
+namespace clad {
+  using namespace clang;
+
+  namespace {
+    enum class PowKind { None, Pow, Derivative, Gradient };
+  } // end anonymous namespace
+
+  /// Recognizes pow from the C library or std and its builtin derivatives.
+  static PowKind getPowKind(const CallExpr* CE) {
+    if (isa<CXXMemberCallExpr>(CE) || isa<CXXOperatorCallExpr>(CE))
+      return PowKind::None;
+    const FunctionDecl* FD = CE->getDirectCallee();
+    if (!FD || !FD->getIdentifier())
+      return PowKind::None;
+    const DeclContext* DC = FD->getDeclContext()->getRedeclContext();
+    if (DC->isTranslationUnit() || DC->isStdNamespace())
+      return FD->getName() == "pow" ? PowKind::Pow : PowKind::None;
+    // The builtin derivatives are templates, overloads provided by the user
+    // may compute something else.
+    auto ND = dyn_cast<NamespaceDecl>(DC);
+    if (!ND || ND->getName() != "custom_derivatives" ||
+        !FD->getPrimaryTemplate())
+      return PowKind::None;
+    return llvm::StringSwitch<PowKind>(FD->getName())
+      .Case("pow_darg0", PowKind::Derivative)
+      .Cases("pow_grad", "pow_grad_primal", PowKind::Gradient)
+      .Default(PowKind::None);
+  }
+
+  /// \returns true if E is a literal, possibly negated, with an integral
+  /// value, which is stored in N.
+  static bool getIntegralLiteral(const Expr* E, int64_t& N) {
+    E = E->IgnoreParenImpCasts();
+    bool Negate = false;
+    if (auto UO = dyn_cast<UnaryOperator>(E)) {
+      if (UO->getOpcode() != UO_Minus)
+        return false;
+      Negate = true;
+      E = UO->getSubExpr()->IgnoreParenImpCasts();
+    }
+    if (auto IL = dyn_cast<IntegerLiteral>(E)) {
+      llvm::APInt Val = IL->getValue();
+      if (Val.getActiveBits() > 31)
+        return false;
+      N = Val.getZExtValue();
+    } else if (auto FL = dyn_cast<FloatingLiteral>(E)) {
+      llvm::APSInt Val(64, /*isUnsigned*/false);
+      bool IsExact = false;
+      if (FL->getValue().convertToInteger(Val, llvm::APFloat::rmTowardZero,
+                                          &IsExact) != llvm::APFloat::opOK ||
+          Val.getMinSignedBits() > 32)
+        return false;
+      N = Val.getSExtValue();
+    } else
+      return false;
+    if (Negate)
+      N = -N;
+    return true;
+  }
+
+  static bool isSmallExponent(int64_t N) {
+    return N >= -StrengthReducer::MaxExponent &&
+           N <= StrengthReducer::MaxExponent;
+  }
+
+  /// \returns the variable read by E, if it can be read several times instead
+  /// of once.
+  static VarDecl* getBaseVar(Expr* E) {
+    auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+    if (!DRE)
+      return nullptr;
+    auto VD = dyn_cast<VarDecl>(DRE->getDecl());
+    if (!VD)
+      return nullptr;
+    QualType T = VD->getType().getNonReferenceType();
+    if (T.isVolatileQualified() || !T->isArithmeticType())
+      return nullptr;
+    return VD;
+  }
+
+  StrengthReducer::StrengthReducer(Sema& S, bool HoistReciprocals)
+    : m_Sema(S), m_Context(S.getASTContext()),
+      m_HoistReciprocals(HoistReciprocals) {}
+
+  std::string StrengthReducer::createTempName() {
+    for (;;) {
+      std::string Name = "_inv" + std::to_string(m_TempCtr++);
+      if (!m_Names.count(Name)) {
+        m_Names.insert(Name);
+        return Name;
+      }
+    }
+  }
+
+  Expr* StrengthReducer::buildRef(VarDecl* VD, QualType T) {
+    SourceLocation noLoc;
+    QualType VT = VD->getType().getNonReferenceType();
+    Expr* Ref = clad_compat::GetResult<Expr*>(
+      m_Sema.BuildDeclRefExpr(VD, VT, VK_LValue, noLoc));
+    Ref = m_Sema.DefaultLvalueConversion(Ref).get();
+    return m_Sema.PerformImplicitConversion(Ref, T, Sema::AA_Converting).get();
+  }
+
+  Expr* StrengthReducer::buildPower(VarDecl* Base, int64_t N, QualType T) {
+    if (N == 0)
+      return ConstantFolder::synthesizeLiteral(T, m_Context, 1);
+    SourceLocation noLoc;
+    int64_t AbsN = N < 0 ? -N : N;
+    Expr* Power = buildRef(Base, T);
+    for (int64_t i = 1; i < AbsN; ++i)
+      Power = m_Sema.BuildBinOp(nullptr, noLoc, BO_Mul, Power,
+                                buildRef(Base, T)).get();
+    if (N > 0)
+      return Power;
+    if (AbsN > 1)
+      Power = m_Sema.ActOnParenExpr(noLoc, noLoc, Power).get();
+    Expr* One = ConstantFolder::synthesizeLiteral(T, m_Context, 1);
+    return m_Sema.BuildBinOp(nullptr, noLoc, BO_Div, One, Power).get();
+  }
+
+  Expr* StrengthReducer::buildPowerDerivative(VarDecl* Base, int64_t N,
+                                              QualType T) {
+    // d(x^N)/dx = N * x^(N-1)
+    if (N == 0)
+      return ConstantFolder::synthesizeLiteral(T, m_Context, 0);
+    SourceLocation noLoc;
+    Expr* Coef = ConstantFolder::synthesizeLiteral(T, m_Context,
+                                                   N < 0 ? -N : N);
+    if (N < 0)
+      Coef = m_Sema.BuildUnaryOp(nullptr, noLoc, UO_Minus, Coef).get();
+    if (N == 1)
+      return Coef;
+    Expr* Power = buildPower(Base, N - 1, T);
+    if (isa<BinaryOperator>(Power))
+      Power = m_Sema.ActOnParenExpr(noLoc, noLoc, Power).get();
+    return m_Sema.BuildBinOp(nullptr, noLoc, BO_Mul, Coef, Power).get();
+  }
+
+  Expr* StrengthReducer::reduceCall(CallExpr* CE) {
+    PowKind Kind = getPowKind(CE);
+    if ((Kind != PowKind::Pow && Kind != PowKind::Derivative) ||
+        CE->getNumArgs() != 2)
+      return CE;
+    QualType T = CE->getType();
+    VarDecl* Base = getBaseVar(CE->getArg(0));
+    int64_t N = 0;
+    if (!T->isRealFloatingType() || !Base ||
+        !getIntegralLiteral(CE->getArg(1), N) || !isSmallExponent(N))
+      return CE;
+    if (Kind == PowKind::Pow)
+      return buildPower(Base, N, T);
+    if (!isSmallExponent(N - 1))
+      return CE;
+    return buildPowerDerivative(Base, N, T);
+  }
+
+  Expr* StrengthReducer::reduceGradCall(CallExpr* CE) {
+    // pow_grad(x, n, _grad) -> _grad[0] += n * x^(n-1)
+    if (getPowKind(CE) != PowKind::Gradient || CE->getNumArgs() < 3)
+      return CE;
+    Expr* Result = CE->getArg(CE->getNumArgs() - 1);
+    if (!Result->getType()->isPointerType())
+      return CE;
+    QualType T = Result->getType()->getPointeeType();
+    VarDecl* Base = getBaseVar(CE->getArg(0));
+    int64_t N = 0;
+    if (!T->isRealFloatingType() || T.isConstQualified() || !Base ||
+        !getIntegralLiteral(CE->getArg(1), N) || !isSmallExponent(N) ||
+        !isSmallExponent(N - 1))
+      return CE;
+    SourceLocation noLoc;
+    Expr* Idx = ConstantFolder::synthesizeLiteral(m_Context.getSizeType(),
+                                                  m_Context, 0);
+    Expr* Elem =
+      m_Sema.CreateBuiltinArraySubscriptExpr(Result, noLoc, Idx, noLoc).get();
+    Expr* Derivative = buildPowerDerivative(Base, N, T);
+    if (!Elem || !Derivative)
+      return CE;
+    return m_Sema.BuildBinOp(nullptr, noLoc, BO_AddAssign, Elem,
+                             Derivative).get();
+  }
+
+  Expr* StrengthReducer::reduceDivision(BinaryOperator* BO) {
+    // x / c -> x * (1 / c) if 1 / c is exact, i.e. c is a power of two.
+    if (BO->getOpcode() != BO_Div || !BO->getType()->isRealFloatingType())
+      return BO;
+    Expr* RHS = BO->getRHS();
+    if (RHS->isValueDependent() || ConstantFolder::evalsTo(RHS, m_Context, 1))
+      return BO;
+    Expr::EvalResult Result;
+    if (!RHS->EvaluateAsRValue(Result, m_Context) || Result.HasSideEffects ||
+        !Result.Val.isFloat())
+      return BO;
+    llvm::APFloat Inverse(0.0);
+    if (!Result.Val.getFloat().getExactInverse(&Inverse))
+      return BO;
+    SourceLocation noLoc;
+    Expr* InverseLit =
+      FloatingLiteral::Create(m_Context, Inverse, /*isexact*/true,
+                              RHS->getType().getUnqualifiedType(), noLoc);
+    return m_Sema.BuildBinOp(nullptr, noLoc, BO_Mul, BO->getLHS(),
+                             InverseLit).get();
+  }
+
+  Expr* StrengthReducer::reduceExpr(Expr* E) {
+    // Lambdas and the opaque forms of the conditional operator share their
+    // subexpressions, leave them untouched.
+    if (isa<LambdaExpr>(E) || isa<BinaryConditionalOperator>(E) ||
+        isa<OpaqueValueExpr>(E) || isa<StmtExpr>(E))
+      return E;
+    for (Stmt*& Child : E->children())
+      if (auto ChildE = dyn_cast_or_null<Expr>(Child))
+        Child = reduceExpr(ChildE);
+    Expr* Reduced = E;
+    if (auto CE = dyn_cast<CallExpr>(E))
+      Reduced = reduceCall(CE);
+    else if (auto BO = dyn_cast<BinaryOperator>(E))
+      Reduced = reduceDivision(BO);
+    if (!Reduced ||
+        !m_Context.hasSameUnqualifiedType(Reduced->getType(), E->getType()))
+      return E;
+    return Reduced;
+  }
+
+  void StrengthReducer::reduceStmt(Stmt* S) {
+    for (Stmt*& Child : S->children()) {
+      if (!Child)
+        continue;
+      if (auto E = dyn_cast<Expr>(Child)) {
+        Child = reduceExpr(E);
+        // The calls to the gradients are always separate statements.
+        if (isa<CompoundStmt>(S))
+          if (auto CE = dyn_cast<CallExpr>(Child))
+            if (Expr* Reduced = reduceGradCall(CE))
+              Child = Reduced;
+      } else
+        reduceStmt(Child);
+    }
+  }
+
+  VarDecl* StrengthReducer::getDivisor(BinaryOperator* BO) const {
+    if (BO->getOpcode() != BO_Div || !BO->getType()->isRealFloatingType() ||
+        m_Reciprocals.count(BO))
+      return nullptr;
+    auto ICE = dyn_cast<ImplicitCastExpr>(BO->getRHS()->IgnoreParens());
+    if (!ICE || ICE->getCastKind() != CK_LValueToRValue)
+      return nullptr;
+    auto DRE = dyn_cast<DeclRefExpr>(ICE->getSubExpr()->IgnoreParens());
+    if (!DRE)
+      return nullptr;
+    auto VD = dyn_cast<VarDecl>(DRE->getDecl());
+    if (!VD || !m_Tracked.count(VD) ||
+        !m_Context.hasSameUnqualifiedType(VD->getType(), BO->getType()))
+      return nullptr;
+    return VD;
+  }
+
+  void StrengthReducer::hoistInStmt(Stmt* S) {
+    for (Stmt*& Child : S->children()) {
+      // Blocks nested in expressions (lambdas, statement expressions) are
+      // left untouched.
+      if (!Child || isa<Expr>(Child))
+        continue;
+      if (auto CS = dyn_cast<CompoundStmt>(Child))
+        Child = hoistReciprocals(CS);
+      else
+        hoistInStmt(Child);
+    }
+  }
+
+  CompoundStmt* StrengthReducer::hoistReciprocals(CompoundStmt* CS) {
+    for (Stmt*& S : CS->body()) {
+      if (auto Nested = dyn_cast<CompoundStmt>(S))
+        S = hoistReciprocals(Nested);
+      else
+        hoistInStmt(S);
+    }
+
+    struct Division {
+      /// The slot in the parent holding the division.
+      Stmt** Slot;
+      VarDecl* Reciprocal;
+    };
+    /// The divisions by a variable which is not written in between.
+    struct Run {
+      VarDecl* Var = nullptr;
+      unsigned First = 0;
+      unsigned Weight = 0;
+      llvm::SmallVector<unsigned, 4> Divisions;
+    };
+    llvm::SmallVector<Division, 16> Divisions;
+    llvm::MapVector<const VarDecl*, Run> Runs;
+    // The reciprocals declared before each of the statements.
+    std::vector<llvm::SmallVector<VarDecl*, 1>> Decls(CS->size());
+    SourceLocation noLoc;
+
+    auto close = [&](const VarDecl* VD) {
+      auto It = Runs.find(VD);
+      if (It == Runs.end())
+        return;
+      Run& R = It->second;
+      // A single division is only worth replacing inside of a loop.
+      if (R.Weight > 1) {
+        QualType T = R.Var->getType().getUnqualifiedType();
+        Expr* One = ConstantFolder::synthesizeLiteral(T, m_Context, 1);
+        Expr* Init = m_Sema.BuildBinOp(nullptr, noLoc, BO_Div, One,
+                                       buildRef(R.Var, T)).get();
+        m_Reciprocals.insert(Init);
+        auto Reciprocal = VarDecl::Create(m_Context, m_Function, noLoc, noLoc,
+                                          &m_Context.Idents.get(
+                                            createTempName()),
+                                          T,
+                                          m_Context.getTrivialTypeSourceInfo(T),
+                                          SC_None);
+        Reciprocal->setInit(Init);
+        Decls[R.First].push_back(Reciprocal);
+        for (unsigned Idx : R.Divisions)
+          Divisions[Idx].Reciprocal = Reciprocal;
+      }
+      Runs.erase(It);
+    };
+    auto closeAll = [&]() {
+      while (!Runs.empty())
+        close(Runs.front().first);
+    };
+
+    // Walks a statement recording the divisions by the variables which it
+    // does not write. The inner divisions are recorded first, so that they are
+    // replaced before the enclosing ones.
+    const llvm::DenseSet<const VarDecl*>* Written = nullptr;
+    unsigned StmtIdx = 0;
+    std::function<void(Stmt**, bool)> collect = [&](Stmt** Slot,
+                                                    bool InLoop) {
+      Stmt* S = *Slot;
+      if (isa<LambdaExpr>(S) || isa<StmtExpr>(S) ||
+          isa<BinaryConditionalOperator>(S))
+        return;
+      bool IsLoop = isa<ForStmt>(S) || isa<WhileStmt>(S) || isa<DoStmt>(S) ||
+                    isa<CXXForRangeStmt>(S);
+      for (Stmt*& Child : S->children())
+        if (Child)
+          collect(&Child, InLoop || IsLoop);
+      auto BO = dyn_cast<BinaryOperator>(S);
+      if (!BO)
+        return;
+      VarDecl* VD = getDivisor(BO);
+      if (!VD || Written->count(VD))
+        return;
+      Run& R = Runs[VD];
+      if (R.Divisions.empty()) {
+        R.Var = VD;
+        R.First = StmtIdx;
+      }
+      R.Weight += InLoop ? 2 : 1;
+      R.Divisions.push_back(Divisions.size());
+      Divisions.push_back({Slot, nullptr});
+    };
+
+    for (unsigned i = 0, e = CS->size(); i < e; ++i) {
+      Stmt*& S = CS->body_begin()[i];
+      // A join point, the variables may have been written before the jump.
+      if (isa<LabelStmt>(S))
+        closeAll();
+      WriteCollector WC(/*CountDecls*/true);
+      WC.TraverseStmt(S);
+      llvm::SmallVector<const VarDecl*, 4> Killed;
+      for (auto& R : Runs)
+        if (WC.Written.count(R.first))
+          Killed.push_back(R.first);
+      for (const VarDecl* VD : Killed)
+        close(VD);
+      Written = &WC.Written;
+      StmtIdx = i;
+      collect(&S, /*InLoop*/false);
+    }
+    closeAll();
+
+    bool Changed = false;
+    for (Division& D : Divisions) {
+      if (!D.Reciprocal)
+        continue;
+      auto BO = cast<BinaryOperator>(*D.Slot);
+      Expr* Ref = buildRef(D.Reciprocal, BO->getType());
+      Expr* LHS = BO->getLHS();
+      if (ConstantFolder::evalsTo(LHS, m_Context, 1))
+        *D.Slot = Ref;
+      else
+        *D.Slot = m_Sema.BuildBinOp(nullptr, noLoc, BO_Mul, LHS, Ref).get();
+      Changed = true;
+    }
+    if (!Changed)
+      return CS;
+
+    llvm::SmallVector<Stmt*, 32> Stmts;
+    for (unsigned i = 0, e = CS->size(); i < e; ++i) {
+      for (VarDecl* Reciprocal : Decls[i])
+        Stmts.push_back(new (m_Context) DeclStmt(DeclGroupRef(Reciprocal),
+                                                 noLoc, noLoc));
+      Stmts.push_back(CS->body_begin()[i]);
+    }
+    return clad_compat::CompoundStmt_Create(m_Context, Stmts,
+                                            CS->getLBracLoc(),
+                                            CS->getRBracLoc());
+  }
+
+  void StrengthReducer::Reduce(FunctionDecl* FD) {
+    auto Body = dyn_cast_or_null<CompoundStmt>(FD->getBody());
+    if (!Body)
+      return;
+    m_Function = FD;
+    reduceStmt(Body);
+    if (!m_HoistReciprocals)
+      return;
+
+    WriteCollector WC;
+    WC.TraverseStmt(Body);
+    for (const VarDecl* VD : WC.Referenced)
+      if (VD->hasLocalStorage() && !VD->getType()->isReferenceType() &&
+          !VD->getType().isVolatileQualified() && !WC.Escaped.count(VD))
+        m_Tracked.insert(VD);
+    for (const ParmVarDecl* PVD : FD->parameters())
+      if (PVD->getIdentifier())
+        m_Names.insert(PVD->getName());
+    for (const VarDecl* VD : WC.Referenced)
+      if (VD->getIdentifier())
+        m_Names.insert(VD->getName());
+    for (const VarDecl* VD : WC.Declared)
+      if (VD->getIdentifier())
+        m_Names.insert(VD->getName());
+    FD->setBody(hoistReciprocals(Body));
+  }
+} // end namespace clad
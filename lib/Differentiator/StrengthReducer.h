@@ -0,0 +1,83 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Strength reduction of the math calls in the produced derivatives, working on
+// AST level
+//
+//----------------------------------------------------------------------------//
+
+#ifndef CLAD_STRENGTH_REDUCER_H
+#define CLAD_STRENGTH_REDUCER_H
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/StringSet.h"
+
+#include <cstdint>
+#include <string>
+
+namespace clang {
+  class ASTContext;
+  class BinaryOperator;
+  class CallExpr;
+  class CompoundStmt;
+  class Expr;
+  class FunctionDecl;
+  class QualType;
+  class Sema;
+  class Stmt;
+  class VarDecl;
+}
+
+namespace clad {
+  /// Replaces the expensive math in a produced derivative by cheaper
+  /// equivalents:
+  ///   pow(x, n) and the builtin pow_darg0(x, n) with a small integer n
+  ///   become products of x;
+  ///   pow_grad(x, n, _grad) with a literal exponent only accumulates
+  ///   _grad[0], the log term computing the derivative w.r.t. the exponent is
+  ///   dropped since its adjoint is discarded;
+  ///   a division by a constant with an exact reciprocal becomes a
+  ///   multiplication.
+  /// These rewrites do not change the results. On request, divisions by the
+  /// same variable, repeated in a block or in a loop, are also replaced by
+  /// multiplications by its reciprocal (_invN), computed once before the
+  /// first of them. x * (1 / y) is rounded twice, so the results may differ
+  /// from x / y in the last bit.
+  class StrengthReducer {
+  private:
+    clang::Sema& m_Sema;
+    clang::ASTContext& m_Context;
+    clang::FunctionDecl* m_Function = nullptr;
+    /// Whether the inexact reciprocal hoisting is enabled.
+    bool m_HoistReciprocals;
+    /// Variables whose every write is visible, i.e. locals and parameters
+    /// which are never referenced other than by reads and assignments.
+    llvm::DenseSet<const clang::VarDecl*> m_Tracked;
+    /// The divisions computing the hoisted reciprocals.
+    llvm::DenseSet<const clang::Expr*> m_Reciprocals;
+    /// Names already taken in the function.
+    llvm::StringSet<> m_Names;
+    unsigned m_TempCtr = 0;
+  public:
+    /// The largest absolute value of an exponent expanded to products.
+    static const int64_t MaxExponent = 4;
+
+    StrengthReducer(clang::Sema& S, bool HoistReciprocals = false);
+    void Reduce(clang::FunctionDecl* FD);
+  private:
+    void reduceStmt(clang::Stmt* S);
+    clang::Expr* reduceExpr(clang::Expr* E);
+    clang::Expr* reduceCall(clang::CallExpr* CE);
+    clang::Expr* reduceGradCall(clang::CallExpr* CE);
+    clang::Expr* reduceDivision(clang::BinaryOperator* BO);
+    void hoistInStmt(clang::Stmt* S);
+    clang::CompoundStmt* hoistReciprocals(clang::CompoundStmt* CS);
+    clang::VarDecl* getDivisor(clang::BinaryOperator* BO) const;
+    clang::Expr* buildRef(clang::VarDecl* VD, clang::QualType T);
+    clang::Expr* buildPower(clang::VarDecl* Base, int64_t N, clang::QualType T);
+    clang::Expr* buildPowerDerivative(clang::VarDecl* Base, int64_t N,
+                                      clang::QualType T);
+    std::string createTempName();
+  };
+} // end namespace clad
+#endif // CLAD_STRENGTH_REDUCER_H
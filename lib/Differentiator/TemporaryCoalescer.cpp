@@ -0,0 +1,445 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Lifetime-based coalescing of the temporaries of the produced gradients,
+// working on AST level
+//
+//----------------------------------------------------------------------------//
+
+#include "TemporaryCoalescer.h"
+
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "clad/Differentiator/Compatibility.h"
+
+namespace clad {
+  using namespace clang;
+
+  namespace {
+    /// A reference to a variable, at the position of the statement holding it.
+    struct Access {
+      unsigned Index;
+      /// The innermost loop or branch containing the statement.
+      unsigned Region;
+      bool Reads;
+      bool Writes;
+      /// Whether every execution of the statement overwrites the variable,
+      /// i.e. the store is not in a conditional part of it.
+      bool Kills;
+    };
+
+    struct Lifetime {
+      /// The first and the last top-level statement referring to the variable.
+      unsigned First = ~0U;
+      unsigned Last = 0;
+      /// The number of references. The variable is a candidate if all of
+      /// them are plain reads or stores, which do not let its address escape.
+      unsigned Uses = 0;
+      llvm::SmallVector<Access, 8> Accesses;
+      llvm::SmallVector<DeclRefExpr*, 4> Refs;
+    };
+
+    /// A loop or a branch, whose statements are at the positions from Begin
+    /// to End.
+    struct Region {
+      unsigned Parent;
+      bool IsLoop;
+      unsigned Begin;
+      unsigned End;
+    };
+
+    /// The positions from the first to the second one.
+    using Interval = std::pair<unsigned, unsigned>;
+
+    /// Numbers the statements of the function body in execution order and
+    /// collects the references to the variables, the regions and the jumps.
+    /// The position 0 is the entry of the function.
+    class LifetimeCollector : public RecursiveASTVisitor<LifetimeCollector> {
+      unsigned m_LambdaDepth = 0;
+      /// The depth of the parts of the current statement which may not run,
+      /// e.g. the operands of ?:.
+      unsigned m_CondDepth = 0;
+      unsigned m_Region = 0;
+      const Stmt* m_Leaf = nullptr;
+      /// Stores whose result is discarded or immediately read.
+      llvm::DenseSet<const Expr*> m_SafeStores;
+
+      void addAccess(const Expr* E, bool Reads, bool Writes) {
+        if (m_LambdaDepth)
+          return;
+        if (auto DRE = dyn_cast<DeclRefExpr>(E->IgnoreParens()))
+          if (auto VD = dyn_cast<VarDecl>(DRE->getDecl()))
+            Lifetimes[VD].Accesses.push_back(
+                {Index, m_Region, Reads, Writes, Writes && !m_CondDepth});
+      }
+      void markSafe(const Stmt* S) {
+        if (auto E = dyn_cast_or_null<Expr>(S))
+          m_SafeStores.insert(E->IgnoreParens());
+      }
+      /// Gives the next position to S as a whole.
+      void visitLeaf(Stmt* S) {
+        if (!S)
+          return;
+        ++Index;
+        m_Leaf = S;
+        TraverseStmt(S);
+      }
+      void enterRegion(bool IsLoop) {
+        Regions.push_back({m_Region, IsLoop, Index + 1, 0});
+        m_Region = Regions.size() - 1;
+      }
+      void leaveRegion() {
+        Regions[m_Region].End = Index;
+        m_Region = Regions[m_Region].Parent;
+      }
+      /// Whether the region Outer is Inner or contains it.
+      bool contains(unsigned Outer, unsigned Inner) const {
+        while (Inner != Outer) {
+          if (!Inner)
+            return false;
+          Inner = Regions[Inner].Parent;
+        }
+        return true;
+      }
+      /// Whether the store W runs before the read R on every path to R.
+      bool dominates(const Access& W, const Access& R) const {
+        if (W.Index >= R.Index || !contains(W.Region, R.Region))
+          return false;
+        // The jumps skip the stores between them and their label.
+        for (auto& Goto : Gotos) {
+          unsigned Label = Labels.lookup(Goto.first);
+          if (Goto.second < W.Index && W.Index < Label && Label <= R.Index)
+            return false;
+        }
+        return true;
+      }
+
+    public:
+      unsigned Index = 0;
+      /// The top-level statement being numbered.
+      unsigned Top = 0;
+      llvm::SmallVector<Region, 16> Regions{{0, false, 0, ~0U}};
+      llvm::DenseMap<const VarDecl*, Lifetime> Lifetimes;
+      llvm::DenseMap<const LabelDecl*, unsigned> Labels;
+      llvm::SmallVector<std::pair<const LabelDecl*, unsigned>, 4> Gotos;
+      bool HasIndirectGoto = false;
+
+      /// Numbers the statements of S, descending into the blocks, the
+      /// branches and the loop bodies. Any other statement is numbered as a
+      /// whole.
+      void walk(Stmt* S) {
+        if (!S)
+          return;
+        markSafe(S);
+        if (auto CS = dyn_cast<CompoundStmt>(S)) {
+          for (Stmt* Child : CS->body())
+            walk(Child);
+        } else if (auto LS = dyn_cast<LabelStmt>(S)) {
+          Labels[LS->getDecl()] = Index + 1;
+          walk(LS->getSubStmt());
+        } else if (auto IS = dyn_cast<IfStmt>(S)) {
+          visitLeaf(IS->getInit());
+          visitLeaf(IS->getConditionVariableDeclStmt());
+          visitLeaf(IS->getCond());
+          enterRegion(/*IsLoop=*/false);
+          walk(IS->getThen());
+          leaveRegion();
+          enterRegion(/*IsLoop=*/false);
+          walk(IS->getElse());
+          leaveRegion();
+        } else if (auto FS = dyn_cast<ForStmt>(S)) {
+          visitLeaf(FS->getInit());
+          enterRegion(/*IsLoop=*/true);
+          visitLeaf(FS->getConditionVariableDeclStmt());
+          visitLeaf(FS->getCond());
+          walk(FS->getBody());
+          markSafe(FS->getInc());
+          visitLeaf(FS->getInc());
+          leaveRegion();
+        } else if (auto WS = dyn_cast<WhileStmt>(S)) {
+          enterRegion(/*IsLoop=*/true);
+          visitLeaf(WS->getConditionVariableDeclStmt());
+          visitLeaf(WS->getCond());
+          walk(WS->getBody());
+          leaveRegion();
+        } else if (auto DS = dyn_cast<DoStmt>(S)) {
+          enterRegion(/*IsLoop=*/true);
+          walk(DS->getBody());
+          visitLeaf(DS->getCond());
+          leaveRegion();
+        } else {
+          visitLeaf(S);
+        }
+      }
+
+      /// Appends to Live the positions at which the variable is stored, and
+      /// the ones from each store to the reads of its value. The value read
+      /// in a loop which does not contain its store is carried through all
+      /// the iterations.
+      void getLiveRanges(const Lifetime& L,
+                         llvm::SmallVectorImpl<Interval>& Live) const {
+        for (unsigned i = 0, e = L.Accesses.size(); i < e; ++i) {
+          const Access& A = L.Accesses[i];
+          if (A.Writes)
+            Live.push_back({A.Index, A.Index});
+          if (!A.Reads)
+            continue;
+          const Access* Store = nullptr;
+          for (unsigned j = i; j-- > 0;)
+            if (L.Accesses[j].Kills && dominates(L.Accesses[j], A)) {
+              Store = &L.Accesses[j];
+              break;
+            }
+          Interval Range{Store ? Store->Index : 0, A.Index};
+          unsigned Outer = Store ? Store->Region : 0;
+          for (unsigned R = A.Region; R != Outer; R = Regions[R].Parent)
+            if (Regions[R].IsLoop)
+              Range.second = std::max(Range.second, Regions[R].End);
+          Live.push_back(Range);
+        }
+      }
+
+      bool TraverseStmt(Stmt* S) {
+        // The statements nested in a numbered one, e.g. in a switch, and the
+        // operands of ?:, && and || may not run.
+        bool Conditional = false;
+        if (S) {
+          auto BO = dyn_cast<BinaryOperator>(S);
+          Conditional =
+              (!isa<Expr>(S) && !isa<DeclStmt>(S) && S != m_Leaf) ||
+              isa<AbstractConditionalOperator>(S) || (BO && BO->isLogicalOp());
+        }
+        m_CondDepth += Conditional;
+        bool Result =
+            RecursiveASTVisitor<LifetimeCollector>::TraverseStmt(S);
+        m_CondDepth -= Conditional;
+        return Result;
+      }
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        if (auto VD = dyn_cast<VarDecl>(DRE->getDecl())) {
+          Lifetime& L = Lifetimes[VD];
+          L.First = std::min(L.First, Top);
+          L.Last = std::max(L.Last, Top);
+          L.Uses++;
+          L.Refs.push_back(DRE);
+        }
+        return true;
+      }
+      bool VisitCompoundStmt(CompoundStmt* CS) {
+        for (Stmt* S : CS->body())
+          markSafe(S);
+        return true;
+      }
+      bool VisitImplicitCastExpr(ImplicitCastExpr* ICE) {
+        if (ICE->getCastKind() == CK_LValueToRValue) {
+          addAccess(ICE->getSubExpr(), /*Reads=*/true, /*Writes=*/false);
+          markSafe(ICE->getSubExpr());
+        }
+        return true;
+      }
+      bool VisitBinaryOperator(BinaryOperator* BO) {
+        if (BO->isAssignmentOp() && m_SafeStores.count(BO))
+          addAccess(BO->getLHS(), /*Reads=*/BO->isCompoundAssignmentOp(),
+                    /*Writes=*/true);
+        return true;
+      }
+      bool VisitUnaryOperator(UnaryOperator* UO) {
+        if (UO->isIncrementDecrementOp() && m_SafeStores.count(UO))
+          addAccess(UO->getSubExpr(), /*Reads=*/true, /*Writes=*/true);
+        return true;
+      }
+      bool VisitLabelStmt(LabelStmt* LS) {
+        Labels[LS->getDecl()] = Index;
+        return true;
+      }
+      bool VisitGotoStmt(GotoStmt* GS) {
+        Gotos.push_back({GS->getLabel(), Index});
+        return true;
+      }
+      bool VisitIndirectGotoStmt(IndirectGotoStmt*) {
+        HasIndirectGoto = true;
+        return true;
+      }
+      bool TraverseLambdaExpr(LambdaExpr* LE) {
+        ++m_LambdaDepth;
+        bool Result = RecursiveASTVisitor<LifetimeCollector>::
+          TraverseLambdaExpr(LE);
+        --m_LambdaDepth;
+        return Result;
+      }
+    };
+
+    class ReferenceFinder : public RecursiveASTVisitor<ReferenceFinder> {
+      const VarDecl* m_Var;
+    public:
+      bool Found = false;
+      ReferenceFinder(const VarDecl* VD) : m_Var(VD) {}
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        Found = DRE->getDecl() == m_Var;
+        return !Found;
+      }
+    };
+
+    struct Temporary {
+      VarDecl* Var;
+      unsigned DeclIdx;
+      const Lifetime* Life;
+      llvm::SmallVector<Interval, 8> Live;
+    };
+
+    /// A declaration shared by temporaries, and the top-level statements
+    /// and the positions at which they live.
+    struct Slot {
+      VarDecl* Var;
+      unsigned DeclIdx;
+      unsigned First;
+      unsigned Last;
+      llvm::SmallVector<Interval, 16> Live;
+    };
+  } // end anonymous namespace
+
+  static bool refersTo(Stmt* S, const VarDecl* VD) {
+    ReferenceFinder Finder(VD);
+    Finder.TraverseStmt(S);
+    return Finder.Found;
+  }
+
+  static bool overlap(llvm::ArrayRef<Interval> A, llvm::ArrayRef<Interval> B) {
+    for (const Interval& I : A)
+      for (const Interval& J : B)
+        if (I.first <= J.second && J.first <= I.second)
+          return true;
+    return false;
+  }
+
+  /// The block S, or the block labelled by S, if any.
+  static CompoundStmt* getBlock(Stmt* S) {
+    if (auto LS = dyn_cast<LabelStmt>(S))
+      S = LS->getSubStmt();
+    return dyn_cast<CompoundStmt>(S);
+  }
+
+  Stmt* TemporaryCoalescer::sinkDecl(Stmt* S, DeclStmt* DS,
+                                     const VarDecl* VD) {
+    if (auto LS = dyn_cast<LabelStmt>(S)) {
+      LS->setSubStmt(sinkDecl(LS->getSubStmt(), DS, VD));
+      return LS;
+    }
+    auto CS = cast<CompoundStmt>(S);
+    llvm::SmallVector<Stmt*, 16> Stmts(CS->body_begin(), CS->body_end());
+    auto RefersToVD = [VD](Stmt* Child) { return refersTo(Child, VD); };
+    auto First = std::find_if(Stmts.begin(), Stmts.end(), RefersToVD);
+    assert(First != Stmts.end() && "The variable is not used in the block");
+    bool InSingleStmt =
+        std::none_of(std::next(First), Stmts.end(), RefersToVD);
+    // Blocks nested in a block are entered once per entry of the outer one,
+    // unlike loop bodies, so the declaration can be moved in.
+    if (InSingleStmt && getBlock(*First))
+      *First = sinkDecl(*First, DS, VD);
+    else
+      Stmts.insert(First, DS);
+    return clad_compat::CompoundStmt_Create(m_Context, Stmts,
+                                            CS->getLBracLoc(),
+                                            CS->getRBracLoc());
+  }
+
+  void TemporaryCoalescer::Coalesce(FunctionDecl* FD) {
+    auto Body = dyn_cast_or_null<CompoundStmt>(FD->getBody());
+    if (!Body)
+      return;
+    llvm::SmallVector<Stmt*, 32> Stmts(Body->body_begin(), Body->body_end());
+    LifetimeCollector Collector;
+    for (unsigned i = 0, e = Stmts.size(); i < e; ++i) {
+      Collector.Top = i;
+      Collector.walk(Stmts[i]);
+    }
+    // The live ranges are only meaningful if the jumps go forward, e.g. the
+    // jumps to the reverse pass.
+    if (Collector.HasIndirectGoto)
+      return;
+    for (auto& Goto : Collector.Gotos)
+      if (Collector.Labels.lookup(Goto.first) <= Goto.second)
+        return;
+
+    llvm::SmallVector<Temporary, 32> Temps;
+    for (unsigned i = 0, e = Stmts.size(); i < e; ++i) {
+      auto DS = dyn_cast<DeclStmt>(Stmts[i]);
+      if (!DS || !DS->isSingleDecl())
+        continue;
+      // Variables with an initializer cannot share a declaration.
+      auto VD = dyn_cast<VarDecl>(DS->getSingleDecl());
+      if (!VD || VD->getInit() || !VD->hasLocalStorage())
+        continue;
+      QualType QT = VD->getType();
+      if (!QT->isScalarType() || QT.isVolatileQualified())
+        continue;
+      auto It = Collector.Lifetimes.find(VD);
+      if (It == Collector.Lifetimes.end() ||
+          It->second.Uses != It->second.Accesses.size())
+        continue;
+      Temps.push_back({VD, i, &It->second, {}});
+      Collector.getLiveRanges(It->second, Temps.back().Live);
+    }
+
+    // Assign the temporaries to slots, a slot is reused by a temporary which
+    // is not live at any of the positions its previous occupants are.
+    auto Begin = [](const Temporary& T) {
+      unsigned B = ~0U;
+      for (const Interval& I : T.Live)
+        B = std::min(B, I.first);
+      return B;
+    };
+    std::stable_sort(Temps.begin(), Temps.end(),
+                     [&](const Temporary& L, const Temporary& R) {
+                       return Begin(L) < Begin(R);
+                     });
+    llvm::SmallVector<Slot, 16> Slots;
+    llvm::DenseSet<unsigned> Removed;
+    for (Temporary& T : Temps) {
+      auto Free = std::find_if(Slots.begin(), Slots.end(), [&](Slot& S) {
+        return m_Context.hasSameType(S.Var->getType(), T.Var->getType()) &&
+               !overlap(S.Live, T.Live);
+      });
+      if (Free == Slots.end()) {
+        Slots.push_back(
+            {T.Var, T.DeclIdx, T.Life->First, T.Life->Last, {}});
+        Slots.back().Live.append(T.Live.begin(), T.Live.end());
+        continue;
+      }
+      for (DeclRefExpr* DRE : T.Life->Refs)
+        DRE->setDecl(Free->Var);
+      Free->First = std::min(Free->First, T.Life->First);
+      Free->Last = std::max(Free->Last, T.Life->Last);
+      Free->Live.append(T.Live.begin(), T.Live.end());
+      Removed.insert(T.DeclIdx);
+    }
+
+    // The declarations used within a single top-level block, e.g. the
+    // reverse pass, are moved into it.
+    for (Slot& S : Slots)
+      if (S.First == S.Last && getBlock(Stmts[S.First])) {
+        Stmts[S.First] = sinkDecl(Stmts[S.First],
+                                  cast<DeclStmt>(Stmts[S.DeclIdx]), S.Var);
+        Removed.insert(S.DeclIdx);
+      }
+
+    if (Removed.empty())
+      return;
+    llvm::SmallVector<Stmt*, 32> NewStmts;
+    for (unsigned i = 0, e = Stmts.size(); i < e; ++i)
+      if (!Removed.count(i))
+        NewStmts.push_back(Stmts[i]);
+    FD->setBody(clad_compat::CompoundStmt_Create(m_Context, NewStmts,
+                                                 Body->getLBracLoc(),
+                                                 Body->getRBracLoc()));
+  }
+} // end namespace clad
@@ -0,0 +1,43 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Lifetime-based coalescing of the temporaries of the produced gradients,
+// working on AST level
+//
+//----------------------------------------------------------------------------//
+
+#ifndef CLAD_TEMPORARY_COALESCER_H
+#define CLAD_TEMPORARY_COALESCER_H
+
+namespace clang {
+  class ASTContext;
+  class DeclStmt;
+  class FunctionDecl;
+  class Stmt;
+  class VarDecl;
+}
+
+namespace clad {
+  /// Shrinks the set of variables declared at the top of a gradient, i.e. the
+  /// temporaries stored by ReverseModeVisitor::GlobalStoreImpl. The statements
+  /// of the body are numbered in execution order, descending into the blocks,
+  /// e.g. the reverse pass, the branches and the loop bodies. A temporary is
+  /// live from each store to the reads it reaches, and over the whole of the
+  /// loops the value is carried through. Temporaries of the same type whose
+  /// live ranges are disjoint share one declaration, and the ones used within
+  /// a single top-level block are declared in the innermost block, which is
+  /// not a loop body, containing their uses.
+  class TemporaryCoalescer {
+  private:
+    clang::ASTContext& m_Context;
+  public:
+    TemporaryCoalescer(clang::ASTContext& C) : m_Context(C) {}
+    void Coalesce(clang::FunctionDecl* FD);
+  private:
+    /// Declares VD in S, a block or a labelled block, or in the innermost
+    /// block nested in it which contains all the references to VD.
+    clang::Stmt* sinkDecl(clang::Stmt* S, clang::DeclStmt* DS,
+                          const clang::VarDecl* VD);
+  };
+} // end namespace clad
+#endif // CLAD_TEMPORARY_COALESCER_H
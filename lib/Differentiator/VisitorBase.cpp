@@ -306,6 +306,68 @@ namespace clad {
         m_Sema.BuildDeclRefExpr(D, T, VK_LValue, noLoc)));
   }
 
+  namespace {
+    /// Collects the names declared or referenced in a function.
+    class NameCollector : public RecursiveASTVisitor<NameCollector> {
+    public:
+      llvm::DenseSet<const IdentifierInfo*>& Names;
+      NameCollector(llvm::DenseSet<const IdentifierInfo*>& N) : Names(N) {}
+      void add(const NamedDecl* ND) {
+        if (const IdentifierInfo* II = ND->getIdentifier())
+          Names.insert(II);
+      }
+      bool VisitNamedDecl(NamedDecl* ND) {
+        add(ND);
+        return true;
+      }
+      bool VisitDeclRefExpr(DeclRefExpr* DRE) {
+        add(DRE->getDecl());
+        return true;
+      }
+      bool VisitMemberExpr(MemberExpr* ME) {
+        add(ME->getMemberDecl());
+        return true;
+      }
+    };
+  } // end anonymous namespace
+
+  bool VisitorBase::isNameTaken(IdentifierInfo* II) {
+    if (m_Function && m_SourceNamesOf != m_Function) {
+      m_SourceNames.clear();
+      NameCollector Collector(m_SourceNames);
+      Collector.TraverseDecl(const_cast<FunctionDecl*>(m_Function));
+      m_SourceNamesOf = m_Function;
+    }
+    DeclarationName Name(II);
+    // Names of the source function may be found through using directives,
+    // the ones in the scopes of the derivative are in the IdResolver.
+    bool mayBeTaken = !m_Function || m_SourceNames.count(II) ||
+                      m_Sema.IdResolver.begin(Name) != m_Sema.IdResolver.end();
+    // Otherwise, only the members of the enclosing classes and namespaces
+    // are visible.
+    if (!mayBeTaken)
+      for (const DeclContext* DC = m_Function->getDeclContext(); DC;
+           DC = DC->getParent()) {
+        if (DC->isFunctionOrMethod() || DC->isTransparentContext())
+          continue;
+        // Members of the bases are not in the lookup table of the class.
+        if (auto RD = dyn_cast<CXXRecordDecl>(DC))
+          if (!RD->hasDefinition() || RD->getNumBases()) {
+            mayBeTaken = true;
+            break;
+          }
+        if (!DC->lookup(Name).empty()) {
+          mayBeTaken = true;
+          break;
+        }
+      }
+    if (!mayBeTaken)
+      return false;
+    LookupResult R(m_Sema, Name, noLoc, Sema::LookupOrdinaryName);
+    m_Sema.LookupName(R, m_CurScope, /*AllowBuiltinCreation*/ false);
+    return !R.empty();
+  }
+
   IdentifierInfo*
   VisitorBase::CreateUniqueIdentifier(llvm::StringRef nameBase) {
     // For intermediate variables, use numbered names (_t0), for everything
@@ -319,10 +381,7 @@ namespace clad {
       id += 1;
     for (;;) {
       IdentifierInfo* name = &m_Context.Idents.get(nameBase.str() + idStr);
-      LookupResult R(
-          m_Sema, DeclarationName(name), noLoc, Sema::LookupOrdinaryName);
-      m_Sema.LookupName(R, m_CurScope, /*AllowBuiltinCreation*/ false);
-      if (R.empty()) {
+      if (!isNameTaken(name)) {
         return name;
       } else {
         idStr = std::to_string(id);
@@ -498,7 +557,9 @@ namespace clad {
     DeclarationName Name = &m_Context.Idents.get(name);
     LookupResult R(m_Sema, Name, noLoc, Sema::LookupOrdinaryName);
     m_Sema.LookupQualifiedName(R, CladNS, CSS);
-    assert(!R.empty() && isa<FunctionTemplateDecl>(R.getRepresentativeDecl()) &&
+    assert(!R.empty() &&
+           (isa<FunctionTemplateDecl>(R.getRepresentativeDecl()) ||
+            isa<FunctionDecl>(R.getRepresentativeDecl())) &&
            "cannot find requested name");
     return R;
   }
@@ -528,15 +589,40 @@ namespace clad {
   }
 
   QualType VisitorBase::GetCladTapeOfType(QualType T) {
-    // Get declaration of clad::tape template.
-    TemplateDecl* CladTapeDecl = GetCladTapeDecl();
+    return InstantiateCladTemplate(GetCladTapeDecl(), T);
+  }
+
+  TemplateDecl* VisitorBase::GetCladScatterBufferDecl() {
+    static TemplateDecl* Result = nullptr;
+    if (Result)
+      return Result;
+    NamespaceDecl* CladNS = GetCladNamespace();
+    CXXScopeSpec CSS;
+    CSS.Extend(m_Context, CladNS, noLoc, noLoc);
+    DeclarationName BufferName = &m_Context.Idents.get("scatter_buffer");
+    LookupResult BufferR(m_Sema,
+                         BufferName,
+                         noLoc,
+                         Sema::LookupUsingDeclName,
+                         clad_compat::Sema_ForVisibleRedeclaration);
+    m_Sema.LookupQualifiedName(BufferR, CladNS, CSS);
+    assert(!BufferR.empty() && isa<TemplateDecl>(BufferR.getFoundDecl()) &&
+           "cannot find clad::scatter_buffer");
+    Result = cast<TemplateDecl>(BufferR.getFoundDecl());
+    return Result;
+  }
+
+  QualType VisitorBase::GetCladScatterBufferOfType(QualType T) {
+    return InstantiateCladTemplate(GetCladScatterBufferDecl(), T);
+  }
+
+  QualType VisitorBase::InstantiateCladTemplate(TemplateDecl* TD, QualType T) {
     // Create a list of template arguments: single argument <T> in that case.
     TemplateArgument TA = T;
     TemplateArgumentListInfo TLI{};
     TLI.addArgument(TemplateArgumentLoc(TA, m_Context.CreateTypeSourceInfo(T)));
-    // This will instantiate tape<T> type and return it.
-    QualType TT =
-        m_Sema.CheckTemplateIdType(TemplateName(CladTapeDecl), noLoc, TLI);
+    // This will instantiate TD<T> type and return it.
+    QualType TT = m_Sema.CheckTemplateIdType(TemplateName(TD), noLoc, TLI);
     // Get clad namespace and its identifier clad::.
     CXXScopeSpec CSS;
     CSS.Extend(m_Context, GetCladNamespace(), noLoc, noLoc);
@@ -547,6 +633,19 @@ namespace clad {
     return m_Context.getElaboratedType(ETK_None, NS, TT);
   }
 
+  QualType VisitorBase::GetCladTapeArenaScopeType() {
+    NamespaceDecl* CladNS = GetCladNamespace();
+    CXXScopeSpec CSS;
+    CSS.Extend(m_Context, CladNS, noLoc, noLoc);
+    DeclarationName Name = &m_Context.Idents.get("tape_arena_scope");
+    LookupResult R(m_Sema, Name, noLoc, Sema::LookupOrdinaryName);
+    m_Sema.LookupQualifiedName(R, CladNS, CSS);
+    assert(!R.empty() && isa<CXXRecordDecl>(R.getFoundDecl()) &&
+           "cannot find clad::tape_arena_scope");
+    QualType T = m_Context.getRecordType(cast<CXXRecordDecl>(R.getFoundDecl()));
+    return m_Context.getElaboratedType(ETK_None, CSS.getScopeRep(), T);
+  }
+
   clang::Expr* 
   VisitorBase::BuildCallExprToMemFn(clang::CXXMethodDecl* FD,
                   llvm::MutableArrayRef<clang::Expr*> argExprs) {
@@ -0,0 +1,89 @@
+//--------------------------------------------------------------------*- C++ -//
+// clad - the C++ Clang-based Automatic Differentiator
+//
+// Collection of the variables written by a statement, shared by the passes
+// rewriting the produced derivatives on AST level
+//
+//----------------------------------------------------------------------------//
+
+#ifndef CLAD_WRITE_COLLECTOR_H
+#define CLAD_WRITE_COLLECTOR_H
+
+#include "clang/AST/RecursiveASTVisitor.h"
+
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+
+namespace clad {
+  /// Collects the variables written in a statement and the variables which
+  /// are referenced in any other way than a read or an assignment, e.g. by
+  /// taking their address or binding them to a reference.
+  class WriteCollector : public clang::RecursiveASTVisitor<WriteCollector> {
+    /// Whether a declaration counts as a write of the declared variable.
+    bool m_CountDecls;
+    unsigned m_LambdaDepth = 0;
+    llvm::SmallPtrSet<const clang::DeclRefExpr*, 16> m_Handled;
+  public:
+    llvm::DenseSet<const clang::VarDecl*> Written;
+    llvm::DenseSet<const clang::VarDecl*> Escaped;
+    llvm::DenseSet<const clang::VarDecl*> Referenced;
+    llvm::SmallVector<const clang::VarDecl*, 16> Declared;
+    /// The number of assignments and increments, to any lvalue.
+    unsigned NumWrites = 0;
+
+    explicit WriteCollector(bool CountDecls = false)
+      : m_CountDecls(CountDecls) {}
+
+    void markWrite(clang::Expr* E) {
+      ++NumWrites;
+      if (auto DRE = llvm::dyn_cast<clang::DeclRefExpr>(E->IgnoreParens()))
+        if (auto VD = llvm::dyn_cast<clang::VarDecl>(DRE->getDecl())) {
+          Written.insert(VD);
+          if (!m_LambdaDepth)
+            m_Handled.insert(DRE);
+        }
+    }
+    bool VisitVarDecl(clang::VarDecl* VD) {
+      // A declaration (re)initializes the variable and opens its scope.
+      Declared.push_back(VD);
+      if (m_CountDecls)
+        Written.insert(VD);
+      return true;
+    }
+    bool VisitBinaryOperator(clang::BinaryOperator* BO) {
+      if (BO->isAssignmentOp())
+        markWrite(BO->getLHS());
+      return true;
+    }
+    bool VisitUnaryOperator(clang::UnaryOperator* UO) {
+      if (UO->isIncrementDecrementOp())
+        markWrite(UO->getSubExpr());
+      return true;
+    }
+    bool VisitImplicitCastExpr(clang::ImplicitCastExpr* ICE) {
+      if (m_LambdaDepth || ICE->getCastKind() != clang::CK_LValueToRValue)
+        return true;
+      clang::Expr* Sub = ICE->getSubExpr()->IgnoreParens();
+      if (auto DRE = llvm::dyn_cast<clang::DeclRefExpr>(Sub))
+        m_Handled.insert(DRE);
+      return true;
+    }
+    bool VisitDeclRefExpr(clang::DeclRefExpr* DRE) {
+      if (auto VD = llvm::dyn_cast<clang::VarDecl>(DRE->getDecl())) {
+        Referenced.insert(VD);
+        if (!m_Handled.count(DRE))
+          Escaped.insert(VD);
+      }
+      return true;
+    }
+    bool TraverseLambdaExpr(clang::LambdaExpr* LE) {
+      ++m_LambdaDepth;
+      bool Result = clang::RecursiveASTVisitor<WriteCollector>::
+        TraverseLambdaExpr(LE);
+      --m_LambdaDepth;
+      return Result;
+    }
+  };
+} // end namespace clad
+#endif // CLAD_WRITE_COLLECTOR_H
@@ -19,12 +19,19 @@
 #include "clang/Frontend/FrontendPluginRegistry.h"
 #include "clang/Frontend/MultiplexConsumer.h"
 #include "clang/Lex/LexDiagnostic.h"
+#include "clang/Lex/Lexer.h"
 #include "clang/Sema/Sema.h"
 #include "clang/Sema/Lookup.h"
 
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Timer.h"
 
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
+
 #include "clad/Differentiator/Compatibility.h"
 
 using namespace clang;
@@ -56,6 +63,142 @@ namespace {
       }
     }
   };
+
+  /// Counts the statements, expressions and declarations of a produced
+  /// derivative. Used as a measure of the size of the generated code.
+  class ASTNodeCounter : public RecursiveASTVisitor<ASTNodeCounter> {
+  public:
+    uint64_t Count = 0;
+    /// The total size of the local variables, approximating the stack frame.
+    uint64_t LocalsSize = 0;
+    bool VisitStmt(Stmt*) { ++Count; return true; }
+    bool VisitDecl(Decl*) { ++Count; return true; }
+    bool VisitVarDecl(VarDecl* VD) {
+      QualType QT = VD->getType();
+      if (!VD->hasLocalStorage() || isa<ParmVarDecl>(VD) ||
+          QT->isDependentType() || QT->isIncompleteType())
+        return true;
+      ASTContext& C = VD->getASTContext();
+      if (QT->isReferenceType())
+        LocalsSize += C.getTypeSizeInChars(C.VoidPtrTy).getQuantity();
+      else
+        LocalsSize += C.getTypeSizeInChars(QT).getQuantity();
+      return true;
+    }
+  };
+
+  /// Returns the peak resident set size of the process in kilobytes or 0 if
+  /// this is not supported on the host.
+  uint64_t GetPeakRSSInKB() {
+#ifdef LLVM_ON_UNIX
+    struct rusage RU;
+    if (getrusage(RUSAGE_SELF, &RU))
+      return 0;
+#ifdef __APPLE__
+    return RU.ru_maxrss / 1024; // Reported in bytes on Darwin.
+#else
+    return RU.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+  }
+
+  /// Returns the floating point type a derivative produced from FD is
+  /// generic over: the type of its result or of its first floating point
+  /// parameter. Returns a null type if there is none.
+  QualType GetScalarType(const FunctionDecl* FD) {
+    QualType RetTy = FD->getReturnType();
+    if (RetTy->isRealFloatingType())
+      return RetTy.getUnqualifiedType();
+    for (const ParmVarDecl* PVD : FD->parameters()) {
+      QualType ParamTy = PVD->getType().getNonReferenceType();
+      if (ParamTy->isRealFloatingType())
+        return ParamTy.getUnqualifiedType();
+    }
+    return QualType();
+  }
+
+  /// Prints the derivative as a function template over the scalar type of
+  /// FD, i.e. every occurrence of that type, including the ones within the
+  /// tapes and the arrays, is spelled as T. The derivative is printed as it
+  /// is if none of its parameters has the scalar type, as T would not be
+  /// deducible then.
+  void PrintGeneric(const FunctionDecl* Derivative, const FunctionDecl* FD,
+                    const PrintingPolicy& Policy, llvm::raw_ostream& Out) {
+    std::string Code;
+    llvm::raw_string_ostream CodeOut(Code);
+    Derivative->print(CodeOut, Policy);
+    CodeOut.flush();
+
+    QualType Scalar = GetScalarType(FD);
+    bool Deducible = false;
+    // long double is spelled by two keywords, it is left as it is.
+    if (!Scalar.isNull() &&
+        !Scalar->isSpecificBuiltinType(BuiltinType::LongDouble))
+      for (const ParmVarDecl* PVD : Derivative->parameters()) {
+        QualType ParamTy = PVD->getType().getNonReferenceType();
+        if (ParamTy->isPointerType())
+          ParamTy = ParamTy->getPointeeType();
+        if (FD->getASTContext().hasSameUnqualifiedType(ParamTy, Scalar))
+          Deducible = true;
+      }
+    if (!Deducible) {
+      Out << Code;
+      return;
+    }
+
+    // The spelling of a builtin type is a single keyword, the raw lexer does
+    // not match it inside of literals and comments.
+    std::string Spelling = Scalar.getAsString(Policy);
+    LangOptions LangOpts;
+    LangOpts.CPlusPlus = true;
+    Lexer L(SourceLocation(), LangOpts, Code.data(), Code.data(),
+            Code.data() + Code.size());
+    Out << "template <typename T>\n";
+    const char* Printed = Code.data();
+    Token Tok;
+    for (L.LexFromRawLexer(Tok); Tok.isNot(tok::eof); L.LexFromRawLexer(Tok)) {
+      if (Tok.isNot(tok::raw_identifier) || Tok.getRawIdentifier() != Spelling)
+        continue;
+      const char* TokEnd = L.getBufferLocation();
+      const char* TokBegin = TokEnd - Tok.getLength();
+      Out << llvm::StringRef(Printed, TokBegin - Printed) << "T";
+      Printed = TokEnd;
+    }
+    Out << llvm::StringRef(Printed, Code.data() + Code.size() - Printed);
+  }
+
+  /// Reports the cost of a single derivation when -fprint-stats is given.
+  class DerivationStats {
+    bool WantStats;
+    llvm::TimeRecord Start;
+    std::string Name;
+
+  public:
+    DerivationStats(bool WantStats, const FunctionDecl* FD)
+        : WantStats(WantStats) {
+      if (WantStats) {
+        Name = FD->getNameAsString();
+        Start = llvm::TimeRecord::getCurrentTime();
+      }
+    }
+
+    void print(const FunctionDecl* Derivative) {
+      if (!WantStats || !Derivative)
+        return;
+      llvm::TimeRecord Elapsed = llvm::TimeRecord::getCurrentTime();
+      Elapsed -= Start;
+      ASTNodeCounter Counter;
+      Counter.TraverseDecl(const_cast<FunctionDecl*>(Derivative));
+      llvm::errs() << "clad stats: " << Name << " -> "
+                   << Derivative->getNameAsString()
+                   << ": wall " << llvm::format("%.6f", Elapsed.getWallTime())
+                   << " s, peak RSS " << GetPeakRSSInKB()
+                   << " KB, AST nodes " << Counter.Count
+                   << ", locals " << Counter.LocalsSize << " B\n";
+    }
+  };
 }
 
 namespace clad {
@@ -108,8 +251,16 @@ namespace clad {
 
       Sema& S = m_CI.getSema();
 
-      if (!m_DerivativeBuilder)
+      if (!m_DerivativeBuilder) {
         m_DerivativeBuilder.reset(new DerivativeBuilder(m_CI.getSema(), *this));
+        std::string Error;
+        if (!m_DO.ProfilePath.empty() &&
+            !m_DerivativeBuilder->loadProfile(m_DO.ProfilePath, Error)) {
+          auto diagId = S.Diags.getCustomDiagID(DiagnosticsEngine::Error,
+                                                "clad: %0");
+          S.Diag(noLoc, diagId) << Error;
+        }
+      }
 
       // FIXME: Remove the PerformPendingInstantiations altogether. We should
       // somehow make the relevant functions referenced.
@@ -132,6 +283,29 @@ namespace clad {
 
     FunctionDecl* CladPlugin::ProcessDiffRequest(DiffRequest& request) {
       const FunctionDecl* FD = request.Function;
+      // Requests issued while producing other derivatives come through here
+      // too, propagate the global options to them.
+      request.Simplify |= m_DO.SimplifyDerivatives;
+      request.EliminateCommonSubexprs |= m_DO.EliminateCommonSubexprs;
+      request.EliminateDeadStores |= m_DO.EliminateDeadStores;
+      request.CoalesceTemporaries |= m_DO.CoalesceTemporaries;
+      request.UsePullbacks |= m_DO.UsePullbacks;
+      request.SplitPullbacks |= m_DO.SplitPullbacks;
+      request.FuseBuiltins |= m_DO.FuseBuiltins;
+      request.StrengthReduce |= m_DO.StrengthReduce;
+      request.HoistReciprocals |= m_DO.HoistReciprocals;
+      request.BatchBuiltins |= m_DO.BatchBuiltins;
+      request.TapeFreeLoops |= m_DO.TapeFreeLoops;
+      request.BufferIndirectAdjoints |= m_DO.BufferIndirectAdjoints;
+      request.StencilAdjoints |= m_DO.StencilAdjoints;
+      request.BlasAdjoints |= m_DO.BlasAdjoints;
+      request.ReorderAdjointLoops |= m_DO.ReorderAdjointLoops;
+      request.InstrumentProfile |= m_DO.InstrumentProfile;
+      request.TapeArena |= m_DO.TapeArena;
+      if (!request.InlineThreshold)
+        request.InlineThreshold = m_DO.InlineThreshold;
+      if (request.Policy == ReversePolicy::store_all)
+        request.Policy = m_DO.Policy;
       //set up printing policy
       clang::LangOptions LangOpts;
       LangOpts.CPlusPlus = true;
@@ -155,9 +329,11 @@ namespace clad {
         bool WantTiming = getenv("LIBCLAD_TIMING");
         SimpleTimer Timer(WantTiming);
         Timer.setOutput("Generation time for " + FD->getNameAsString());
+        DerivationStats Stats(m_DO.PrintStats, FD);
 
         std::tie(DerivativeDecl, DerivativeDeclContext) =
           m_DerivativeBuilder->Derive(FD, request);
+        Stats.print(DerivativeDecl);
       }
 
       if (DerivativeDecl) {
@@ -166,6 +342,14 @@ namespace clad {
         assert(I.second);
         bool lastDerivativeOrder = 
           (request.CurrentDerivativeOrder == request.RequestedDerivativeOrder);
+        // The structural sparsity of the jacobians and hessians, one line of
+        // 0 and 1 per row.
+        request.SparsityPattern =
+            m_DerivativeBuilder->getSparsityPattern(DerivativeDecl);
+        if (m_DO.PrintSparsity && !request.SparsityPattern.empty())
+          llvm::errs() << "clad sparsity: " << FD->getNameAsString() << " -> "
+                       << DerivativeDecl->getNameAsString() << ":\n"
+                       << request.SparsityPattern;
         // If this is the last required derivative order, replace the function
         // inside a call to clad::differentiate/gradient with its derivative.
         if (request.CallUpdateRequired && lastDerivativeOrder)
@@ -173,7 +357,10 @@ namespace clad {
 
         // if enabled, print source code of the derived functions
         if (m_DO.DumpDerivedFn) {
-          DerivativeDecl->print(llvm::outs(), Policy);
+          if (m_DO.GenericDerivatives)
+            PrintGeneric(DerivativeDecl, FD, Policy, llvm::outs());
+          else
+            DerivativeDecl->print(llvm::outs(), Policy);
         }
         // if enabled, print ASTs of the derived functions
         if (m_DO.DumpDerivedAST) {
@@ -183,7 +370,10 @@ namespace clad {
         if (m_DO.GenerateSourceFile) {
           std::error_code err;
           llvm::raw_fd_ostream f("Derivatives.cpp", err, llvm::sys::fs::F_Append);
-          DerivativeDecl->print(f, Policy);
+          if (m_DO.GenericDerivatives)
+            PrintGeneric(DerivativeDecl, FD, Policy, f);
+          else
+            DerivativeDecl->print(f, Policy);
           f.flush();
         }
         // Call CodeGen only if the produced decl is a top-most decl.
@@ -36,7 +36,18 @@ namespace clad {
       DifferentiationOptions()
         : DumpSourceFn(false), DumpSourceFnAST(false), DumpDerivedFn(false),
           DumpDerivedAST(false), GenerateSourceFile(false),
-          ValidateClangVersion(false) { }
+          ValidateClangVersion(false), PrintStats(false),
+          SimplifyDerivatives(false), EliminateCommonSubexprs(false),
+          EliminateDeadStores(false), CoalesceTemporaries(false),
+          UsePullbacks(false), SplitPullbacks(false), FuseBuiltins(false),
+          StrengthReduce(false), HoistReciprocals(false),
+          BatchBuiltins(false),
+          GenericDerivatives(false), TapeFreeLoops(false),
+          BufferIndirectAdjoints(false), StencilAdjoints(false),
+          BlasAdjoints(false), ReorderAdjointLoops(false),
+          PrintSparsity(false), InstrumentProfile(false), TapeArena(false),
+          InlineThreshold(0),
+          Policy(ReversePolicy::store_all) { }
 
       bool DumpSourceFn : 1;
       bool DumpSourceFnAST : 1;
@@ -44,6 +55,29 @@ namespace clad {
       bool DumpDerivedAST : 1;
       bool GenerateSourceFile : 1;
       bool ValidateClangVersion : 1;
+      bool PrintStats : 1;
+      bool SimplifyDerivatives : 1;
+      bool EliminateCommonSubexprs : 1;
+      bool EliminateDeadStores : 1;
+      bool CoalesceTemporaries : 1;
+      bool UsePullbacks : 1;
+      bool SplitPullbacks : 1;
+      bool FuseBuiltins : 1;
+      bool StrengthReduce : 1;
+      bool HoistReciprocals : 1;
+      bool BatchBuiltins : 1;
+      bool GenericDerivatives : 1;
+      bool TapeFreeLoops : 1;
+      bool BufferIndirectAdjoints : 1;
+      bool StencilAdjoints : 1;
+      bool BlasAdjoints : 1;
+      bool ReorderAdjointLoops : 1;
+      bool PrintSparsity : 1;
+      bool InstrumentProfile : 1;
+      bool TapeArena : 1;
+      unsigned InlineThreshold;
+      ReversePolicy Policy;
+      std::string ProfilePath;
     };
 
     class CladPlugin : public clang::ASTConsumer {
@@ -117,6 +151,98 @@ namespace clad {
             if (!IsRunningOnExpectedClangVersion())
               return false; // Tells clang not to create the plugin.
           }
+          else if (args[i] == "-fprint-stats") {
+            m_DO.PrintStats = true;
+          }
+          else if (args[i] == "-fsimplify-derivatives") {
+            m_DO.SimplifyDerivatives = true;
+          }
+          else if (args[i] == "-fcse-derivatives") {
+            m_DO.EliminateCommonSubexprs = true;
+          }
+          else if (args[i] == "-fdce-derivatives") {
+            m_DO.EliminateDeadStores = true;
+          }
+          else if (args[i] == "-fcoalesce-temporaries") {
+            m_DO.CoalesceTemporaries = true;
+          }
+          else if (args[i] == "-fuse-pullbacks") {
+            m_DO.UsePullbacks = true;
+          }
+          else if (args[i] == "-fsplit-pullbacks") {
+            m_DO.UsePullbacks = true;
+            m_DO.SplitPullbacks = true;
+          }
+          else if (args[i] == "-ffuse-builtin-derivatives") {
+            m_DO.FuseBuiltins = true;
+          }
+          else if (args[i] == "-fstrength-reduce") {
+            m_DO.StrengthReduce = true;
+          }
+          else if (args[i] == "-fhoist-reciprocals") {
+            m_DO.StrengthReduce = true;
+            m_DO.HoistReciprocals = true;
+          }
+          else if (args[i] == "-fbatch-builtins") {
+            m_DO.BatchBuiltins = true;
+          }
+          else if (args[i] == "-fgeneric-derivatives") {
+            m_DO.GenericDerivatives = true;
+          }
+          else if (args[i] == "-ftape-free-loops") {
+            m_DO.TapeFreeLoops = true;
+          }
+          else if (args[i] == "-fbuffer-indirect-adjoints") {
+            m_DO.BufferIndirectAdjoints = true;
+          }
+          else if (args[i] == "-fstencil-adjoints") {
+            m_DO.StencilAdjoints = true;
+          }
+          else if (args[i] == "-fblas-adjoints") {
+            m_DO.BlasAdjoints = true;
+          }
+          else if (args[i] == "-freorder-adjoint-loops") {
+            m_DO.ReorderAdjointLoops = true;
+          }
+          else if (args[i] == "-fprint-sparsity") {
+            m_DO.PrintSparsity = true;
+          }
+          else if (args[i] == "-finline-callees") {
+            if (!m_DO.InlineThreshold)
+              m_DO.InlineThreshold = 32;
+          }
+          else if (llvm::StringRef(args[i]).startswith("-finline-threshold=")) {
+            llvm::StringRef Value = llvm::StringRef(args[i]).split('=').second;
+            if (Value.getAsInteger(10, m_DO.InlineThreshold)) {
+              llvm::errs() << "clad: Error: invalid inline threshold "
+                           << Value << "\n";
+              return false;
+            }
+          }
+          else if (llvm::StringRef(args[i]).startswith("-freverse-policy=")) {
+            llvm::StringRef Value = llvm::StringRef(args[i]).split('=').second;
+            if (Value == "store-all")
+              m_DO.Policy = ReversePolicy::store_all;
+            else if (Value == "mixed")
+              m_DO.Policy = ReversePolicy::mixed;
+            else if (Value == "recompute-all")
+              m_DO.Policy = ReversePolicy::recompute_all;
+            else {
+              llvm::errs() << "clad: Error: invalid reverse mode policy "
+                           << Value << "\n";
+              return false;
+            }
+          }
+          else if (args[i] == "-fprofile-derivatives-generate") {
+            m_DO.InstrumentProfile = true;
+          }
+          else if (llvm::StringRef(args[i])
+                       .startswith("-fprofile-derivatives-use=")) {
+            m_DO.ProfilePath = llvm::StringRef(args[i]).split('=').second;
+          }
+          else if (args[i] == "-ftape-arena") {
+            m_DO.TapeArena = true;
+          }
           else if (args[i] == "-help") {
             // Print some help info.
             llvm::errs() <<
@@ -125,7 +251,31 @@ namespace clad {
               "-fdump-source-fn-ast - Prints out the AST of the function.\n" <<
               "-fdump-derived-fn - Prints out the source code of the derivative.\n" <<
               "-fdump-derived-fn-ast - Prints out the AST of the derivative.\n" <<
-              "-fgenerate-source-file - Produces a file containing the derivatives.\n";
+              "-fgenerate-source-file - Produces a file containing the derivatives.\n" <<
+              "-fprint-stats - Prints the time, peak memory and AST size of each derivation.\n" <<
+              "-fsimplify-derivatives - Simplifies the algebra of the produced derivatives.\n" <<
+              "-fcse-derivatives - Eliminates common subexpressions in the derivatives.\n" <<
+              "-fdce-derivatives - Removes the dead stores from the gradients.\n" <<
+              "-fcoalesce-temporaries - Reuses the temporaries of the gradients.\n" <<
+              "-fuse-pullbacks - Differentiates the callees of the gradients as pullbacks.\n" <<
+              "-fsplit-pullbacks - Splits the pullbacks into forward and reverse passes.\n" <<
+              "-ffuse-builtin-derivatives - Reuses the primal values in the builtin derivatives.\n" <<
+              "-fstrength-reduce - Replaces pow and divisions by cheaper operations.\n" <<
+              "-fhoist-reciprocals - Multiplies by hoisted reciprocals, may change the rounding.\n" <<
+              "-fbatch-builtins - Evaluates the builtin derivatives in loops in batches.\n" <<
+              "-fgeneric-derivatives - Prints the derivatives as templates over the scalar type.\n" <<
+              "-ftape-free-loops - Reverses the loops with independent iterations without tapes.\n" <<
+              "-fbuffer-indirect-adjoints - Buffers the adjoint updates at indirect indices in loops.\n" <<
+              "-fstencil-adjoints - Reverses the stencil loops gathering the updates of each element.\n" <<
+              "-fblas-adjoints - Reverses the dot product, axpy and matrix-vector loops with kernels.\n" <<
+              "-freorder-adjoint-loops - Orders the reverse loop nests for contiguous adjoint updates.\n" <<
+              "-fprint-sparsity - Prints the structural sparsity of the jacobians and hessians.\n" <<
+              "-finline-callees - Inlines the small callees into the gradients.\n" <<
+              "-finline-threshold=<N> - Inlines the callees of up to N AST nodes.\n" <<
+              "-freverse-policy=<store-all|mixed|recompute-all> - Stores or recomputes the values of the loops.\n" <<
+              "-fprofile-derivatives-generate - Counts the calls and the loop trips of the gradients at run time.\n" <<
+              "-fprofile-derivatives-use=<file> - Sizes the tapes, recomputes and inlines using a profile.\n" <<
+              "-ftape-arena - Allocates the tapes of the gradients from an arena released when they return.\n";
 
             llvm::errs() << "-help - Prints out this screen.\n\n";
           }